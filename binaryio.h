@@ -0,0 +1,108 @@
+#ifndef BINARYIO_H
+#define BINARYIO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+// Little-endian fixed-width encoding for WAL records and snapshots, plus
+// LEB128 varints and varint-prefixed blobs for master protocol frames.
+class BinaryWriter {
+public:
+  BinaryWriter(string& out) : out(out) {}
+  void put_u8(uint8_t v) { out.push_back((char)v); }
+  void put_u32(uint32_t v) { out.append((const char*)&v, sizeof(v)); }
+  void put_u64(uint64_t v) { out.append((const char*)&v, sizeof(v)); }
+  void put_str(const string& s) {
+    put_u32(s.size());
+    out.append(s);
+  }
+  void put_varint(uint64_t v) {
+    while (v >= 0x80) {
+      out.push_back((char)(v | 0x80));
+      v >>= 7;
+    }
+    out.push_back((char)v);
+  }
+  void put_blob(const string& s) {
+    put_varint(s.size());
+    out.append(s);
+  }
+private:
+  string& out;
+};
+
+// Reads what BinaryWriter wrote. Running past the end sets ok to false and
+// returns zeros, so callers check ok once after decoding a whole record.
+class BinaryReader {
+public:
+  BinaryReader(const char* p, size_t len) : p(p), end(p + len), ok(true) {}
+  uint8_t get_u8() { uint8_t v = 0; get(&v, sizeof(v)); return v; }
+  uint32_t get_u32() { uint32_t v = 0; get(&v, sizeof(v)); return v; }
+  uint64_t get_u64() { uint64_t v = 0; get(&v, sizeof(v)); return v; }
+  string get_str() {
+    uint32_t len = get_u32();
+    if (!ok || (size_t)(end - p) < len) {
+      ok = false;
+      return "";
+    }
+    string s(p, len);
+    p += len;
+    return s;
+  }
+  uint64_t get_varint() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (!ok || p == end) {
+        ok = false;
+        return 0;
+      }
+      uint8_t b = *p++;
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (b < 0x80)
+        return v;
+    }
+    ok = false;
+    return 0;
+  }
+  string get_blob() {
+    uint64_t len = get_varint();
+    if (!ok || (uint64_t)(end - p) < len) {
+      ok = false;
+      return "";
+    }
+    string s(p, len);
+    p += len;
+    return s;
+  }
+  // Into out, reusing its buffer.
+  void get_blob(string& out) {
+    uint64_t len = get_varint();
+    if (!ok || (uint64_t)(end - p) < len) {
+      ok = false;
+      out.clear();
+      return;
+    }
+    out.assign(p, len);
+    p += len;
+  }
+  size_t remaining() const { return end - p; }
+  const char* pos() const { return p; }
+  bool good() const { return ok; }
+private:
+  void get(void* v, size_t n) {
+    if (!ok || (size_t)(end - p) < n) {
+      ok = false;
+      return;
+    }
+    memcpy(v, p, n);
+    p += n;
+  }
+  const char* p;
+  const char* end;
+  bool ok;
+};
+
+#endif
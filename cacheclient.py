@@ -11,8 +11,45 @@ import concurrent.futures as fs
 import smart_open
 import posix_ipc
 import mmap
+import bisect
 
 STORAGE = "/dev/shm/cache/"
+MASTER_PORT = 1988
+RING_VNODES = 64
+BATCH_MAX = 1000 # keys in one mlookup/mreg/mcache/munlock request
+LIST_PAGE_BYTES = 65536 # names in one list_prefix reply
+MASK64 = 0xffffffffffffffff
+
+def ring_hash(s):
+  # fnv1a() in hash.h
+  h = 0xcbf29ce484222325
+  for c in s:
+    h = ((h ^ ord(c)) * 0x100000001b3) & MASK64
+  h ^= h >> 33
+  h = (h * 0xff51afd7ed558ccd) & MASK64
+  h ^= h >> 33
+  h = (h * 0xc4ceb9fe1a85ec53) & MASK64
+  h ^= h >> 33
+  return h
+
+class HashRing():
+  # same placement of keys on master shards as hashring.cc
+  def __init__(self, members):
+    self.members = members
+    points = []
+    for m in range(len(members)):
+      for i in range(RING_VNODES):
+        points.append((ring_hash("%s#%s" % (members[m], i)), m))
+    points.sort()
+    self.hashes = [p[0] for p in points]
+    self.owners = [p[1] for p in points]
+
+  def owner(self, key):
+    # "~name" of a consistent key places like the stored "name"
+    if key.startswith("~"):
+      key = key[1:]
+    i = bisect.bisect_left(self.hashes, ring_hash(key))
+    return self.members[self.owners[i % len(self.owners)]]
 
 
 class FIOStream():
@@ -87,17 +124,15 @@ class FOutputStream():
     os.symlink(self.tmp_fn, tmp_link)
     os.rename(tmp_link, self.fn)
     if self.client.replay_inputs is not None:
-      msg = "0|failover_write_update|%s|%s|%s\n" % (self.shm_name, self.client.lambda_id[6:], self.client.lambda_id)
-      self.client.master.sendall(msg)
-      self.client.master.recv(1024)      
+      msg = "0|failover_write_update|%s|%s|%s" % (self.shm_name, self.client.lambda_id[6:], self.client.lambda_id)
+      self.client.call(self.shm_name, msg)
     #normal execution
     else:
       if self.consistency:
         if not self.snap_iso:
           self.client.direct_unlock(self.bucket, self.key, True, self.modified)
       else:
-        self.client.send_put(self.bucket, self.key, self.consistency)
-        ack = self.client.master.recv(1024)
+        ack = self.client.send_put(self.bucket, self.key, self.consistency)
     if self.s3:
       upload_res = self.client.executor.apply_async(upload_s3_proc, (self.fn, self.bucket, self.key, self.client.seq,))
       self.client.s3_uploads.append(upload_res)
@@ -200,9 +235,8 @@ class FInputStream:
         self.client.direct_unlock(self.bucket, self.key, write = False, modified = True, s3 = self.s3)
       else:
         self.client.log.debug("sending put to master: %s/%s" % (self.bucket, self.key))
-        self.client.send_put(self.bucket, self.key, False)
         self.client.log.debug("waiting master to ack")
-        ack = self.client.master.recv(1024)
+        ack = self.client.send_put(self.bucket, self.key, False)
         self.client.log.debug("master acked")
 
         self.client.cache_reg(self.bucket, self.key, consistency = False)
@@ -279,14 +313,26 @@ class CacheClient:
     mm[0] = '1'
     self.savanna_gc = buffer(mm, 0, shm.size)
 
-    self.master = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-    self.master.connect((self.master_ip, 1988))
-    self.master.sendall("0|new_server|1222|%s\n" % ("" if "lambda_id" not in extra else extra["lambda_id"]))
+    # keys are spread over master shards, the first one hands out lambda ids
+    shards = extra["shards"] if "shards" in extra else self.get_shard_addrs()
+    self.ring = HashRing(shards)
+    self.master = self.connect_master(shards[0], "" if "lambda_id" not in extra else extra["lambda_id"])
     self.seq = int(self.master.recv(1024).split("|")[3])
     self.lambda_id = "lambda" + str(self.seq) if "lambda_id" not in extra else extra["lambda_id"]
+    self.masters = {shards[0]: self.master}
+    # lookups go to a follower of the owning shard when there are any, see send_miss
+    self.replicas = {}
+    replicas = extra["replicas"] if "replicas" in extra else self.get_replica_addrs()
+    for line in replicas:
+      parts = line.split()
+      leader = parts[1] if len(parts) > 1 else shards[0]
+      self.replicas.setdefault(leader, []).append(parts[0])
+    self.replica_conns = {}
+    self.miss_conn = self.master
     self.replay_inputs = None if "replay_inputs" not in extra else extra["replay_inputs"]
     if self.replay_inputs is not None: print "replay inputs:", self.replay_inputs
     self.read_obj = []
+    self.prefetched = {} # name -> locations from prefetch()
     self.write_obj = []
     self.s3_uploads = []
     self.log.info("CacheClient Initialized id:%s" % self.lambda_id)
@@ -302,7 +348,13 @@ class CacheClient:
       self.commit_write()
       for k,v in self.sockets.iteritems():
         v.close()
-      self.master.close()
+      # lets the masters reclaim this lambda once its outputs are superseded
+      for conn in self.masters.values():
+        conn.sendall("0|lambda_done|%s\n" % self.lambda_id)
+        conn.recv(1024)
+        conn.close()
+      for conn in self.replica_conns.values():
+        conn.close()
       self.executor.close()
       self.closed = True
       self.log.info("CacheClient deleted")
@@ -314,21 +366,180 @@ class CacheClient:
     self.log.debug("Getting master ip address")
     with open('/dev/shm/master', 'r') as content_file:
       return content_file.read().strip()
-    
+
+  def get_replica_addrs(self):
+    # one "follower_host:port [shard_host:port]" per line, the shard
+    # defaults to the first one
+    if not os.path.exists('/dev/shm/master_replicas'):
+      return []
+    with open('/dev/shm/master_replicas', 'r') as content_file:
+      return [l.strip() for l in content_file if l.strip() != ""]
+
+  def get_shard_addrs(self):
+    # written by the cache server when the masters are sharded
+    if os.path.exists('/dev/shm/master_shards'):
+      with open('/dev/shm/master_shards', 'r') as content_file:
+        shards = [a.strip() for a in content_file.read().split(",") if a.strip() != ""]
+      if shards:
+        return shards
+    return ["%s:%s" % (self.master_ip, MASTER_PORT)]
+
+  def connect_master(self, addr, lambda_id):
+    conn = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    conn.connect((addr.split(":")[0], int(addr.split(":")[1])))
+    conn.sendall("0|new_server|1222|%s\n" % lambda_id)
+    return conn
+
+  def shard_conn(self, name):
+    return self.member_conn(self.ring.owner(name))
+
+  def member_conn(self, addr):
+    if addr not in self.masters:
+      conn = self.connect_master(addr, self.lambda_id)
+      conn.recv(1024)
+      self.masters[addr] = conn
+    return self.masters[addr]
+
+  def refresh_shards(self):
+    self.master.sendall("0|shards\n")
+    shards = [a for a in self.master.recv(1024).strip().split("|")[3].split(",") if a != ""]
+    self.log.debug("master shards now %s" % shards)
+    if shards:
+      self.ring = HashRing(shards)
+
+  def call(self, name, msg):
+    # sends a request on the key name to its shard and returns the ack,
+    # following the ring when shards are added
+    while True:
+      conn = self.shard_conn(name)
+      conn.sendall(msg + "\n")
+      ack = conn.recv(1024)
+      if "exception: wrong_shard" in ack:
+        self.refresh_shards()
+      elif "exception: migrating" in ack:
+        time.sleep(0.01)
+      else:
+        return ack
+
+  def recv_line(self, conn):
+    data = conn.recv(1024 * 1024)
+    while data[-1] != '\n':
+      data += conn.recv(1024 * 1024)
+    return data
+
+  def batch(self, op, names, args = [], flags = None):
+    # sends "op|args|flags|key|key|..." to the shards owning names, at most
+    # BATCH_MAX keys a request, and returns the per-key results in the order
+    # of names. flags has one char per name and is split along with them.
+    results = [None] * len(names)
+    pending = range(len(names))
+    while pending:
+      by_shard = {}
+      for i in pending:
+        by_shard.setdefault(self.ring.owner(names[i]), []).append(i)
+      retry = []
+      moved = False
+      for shard, idx in by_shard.iteritems():
+        for j in range(0, len(idx), BATCH_MAX):
+          chunk = idx[j:j+BATCH_MAX]
+          fields = [op] + args
+          if flags is not None:
+            fields.append("".join([flags[i] for i in chunk]))
+          fields += [names[i] for i in chunk]
+          conn = self.shard_conn(names[chunk[0]])
+          conn.sendall("0|" + "|".join(fields) + "\n")
+          ack = self.recv_line(conn).strip().split("|")
+          if ack[2] in ("exception: wrong_shard", "exception: migrating"):
+            moved = moved or ack[2] == "exception: wrong_shard"
+            retry += chunk
+            continue
+          values = list(ack[2]) if op in ("mreg", "mcache") else ack[2:]
+          for i, v in zip(chunk, values):
+            results[i] = v
+      if moved:
+        self.refresh_shards()
+      elif retry:
+        time.sleep(0.01)
+      pending = retry
+    return results
+
+  def mlookup(self, names):
+    return self.batch("mlookup", names)
+
+  def mreg(self, names):
+    return [r == "1" for r in self.batch("mreg", names)]
+
+  def mcache(self, names):
+    return [r == "1" for r in self.batch("mcache", names)]
+
+  def munlock(self, names, write, modified):
+    return self.batch("munlock", names, ["write" if write else "read", self.lambda_id], ["1" if m else "0" for m in modified])
+
+  def prefetch(self, bucket, keys, consistency = False):
+    # looks up many keys in one round trip per shard; get() then reads them
+    # without asking the master again
+    names = [self.shm_name(bucket, key, consistency) for key in keys]
+    for name, locations in zip(names, self.mlookup(names)):
+      self.prefetched[name] = locations
+
+
+  def list_prefix(self, bucket, prefix = ""):
+    # shm names of the keys under bucket/prefix, consistent ones with their
+    # leading "~", gathered page by page from every shard
+    name_prefix = self.shm_name(bucket, prefix, False)
+    names = []
+    for addr in self.ring.members:
+      conn = self.member_conn(addr)
+      cursor = ""
+      while True:
+        conn.sendall("0|list_prefix|%s|%s|%d\n" % (name_prefix, cursor, LIST_PAGE_BYTES))
+        ack = self.recv_line(conn).strip().split("|")
+        names += [n for n in ack[2].split(";") if n != ""]
+        cursor = ack[3]
+        if cursor == "":
+          break
+    return sorted(names)
+
+  def delete_prefix(self, bucket, prefix = ""):
+    # drops every key under bucket/prefix in one request per shard, the
+    # masters purge the cached copies; returns (deleted, skipped) where
+    # skipped counts consistent keys other lambdas hold
+    name_prefix = self.shm_name(bucket, prefix, False)
+    deleted = skipped = 0
+    for addr in self.ring.members:
+      conn = self.member_conn(addr)
+      conn.sendall("0|delete_prefix|%s|%s\n" % (name_prefix, self.lambda_id))
+      ack = self.recv_line(conn).strip().split("|")
+      deleted += int(ack[2])
+      skipped += int(ack[3])
+    return (deleted, skipped)
 
   def shm_name(self, bucket, key, consistency):
     return ("~" if consistency else "") + bucket + "~" + key.replace("/", "~")
 
   def send_put(self, bucket, key, consistency = False):
-    msg = "0|reg|" + self.shm_name(bucket, key, consistency)
+    name = self.shm_name(bucket, key, consistency)
+    msg = "0|reg|" + name
     self.log.debug("sending msg %s" % msg)
-    self.master.sendall(msg + "\n")
+    return self.call(name, msg)
 
 
+  def replica_conn(self, shard):
+    if shard not in self.replicas:
+      return None
+    if shard not in self.replica_conns:
+      self.replica_conns[shard] = self.connect_master(random.choice(self.replicas[shard]), self.lambda_id)
+      self.replica_conns[shard].recv(1024)
+    return self.replica_conns[shard]
+
   def send_miss(self, bucket, key, consistency):
-    msg = "0|lookup|" + self.shm_name(bucket, key, consistency)
+    name = self.shm_name(bucket, key, consistency)
+    msg = "0|lookup|" + name
     self.log.debug("sending msg %s" % msg)
-    self.master.sendall(msg + "\n")
+    self.miss_name = name
+    self.miss_msg = msg
+    self.miss_conn = self.replica_conn(self.ring.owner(name)) or self.shard_conn(name)
+    self.miss_conn.sendall(msg + "\n")
 
   def get_socket(self, server):
     if server not in self.sockets:
@@ -444,9 +655,16 @@ class CacheClient:
 
   def recv_miss_ret_direct(self, fn):
     self.log.debug("waiting for miss ack")
-    ack = self.master.recv(1024).strip()
+    ack = self.miss_conn.recv(1024).strip()
+    if "exception:" in ack:
+      # a stale follower, or the key moved to another shard
+      self.log.debug("lookup failed: %s" % ack)
+      ack = self.call(self.miss_name, self.miss_msg).strip()
     self.log.debug("miss ack received: %s" % ack)
-    addrs = ack.split("|")[2].strip(";").split(";")
+    return self.miss_ret(fn, ack.split("|")[2])
+
+  def miss_ret(self, fn, locations):
+    addrs = locations.strip(";").split(";")
     size = None
     tmp_key = fn
     if "" == addrs[0]:
@@ -454,7 +672,8 @@ class CacheClient:
     elif "use_local" in addrs[0]:
       return_msg = "success:use_local"
     else:
-      (size, tmp_key) = self.peer_read(random.choice(addrs), fn)
+      # the master ranks replicas by locality and load, best first
+      (size, tmp_key) = self.peer_read(addrs[0], fn)
       return_msg = "success:from_peer"  
     return ["miss_ret", "/host", return_msg, size, tmp_key]    
 
@@ -481,11 +700,11 @@ class CacheClient:
         version = "recent" if self.replay_inputs is None else self.lambda_id[6:]    
       else:
         version = "recent" if (self.replay_inputs is None or name not in self.replay_inputs) else self.replay_inputs[name].version
-    msg = "0|consistent_lock|%s|%s|%s|%s|%s|%s|%s|%s\n" % (rw, name, self.lambda_id, max_duration, use_s3, snap_iso, check_loc, version)
+    # with "wait" the master queues a contended request and answers when it is granted
+    msg = "0|consistent_lock|%s|%s|%s|%s|%s|%s|%s|%s|wait\n" % (rw, name, self.lambda_id, max_duration, use_s3, snap_iso, check_loc, version)
     while True:
       self.log.debug("sending direct lock: %s" % msg[0:-1])
-      self.master.sendall(msg)
-      ack = self.master.recv(1024).strip().split("|")
+      ack = self.call(name, msg[0:-1]).strip().split("|")
       self.log.debug("direct lock ack: %s" % ack)
       if ack[2].startswith("success"):
         return (True, ack[4], rw if not s3 else ack[3])
@@ -496,46 +715,36 @@ class CacheClient:
           raise Exception(ack[2])
       elif ack[2].startswith("fail") and snap:
         raise LockException(ack[2])
-      time.sleep(0.1)
+      # a queued request only fails when the key was deleted meanwhile, retry at once
     return (False, "", rw)
 
   def direct_unlock(self, bucket, key, write = False, modified = True, s3 = False):
     rw = "write" if write or s3 else "read"
-    msg = "0|consistent_unlock|%s|%s|%s|%s\n" % (rw, self.shm_name(bucket, key, True), self.lambda_id, "1" if modified else "0")
-    self.log.debug("sending direct unlock: %s" % msg[0:-1])
-    self.master.sendall(msg)
-    ack = self.master.recv(1024).strip().split("|")
+    name = self.shm_name(bucket, key, True)
+    msg = "0|consistent_unlock|%s|%s|%s|%s" % (rw, name, self.lambda_id, "1" if modified else "0")
+    self.log.debug("sending direct unlock: %s" % msg)
+    ack = self.call(name, msg).strip().split("|")
     self.log.debug("direct unlock ack %s" % ack)
     return ack[2] != "fail"
 
   def commit_write(self):
     if self.commit_write_done:
       return
-    def get_cmd(os):
-      return "0|consistent_unlock|write|%s|%s|%s" % (os.shm_name, os.client.lambda_id, "1" if os.modified else "0")
-    cmds = [get_cmd(os) for os in self.write_obj if os.consistency and os.snap_iso]
-    if len(cmds) > 0:
-      for i in range(0, len(cmds), 100):
-        curr_cmds = cmds[i:i+100]
-        msg = "/".join(curr_cmds)
-        self.log.debug("sending write unlock: %s" % msg)
-        self.master.sendall(msg + "\n")
-        ack = self.master.recv(1024 * 1024)
-        assert ack[-1] == '\n'
-        acks = ack.split("/")
-        self.log.debug("write unlock ack %s" % ack[0:-1])
-        self.log.debug("len(curr_cmds) = %s, len(acks) = %s" % (len(curr_cmds), len(acks)))
-        assert len(curr_cmds) == len(acks)
+    outputs = [os for os in self.write_obj if os.consistency and os.snap_iso]
+    if len(outputs) > 0:
+      names = [os.shm_name for os in outputs]
+      self.log.debug("sending write unlock: %s" % names)
+      acks = self.munlock(names, True, [os.modified for os in outputs])
+      self.log.debug("write unlock ack %s" % acks)
     else:
       self.log.debug("Nothing to commit")
     self.commit_write_done = True
 
   def cache_reg(self, bucket, key, consistency):
     fn = self.shm_name(bucket, key, consistency)
-    msg = "0|cache|%s\n" % fn
+    msg = "0|cache|%s" % fn
     self.log.debug("sending cache reg: %s" % msg)
-    self.master.sendall(msg)
-    ack = self.master.recv(1024).strip().split("|")
+    ack = self.call(fn, msg).strip().split("|")
     self.log.debug("cache ack: %s" % ack)
     return ack[3] == "success"
 
@@ -566,9 +775,12 @@ class CacheClient:
         if ret is not None:
           return ret
         else:
-          self.send_miss(bucket, key, consistency)
           size = None
-          parts = self.recv_miss_ret_direct(name)
+          if name in self.prefetched:
+            parts = self.miss_ret(name, self.prefetched.pop(name))
+          else:
+            self.send_miss(bucket, key, consistency)
+            parts = self.recv_miss_ret_direct(name)
           if parts is None:
             if s3:
               size = self.s3_read(name, bucket, key, consistency)
@@ -2,6 +2,9 @@
 #include "cacheserver.h"
 #include "threadpool.h"
 #include "log.h"
+#include "epoch.h"
+#include "frame.h"
+#include "latency.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,12 +17,18 @@
 #include <netdb.h>
 #include <netinet/tcp.h>
 #include <stdio.h>
+#include <limits.h>
 #include <memory>
 #include <fstream>
 
 #define MSGSIZE 256
+#define READ_BYTES (64 * 1024)
 #define THRDPOOLSIZE 1
 #define PORT 1222
+#define STORAGE "/dev/shm/cache/"
+#define POLL_INTERVAL_SEC 5
+#define POLL_BYTES (64 * 1024) //commands taken per poll
+#define SHARD_RETRY_US 10000 //wait while a key is migrating between shards
 
 #if ENABLES3 == 1
 using namespace Aws::S3;
@@ -35,32 +44,59 @@ struct MsgState {
 };
 
 
-CacheServer::CacheServer(string masterip) : tpool(THRDPOOLSIZE), 
-  port(PORT), master_ip(masterip), obj_server(PORT), msg_seq(0)
+CacheServer::CacheServer(string masterip, string rack, string host) : tpool(THRDPOOLSIZE), 
+  port(PORT), master_ip(masterip), rack(rack), host(host), obj_server(PORT), msg_seq(0)
 {
+  const char* busy_poll = getenv("UCACHE_BUSY_POLL");
+  busy_poll_us = busy_poll != NULL ? atoi(busy_poll) : 0;
+  if (this->host == "") {
+    char name[HOST_NAME_MAX + 1] = {0};
+    gethostname(name, HOST_NAME_MAX);
+    this->host = name;
+  }
   get_aws_credential();
   setup_s3();
-  connect_master(master_ip, 1988);
+  //masterip is one master "host[:port]" or the shards "host:port,host:port,..."
+  vector<string> shards = HashRing::parse(master_ip);
+  if (shards.empty())
+    DIE("No master given");
+  for (auto& addr : shards) {
+    MasterConn* conn = connect_master(addr);
+    masters.push_back(conn);
+    master_by_addr[addr] = conn;
+  }
+  ring.set(shards);
+  ofstream master_file("/dev/shm/master");
+  master_file << shards[0].substr(0, shards[0].rfind(':'));
+  master_file.close();
+  refresh_shards();
+
+  pthread_t t;
+  if(pthread_create(&t, NULL, &CacheServer::poll_thread_helper, this))
+    LOG_ERROR << "Failed to create poll thread";
   LOG_INFO << "Started Cache Server";
 }
 
 CacheServer::~CacheServer() {
-  close(master_sock);
+  for (auto conn : masters)
+    close(conn->sock);
 }
 
-void CacheServer::connect_master(string server_name, int portno) {
-  LOG_INFO << "Connect to master server " << server_name << ":" << portno;
-  ofstream master_file("/dev/shm/master");
-  master_file << server_name;
-  master_file.close();
+MasterConn* CacheServer::connect_master(string addr) {
+  LOG_INFO << "Connect to master server " << addr;
+  string server_name = addr.substr(0, addr.rfind(':'));
+  int portno = atoi(addr.substr(addr.rfind(':') + 1).c_str());
+  MasterConn* conn = new MasterConn(this, addr);
   struct sockaddr_in serv_addr;
   struct hostent *server; 
-  master_sock = socket(AF_INET, SOCK_STREAM, 0);
+  int master_sock = socket(AF_INET, SOCK_STREAM, 0);
   if (master_sock < 0)
     DIE("Error opening socket");
   int yes = 1;
   if (setsockopt(master_sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)))
     LOG_ERROR << "error: unable to set socket option";
+  if (busy_poll_us > 0 && setsockopt(master_sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(int)))
+    LOG_ERROR << "SO_BUSY_POLL refused: " << strerror(errno);
   server = gethostbyname(server_name.c_str());
   if (server == NULL)
     DIE("Can't find host");
@@ -75,64 +111,257 @@ void CacheServer::connect_master(string server_name, int portno) {
     else
       sleep(1);
   }
+  conn->sock = master_sock;
   pthread_t t;
-  if(pthread_create(&t, NULL, &CacheServer::recv_thread_helper, this)) 
+  if(pthread_create(&t, NULL, &CacheServer::recv_thread_helper, conn)) 
     LOG_ERROR << "Failed to create recv thread";
 
-  int id = send_master("new_server|" + to_string(port));
+  //asks for frames, a master that does not know them answers without
+  //FRAME_PROTOCOL and the connection stays text
+  int id = send_master(conn, {"new_server", to_string(port), "", rack, host, to_string(ObjWorker::transfers()), FRAME_PROTOCOL});
   auto ack = recv_master(id);
-  if (ack->size() != 3 || ack->at(0) != "new_server_ack")
+  if (ack->size() < 3 || ack->at(0) != "new_server_ack")
     DIE("Error return msg");
   ip = ack->at(1);//TODO: not correct
+  return conn;
+}
+
+void CacheServer::refresh_shards() {
+  //shards_ack|ring_version|members, no members when the master is not sharded
+  auto ack = recv_master(send_master({"shards"}));
+  if (ack->size() < 3 || ack->at(0) != "shards_ack")
+    return;
+  vector<string> members = HashRing::parse(ack->at(2));
+  if (members.empty()) {
+    remove("/dev/shm/master_shards");
+    return;
+  }
+  //connecting blocks, so it is done outside masters_lock and requests keep
+  //going to the shards already known until the new ones are published
+  lock_guard<mutex> guard(refresh_lock);
+  vector<string> added;
+  masters_lock.lock_shared();
+  for (auto& addr : members)
+    if (master_by_addr.find(addr) == master_by_addr.end())
+      added.push_back(addr);
+  masters_lock.unlock_shared();
+  vector<MasterConn*> conns;
+  for (auto& addr : added)
+    conns.push_back(connect_master(addr));
+  masters_lock.lock();
+  for (size_t i = 0; i < added.size(); i++) {
+    masters.push_back(conns[i]);
+    master_by_addr[added[i]] = conns[i];
+  }
+  if (members != ring.members())
+    ring.set(members);
+  masters_lock.unlock();
+  //cacheclient.py routes with the same ring
+  ofstream shard_file("/dev/shm/master_shards");
+  shard_file << HashRing::join(members);
+  shard_file.close();
+  LOG_INFO << "Master shards now " << HashRing::join(members);
 }
 
+MasterConn* CacheServer::shard_for(const string& key) {
+  EpochGuard epoch;
+  masters_lock.lock_shared();
+  auto it = master_by_addr.find(ring.owner(key));
+  MasterConn* conn = it == master_by_addr.end() ? masters[0] : it->second;
+  masters_lock.unlock_shared();
+  return conn;
+}
 
-int CacheServer::send_master(string m) {
+shared_ptr<vector<string>> CacheServer::call_master(const string& key, const vector<string>& msg) {
+  while (true) {
+    auto ack = recv_master(send_master(shard_for(key), msg));
+    if (ack->size() == 2 && ack->at(1) == "exception: wrong_shard")
+      refresh_shards();
+    else if (ack->size() == 2 && ack->at(1) == "exception: migrating")
+      usleep(SHARD_RETRY_US);
+    else
+      return ack;
+  }
+}
+
+int CacheServer::send_master(const vector<string>& m) {
+  masters_lock.lock_shared();
+  MasterConn* conn = masters[0];
+  masters_lock.unlock_shared();
+  return send_master(conn, m);
+}
+
+int CacheServer::send_master(MasterConn* conn, const vector<string>& m) {
   MsgState* s = new MsgState;
   s->replied = false;
   msg_states_lock.lock();
   int msg_id = msg_seq++;
   msg_states[msg_id] = s;
   msg_states_lock.unlock();
-  string msg = to_string(msg_id) + "|" + m + "\n";
-  LOG_DEBUG << "Sending msg to master " << msg_id << "|" << m;
-  int n = write(master_sock, msg.c_str(), msg.size());
-  if (n < 0)
-    LOG_ERROR << "Error writing to socket";
+  string msg;
+  if (conn->binary)
+    encode_frame(msg, frame_opcode(m[0]), msg_id, m, 1);
+  else
+    msg = to_string(msg_id) + "|" + boost::algorithm::join(m, "|") + "\n";
+  LOG_DEBUG << "Sending msg to master " << conn->addr << " " << msg_id << "|" << boost::algorithm::join(m, "|");
+  lock_guard<mutex> guard(conn->send_lock);
+  for (size_t sent = 0; sent < msg.size(); ) {
+    int n = write(conn->sock, msg.data() + sent, msg.size() - sent);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      LOG_ERROR << "Error writing to socket";
+      break;
+    }
+    sent += n;
+  }
   return msg_id;
 }
 
-void* CacheServer::recv_thread(void) {
-  LOG_INFO << "Started master receive thread";
-  char buf[MSGSIZE];
-  int n;
-  MsgState* msg_state_p;
+void CacheServer::deliver(int msg_id, shared_ptr<vector<string>> ack) {
+  msg_states_lock.lock_shared();
+  auto ms = msg_states.find(msg_id);
+  MsgState* msg_state_p = (ms != msg_states.end())?ms->second:NULL;
+  msg_states_lock.unlock_shared();
+  if (msg_state_p){
+    msg_state_p->ack = ack;
+    msg_state_p->replied = true;
+  }
+}
+
+void* CacheServer::recv_thread(MasterConn* conn) {
+  LOG_INFO << "Started master receive thread for " << conn->addr;
+  char buf[READ_BYTES];
+  string input; // read but not yet a whole line or frame
+  uint64_t last_read = now_ns();
   while(true) {
-    n = read(master_sock, buf, MSGSIZE - 1);
-    if (n < 0)
+    int n;
+    //busy polling: replies are picked up without a wakeup until the
+    //master has been quiet for busy_poll_us
+    if (busy_poll_us > 0 && now_ns() - last_read < (uint64_t)busy_poll_us * 1000) {
+      n = recv(conn->sock, buf, READ_BYTES, MSG_DONTWAIT);
+      if (n < 0 && errno == EAGAIN)
+        continue;
+    } else {
+      n = read(conn->sock, buf, READ_BYTES);
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    last_read = now_ns();
+    if (n <= 0) {
       LOG_ERROR << "Error reading from socket";
-    buf[n] = '\0';
-    string msg(buf);
-    boost::trim(msg);
-    LOG_DEBUG << "Recvd msg from master: " << msg;
-    shared_ptr<vector<string>> parts(new vector<string>());
-    boost::split(*parts, msg, boost::is_any_of("|"));
-    int msg_id = atoi(parts->at(0).c_str());
-    msg_states_lock.lock_shared();
-    auto ms = msg_states.find(msg_id);
-    msg_state_p = (ms != msg_states.end())?ms->second:NULL;
-    msg_states_lock.unlock_shared();
-    if (msg_state_p){
-      parts->erase(parts->begin());
-      msg_state_p->ack = parts;
-      msg_state_p->replied = true;
+      return 0;
+    }
+    input.append(buf, n);
+    size_t used = 0;
+    while (used < input.size()) {
+      shared_ptr<vector<string>> parts(new vector<string>());
+      int msg_id;
+      if (conn->binary) {
+        uint8_t opcode;
+        uint64_t id;
+        size_t len = decode_frame(input.data() + used, input.size() - used, opcode, id, *parts);
+        if (len == 0)
+          break;
+        if (len == FRAME_CORRUPT)
+          DIE("Corrupt frame from master");
+        used += len;
+        parts->insert(parts->begin(), frame_op_name(opcode & ~FRAME_ACK) + "_ack");
+        msg_id = id;
+      } else {
+        size_t pos = input.find('\n', used);
+        if (pos == string::npos)
+          break;
+        string msg = input.substr(used, pos - used);
+        used = pos + 1;
+        boost::trim(msg);
+        LOG_DEBUG << "Recvd msg from master: " << msg;
+        boost::split(*parts, msg, boost::is_any_of("|"));
+        msg_id = atoi(parts->at(0).c_str());
+        parts->erase(parts->begin());
+        //the master switches right after granting frames, so must we
+        if (parts->size() > 3 && parts->at(0) == "new_server_ack" && parts->back() == FRAME_PROTOCOL)
+          conn->binary = true;
+      }
+      deliver(msg_id, parts);
     }
+    input.erase(0, used);
   }
   return 0;
 }
 
-void* CacheServer::recv_thread_helper(void* cs){
-  return ((CacheServer*)cs)->recv_thread();
+void* CacheServer::recv_thread_helper(void* conn){
+  return ((MasterConn*)conn)->server->recv_thread((MasterConn*)conn);
+}
+
+void* CacheServer::poll_thread(void) {
+  LOG_INFO << "Started master poll thread";
+  while(true) {
+    sleep(POLL_INTERVAL_SEC);
+    masters_lock.lock_shared();
+    vector<MasterConn*> conns = masters;
+    masters_lock.unlock_shared();
+    //drain everything each shard queued for this node
+    for (auto conn : conns) {
+      while(true) {
+        int id = send_master(conn, {"poll", to_string(POLL_BYTES), to_string(ObjWorker::transfers())});
+        auto ack = recv_master(id);
+        if (ack->size() < 2 || ack->at(0) != "poll_ack" || ack->at(1) == "")
+          break;
+        vector<string> cmds;
+        boost::split(cmds, ack->at(1), boost::is_any_of(";"));
+        for (auto& cmd : cmds)
+          if (cmd != "")
+            handle_master_cmd(cmd);
+      }
+    }
+  }
+  return 0;
+}
+
+void CacheServer::decommission() {
+  masters_lock.lock_shared();
+  vector<MasterConn*> conns = masters;
+  masters_lock.unlock_shared();
+  for (auto conn : conns) {
+    auto ack = recv_master(send_master(conn, {"decommission", ""}));
+    if (ack->size() < 2 || ack->at(0) != "decommission_ack")
+      LOG_ERROR << "decommission failed at " << conn->addr;
+    else
+      LOG_INFO << "decommissioned at " << conn->addr << ", " << ack->at(1) << " keys dropped";
+  }
+}
+
+void* CacheServer::poll_thread_helper(void* cs){
+  return ((CacheServer*)cs)->poll_thread();
+}
+
+void CacheServer::handle_master_cmd(string cmd) {
+  //cmd format type:arg
+  size_t pos = cmd.find(':');
+  string type = cmd.substr(0, pos);
+  string arg = pos == string::npos ? "" : cmd.substr(pos + 1);
+  LOG_DEBUG << "Master cmd " << type << " " << arg;
+  if (type == "purge") {
+    string fn = STORAGE + arg;
+    if (remove(fn.c_str()) != 0 && errno != ENOENT)
+      LOG_ERROR << "can't purge " << fn << " errno " << strerror(errno);
+  } else if (type == "fetch") {
+    //fetch:source,name for a hot key, serve another copy of it from here
+    size_t comma = arg.find(',');
+    if (comma == string::npos) {
+      LOG_ERROR << "Malformed master cmd " << cmd;
+      return;
+    }
+    tpool.add([this](string source, string name) {
+      if (obj_client.fetch(source, name, STORAGE))
+        call_master(name, {"cache", name});
+      else
+        LOG_ERROR << "can't fetch hot key " << name << " from " << source;
+    }, arg.substr(0, comma), arg.substr(comma + 1));
+  } else {
+    LOG_ERROR << "Unknown master cmd " << cmd;
+  }
 }
 
 
@@ -140,7 +369,11 @@ shared_ptr<vector<string>> CacheServer::recv_master(int msg_id) {
   msg_states_lock.lock_shared();
   MsgState* msg_state_p = msg_states[msg_id];
   msg_states_lock.unlock_shared();
-  while(!msg_state_p->replied);
+  //lock requests can be parked at the master for long, back off after a spin
+  uint64_t spin_until = now_ns() + (uint64_t)busy_poll_us * 1000;
+  for (int spins = 0; !msg_state_p->replied; spins++)
+    if (spins > 1000 && (busy_poll_us == 0 || now_ns() > spin_until))
+      usleep(100);
   LOG_DEBUG << "msg " << msg_id << " acked";
   shared_ptr<vector<string>> ret = msg_state_p->ack;
   delete msg_state_p;
@@ -289,8 +522,7 @@ void CacheServer::run() {
 }
 
 vector<string> CacheServer::lookup_key(string filename) {
-  int id = send_master("lookup|" + filename);
-  auto res = recv_master(id);    
+  auto res = call_master(filename, {"lookup", filename});
   if (res->at(0) != "lookup_ack")
     LOG_ERROR << "Lookup ack error: " << res->at(0) << res->at(1);
   vector<string> addrs;
@@ -369,15 +601,15 @@ bool CacheServer::s3_read(string bucket, string key, string shm_name) {
 
 void CacheServer::handle_consistent_lock(std::vector<std::string> strs) {
   //Msg from client: consistent_lock|client_q|bucket|key|rw|lambda|duration
-  //Msg to master: consistent_lock|read/write|key|lambda|duration_in_sec 
+  //Msg to master: consistent_lock|read/write|key|lambda|duration_in_sec|use_s3|snap|check_loc|version|wait
+  //the master queues the request and answers once the lock is granted,
+  //"fail" only comes back if the key was deleted while waiting
   tpool.add([this](string client_q, string bucket, string key, string rw, string lambda, string duration) {
     shared_ptr<vector<string>> ack;
-    for(int i = 0; i < 10000; i++){
-      int id = send_master("consistent_lock|" + rw + "|" +  get_shm_name(bucket,key,true) + "|" + lambda + "|" + duration);
-      ack = recv_master(id);
+    for(int i = 0; i < 100; i++){
+      ack = call_master(get_shm_name(bucket,key,true), {"consistent_lock", rw, get_shm_name(bucket,key,true), lambda, duration, "nos3", "no_snap", "no_check_loc", "recent", "wait"});
       if(ack->at(1) != "fail")
         break;
-      usleep(100000);
     }
     send(client_q, "consistent_lock_ret|/host|" + ack->at(1));
   }, strs[1], strs[2], strs[3], strs[4], strs[5], strs[6]);
@@ -388,8 +620,7 @@ void CacheServer::handle_consistent_unlock(std::vector<std::string> strs) {
   //Msg to master: consistent_unlock|read/write|key|lambda|modified
   tpool.add([this](string client_q, string bucket, string key, string rw, string lambda, string modified) {
     string ret;
-    int id = send_master("consistent_unlock|" + rw + "|" +  get_shm_name(bucket,key,true) + "|" + lambda + "|" + modified);
-    auto ack = recv_master(id);
+    auto ack = call_master(get_shm_name(bucket,key,true), {"consistent_unlock", rw, get_shm_name(bucket,key,true), lambda, modified});
     send(client_q, "consistent_unlock_ret|/host|" + ack->at(1));
   }, strs[1], strs[2], strs[3], strs[4], strs[5], strs[6]);
 }
@@ -400,8 +631,7 @@ void CacheServer::handle_consistent_delete(std::vector<std::string> strs) {
   //Msg to master: consistent_delete|key
   tpool.add([this](string client_q, string bucket, string key) {
     string ret;
-    int id = send_master("consistent_delete|" +  get_shm_name(bucket,key,true));
-    auto ack = recv_master(id);
+    auto ack = call_master(get_shm_name(bucket,key,true), {"consistent_delete", get_shm_name(bucket,key,true)});
     if (ack->at(1) == "success") {
       if(remove(("/dev/shm/" + get_shm_name(bucket,key,true)).c_str()) != 0) {
         LOG_ERROR << "removing /dev/shm/" << get_shm_name(bucket,key,true) << " fail";
@@ -432,8 +662,7 @@ void CacheServer::handle_lambda_exit(std::vector<std::string> strs) {
 void CacheServer::handle_put(std::vector<std::string> strs) {
   tpool.add([this](string client_q, string bucket, string key) {
     string shm_name = string("/dev/shm/") + get_shm_name(bucket, key, false);
-    int id = send_master("reg|" + get_shm_name(bucket,key,false));
-    auto ack = recv_master(id);
+    auto ack = call_master(get_shm_name(bucket,key,false), {"reg", get_shm_name(bucket,key,false)});
     string ret;
     if (ack->at(2) == "success") {
       ret = "put_ret|/host|success|" + get_shm_name(bucket,key,false);
@@ -483,8 +712,7 @@ void CacheServer::handle_miss(std::vector<std::string> strs) {
     }
     string msg = "miss_ret|/host|" + return_msg;
     if(updated > 0) {
-      int id = send_master((updated==1?string("cache"):string("reg")) + "|" + get_shm_name(bucket,key,false));
-      auto ack = recv_master(id);
+      auto ack = call_master(get_shm_name(bucket,key,false), {updated==1?string("cache"):string("reg"), get_shm_name(bucket,key,false)});
     }
     send(client_q, msg);
     LOG_DEBUG << "Done handle miss, sending " << msg;
@@ -497,8 +725,7 @@ void CacheServer::handle_delete(std::vector<std::string> strs) {
     string filename = get_shm_name(bucket, key, false);
     string shm_name = string("/dev/shm/") + filename;
     
-    int id = send_master("delete|" + filename);
-    auto ack = recv_master(id);
+    auto ack = call_master(filename, {"delete", filename});
     if (ack->at(1) == "success") {
       if(remove(("/dev/shm/" + filename).c_str()) != 0) {
         LOG_ERROR << "removing /dev/shm/" << filename << " fail";
@@ -24,24 +24,49 @@
 #include "objserver.h"
 #include "objclient.h"
 #include "epollobjserver.h"
+#include "hashring.h"
 #include <memory>
+#include <mutex>
 using namespace std;
 
 class ObjWorker;
 
 struct MsgState;
+class CacheServer;
+
+// One master shard. Replies come back on its own receive thread; message
+// ids are unique across all shards.
+struct MasterConn {
+  MasterConn(CacheServer* server, const string& addr) : server(server), addr(addr), sock(-1), binary(false) {}
+  CacheServer* server;
+  string addr;
+  int sock;
+  volatile bool binary; // frames after new_server_ack granted them
+  mutex send_lock;      // keeps requests from interleaving on sock
+};
 
 class CacheServer {
 public:
-  CacheServer(string);
+  // rack and host label this node for replica selection, host defaults to
+  // the hostname.
+  CacheServer(string masterip, string rack = "", string host = "");
   void run();
+  // Tells every shard this node is leaving so they drop it from their keys
+  // at once instead of waiting for its polls to stop.
+  void decommission();
   ~CacheServer();
 private:
   ThreadPool tpool;
   string access_key_id;
   string secret_key;
   string master_ip;
-  int master_sock;
+  string rack;
+  string host;
+  vector<MasterConn*> masters; // masters[0] hands out lambda ids
+  map<string, MasterConn*> master_by_addr;
+  boost::shared_mutex masters_lock;
+  mutex refresh_lock; // one refresh_shards at a time connects new shards
+  HashRing ring;
   string ip;
   int port;
 #if USE_EPOLL == 1
@@ -55,13 +80,26 @@ private:
   map<int,MsgState*> msg_states;
   boost::shared_mutex msg_states_lock;
   int msg_seq;
+  int busy_poll_us; // UCACHE_BUSY_POLL, how long to spin for master replies
 
   mqd_t get_mqd(string);
   void delete_mqd(string);
-  int send_master(string msg);
+  // A request is its fields, the command first; acks come back the same
+  // way, "<op>_ack" first, whether the connection uses lines or frames.
+  int send_master(const vector<string>& msg);
+  int send_master(MasterConn* conn, const vector<string>& msg);
   shared_ptr<vector<string>> recv_master(int);
-  void* recv_thread(void);
+  // Sends a keyed request to the shard owning key and waits for the ack,
+  // following the ring as shards are added.
+  shared_ptr<vector<string>> call_master(const string& key, const vector<string>& msg);
+  void deliver(int msg_id, shared_ptr<vector<string>> ack);
+  MasterConn* shard_for(const string& key);
+  void refresh_shards();
+  void* recv_thread(MasterConn* conn);
   static void* recv_thread_helper(void*);
+  void* poll_thread(void);
+  static void* poll_thread_helper(void*);
+  void handle_master_cmd(string cmd);
 #if ENABLES3 == 1
   std::shared_ptr<Aws::S3::S3Client> s3client;
 #endif
@@ -82,7 +120,7 @@ private:
   void setup_s3();  
   string get_shm_name(string bucket, string key, bool consistency);
   void send(string name, string msg);
-  void connect_master(string server, int port);
+  MasterConn* connect_master(string addr);
 };
 
 #endif
@@ -0,0 +1,126 @@
+#include "corerouter.h"
+#include "hash.h"
+#include "log.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <new>
+#include <sys/eventfd.h>
+
+CoreRouter::CoreRouter() : cores(0) {
+}
+
+CoreRouter::~CoreRouter() {
+  for (Core* c : state) {
+    close(c->event_fd);
+    for (CoreTask* t : c->free)
+      delete t;
+    delete c;
+  }
+  for (Queue* q : queues) {
+    q->~Queue();
+    free(q);
+  }
+}
+
+void CoreRouter::start(int cores) {
+  for (int i = 0; i < cores; i++) {
+    Core* c = new Core();
+    c->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (c->event_fd < 0)
+      DIE("Can't create eventfd: %s", strerror(errno));
+    c->outstanding.assign(cores, 0);
+    c->signal.assign(cores, false);
+    state.push_back(c);
+  }
+  //plain new only honours alignas(64) from C++17 on
+  for (int i = 0; i < cores * cores * 2; i++) {
+    void* mem;
+    if (posix_memalign(&mem, alignof(Queue), sizeof(Queue)) != 0)
+      DIE("Can't allocate core queues");
+    queues.push_back(new (mem) Queue());
+  }
+  this->cores = cores;
+}
+
+int CoreRouter::owner(const string& key) {
+  return wyhash(key) % cores;
+}
+
+CoreTask* CoreRouter::task(int core) {
+  vector<CoreTask*>& free = state[core]->free;
+  if (free.empty())
+    return new CoreTask();
+  CoreTask* t = free.back();
+  free.pop_back();
+  return t;
+}
+
+void CoreRouter::recycle(int core, CoreTask* task) {
+  state[core]->free.push_back(task);
+}
+
+bool CoreRouter::forward(int core, int to, CoreTask* task) {
+  Core* c = state[core];
+  //at most ROUTE_DEPTH outstanding, so neither queue of the pair fills up
+  if (c->outstanding[to] == ROUTE_DEPTH)
+    return false;
+  requests(core, to).push(task);
+  c->outstanding[to]++;
+  c->signal[to] = true;
+  return true;
+}
+
+void CoreRouter::drain(int core, function<void(CoreTask*)> run, function<void(CoreTask*)> deliver) {
+  Core* c = state[core];
+  uint64_t n;
+  //read before popping, a push after the last pop signals again
+  if (read(c->event_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+    LOG_ERROR << "eventfd read failed " << strerror(errno);
+  CoreTask* t;
+  for (int from = 0; from < cores; from++) {
+    if (from == core)
+      continue;
+    bool ran = false;
+    while (requests(from, core).pop(t)) {
+      run(t);
+      replies(core, from).push(t);
+      ran = true;
+    }
+    if (ran)
+      c->signal[from] = true;
+    while (replies(from, core).pop(t)) {
+      c->outstanding[from]--;
+      deliver(t);
+    }
+  }
+}
+
+void CoreRouter::wait(int core, MasterWorker* worker) {
+  state[core]->waiting.push_back(worker);
+}
+
+void CoreRouter::take_waiting(int core, vector<MasterWorker*>& out) {
+  vector<MasterWorker*>& waiting = state[core]->waiting;
+  out.insert(out.end(), waiting.begin(), waiting.end());
+  waiting.clear();
+}
+
+void CoreRouter::forget(int core, MasterWorker* worker) {
+  vector<MasterWorker*>& waiting = state[core]->waiting;
+  waiting.erase(std::remove(waiting.begin(), waiting.end(), worker), waiting.end());
+}
+
+void CoreRouter::wake(int core) {
+  Core* c = state[core];
+  uint64_t one = 1;
+  for (int to = 0; to < cores; to++) {
+    if (!c->signal[to])
+      continue;
+    c->signal[to] = false;
+    if (write(state[to]->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      LOG_ERROR << "eventfd write failed " << strerror(errno);
+  }
+}
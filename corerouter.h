@@ -0,0 +1,80 @@
+#ifndef COREROUTER_H
+#define COREROUTER_H
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+#include "interntable.h"
+#include "spscqueue.h"
+
+#define ROUTE_DEPTH 256 // requests one core may have outstanding at another
+
+using namespace std;
+
+class MasterWorker;
+
+// A keyed request on its way to the core that owns the key, and then its
+// reply on the way back.
+struct CoreTask {
+  MasterWorker* worker; // connection it came from
+  uint64_t slot;        // where its reply goes in the worker's output
+  NodeId node;
+  uint8_t op;           // reg, cache, uncache or lookup
+  string id;
+  string key;
+  vector<string> ret;   // recycled with the task, so its buffers are reused
+  uint64_t lsn;         // journaled by the request, its reply waits for it
+};
+
+// Thread-per-core mode (--per_core): each event loop is pinned to a core
+// and owns the keys hashing to it. A loop hands the keyed requests of its
+// connections to the owner over a pair of SPSC queues per pair of cores,
+// so a key's entry is only ever touched from one core, and the owner
+// sends the reply back the same way. Tasks are recycled per core and an
+// eventfd per core wakes the owner, once per batch.
+//
+// Every method but start() and owner() is called from the thread of core.
+class CoreRouter {
+public:
+  CoreRouter();
+  ~CoreRouter();
+  void start(int cores);
+  bool active() {return cores > 0;}
+  int owner(const string& key);
+  int event_fd(int core) {return state[core]->event_fd;}
+  CoreTask* task(int core);
+  void recycle(int core, CoreTask* task);
+  // False when core already has ROUTE_DEPTH requests outstanding at to.
+  // The caller then waits for room, see wait.
+  bool forward(int core, int to, CoreTask* task);
+  // Runs the requests other cores sent to core, and hands the replies to
+  // core's own requests to deliver.
+  void drain(int core, function<void(CoreTask*)> run, function<void(CoreTask*)> deliver);
+  // worker found a queue of core full. The loop takes it back with
+  // take_waiting after a drain, which may have made room, to retry.
+  void wait(int core, MasterWorker* worker);
+  void take_waiting(int core, vector<MasterWorker*>& out);
+  // worker is gone.
+  void forget(int core, MasterWorker* worker);
+  // Signals the cores sent something since the last call.
+  void wake(int core);
+private:
+  typedef SpscQueue<CoreTask*, ROUTE_DEPTH> Queue;
+  // Only touched by its own core, and allocated apart from the others'.
+  struct Core {
+    int event_fd;
+    vector<CoreTask*> free;
+    vector<int> outstanding; // requests at each core
+    vector<bool> signal;     // cores to wake
+    vector<MasterWorker*> waiting; // stalled on a full queue
+  };
+  Queue& requests(int from, int to) {return *queues[(from * cores + to) * 2];}
+  Queue& replies(int from, int to) {return *queues[(from * cores + to) * 2 + 1];}
+
+  int cores;
+  vector<Core*> state;
+  vector<Queue*> queues;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include "epoch.h"
+#include "log.h"
+#include <algorithm>
+#include <cassert>
+#include <mutex>
+#include <unistd.h>
+#include <vector>
+
+struct EpochSlot {
+  atomic<uint64_t> state;   // (epoch << 1) | 1 while inside a guard, 0 outside
+  atomic<bool> in_use;
+  char pad[64 - sizeof(atomic<uint64_t>) - sizeof(atomic<bool>)];
+};
+
+struct Retired {
+  void* p;
+  void (*deleter)(void*);
+  uint64_t epoch;
+};
+
+static atomic<uint64_t> global_epoch(1);
+static EpochSlot slots[EPOCH_MAX_THREADS];
+static atomic<int> slot_high(0);
+// retired objects left behind by threads that exited
+static mutex orphan_lock;
+static std::vector<Retired> orphans;
+
+static void free_retired(std::vector<Retired>& list, uint64_t safe_before) {
+  //deleters may retire more objects into list, so work on a detached copy
+  std::vector<Retired> pending;
+  pending.swap(list);
+  for (size_t i = 0; i < pending.size(); i++) {
+    if (pending[i].epoch < safe_before)
+      pending[i].deleter(pending[i].p);
+    else
+      list.push_back(pending[i]);
+  }
+}
+
+struct EpochThread {
+  EpochThread() : slot(NULL), depth(0), scan_at(EPOCH_RETIRE_BATCH) {
+    for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+      bool expected = false;
+      if (!slots[i].in_use.load(memory_order_relaxed) &&
+          slots[i].in_use.compare_exchange_strong(expected, true)) {
+        slot = &slots[i];
+        slot->state.store(0, memory_order_relaxed);
+        int high = slot_high.load();
+        while (high < i + 1 && !slot_high.compare_exchange_weak(high, i + 1));
+        break;
+      }
+    }
+    if (slot == NULL)
+      DIE("Out of epoch slots, raise EPOCH_MAX_THREADS");
+  }
+
+  ~EpochThread() {
+    slot->state.store(0, memory_order_release);
+    slot->in_use.store(false, memory_order_release);
+    lock_guard<mutex> guard(orphan_lock);
+    orphans.insert(orphans.end(), retired.begin(), retired.end());
+  }
+
+  EpochSlot* slot;
+  int depth;
+  std::vector<Retired> retired;
+  size_t scan_at; // retired size that triggers the next scan
+};
+
+static thread_local EpochThread epoch_thread;
+
+// Moves the global epoch forward if every active thread has caught up with it.
+static uint64_t try_advance() {
+  // pairs with the fence in enter(): either the scan sees a reader's slot or
+  // that reader sees everything unlinked before this point
+  atomic_thread_fence(memory_order_seq_cst);
+  uint64_t epoch = global_epoch.load(memory_order_acquire);
+  int high = slot_high.load(memory_order_acquire);
+  for (int i = 0; i < high; i++) {
+    uint64_t state = slots[i].state.load(memory_order_acquire);
+    if ((state & 1) && (state >> 1) != epoch)
+      return epoch;
+  }
+  if (global_epoch.compare_exchange_strong(epoch, epoch + 1))
+    return epoch + 1;
+  return epoch;
+}
+
+void Epoch::enter() {
+  EpochThread& t = epoch_thread;
+  if (t.depth++ > 0)
+    return;
+  t.slot->state.store((global_epoch.load(memory_order_relaxed) << 1) | 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+void Epoch::exit() {
+  EpochThread& t = epoch_thread;
+  assert(t.depth > 0);
+  if (--t.depth > 0)
+    return;
+  t.slot->state.store(0, memory_order_release);
+}
+
+void Epoch::retire(void* p, void (*deleter)(void*)) {
+  EpochThread& t = epoch_thread;
+  Retired r = {p, deleter, global_epoch.load(memory_order_acquire)};
+  t.retired.push_back(r);
+  if (t.retired.size() < t.scan_at)
+    return;
+  // anything retired two epochs back can no longer be seen by any reader
+  uint64_t safe_before = try_advance() - 1;
+  free_retired(t.retired, safe_before);
+  //while a long guard (a snapshot) pins the epoch little can be freed, back
+  //off so retiring stays amortized O(1) instead of rescanning every time
+  t.scan_at = max((size_t)EPOCH_RETIRE_BATCH, t.retired.size() * 2);
+  unique_lock<mutex> guard(orphan_lock, try_to_lock);
+  if (guard.owns_lock() && !orphans.empty())
+    free_retired(orphans, safe_before);
+}
+
+void Epoch::synchronize() {
+  assert(epoch_thread.depth == 0);
+  //a guard entered before this call announced an epoch <= the current one,
+  //the second advance past it needs that guard to be gone
+  uint64_t target = global_epoch.load(memory_order_acquire) + 2;
+  while (try_advance() < target)
+    usleep(100);
+}
@@ -0,0 +1,47 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <atomic>
+
+#define EPOCH_MAX_THREADS 512
+#define EPOCH_RETIRE_BATCH 64
+
+using namespace std;
+
+// Epoch-based reclamation for objects that readers reach without locks.
+//
+// A thread inside an EpochGuard announces the global epoch it started in with
+// one store to its own cache line, no read-modify-write. Writers unlink an
+// object and hand it to retire(); it is freed once every thread that could
+// still see it has left its guard, i.e. two epoch advances later.
+// Guards nest, so code that already holds one may call code that takes one.
+class Epoch {
+public:
+  static void enter();
+  static void exit();
+  static void retire(void* p, void (*deleter)(void*));
+  // Returns once every guard that was active when it was called has been
+  // left. Must not be called from inside a guard.
+  static void synchronize();
+  template <typename T>
+  static void retire(T* p) {
+    if (p != NULL)
+      retire(p, &delete_object<T>);
+  }
+
+private:
+  template <typename T>
+  static void delete_object(void* p) { delete (T*)p; }
+};
+
+class EpochGuard {
+public:
+  EpochGuard() { Epoch::enter(); }
+  ~EpochGuard() { Epoch::exit(); }
+private:
+  EpochGuard(const EpochGuard&);
+};
+
+#endif
@@ -2,17 +2,34 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <algorithm>
 #include "log.h"
+#include "latency.h"
 
 
 #define MAXEVENTS 64
 
-EpollMasterWorker::EpollMasterWorker() : count(0) {
+#ifndef EPIOCSPARAMS
+// linux 6.9, older headers lack it
+struct epoll_params {
+  uint32_t busy_poll_usecs;
+  uint16_t busy_poll_budget;
+  uint8_t prefer_busy_poll;
+  uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+EpollMasterWorker::EpollMasterWorker() : listen_fd(-1), master(NULL), core(-1), router(NULL), busy_poll_us(0), count(0) {
   epoll_fd = epoll_create1(0);
   if (epoll_fd == -1)
     DIE("Can't create epoll fd");
   events = (epoll_event*)calloc (MAXEVENTS, sizeof(epoll_event));
-  pthread_t thread;
   int ret = pthread_create(&thread, NULL, &EpollMasterWorker::pthread_helper, this);
   if (ret)
     DIE("Can't create thread");
@@ -26,7 +43,8 @@ EpollMasterWorker::~EpollMasterWorker() {
 void EpollMasterWorker::add(int fd, MasterWorker* worker) {
   struct epoll_event event;
   event.data.fd = fd;
-  event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+  //EPOLLOUT is edge triggered too, it only fires once a full socket drains
+  event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
   master_workers[fd] = worker;
   int ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
   if (ret == -1)
@@ -35,31 +53,150 @@ void EpollMasterWorker::add(int fd, MasterWorker* worker) {
   LOG_DEBUG << "fd " << fd << " added to epollworker";
 }
 
+void EpollMasterWorker::listen(int fd, Master& master) {
+  this->master = &master;
+  listen_fd = fd;
+  //accept_all takes connections until there are none left
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  struct epoll_event event;
+  event.data.fd = fd;
+  event.events = EPOLLIN;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    DIE("failed to add listening socket to epoll");
+}
+
+void EpollMasterWorker::pin(int core) {
+  this->core = core;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(core, &cpus);
+  if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus))
+    LOG_ERROR << "failed to pin event loop to core " << core;
+}
+
+void EpollMasterWorker::busy_poll(int usec) {
+  busy_poll_us = usec;
+  //epoll_wait then polls the device queues of its sockets itself
+  struct epoll_params params;
+  memset(&params, 0, sizeof(params));
+  params.busy_poll_usecs = usec;
+  params.busy_poll_budget = MAXEVENTS;
+  params.prefer_busy_poll = 1;
+  if (ioctl(epoll_fd, EPIOCSPARAMS, &params) == -1)
+    LOG_ERROR << "epoll busy poll is not available (" << strerror(errno) << "), spinning in user space only";
+}
+
+void EpollMasterWorker::route(CoreRouter& router) {
+  this->router = &router;
+  struct epoll_event event;
+  event.data.fd = router.event_fd(core);
+  event.events = EPOLLIN;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event) == -1)
+    DIE("failed to add eventfd to epoll");
+}
+
+void EpollMasterWorker::drain() {
+  vector<MasterWorker*> answered;
+  router->drain(core, [this](CoreTask* t) {
+    MasterWorker::run_forwarded(*master, t);
+  }, [this, &answered](CoreTask* t) {
+    t->worker->deliver(t);
+    answered.push_back(t->worker);
+    router->recycle(core, t);
+  });
+  //the replies made room for the requests stalled on a full queue
+  router->take_waiting(core, answered);
+  sort(answered.begin(), answered.end());
+  answered.erase(unique(answered.begin(), answered.end()), answered.end());
+  for (MasterWorker* w : answered) {
+    if (retired.count(w)) {
+      if (w->forwarded() == 0) {
+        retired.erase(w);
+        delete w;
+      }
+      continue;
+    }
+    try {
+      w->replied();
+    } catch (exception& e) {
+      LOG_ERROR << "Caught exception, removing";
+      int fd = w->get_socket();
+      remove(fd);
+      close(fd);
+    }
+  }
+}
+
+void EpollMasterWorker::accept_all() {
+  while (true) {
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN)
+        LOG_ERROR << "error: unable to accept client " << strerror(errno);
+      return;
+    }
+    LOG_DEBUG << "new client";
+    //raising it past net.core.busy_read needs CAP_NET_ADMIN
+    if (busy_poll_us > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us)))
+      LOG_DEBUG << "SO_BUSY_POLL refused: " << strerror(errno);
+    add(fd, new MasterWorker(*master, fd, core));
+  }
+}
+
 void EpollMasterWorker::remove(int fd) {
-  delete master_workers[fd];
+  MasterWorker* w = master_workers[fd];
   master_workers.erase(fd);
+  if (router != NULL)
+    router->forget(core, w);
+  if (w->forwarded() > 0) {
+    //the fd is closed next and may be reused, nothing more goes out on it
+    w->hang_up();
+    retired.insert(w);
+  } else {
+    delete w;
+  }
   count--;
   LOG_DEBUG << "fd " << fd << " is removed from epollworker";
 }
 
 void EpollMasterWorker::run() {
   int n;
+  bool spinning = false;
+  uint64_t last_event = 0;
   while(true) {
-    n = epoll_wait (epoll_fd, events, MAXEVENTS, -1);
+    //busy polling: wait without sleeping until busy_poll_us pass idle
+    n = epoll_wait (epoll_fd, events, MAXEVENTS, spinning ? 0 : -1);
+    if (busy_poll_us > 0) {
+      uint64_t now = now_ns();
+      if (n > 0) {
+        spinning = true;
+        last_event = now;
+      } else if (now - last_event > (uint64_t)busy_poll_us * 1000) {
+        spinning = false;
+      }
+    }
     for (int i = 0; i < n; i++) {
-      if (events[i].events & EPOLLRDHUP) {
+      if (events[i].data.fd == listen_fd) {
+        accept_all();
+      } else if (router != NULL && events[i].data.fd == router->event_fd(core)) {
+        drain();
+      } else if (events[i].events & EPOLLRDHUP) {
         remove(events[i].data.fd);
         close(events[i].data.fd);
       } else if ((events[i].events & EPOLLERR) ||
-          (events[i].events & EPOLLHUP) ||
-          (!(events[i].events & EPOLLIN))) {
+          (events[i].events & EPOLLHUP)) {
         LOG_ERROR << "epoll error";
         remove(events[i].data.fd);
         close(events[i].data.fd);
         continue;
       } else {
         try {
-          master_workers[events[i].data.fd]->do_action();
+          if (events[i].events & EPOLLOUT)
+            master_workers[events[i].data.fd]->on_writable();
+          if (events[i].events & EPOLLIN)
+            master_workers[events[i].data.fd]->do_action();
         } catch (exception& e) {
           LOG_ERROR << "Caught exception, removing";
           remove(events[i].data.fd);
@@ -67,6 +204,9 @@ void EpollMasterWorker::run() {
         }
       }
     }
+    //one signal per core sent to in this round
+    if (router != NULL)
+      router->wake(core);
 
   }
 }
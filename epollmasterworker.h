@@ -2,6 +2,8 @@
 #define EPOLLMASTERWORKER_H
 
 #include <map>
+#include <set>
+#include <pthread.h>
 #include "masterworker.h"
 
 class EpollMasterWorker {
@@ -11,10 +13,30 @@ public:
   void run();
   void add(int fd, MasterWorker* master_worker);
   void remove(int fd);
+  // Accepts the connections of listening socket fd on this loop's thread.
+  void listen(int fd, Master& master);
+  // Before listen: pins the loop's thread to core, for --per_core and
+  // --busy_poll.
+  void pin(int core);
+  // --per_core: takes part in router as the loop of its core.
+  void route(CoreRouter& router);
+  // Spins on its sockets while requests keep coming, and blocks again after
+  // usec without any. Its connections busy poll the device queue as well.
+  void busy_poll(int usec);
   int get_count() {return count;}
   static void *pthread_helper(void * EpollMasterWorker);
 private:
+  void accept_all();
+  // Runs the requests other cores forwarded and sends back the replies to ours.
+  void drain();
   int epoll_fd;  
+  int listen_fd;
+  Master* master;
+  pthread_t thread;
+  int core;
+  CoreRouter* router;
+  int busy_poll_us;
+  set<MasterWorker*> retired; // removed, waiting for forwarded replies
   struct epoll_event *events;
   map<int, MasterWorker*> master_workers;
   int count;
@@ -3,8 +3,10 @@
 
 #include <map>
 #include <string>
+#include <vector>
 #include "objworker.h"
 #include "epollworker.h"
+#include "uringworker.h"
 
 
 using namespace std;
@@ -12,14 +14,12 @@ using namespace std;
 class EpollObjServer {
 public:
   EpollObjServer(int);
-  void run();
-  static void* run_helper(void*);
 
 private:
   int port;
   vector<EpollWorker*> epoll_workers;
-  int obj_server_sock;
-  int make_socket_non_blocking(int sfd);
+  vector<UringWorker*> uring_workers; // instead, with UCACHE_IO=uring
+  vector<int> obj_server_socks; // one per event loop
   void start_obj_server();
   void stop_obj_server();
 };
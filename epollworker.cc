@@ -2,12 +2,15 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
 #include "log.h"
 
 
 #define MAXEVENTS 64
 
-EpollWorker::EpollWorker() : count(0) {
+EpollWorker::EpollWorker() : listen_fd(-1), count(0) {
   epoll_fd = epoll_create1(0);
   if (epoll_fd == -1)
     DIE("Can't create epoll fd");
@@ -26,7 +29,8 @@ EpollWorker::~EpollWorker() {
 void EpollWorker::add(int fd, ObjWorker* worker) {
   struct epoll_event event;
   event.data.fd = fd;
-  event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+  //EPOLLOUT is edge triggered too, it only fires once a full socket drains
+  event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
   obj_workers[fd] = worker;
   int ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
   if (ret == -1)
@@ -35,6 +39,32 @@ void EpollWorker::add(int fd, ObjWorker* worker) {
   LOG_DEBUG << "fd " << fd << " added to epollworker";
 }
 
+void EpollWorker::listen(int fd) {
+  listen_fd = fd;
+  //accept_all takes connections until there are none left
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  struct epoll_event event;
+  event.data.fd = fd;
+  event.events = EPOLLIN;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    DIE("failed to add listening socket to epoll");
+}
+
+void EpollWorker::accept_all() {
+  while (true) {
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN)
+        LOG_ERROR << "error: unable to accept client " << strerror(errno);
+      return;
+    }
+    LOG_DEBUG << "new client";
+    add(fd, new ObjWorker(fd));
+  }
+}
+
 void EpollWorker::remove(int fd) {
   delete obj_workers[fd];
   obj_workers.erase(fd);
@@ -47,19 +77,23 @@ void EpollWorker::run() {
   while(true) {
     n = epoll_wait (epoll_fd, events, MAXEVENTS, -1);
     for (int i = 0; i < n; i++) {
-      if (events[i].events & EPOLLRDHUP) {
+      if (events[i].data.fd == listen_fd) {
+        accept_all();
+      } else if (events[i].events & EPOLLRDHUP) {
         remove(events[i].data.fd);
         close(events[i].data.fd);
       } else if ((events[i].events & EPOLLERR) ||
-          (events[i].events & EPOLLHUP) ||
-          (!(events[i].events & EPOLLIN))) {
+          (events[i].events & EPOLLHUP)) {
         LOG_ERROR << "epoll error";
         remove(events[i].data.fd);
         close(events[i].data.fd);
         continue;
       } else {
         try {
-          obj_workers[events[i].data.fd]->handle_msg();
+          if (events[i].events & EPOLLOUT)
+            obj_workers[events[i].data.fd]->on_writable();
+          if (events[i].events & EPOLLIN)
+            obj_workers[events[i].data.fd]->handle_msg();
         } catch (exception& e) {
           LOG_ERROR << "Caught exception, removing";
           remove(events[i].data.fd);
@@ -11,10 +11,14 @@ public:
   void run();
   void add(int fd, ObjWorker* obj_worker);
   void remove(int fd);
+  // Accepts the connections of listening socket fd on this loop's thread.
+  void listen(int fd);
   int get_count() {return count;}
   static void *pthread_helper(void * EpollWorker);
 private:
+  void accept_all();
   int epoll_fd;  
+  int listen_fd;
   struct epoll_event *events;
   map<int, ObjWorker*> obj_workers;
   int count;
@@ -0,0 +1,111 @@
+#include "frame.h"
+#include "binaryio.h"
+#include "token.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static const string names[OP_COUNT] = {
+  "", "new_server", "reg", "cache", "uncache", "lookup", "mlookup", "mreg", "mcache", "munlock",
+  "delete", "list_prefix", "delete_prefix", "consistent_lock", "consistent_unlock",
+  "consistent_delete", "lineage", "failover_write_update", "force_release_lock", "poll",
+  "decommission", "stats", "lambda_done", "promote", "follow", "shards", "migrate_done"
+};
+
+#define OP_CASE(name, code) case op_hash(name, sizeof(name) - 1): c = code; break;
+
+uint8_t frame_opcode(const char* op, size_t len) {
+  //the names' hashes are case labels, so a collision does not compile, and
+  //a hit is confirmed against the name
+  uint8_t c;
+  switch (op_hash(op, len)) {
+  OP_CASE("new_server", OP_NEW_SERVER)
+  OP_CASE("reg", OP_REG)
+  OP_CASE("cache", OP_CACHE)
+  OP_CASE("uncache", OP_UNCACHE)
+  OP_CASE("lookup", OP_LOOKUP)
+  OP_CASE("mlookup", OP_MLOOKUP)
+  OP_CASE("mreg", OP_MREG)
+  OP_CASE("mcache", OP_MCACHE)
+  OP_CASE("munlock", OP_MUNLOCK)
+  OP_CASE("delete", OP_DELETE)
+  OP_CASE("list_prefix", OP_LIST_PREFIX)
+  OP_CASE("delete_prefix", OP_DELETE_PREFIX)
+  OP_CASE("consistent_lock", OP_CONSISTENT_LOCK)
+  OP_CASE("consistent_unlock", OP_CONSISTENT_UNLOCK)
+  OP_CASE("consistent_delete", OP_CONSISTENT_DELETE)
+  OP_CASE("lineage", OP_LINEAGE)
+  OP_CASE("failover_write_update", OP_FAILOVER_WRITE_UPDATE)
+  OP_CASE("force_release_lock", OP_FORCE_RELEASE_LOCK)
+  OP_CASE("poll", OP_POLL)
+  OP_CASE("decommission", OP_DECOMMISSION)
+  OP_CASE("stats", OP_STATS)
+  OP_CASE("lambda_done", OP_LAMBDA_DONE)
+  OP_CASE("promote", OP_PROMOTE)
+  OP_CASE("follow", OP_FOLLOW)
+  OP_CASE("shards", OP_SHARDS)
+  OP_CASE("migrate_done", OP_MIGRATE_DONE)
+  default:
+    return OP_NONE;
+  }
+  return names[c].size() == len && memcmp(names[c].data(), op, len) == 0 ? c : (uint8_t)OP_NONE;
+}
+
+uint8_t frame_opcode(const string& op) {
+  return frame_opcode(op.data(), op.size());
+}
+
+const string& frame_op_name(uint8_t opcode) {
+  return opcode < OP_COUNT ? names[opcode] : names[OP_NONE];
+}
+
+static size_t varint_size(uint64_t v) {
+  size_t n = 1;
+  for (; v >= 0x80; v >>= 7)
+    n++;
+  return n;
+}
+
+void encode_frame(string& out, uint8_t opcode, uint64_t id, const vector<string>& fields, size_t first) {
+  //sized up front so the frame is written straight into out
+  size_t count = fields.size() > first ? fields.size() - first : 0;
+  size_t body = 1 + varint_size(id) + varint_size(count);
+  for (size_t i = first; i < fields.size(); i++)
+    body += varint_size(fields[i].size()) + fields[i].size();
+  out.reserve(out.size() + varint_size(body) + body);
+  BinaryWriter w(out);
+  w.put_varint(body);
+  w.put_u8(opcode);
+  w.put_varint(id);
+  w.put_varint(count);
+  for (size_t i = first; i < fields.size(); i++)
+    w.put_blob(fields[i]);
+}
+
+size_t decode_frame(const char* p, size_t len, uint8_t& opcode, uint64_t& id, vector<string>& fields) {
+  //a varint length is at most 10 bytes, short of that it may be cut off
+  BinaryReader header(p, len);
+  uint64_t body = header.get_varint();
+  if (!header.good())
+    return len >= 10 ? FRAME_CORRUPT : 0;
+  if (body > FRAME_MAX_BYTES)
+    return FRAME_CORRUPT;
+  size_t head = len - header.remaining();
+  if (header.remaining() < body)
+    return 0;
+  BinaryReader in(p + head, body);
+  opcode = in.get_u8();
+  id = in.get_varint();
+  uint64_t n = in.get_varint();
+  //fields already there are assigned into, keeping their buffers
+  size_t i = 0;
+  for (; i < n && in.good(); i++) {
+    if (i == fields.size())
+      fields.emplace_back();
+    in.get_blob(fields[i]);
+  }
+  fields.resize(i);
+  if (!in.good() || in.remaining() != 0)
+    return FRAME_CORRUPT;
+  return head + body;
+}
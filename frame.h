@@ -0,0 +1,70 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Sent as new_server's last field to ask for frames, echoed in the ack when
+// the master grants it. Both sides switch after the ack.
+#define FRAME_PROTOCOL "bin1"
+#define FRAME_ACK 0x80 // set in a reply's opcode
+#define FRAME_MAX_BYTES (256 << 20)
+#define FRAME_CORRUPT SIZE_MAX
+
+using namespace std;
+
+// Binary framing of master requests and replies, in place of a
+// "id|op|field|...\n" line. A frame is
+//   varint length of the rest, u8 opcode, varint request id,
+//   varint field count, then each field as a varint length and its bytes
+// so fields may hold any byte, '|' and '/' included, and nothing is
+// scanned for delimiters or parsed with atoi. A reply carries its request's
+// opcode with FRAME_ACK set in place of the "<op>_ack" name, and its id, so
+// replies can come back in any order.
+//
+// Commands that take over their connection (replicate, migrate) have no
+// opcode and stay text.
+enum Opcode {
+  OP_NONE = 0,
+  OP_NEW_SERVER,
+  OP_REG,
+  OP_CACHE,
+  OP_UNCACHE,
+  OP_LOOKUP,
+  OP_MLOOKUP,
+  OP_MREG,
+  OP_MCACHE,
+  OP_MUNLOCK,
+  OP_DELETE,
+  OP_LIST_PREFIX,
+  OP_DELETE_PREFIX,
+  OP_CONSISTENT_LOCK,
+  OP_CONSISTENT_UNLOCK,
+  OP_CONSISTENT_DELETE,
+  OP_LINEAGE,
+  OP_FAILOVER_WRITE_UPDATE,
+  OP_FORCE_RELEASE_LOCK,
+  OP_POLL,
+  OP_DECOMMISSION,
+  OP_STATS,
+  OP_LAMBDA_DONE,
+  OP_PROMOTE,
+  OP_FOLLOW,
+  OP_SHARDS,
+  OP_MIGRATE_DONE,
+  OP_COUNT
+};
+
+// OP_NONE for a command without an opcode.
+uint8_t frame_opcode(const char* op, size_t len);
+uint8_t frame_opcode(const string& op);
+// "" for an unknown opcode.
+const string& frame_op_name(uint8_t opcode);
+// Appends a frame holding fields[first...].
+void encode_frame(string& out, uint8_t opcode, uint64_t id, const vector<string>& fields, size_t first = 0);
+// Decodes the frame at the start of p into fields. Returns its size, 0 if
+// more bytes are needed, or FRAME_CORRUPT.
+size_t decode_frame(const char* p, size_t len, uint8_t& opcode, uint64_t& id, vector<string>& fields);
+
+#endif
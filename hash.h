@@ -0,0 +1,110 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+// 64-bit wyhash (final v4). Strong enough that keys sharing a long common
+// prefix such as "bucket~part-00001" spread evenly over shards and slots.
+
+#define WYHASH_S0 0xa0761d6478bd642full
+#define WYHASH_S1 0xe7037ed1a0b428dbull
+#define WYHASH_S2 0x8ebc6af09c88c6e7ull
+#define WYHASH_S3 0x589965cc75374cc3ull
+
+static inline void wyhash_mum(uint64_t* a, uint64_t* b) {
+  __uint128_t r = *a;
+  r *= *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wyhash_mix(uint64_t a, uint64_t b) {
+  wyhash_mum(&a, &b);
+  return a ^ b;
+}
+
+static inline uint64_t wyhash_r8(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint64_t wyhash_r4(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint64_t wyhash_r3(const uint8_t* p, size_t k) {
+  return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
+
+static inline uint64_t wyhash(const void* key, size_t len, uint64_t seed = 0) {
+  const uint8_t* p = (const uint8_t*)key;
+  seed ^= wyhash_mix(seed ^ WYHASH_S0, WYHASH_S1);
+  uint64_t a, b;
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (wyhash_r4(p) << 32) | wyhash_r4(p + ((len >> 3) << 2));
+      b = (wyhash_r4(p + len - 4) << 32) | wyhash_r4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = wyhash_r3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = wyhash_mix(wyhash_r8(p) ^ WYHASH_S1, wyhash_r8(p + 8) ^ seed);
+        see1 = wyhash_mix(wyhash_r8(p + 16) ^ WYHASH_S2, wyhash_r8(p + 24) ^ see1);
+        see2 = wyhash_mix(wyhash_r8(p + 32) ^ WYHASH_S3, wyhash_r8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = wyhash_mix(wyhash_r8(p) ^ WYHASH_S1, wyhash_r8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = wyhash_r8(p + i - 16);
+    b = wyhash_r8(p + i - 8);
+  }
+  a ^= WYHASH_S1;
+  b ^= seed;
+  wyhash_mum(&a, &b);
+  return wyhash_mix(a ^ WYHASH_S0 ^ len, b ^ WYHASH_S1);
+}
+
+static inline uint64_t wyhash(const std::string& s) {
+  return wyhash(s.data(), s.size());
+}
+
+// 64-bit FNV-1a followed by the murmur3 finalizer. Much slower than wyhash
+// but a few lines in any language, so clients can place keys on the shard
+// ring (HashRing) the same way the servers do.
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+static inline uint64_t fnv1a(const void* key, size_t len) {
+  const uint8_t* p = (const uint8_t*)key;
+  uint64_t h = FNV_OFFSET;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= FNV_PRIME;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+#endif
@@ -0,0 +1,77 @@
+#include "hashring.h"
+#include "hash.h"
+#include "epoch.h"
+#include <algorithm>
+#include <boost/algorithm/string.hpp>
+
+static const string no_owner;
+
+HashRing::HashRing() : table(new Table()) {
+  table.load()->version = 0;
+}
+
+HashRing::~HashRing() {
+  delete table.load();
+}
+
+void HashRing::set(const vector<string>& members) {
+  Table* next = new Table();
+  next->members = members;
+  for (uint32_t m = 0; m < members.size(); m++) {
+    for (int i = 0; i < RING_VNODES; i++) {
+      string point = members[m] + "#" + to_string(i);
+      next->points.push_back(make_pair(fnv1a(point.data(), point.size()), m));
+    }
+  }
+  sort(next->points.begin(), next->points.end());
+  Table* prev = table.load();
+  next->version = prev->version + 1;
+  table.store(next);
+  Epoch::retire(prev);
+}
+
+bool HashRing::empty() {
+  EpochGuard epoch;
+  return table.load(memory_order_acquire)->members.empty();
+}
+
+const string& HashRing::owner(const string& key) {
+  Table* t = table.load(memory_order_acquire);
+  if (t->points.empty())
+    return no_owner;
+  //a consistent key travels as "~name" and is stored as "name"
+  size_t skip = !key.empty() && key[0] == '~' ? 1 : 0;
+  uint64_t h = fnv1a(key.data() + skip, key.size() - skip);
+  auto it = lower_bound(t->points.begin(), t->points.end(), make_pair(h, (uint32_t)0));
+  if (it == t->points.end())
+    it = t->points.begin();
+  return t->members[it->second];
+}
+
+vector<string> HashRing::members() {
+  EpochGuard epoch;
+  return table.load(memory_order_acquire)->members;
+}
+
+uint64_t HashRing::version() {
+  EpochGuard epoch;
+  return table.load(memory_order_acquire)->version;
+}
+
+vector<string> HashRing::parse(const string& spec) {
+  vector<string> parts, members;
+  boost::split(parts, spec, boost::is_any_of(","));
+  for (auto& p : parts) {
+    string m = boost::trim_copy(p);
+    if (m == "")
+      continue;
+    if (m.find(':') == string::npos)
+      m += ":" + to_string(MASTER_PORT);
+    members.push_back(m);
+  }
+  return members;
+}
+
+string HashRing::join(const vector<string>& members) {
+  return boost::algorithm::join(members, ",");
+}
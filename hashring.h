@@ -0,0 +1,50 @@
+#ifndef HASHRING_H
+#define HASHRING_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define RING_VNODES 64
+#define MASTER_PORT 1988
+
+using namespace std;
+
+// Consistent hashing of shm names onto master shards ("host:port"). Every
+// shard owns RING_VNODES points, fnv1a("host:port#i"), and a key belongs to
+// the shard of the first point at or after fnv1a(key), so adding a shard
+// only moves the keys that now land on its points. A leading '~' is not
+// hashed, so "~name" of a consistent key lands where its stored "name"
+// does. cacheclient.py places keys with the same ring, keep the two in step.
+//
+// The first member hands out lambda ids for the whole deployment.
+//
+// owner() takes no lock: the point table is replaced by set() and retired
+// through Epoch, so callers hold an EpochGuard while they use its result.
+class HashRing {
+public:
+  HashRing();
+  ~HashRing();
+  void set(const vector<string>& members);
+  bool empty();
+  // The shard of key, or "" when the ring is empty.
+  const string& owner(const string& key);
+  vector<string> members();
+  // Bumped by every set(), so copies of the ring can tell they are behind.
+  uint64_t version();
+
+  // "a:1,b:2" <-> members; a host without a port gets MASTER_PORT.
+  static vector<string> parse(const string& spec);
+  static string join(const vector<string>& members);
+private:
+  struct Table {
+    vector<string> members;
+    vector<pair<uint64_t, uint32_t>> points; // sorted (hash, member)
+    uint64_t version;
+  };
+  atomic<Table*> table;
+};
+
+#endif
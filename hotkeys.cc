@@ -0,0 +1,29 @@
+#include "hotkeys.h"
+
+#define HOT_KEY_MASK ((1 << HOT_KEY_COLUMN_BITS) - 1)
+
+// Row r's column from two halves of one 64-bit hash, double hashing
+static inline uint32_t column(uint64_t hash, int r) {
+  uint32_t h1 = (uint32_t)hash;
+  uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+  return (h1 + r * h2) & HOT_KEY_MASK;
+}
+
+HotKeys::HotKeys() {
+  rotate();
+}
+
+bool HotKeys::hit(uint64_t hash) {
+  uint32_t est = UINT32_MAX;
+  for (int r = 0; r < HOT_KEY_ROWS; r++) {
+    uint32_t c = counts[r][column(hash, r)].fetch_add(1, memory_order_relaxed) + 1;
+    est = c < est ? c : est;
+  }
+  return est % HOT_KEY_LOOKUPS == 0;
+}
+
+void HotKeys::rotate() {
+  for (int r = 0; r < HOT_KEY_ROWS; r++)
+    for (int c = 0; c <= HOT_KEY_MASK; c++)
+      counts[r][c].store(0, memory_order_relaxed);
+}
@@ -0,0 +1,35 @@
+#ifndef HOTKEYS_H
+#define HOTKEYS_H
+
+#include <stdint.h>
+#include <atomic>
+
+#define HOT_KEY_ROWS 4
+#define HOT_KEY_COLUMN_BITS 12
+#define HOT_KEY_WINDOW_MS 1000
+// peer reads of one key in a window that earn it one more replica
+#define HOT_KEY_LOOKUPS 64
+#define HOT_KEY_MAX_REPLICAS 16
+
+using namespace std;
+
+// Count-min sketch of how often each key is read from a peer in the current
+// window. A key's estimate never undercounts, and overcounts only by what
+// colliding keys add in all rows at once.
+//
+// hit() is a handful of relaxed atomic adds, no lock; rotate() starts a new
+// window. Counts of a window in progress may be lost to a concurrent
+// rotate(), which only delays a key by a window.
+class HotKeys {
+public:
+  HotKeys();
+  // Counts one read of the key with this hash (KeyHashMap::hash) and
+  // returns true each time its estimate reaches another HOT_KEY_LOOKUPS.
+  bool hit(uint64_t hash);
+  void rotate();
+
+private:
+  atomic<uint32_t> counts[HOT_KEY_ROWS][1 << HOT_KEY_COLUMN_BITS];
+};
+
+#endif
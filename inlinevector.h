@@ -0,0 +1,81 @@
+#ifndef INLINEVECTOR_H
+#define INLINEVECTOR_H
+
+#include <stdint.h>
+#include <algorithm>
+
+// Vector of plain values that keeps up to N elements inline and only goes to
+// the heap when it outgrows them. Used for per-key location and owner lists,
+// which almost always hold one to three small ids.
+template <typename T, unsigned N>
+class InlineVector {
+public:
+  InlineVector() : count(0), cap(N), heap(NULL) {}
+  InlineVector(const InlineVector& other) : count(0), cap(N), heap(NULL) { assign(other); }
+  ~InlineVector() { delete[] heap; }
+  InlineVector& operator=(const InlineVector& other) {
+    if (this != &other) {
+      count = 0;
+      assign(other);
+    }
+    return *this;
+  }
+
+  T* begin() { return data(); }
+  T* end() { return data() + count; }
+  const T* begin() const { return data(); }
+  const T* end() const { return data() + count; }
+  T& operator[](uint32_t i) { return data()[i]; }
+  const T& operator[](uint32_t i) const { return data()[i]; }
+  T& front() { return data()[0]; }
+  T& back() { return data()[count - 1]; }
+  uint32_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  void clear() { count = 0; }
+
+  void push_back(const T& v) {
+    if (count == cap)
+      grow(cap * 2);
+    data()[count++] = v;
+  }
+
+  // Order is not preserved, the last element takes the removed one's place.
+  void erase_at(uint32_t i) {
+    data()[i] = data()[count - 1];
+    count--;
+  }
+
+  template <typename P>
+  T* find_if(P pred) {
+    for (T* it = begin(); it != end(); it++)
+      if (pred(*it))
+        return it;
+    return NULL;
+  }
+
+private:
+  T* data() { return heap != NULL ? heap : inline_buf; }
+  const T* data() const { return heap != NULL ? heap : inline_buf; }
+
+  void grow(uint32_t new_cap) {
+    T* buf = new T[new_cap];
+    std::copy(begin(), end(), buf);
+    delete[] heap;
+    heap = buf;
+    cap = new_cap;
+  }
+
+  void assign(const InlineVector& other) {
+    if (other.count > cap)
+      grow(other.count);
+    std::copy(other.begin(), other.end(), data());
+    count = other.count;
+  }
+
+  uint32_t count;
+  uint32_t cap;
+  T* heap;
+  T inline_buf[N];
+};
+
+#endif
@@ -0,0 +1,37 @@
+#include "interntable.h"
+#include "log.h"
+#include <cassert>
+
+InternTable::InternTable() : count(0) {
+  for (int i = 0; i < INTERN_MAX_CHUNKS; i++)
+    chunks[i] = NULL;
+}
+
+InternTable::~InternTable() {
+  for (int i = 0; i < INTERN_MAX_CHUNKS; i++)
+    delete[] chunks[i];
+}
+
+uint InternTable::intern(const string& name) {
+  lock_guard<mutex> guard(lock);
+  auto it = ids.find(name);
+  if (it != ids.end())
+    return it->second;
+  uint id = count.load(memory_order_relaxed);
+  uint chunk = id >> INTERN_CHUNK_BITS;
+  assert(chunk < INTERN_MAX_CHUNKS);
+  if (chunks[chunk] == NULL)
+    chunks[chunk] = new string[INTERN_CHUNK_SIZE];
+  chunks[chunk][id & (INTERN_CHUNK_SIZE - 1)] = name;
+  ids[name] = id;
+  count.store(id + 1, memory_order_release);
+  LOG_DEBUG << "interned " << name << " as " << id;
+  return id;
+}
+
+const string& InternTable::name(uint id) const {
+  static const string unknown("");
+  if (id >= size())
+    return unknown;
+  return chunks[id >> INTERN_CHUNK_BITS][id & (INTERN_CHUNK_SIZE - 1)];
+}
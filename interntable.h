@@ -0,0 +1,37 @@
+#ifndef INTERNTABLE_H
+#define INTERNTABLE_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#define INTERN_CHUNK_BITS 10
+#define INTERN_CHUNK_SIZE (1 << INTERN_CHUNK_BITS)
+#define INTERN_MAX_CHUNKS 4096
+
+using namespace std;
+
+typedef uint NodeId;
+#define NO_NODE ((NodeId)-1)
+
+// Maps identity strings (e.g. "ip:port" of a cache server) to dense integer
+// ids, once, so hot structures can store and compare ids instead of strings.
+// Interning takes a mutex; name() is lock-free since names never move or
+// disappear once assigned.
+class InternTable {
+public:
+  InternTable();
+  ~InternTable();
+  uint intern(const string& name);
+  const string& name(uint id) const;
+  uint size() const { return count.load(memory_order_acquire); }
+
+private:
+  mutex lock;
+  unordered_map<string, uint> ids;
+  string* chunks[INTERN_MAX_CHUNKS];
+  atomic<uint> count;
+};
+
+#endif
@@ -0,0 +1,182 @@
+#include "keyhashmap.h"
+#include "masterregistry.h"
+#include "epoch.h"
+#include "log.h"
+
+KeyHashMap::KeyHashMap() {
+}
+
+KeyHashMap::~KeyHashMap() {
+  for (auto& s : shards) {
+    delete s.table.load();
+    delete s.old.load();
+  }
+}
+
+size_t KeyHashMap::capacity_for(size_t n) {
+  size_t capacity = KEY_MAP_MIN_CAPACITY;
+  while (capacity * 3 < n * 4)
+    capacity <<= 1;
+  return capacity;
+}
+
+KeyHashMap::Slot* KeyHashMap::probe(Table* t, const char* key, size_t len, uint64_t hash) {
+  size_t i = hash & t->mask;
+  for (size_t n = 0; n <= t->mask; n++, i = (i + 1) & t->mask) {
+    Slot& s = t->slots[i];
+    uint64_t h = s.hash.load(memory_order_acquire);
+    if (h == 0)
+      return NULL;
+    if (h != hash)
+      continue;
+    KeyEntry* value = s.value.load(memory_order_acquire);
+    if (value != NULL && value != KEY_MAP_TOMBSTONE &&
+        value->key.size() == len && memcmp(value->key.data(), key, len) == 0)
+      return &s;
+  }
+  return NULL;
+}
+
+void KeyHashMap::place(Table* t, uint64_t hash, KeyEntry* value) {
+  size_t i = hash & t->mask;
+  while (true) {
+    Slot& s = t->slots[i];
+    uint64_t h = s.hash.load(memory_order_relaxed);
+    if (h == 0 || s.value.load(memory_order_relaxed) == KEY_MAP_TOMBSTONE) {
+      if (h == 0)
+        t->used++;
+      // value before hash: a reader that matches the hash finds the entry
+      s.value.store(value, memory_order_release);
+      s.hash.store(hash, memory_order_release);
+      return;
+    }
+    i = (i + 1) & t->mask;
+  }
+}
+
+void KeyHashMap::migrate(Shard& s, size_t steps) {
+  Table* old = s.old.load(memory_order_relaxed);
+  if (old == NULL)
+    return;
+  Table* table = s.table.load(memory_order_relaxed);
+  size_t end = s.migrated + steps;
+  if (end > old->capacity())
+    end = old->capacity();
+  // old slots are copied, not cleared, so a reader probing the old table
+  // still finds every key until the old table is unpublished
+  for (; s.migrated < end; s.migrated++) {
+    Slot& slot = old->slots[s.migrated];
+    KeyEntry* value = slot.value.load(memory_order_relaxed);
+    if (value != NULL && value != KEY_MAP_TOMBSTONE)
+      place(table, slot.hash.load(memory_order_relaxed), value);
+  }
+  if (s.migrated == old->capacity()) {
+    LOG_DEBUG << "resize to " << table->capacity() << " slots done";
+    s.old.store(NULL, memory_order_release);
+    Epoch::retire(old);
+    s.migrated = 0;
+  }
+}
+
+void KeyHashMap::start_resize(Shard& s, size_t capacity) {
+  // finish any resize still in flight first, there is only room for one
+  Table* old = s.old.load(memory_order_relaxed);
+  migrate(s, old == NULL ? 0 : old->capacity());
+  Table* table = s.table.load(memory_order_relaxed);
+  LOG_DEBUG << "resizing shard from " << table->capacity() << " to " << capacity << " slots";
+  if (s.count == 0) {
+    s.table.store(new Table(capacity), memory_order_release);
+    Epoch::retire(table);
+    return;
+  }
+  // old is published before the new table, so a reader that sees the new
+  // table also sees the old one until migration has finished
+  s.migrated = 0;
+  s.old.store(table, memory_order_release);
+  s.table.store(new Table(capacity), memory_order_release);
+}
+
+void KeyHashMap::maybe_grow(Shard& s) {
+  Table* t = s.table.load(memory_order_relaxed);
+  if ((t->used + 1) * 4 <= t->capacity() * 3)
+    return;
+  // sized by live keys, so a table full of tombstones is rebuilt in place
+  start_resize(s, capacity_for((s.count + 1) * 2));
+}
+
+void KeyHashMap::reserve(size_t n) {
+  size_t capacity = capacity_for(n / KEY_MAP_SHARDS + 1);
+  for (auto& s : shards) {
+    tbb::spin_mutex::scoped_lock guard(s.lock);
+    if (s.table.load(memory_order_relaxed)->capacity() < capacity)
+      start_resize(s, capacity);
+  }
+}
+
+KeyEntry* KeyHashMap::find(const char* key, size_t len, uint64_t hash) {
+  Shard& s = shard_for(hash);
+  Table* table = s.table.load(memory_order_acquire);
+  Table* old = s.old.load(memory_order_acquire);
+  Slot* slot = probe(table, key, len, hash);
+  if (slot == NULL && old != NULL)
+    slot = probe(old, key, len, hash);
+  if (slot == NULL)
+    return NULL;
+  KeyEntry* value = slot->value.load(memory_order_acquire);
+  return value == KEY_MAP_TOMBSTONE ? NULL : value;
+}
+
+KeyEntry* KeyHashMap::insert(KeyEntry* value) {
+  return insert(value, hash(value->key));
+}
+
+KeyEntry* KeyHashMap::insert(KeyEntry* value, uint64_t hash) {
+  const string& key = value->key;
+  Shard& s = shard_for(hash);
+  tbb::spin_mutex::scoped_lock guard(s.lock);
+  migrate(s, KEY_MAP_MIGRATE_STEP);
+  Table* table = s.table.load(memory_order_relaxed);
+  Table* old = s.old.load(memory_order_relaxed);
+  Slot* slot = probe(table, key.data(), key.size(), hash);
+  if (slot == NULL && old != NULL)
+    slot = probe(old, key.data(), key.size(), hash);
+  if (slot != NULL)
+    return slot->value.load(memory_order_relaxed);
+  maybe_grow(s);
+  place(s.table.load(memory_order_relaxed), hash, value);
+  s.count++;
+  return value;
+}
+
+KeyEntry* KeyHashMap::erase(const char* key, size_t len, uint64_t hash, KeyEntry* expected) {
+  Shard& s = shard_for(hash);
+  tbb::spin_mutex::scoped_lock guard(s.lock);
+  migrate(s, KEY_MAP_MIGRATE_STEP);
+  // a copied key sits in both tables until the old one is dropped
+  KeyEntry* removed = NULL;
+  Table* tables[2] = {s.table.load(memory_order_relaxed), s.old.load(memory_order_relaxed)};
+  for (Table* t : tables) {
+    if (t == NULL)
+      continue;
+    Slot* slot = probe(t, key, len, hash);
+    if (slot == NULL)
+      continue;
+    KeyEntry* value = slot->value.load(memory_order_relaxed);
+    if (expected != NULL && value != expected)
+      continue;
+    removed = value;
+    slot->value.store(KEY_MAP_TOMBSTONE, memory_order_release);
+  }
+  if (removed != NULL)
+    s.count--;
+  return removed;
+}
+
+size_t KeyHashMap::size() {
+  size_t total = 0;
+  for (auto& s : shards) {
+    tbb::spin_mutex::scoped_lock guard(s.lock);
+    total += s.count;
+  }
+  return total;
+}
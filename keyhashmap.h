@@ -0,0 +1,163 @@
+#ifndef KEYHASHMAP_H
+#define KEYHASHMAP_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include "tbb/spin_mutex.h"
+#include "hash.h"
+
+#define KEY_MAP_SHARDS 64
+#define KEY_MAP_SHARD_BITS 6
+#define KEY_MAP_MIN_CAPACITY 16
+#define KEY_MAP_MIGRATE_STEP 64
+#define KEY_MAP_TOMBSTONE ((KeyEntry*)1)
+
+using namespace std;
+
+class KeyEntry;
+
+// Sharded open-addressing map from key name to KeyEntry.
+//
+// Every slot keeps the full 64-bit hash next to the entry pointer, so probing
+// compares hashes first and only touches the key string on a hash match, and
+// growing a table never rehashes a key. The key itself lives in KeyEntry::key.
+// The top bits of the hash pick the shard, the low bits pick the slot.
+//
+// Tables grow incrementally: when a shard crosses its load factor a table of
+// the new size is installed next to the old one, and every later write to the
+// shard moves KEY_MAP_MIGRATE_STEP old slots over. Lookups probe both tables
+// until the move is done, so no single request pays for a full rehash.
+//
+// Writers serialize on a per-shard lock. find() takes no lock at all: slots
+// and table pointers are published with release stores and dropped tables are
+// reclaimed through Epoch, so callers of find() must hold an EpochGuard for as
+// long as they use the returned entry.
+class KeyHashMap {
+public:
+  KeyHashMap();
+  ~KeyHashMap();
+
+  static uint64_t hash(const char* key, size_t len) {
+    uint64_t h = wyhash(key, len);
+    return h == 0 ? 1 : h;
+  }
+  static uint64_t hash(const string& key) { return hash(key.data(), key.size()); }
+
+  // Pulls the home slot of hash toward the cache ahead of a find().
+  void prefetch(uint64_t hash) {
+    Table* t = shard_for(hash).table.load(memory_order_acquire);
+    __builtin_prefetch(&t->slots[hash & t->mask]);
+  }
+  // Pre-size for a bulk load of n keys; growth happens incrementally.
+  void reserve(size_t n);
+  KeyEntry* find(const char* key, size_t len, uint64_t hash);
+  KeyEntry* find(const string& key) { return find(key.data(), key.size(), hash(key)); }
+  // Inserts value under value->key unless the key exists. Returns the entry
+  // that is in the map afterwards, so value != return means it lost a race.
+  KeyEntry* insert(KeyEntry* value, uint64_t hash);
+  KeyEntry* insert(KeyEntry* value);
+  // Removes the key and returns the removed entry, or NULL. With expected set,
+  // only removes the key if it still maps to that entry. Readers may still
+  // hold the removed entry, so it must be retired through Epoch, not deleted.
+  KeyEntry* erase(const char* key, size_t len, uint64_t hash, KeyEntry* expected = NULL);
+  KeyEntry* erase(const string& key) { return erase(key.data(), key.size(), hash(key)); }
+  size_t size();
+
+  template <typename F>
+  void for_each(F f);
+  // Calls f with every entry stored under hash, one unless two keys collide.
+  // Like find(), the caller holds an EpochGuard.
+  template <typename F>
+  void for_hash(uint64_t hash, F f);
+
+private:
+  struct Slot {
+    atomic<uint64_t> hash;     // 0 = never used
+    atomic<KeyEntry*> value;   // KEY_MAP_TOMBSTONE once erased
+  };
+
+  struct Table {
+    Table(size_t capacity) : mask(capacity - 1), used(0), slots(new Slot[capacity]) {
+      for (size_t i = 0; i < capacity; i++) {
+        slots[i].hash.store(0, memory_order_relaxed);
+        slots[i].value.store(NULL, memory_order_relaxed);
+      }
+    }
+    ~Table() { delete[] slots; }
+    size_t capacity() { return mask + 1; }
+    size_t mask;
+    size_t used;   // live slots plus tombstones, writer side only
+    Slot* slots;
+  };
+
+  struct Shard {
+    Shard() : table(new Table(KEY_MAP_MIN_CAPACITY)), old(NULL), migrated(0), count(0) {}
+    tbb::spin_mutex lock;   // writers only
+    atomic<Table*> table;
+    atomic<Table*> old;     // non-NULL while a resize is in progress
+    size_t migrated;        // old slots below this index have been copied
+    size_t count;
+    char pad[64];
+  };
+
+  Shard& shard_for(uint64_t hash) { return shards[hash >> (64 - KEY_MAP_SHARD_BITS)]; }
+  static Slot* probe(Table* t, const char* key, size_t len, uint64_t hash);
+  static void place(Table* t, uint64_t hash, KeyEntry* value);
+  static size_t capacity_for(size_t n);
+  void migrate(Shard& s, size_t steps);
+  void start_resize(Shard& s, size_t capacity);
+  void maybe_grow(Shard& s);
+
+  Shard shards[KEY_MAP_SHARDS];
+};
+
+template <typename F>
+void KeyHashMap::for_each(F f) {
+  for (auto& s : shards) {
+    tbb::spin_mutex::scoped_lock guard(s.lock);
+    Table* t = s.table.load(memory_order_relaxed);
+    for (size_t i = 0; i < t->capacity(); i++) {
+      KeyEntry* value = t->slots[i].value.load(memory_order_relaxed);
+      if (value != NULL && value != KEY_MAP_TOMBSTONE)
+        f(value);
+    }
+    Table* old = s.old.load(memory_order_relaxed);
+    if (old != NULL) {
+      for (size_t i = s.migrated; i < old->capacity(); i++) {
+        KeyEntry* value = old->slots[i].value.load(memory_order_relaxed);
+        if (value != NULL && value != KEY_MAP_TOMBSTONE)
+          f(value);
+      }
+    }
+  }
+}
+
+template <typename F>
+void KeyHashMap::for_hash(uint64_t hash, F f) {
+  Shard& s = shard_for(hash);
+  Table* tables[2] = {s.table.load(memory_order_acquire), s.old.load(memory_order_acquire)};
+  KeyEntry* seen = NULL;
+  for (Table* t : tables) {
+    if (t == NULL)
+      continue;
+    size_t i = hash & t->mask;
+    for (size_t n = 0; n <= t->mask; n++, i = (i + 1) & t->mask) {
+      Slot& slot = t->slots[i];
+      uint64_t h = slot.hash.load(memory_order_acquire);
+      if (h == 0)
+        break;
+      if (h != hash)
+        continue;
+      KeyEntry* value = slot.value.load(memory_order_acquire);
+      //a key being moved is in both tables, the new one is probed first
+      if (value == NULL || value == KEY_MAP_TOMBSTONE || (t == tables[1] && value == seen))
+        continue;
+      if (t == tables[0])
+        seen = value;
+      f(value);
+    }
+  }
+}
+
+#endif
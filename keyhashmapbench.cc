@@ -0,0 +1,121 @@
+#include "keyhashmap.h"
+#include "masterregistry.h"
+#include "epoch.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+#include "tbb/concurrent_hash_map.h"
+
+// Insert and lookup cost of KeyHashMap against the tbb::concurrent_hash_map
+// it replaced, over keys shaped like object names. Usage:
+//   keyhashmapbench [keys] [lookup threads]
+// The map is meant for 10M keys (keyhashmapbench 10000000). Each key takes
+// about 1.4KB resident here, nearly all of it the KeyEntry, so that run
+// needs some 14GB; the default of 1M fits a small machine.
+
+// the hasher MasterRegistry used with the tbb map
+struct OldKeyHash {
+  static size_t hash(const string& key) {
+    size_t h = 0;
+    for (const char* s = key.c_str(); *s; ++s)
+      h = (h * 17) ^ *s;
+    return h;
+  }
+  static bool equal(const string& a, const string& b) { return a == b; }
+};
+typedef tbb::concurrent_hash_map<string, KeyEntry*, OldKeyHash> OldKeyMap;
+
+static double now_ns() {
+  return chrono::duration<double, nano>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const char* what, size_t ops, double start) {
+  printf("%-28s %8.1f ns/op\n", what, (now_ns() - start) / ops);
+}
+
+// Spreads n random lookups over threads; returns the hits so the loop
+// cannot be optimized out.
+template <typename F>
+static size_t run_lookups(const vector<string>& keys, size_t n, int threads, F lookup) {
+  vector<thread> workers;
+  vector<size_t> hits(threads);
+  for (int t = 0; t < threads; t++) {
+    workers.push_back(thread([&, t]() {
+      mt19937_64 rng(t);
+      for (size_t i = 0; i < n / threads; i++)
+        hits[t] += lookup(keys[rng() % keys.size()]);
+    }));
+  }
+  for (auto& w : workers)
+    w.join();
+  size_t total = 0;
+  for (size_t h : hits)
+    total += h;
+  return total;
+}
+
+int main(int argc, char** argv) {
+  size_t n = argc > 1 ? atol(argv[1]) : 1000000;
+  int threads = argc > 2 ? atoi(argv[2]) : thread::hardware_concurrency();
+  if (threads < 1)
+    threads = 1;
+  vector<string> keys;
+  vector<KeyEntry*> entries;
+  char name[64];
+  for (size_t i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "bucket~part-%08zu", i);
+    keys.push_back(name);
+    entries.push_back(new KeyEntry(name));
+  }
+  printf("%zu keys, %d lookup threads\n", n, threads);
+
+  double start = now_ns();
+  OldKeyMap old;
+  for (size_t i = 0; i < n; i++)
+    old.insert(make_pair(keys[i], entries[i]));
+  report("tbb map insert", n, start);
+  start = now_ns();
+  size_t hits = run_lookups(keys, n, 1, [&](const string& key) {
+    OldKeyMap::const_accessor a;
+    return old.find(a, key) ? 1 : 0;
+  });
+  report("tbb map lookup", n, start);
+  start = now_ns();
+  hits += run_lookups(keys, n, threads, [&](const string& key) {
+    OldKeyMap::const_accessor a;
+    return old.find(a, key) ? 1 : 0;
+  });
+  report("tbb map lookup, threaded", n, start);
+
+  start = now_ns();
+  KeyHashMap map;
+  for (size_t i = 0; i < n; i++)
+    map.insert(entries[i]);
+  report("KeyHashMap insert", n, start);
+  start = now_ns();
+  hits += run_lookups(keys, n, 1, [&](const string& key) {
+    EpochGuard guard;
+    return map.find(key) != NULL ? 1 : 0;
+  });
+  report("KeyHashMap lookup", n, start);
+  start = now_ns();
+  hits += run_lookups(keys, n, threads, [&](const string& key) {
+    EpochGuard guard;
+    return map.find(key) != NULL ? 1 : 0;
+  });
+  report("KeyHashMap lookup, threaded", n, start);
+
+  // every lookup above is of a key that was inserted
+  size_t expected = 2 * n + 2 * (n / threads * threads);
+  if (hits != expected) {
+    printf("lookups missed: %zu of %zu hit\n", hits, expected);
+    return 1;
+  }
+  for (KeyEntry* e : entries)
+    delete e;
+  return 0;
+}
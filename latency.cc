@@ -0,0 +1,86 @@
+#include "latency.h"
+#include <stdio.h>
+
+LatencyHistogram::LatencyHistogram() {
+  for (size_t b = 0; b < LATENCY_BUCKETS; b++)
+    counts[b].store(0, memory_order_relaxed);
+}
+
+size_t LatencyHistogram::bucket(uint64_t ns) {
+  if (ns < (1 << LATENCY_SUB_BITS))
+    return ns;
+  int e = 63 - __builtin_clzll(ns);
+  size_t sub = (ns >> (e - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1);
+  return ((e - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + sub;
+}
+
+uint64_t LatencyHistogram::value(size_t b) {
+  if (b < (1 << LATENCY_SUB_BITS))
+    return b;
+  int e = (b >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+  uint64_t sub = b & ((1 << LATENCY_SUB_BITS) - 1);
+  uint64_t width = 1ULL << (e - LATENCY_SUB_BITS);
+  return (((1 << LATENCY_SUB_BITS) + sub) << (e - LATENCY_SUB_BITS)) + width / 2;
+}
+
+void LatencyHistogram::record(uint64_t ns, uint64_t count) {
+  //single writer, so no locked add
+  atomic<uint64_t>& c = counts[bucket(ns)];
+  c.store(c.load(memory_order_relaxed) + count, memory_order_relaxed);
+}
+
+void LatencyHistogram::add_to(vector<uint64_t>& sums) {
+  for (size_t b = 0; b < LATENCY_BUCKETS; b++)
+    sums[b] += counts[b].load(memory_order_relaxed);
+}
+
+static atomic<uint64_t> next_recorder(1);
+
+LatencyRecorder::LatencyRecorder() : id(next_recorder++) {
+}
+
+LatencyRecorder::~LatencyRecorder() {
+  for (LatencyHistogram* h : histograms)
+    delete h;
+}
+
+LatencyHistogram* LatencyRecorder::local() {
+  //a thread records into one recorder in practice, the master's. The
+  //entries of a recorder that is gone are never matched again
+  static thread_local vector<pair<uint64_t, LatencyHistogram*>> mine;
+  for (auto& m : mine)
+    if (m.first == id)
+      return m.second;
+  LatencyHistogram* h = new LatencyHistogram();
+  {
+    lock_guard<mutex> guard(lock);
+    histograms.push_back(h);
+  }
+  mine.push_back(make_pair(id, h));
+  return h;
+}
+
+string LatencyRecorder::stats(const string& name) {
+  vector<uint64_t> sums(LATENCY_BUCKETS, 0);
+  {
+    lock_guard<mutex> guard(lock);
+    for (LatencyHistogram* h : histograms)
+      h->add_to(sums);
+  }
+  uint64_t total = 0;
+  for (uint64_t c : sums)
+    total += c;
+  double p[2] = {0.5, 0.99};
+  string out;
+  for (int i = 0; i < 2; i++) {
+    uint64_t rank = total * p[i], seen = 0;
+    size_t b = 0;
+    while (b < LATENCY_BUCKETS && (seen += sums[b]) <= rank && seen < total)
+      b++;
+    char field[64];
+    snprintf(field, sizeof(field), "|%s_p%d_us=%.1f", name.c_str(), (int)(p[i] * 100),
+             total == 0 ? 0.0 : LatencyHistogram::value(b) / 1000.0);
+    out += field;
+  }
+  return out + "|" + name + "_samples=" + to_string(total);
+}
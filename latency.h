@@ -0,0 +1,53 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define LATENCY_SUB_BITS 4 // buckets per power of two, as a power of two
+#define LATENCY_BUCKETS (64 << LATENCY_SUB_BITS)
+
+using namespace std;
+
+static inline uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Log-linear histogram of latencies in ns, 16 buckets per power of two so
+// a percentile is off by at most 1/32. Only its own thread records into
+// it, with plain stores; readers sum it a little behind.
+class LatencyHistogram {
+public:
+  LatencyHistogram();
+  void record(uint64_t ns, uint64_t count);
+  void add_to(vector<uint64_t>& sums);
+  static size_t bucket(uint64_t ns);
+  // The middle of bucket b.
+  static uint64_t value(size_t b);
+private:
+  atomic<uint64_t> counts[LATENCY_BUCKETS];
+};
+
+// Latencies recorded from any number of threads, each into a histogram of
+// its own, so the event loops never share a counter.
+class LatencyRecorder {
+public:
+  LatencyRecorder();
+  ~LatencyRecorder();
+  void record(uint64_t ns, uint64_t count = 1) {local()->record(ns, count);}
+  // "|<name>_p50_us=..|<name>_p99_us=..|<name>_samples=.."
+  string stats(const string& name);
+private:
+  LatencyHistogram* local();
+  const uint64_t id; // never reused, so a thread's histograms are found by it
+  mutex lock;
+  vector<LatencyHistogram*> histograms;
+};
+
+#endif
@@ -0,0 +1,172 @@
+#include "lineagegraph.h"
+#include "log.h"
+#include <algorithm>
+#include <unordered_set>
+
+LineageGraph::Node& LineageGraph::node(uint lambda) {
+  return *nodes.create(lambda);
+}
+
+bool LineageGraph::add(uint lambda, const string& key, uint version) {
+  uint key_id = keys.intern(key);
+  tbb::spin_rw_mutex::scoped_lock guard(lock, true);
+  Node& n = node(lambda);
+  for (auto& e : n.deps)
+    if (e.key == key_id && e.version == version)
+      return false;
+  LineageEdge e = {key_id, version};
+  n.deps.push_back(e);
+  node(version).dependents.push_back(lambda);
+  invalidate(lambda);
+  return true;
+}
+
+void LineageGraph::invalidate(uint lambda) {
+  lock_guard<mutex> memo_guard(memo_lock);
+  if (memo.empty())
+    return;
+  unordered_set<uint> visited;
+  vector<uint> pending;
+  pending.push_back(lambda);
+  visited.insert(lambda);
+  while (!pending.empty()) {
+    uint curr = pending.back();
+    pending.pop_back();
+    memo.erase(curr);
+    Node* n = nodes.get(curr);
+    if (n == NULL)
+      continue;
+    for (uint d : n->dependents)
+      if (visited.insert(d).second)
+        pending.push_back(d);
+  }
+}
+
+shared_ptr<const vector<uint>> LineageGraph::closure(uint lambda) {
+  tbb::spin_rw_mutex::scoped_lock guard(lock, false);
+  {
+    lock_guard<mutex> memo_guard(memo_lock);
+    auto it = memo.find(lambda);
+    if (it != memo.end())
+      return it->second;
+  }
+  unordered_set<uint> visited;
+  vector<uint> pending;
+  pending.push_back(lambda);
+  visited.insert(lambda);
+  while (!pending.empty()) {
+    uint curr = pending.back();
+    pending.pop_back();
+    if (curr != lambda) {
+      shared_ptr<const vector<uint>> known;
+      {
+        lock_guard<mutex> memo_guard(memo_lock);
+        auto it = memo.find(curr);
+        if (it != memo.end())
+          known = it->second;
+      }
+      if (known) {
+        visited.insert(known->begin(), known->end());
+        continue;
+      }
+    }
+    Node* n = nodes.get(curr);
+    if (n == NULL)
+      continue;
+    for (auto& e : n->deps)
+      if (visited.insert(e.version).second)
+        pending.push_back(e.version);
+  }
+  auto res = make_shared<vector<uint>>(visited.begin(), visited.end());
+  sort(res->begin(), res->end());
+  //edges only change under the exclusive lock, so this cannot be stale
+  lock_guard<mutex> memo_guard(memo_lock);
+  if (memo.size() >= LINEAGE_MEMO_MAX)
+    memo.clear();
+  memo[lambda] = res;
+  return res;
+}
+
+void LineageGraph::edges(uint lambda, vector<LineageEdge>& out) {
+  tbb::spin_rw_mutex::scoped_lock guard(lock, false);
+  Node* n = nodes.get(lambda);
+  if (n != NULL)
+    out.insert(out.end(), n->deps.begin(), n->deps.end());
+}
+
+void LineageGraph::remove(uint lambda) {
+  tbb::spin_rw_mutex::scoped_lock guard(lock, true);
+  Node* n = nodes.get(lambda);
+  if (n == NULL)
+    return;
+  invalidate(lambda);
+  for (auto& e : n->deps) {
+    Node* target = nodes.get(e.version);
+    if (target == NULL)
+      continue;
+    auto& d = target->dependents;
+    auto it = find(d.begin(), d.end(), lambda);
+    if (it != d.end()) {
+      *it = d.back();
+      d.pop_back();
+    }
+  }
+  nodes.destroy(lambda);
+}
+
+void LineageGraph::save(BinaryWriter& out) {
+  tbb::spin_rw_mutex::scoped_lock guard(lock, false);
+  uint num_keys = keys.size();
+  out.put_u32(num_keys);
+  for (uint k = 0; k < num_keys; k++)
+    out.put_str(keys.name(k));
+  vector<uint> with_deps;
+  nodes.for_each([&with_deps](uint id, Node* n) {
+    if (!n->deps.empty())
+      with_deps.push_back(id);
+  });
+  out.put_u32(with_deps.size());
+  for (uint id : with_deps) {
+    Node* n = nodes.get(id);
+    out.put_u32(id);
+    out.put_u32(n->deps.size());
+    for (auto& e : n->deps) {
+      out.put_u32(e.key);
+      out.put_u32(e.version);
+    }
+  }
+}
+
+bool LineageGraph::load(BinaryReader& in) {
+  tbb::spin_rw_mutex::scoped_lock guard(lock, true);
+  uint num_keys = in.get_u32();
+  vector<uint> key_map;
+  for (uint k = 0; k < num_keys && in.good(); k++)
+    key_map.push_back(keys.intern(in.get_str()));
+  uint num_nodes = in.get_u32();
+  for (uint i = 0; i < num_nodes && in.good(); i++) {
+    uint lambda = in.get_u32();
+    uint num_deps = in.get_u32();
+    for (uint j = 0; j < num_deps && in.good(); j++) {
+      LineageEdge e;
+      e.key = in.get_u32();
+      e.version = in.get_u32();
+      if (e.key >= key_map.size())
+        continue;
+      e.key = key_map[e.key];
+      node(lambda).deps.push_back(e);
+      node(e.version).dependents.push_back(lambda);
+    }
+  }
+  return in.good();
+}
+
+void LineageGraph::clear() {
+  vector<uint> ids;
+  {
+    tbb::spin_rw_mutex::scoped_lock guard(lock, false);
+    nodes.for_each([&ids](uint id, Node*) { ids.push_back(id); });
+  }
+  for (uint id : ids)
+    remove(id);
+}
@@ -0,0 +1,64 @@
+#ifndef LINEAGEGRAPH_H
+#define LINEAGEGRAPH_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "tbb/spin_rw_mutex.h"
+#include "interntable.h"
+#include "slab.h"
+#include "binaryio.h"
+
+#define LINEAGE_MEMO_MAX 4096
+#define LINEAGE_SLAB_BITS 12
+
+using namespace std;
+
+// lambda read key at version; the version is the id of the lambda that wrote it
+struct LineageEdge {
+  uint key;
+  uint version;
+};
+
+// Dependency graph between lambdas, stored as adjacency arrays indexed by
+// lambda id with interned key names, plus the reverse edges.
+//
+// Closures of queried lambdas are memoized. A memoized closure is complete,
+// so a later traversal that reaches that lambda reuses it instead of walking
+// on. Adding an edge drops the memo of the lambda and of everything that
+// depends on it, found by walking the reverse edges.
+class LineageGraph {
+public:
+  // Returns false if the edge was already known.
+  bool add(uint lambda, const string& key, uint version);
+  // Every lambda reachable from lambda, lambda included, sorted by id.
+  shared_ptr<const vector<uint>> closure(uint lambda);
+  void edges(uint lambda, vector<LineageEdge>& out);
+  // Drops the edges of a lambda that is no longer needed. Lambdas that read
+  // its versions keep their edges to it, they just lead nowhere.
+  void remove(uint lambda);
+  const string& key_name(uint key) const {return keys.name(key);}
+  // Key names in id order, then the edges of every lambda.
+  void save(BinaryWriter& out);
+  bool load(BinaryReader& in);
+  void clear();
+
+private:
+  struct Node {
+    vector<LineageEdge> deps;
+    vector<uint> dependents;
+  };
+
+  Node& node(uint lambda);
+  void invalidate(uint lambda);
+
+  tbb::spin_rw_mutex lock;
+  SlabArray<Node, LINEAGE_SLAB_BITS> nodes;
+  InternTable keys;
+  mutex memo_lock;
+  unordered_map<uint, shared_ptr<const vector<uint>>> memo;
+};
+
+#endif
@@ -0,0 +1,47 @@
+#include "listener.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static int bound_socket(uint16_t port, bool reuse_port) {
+  int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0)
+    return -1;
+  int yes = 1;
+  sockaddr_in address;
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = INADDR_ANY;
+  address.sin_port = htons(port);
+  //accepted sockets inherit TCP_NODELAY
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) ||
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) ||
+      (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int))) ||
+      bind(fd, (sockaddr *)(&address), sizeof(sockaddr_in)) < 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+int listen_on(uint16_t port, bool reuse_port) {
+  int fd = bound_socket(port, reuse_port);
+  if (fd >= 0 && listen(fd, SOMAXCONN) < 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+bool port_available(uint16_t port) {
+  int fd = bound_socket(port, false);
+  if (fd < 0)
+    return false;
+  close(fd);
+  return true;
+}
@@ -0,0 +1,16 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <stdint.h>
+
+// A TCP listening socket on port with a full SOMAXCONN backlog, or -1 with
+// errno set. With reuse_port any number of them listen on the same port
+// and the kernel spreads new connections over them by connection hash, so
+// every event loop accepts on its own socket.
+int listen_on(uint16_t port, bool reuse_port);
+
+// True when nothing listens on port yet. SO_REUSEPORT would otherwise let
+// a second server of the same user quietly share the port with the first.
+bool port_available(uint16_t port);
+
+#endif
@@ -1,14 +1,41 @@
 #include "cacheserver.h"
 #include "log.h"
 #include <csignal>
+#include <pthread.h>
 
 void signal_callback_handler(int signum){
   LOG_ERROR << "Caught signal SIGPIPE " << signum;
 }
 
+static void* shutdown_helper(void* server) {
+  //SIGTERM and SIGINT are blocked in every thread and taken here
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  int signum = 0;
+  sigwait(&set, &signum);
+  LOG_INFO << "Caught signal " << signum << ", decommissioning";
+  static_cast<CacheServer*>(server)->decommission();
+  exit(0);
+  return nullptr;
+}
+
 int main(int argc, char** argv) {
   signal(SIGPIPE, signal_callback_handler);
-  CacheServer c(argv[1]);
+  //blocked before any thread starts, so they all inherit it
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  //cacheserver masters [rack] [host]
+  //UCACHE_IO=uring serves objects from io_uring loops instead of epoll
+  //UCACHE_BUSY_POLL=usec spins that long for master replies before sleeping
+  CacheServer c(argv[1], argc > 2 ? argv[2] : "", argc > 3 ? argv[3] : "");
+  pthread_t t;
+  if (pthread_create(&t, NULL, shutdown_helper, &c))
+    LOG_ERROR << "Failed to create shutdown thread";
   c.run();
   return 0;
 }
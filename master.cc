@@ -1,6 +1,7 @@
 #include "master.h"
 #include "masterworker.h"
 #include "log.h"
+#include "listener.h"
 
 #include <iostream>
 #include <cerrno>
@@ -16,38 +17,38 @@ void signal_callback_handler(int signum){
   LOG_ERROR << "Caught signal SIGPIPE " << signum;
 }
 
-Master::Master(unsigned short port)
-    : port(port)
+Master::Master(const MasterConfig& config)
+    : replica(registry, config.max_staleness_ms)
+    , shards(registry)
+    , batch_pool(sysconf(_SC_NPROCESSORS_ONLN))
+    , config(config)
+    , port(config.port)
     , workers()
     , socket_fd(-1)
 {
 #if USE_EPOLL == 1
   num_core = sysconf(_SC_NPROCESSORS_ONLN);
   LOG_MSG << "Detected " << num_core << " cores";  
-  for (int i = 0; i < num_core*2; i++) {
-    epoll_master_workers.push_back(new EpollMasterWorker());
+  io = Uring::backend(config.io);
+  int loops = num_core*2;
+  //spinning loops each get a core of their own
+  if (config.per_core || config.busy_poll_us > 0) {
+    if (io == "uring")
+      LOG_ERROR << "--per_core and --busy_poll run on epoll loops, ignoring --io=uring";
+    io = "epoll";
+    loops = num_core;
   }
-#endif
-}
-
-int Master::make_socket_non_blocking (int sfd) {
-  int flags, s;
-  flags = fcntl (sfd, F_GETFL, 0);
-  if (flags == -1) {
-    perror ("fcntl");
-    return -1;
-  }
-
-  flags |= O_NONBLOCK;
-  s = fcntl (sfd, F_SETFL, flags);
-  if (s == -1) {
-    perror ("fcntl");
-    return -1;
+  if (config.per_core)
+    router.start(num_core);
+  for (int i = 0; i < loops; i++) {
+    if (io == "uring")
+      uring_master_workers.push_back(new UringMasterWorker());
+    else
+      epoll_master_workers.push_back(new EpollMasterWorker());
   }
-  return 0;
+#endif
 }
 
-
 Master::~Master()
 {
     for (auto i = workers.begin(); i != workers.end(); ++i)
@@ -56,40 +57,65 @@ Master::~Master()
 
 bool Master::init()
 {
-    if ((socket_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
-      DIE("error: cannot create socket");
-
-    int yes = 1;
-    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)))
-      DIE("error: unable to set socket option");
-    if (setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)))
-      DIE("error: unable to set socket option");
-
-    sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-    if (bind(socket_fd, (sockaddr *)(&address), sizeof(sockaddr_in)) < 0)
-      DIE("error: cannot bind socket to port ");
-
-    if (listen(socket_fd, port) < 0)
-      DIE("error: cannot listen on port ");
+#if USE_EPOLL == 1
+    if (!port_available(port))
+      DIE("error: port %d is in use", port);
+    //a listener per event loop, which accepts its own connections
+    for (size_t i = 0; i < epoll_master_workers.size(); i++) {
+      int fd = listen_on(port, true);
+      if (fd < 0)
+        DIE("error: cannot listen on port %d: %s", port, strerror(errno));
+      listen_fds.push_back(fd);
+      if (config.per_core || config.busy_poll_us > 0)
+        epoll_master_workers[i]->pin(i);
+      if (router.active())
+        epoll_master_workers[i]->route(router);
+      if (config.busy_poll_us > 0)
+        epoll_master_workers[i]->busy_poll(config.busy_poll_us);
+      epoll_master_workers[i]->listen(fd, *this);
+    }
+    for (UringMasterWorker* loop : uring_master_workers) {
+      int fd = listen_on(port, true);
+      if (fd < 0)
+        DIE("error: cannot listen on port %d: %s", port, strerror(errno));
+      listen_fds.push_back(fd);
+      loop->listen(fd, *this);
+    }
+#else
+    if ((socket_fd = listen_on(port, false)) < 0)
+      DIE("error: cannot listen on port %d: %s", port, strerror(errno));
+#endif
 
-    LOG_MSG << "listening on port " << port;
+    LOG_MSG << "listening on port " << port << " with " << stats();
 
     return true;
 }
 
 void Master::cleanup() {
+  for (int fd : listen_fds)
+    close(fd);
+  listen_fds.clear();
   if (socket_fd >= 0) {
     close(socket_fd);
     socket_fd = -1;
-    sleep(2);
   }
+  sleep(2);
 }
 
 void Master::run() {
 
+    //recover before accepting anyone, clients see either nothing or the full state
+    if (config.data_dir != "" && !registry.open_store(config.data_dir, config.wal_sync))
+      DIE("error: cannot recover from %s", config.data_dir.c_str());
+
+    shards.configure(config.shard_addr, HashRing::parse(config.shards), config.data_dir);
+    if (config.join)
+      shards.join();
+
+    if (config.follow != "")
+      replica.follow(config.follow);
+    replica.start();
+
     if (!init()) {
         cleanup();
         return;
@@ -101,6 +127,18 @@ void Master::run() {
     if ( pthread_sigmask(SIG_BLOCK, &signal_mask, NULL) )
       LOG_ERROR << "error setting sigmask";
 
+    pthread_t maintenance_thread;
+    if (pthread_create(&maintenance_thread, 0, &Master::maintenance_helper, this))
+      LOG_ERROR << "error: unable to create maintenance thread";
+    pthread_t lease_thread;
+    if (pthread_create(&lease_thread, 0, &Master::lease_timer_helper, this))
+      LOG_ERROR << "error: unable to create lease timer thread";
+
+#if USE_EPOLL == 1
+    //the event loops accept, this thread only waits to be stopped
+    pause();
+    LOG_ERROR << "stopping server, waiting for threads to terminate";
+#else
     for (;;) {
         int worker_socket = accept(socket_fd, nullptr, nullptr);
         if (worker_socket < 0) {
@@ -113,13 +151,6 @@ void Master::run() {
         } else {
             LOG_DEBUG << "new client";
             MasterWorker * worker = new MasterWorker(*this, worker_socket);
-#if USE_EPOLL == 1
-            make_socket_non_blocking(worker_socket);
-            int r1 = rand() % epoll_master_workers.size();
-            int r2 = rand() % epoll_master_workers.size();
-            EpollMasterWorker* selected = epoll_master_workers[r1]->get_count() < epoll_master_workers[r2]->get_count()?epoll_master_workers[r1]:epoll_master_workers[r2];
-            selected->add(worker_socket, worker);
-#else
             workers.push_back(worker);
             pthread_t thread;
             if (pthread_create(&thread, 0, &MasterWorker::pthread_helper, worker)) {
@@ -130,15 +161,99 @@ void Master::run() {
                 LOG_ERROR << "error: unable to detach thread";
                 continue;
             }
-#endif
         }
     }
+#endif
     cleanup();
 }
 
+string Master::stats() {
+  string mode = io;
+  if (config.per_core)
+    mode += "+per_core";
+  if (config.busy_poll_us > 0)
+    mode += "+busy_poll";
+  return "|io=" + mode + latency.stats("rpc");
+}
 
-int main() {
+void Master::maintenance() {
+  time_t last_snapshot = time(NULL);
+  while (true) {
+    sleep(GC_INTERVAL_SEC);
+    //a follower's versions and lambdas follow the leader's
+    if (!replica.following()) {
+      int collected = registry.collect_garbage();
+      if (collected > 0)
+        LOG_INFO << "gc collected " << collected << " versions";
+    }
+    registry.sweep_node_keys();
+    if (config.data_dir != "" && time(NULL) - last_snapshot >= config.snapshot_interval) {
+      registry.checkpoint();
+      last_snapshot = time(NULL);
+    }
+  }
+}
+
+void *Master::maintenance_helper(void *master) {
+  static_cast<Master *>(master)->maintenance();
+  return nullptr;
+}
+
+void Master::lease_timer() {
+  for (uint64_t tick = 1; ; tick++) {
+    usleep(LEASE_TICK_MS * 1000);
+    registry.expire_leases();
+    if (tick % (HOT_KEY_WINDOW_MS / LEASE_TICK_MS) == 0)
+      registry.rotate_hot_keys();
+    //a follower learns of lost nodes from the journal
+    if (tick % (1000 / LEASE_TICK_MS) == 0 && !replica.following())
+      registry.detect_failures();
+  }
+}
+
+void *Master::lease_timer_helper(void *master) {
+  static_cast<Master *>(master)->lease_timer();
+  return nullptr;
+}
+
+// Flags are --name=value: --port, --data_dir, --wal_sync=0|1, --snapshot_interval,
+// --follow=host:port, --max_staleness_ms, --shards=host:port,..., --shard_addr=host:port,
+// --join, --io=epoll|uring, --per_core, --busy_poll=usec.
+int main(int argc, char** argv) {
   signal(SIGPIPE, SIG_IGN);
-  Master m(1988);
+  MasterConfig config = {MASTER_PORT, "", true, SNAPSHOT_INTERVAL_SEC, "", REPL_MAX_STALENESS_MS, "", "", false, "epoll", false, 0};
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    size_t eq = arg.find('=');
+    string name = arg.substr(0, eq);
+    string value = eq == string::npos ? "" : arg.substr(eq + 1);
+    if (name == "--port")
+      config.port = atoi(value.c_str());
+    else if (name == "--data_dir")
+      config.data_dir = value;
+    else if (name == "--wal_sync")
+      config.wal_sync = value != "0";
+    else if (name == "--snapshot_interval")
+      config.snapshot_interval = atoi(value.c_str());
+    else if (name == "--follow")
+      config.follow = value;
+    else if (name == "--max_staleness_ms")
+      config.max_staleness_ms = atoi(value.c_str());
+    else if (name == "--shards")
+      config.shards = value;
+    else if (name == "--shard_addr")
+      config.shard_addr = value;
+    else if (name == "--join")
+      config.join = value != "0";
+    else if (name == "--io")
+      config.io = value;
+    else if (name == "--per_core")
+      config.per_core = value != "0";
+    else if (name == "--busy_poll")
+      config.busy_poll_us = atoi(value.c_str());
+    else
+      DIE("error: unknown flag %s", arg.c_str());
+  }
+  Master m(config);
   m.run();
 }
@@ -11,29 +11,65 @@
 #include <unistd.h>
 #include <vector>
 #include "epollmasterworker.h"
+#include "uringmasterworker.h"
+#include "replication.h"
+#include "sharding.h"
+#include "threadpool.h"
+#include "latency.h"
 #define USE_EPOLL 1
+#define GC_INTERVAL_SEC 10
+#define SNAPSHOT_INTERVAL_SEC 300
 
 class MasterWorker;
 
+struct MasterConfig {
+    std::uint16_t port;
+    std::string data_dir;   // snapshot and journal directory, "" keeps state in memory only
+    bool wal_sync;          // fsync journal records before acknowledging them
+    int snapshot_interval;  // seconds between snapshots
+    std::string follow;     // leader "host:port" to replicate from, "" to lead
+    int max_staleness_ms;   // how far behind the leader a follower still serves reads
+    std::string shards;     // "host:port,..." of every shard, "" when not sharded
+    std::string shard_addr; // this master's entry in shards
+    bool join;              // take over this shard's keys from the others
+    std::string io;         // event loops, "epoll" or "uring" (falls back to epoll)
+    bool per_core;          // an epoll loop pinned to each core, owning the keys hashed to it
+    int busy_poll_us;       // epoll loops on dedicated cores spin this long idle before blocking, 0 never
+};
+
 class Master
 {
 public:
 
-    Master(std::uint16_t port);
+    Master(const MasterConfig& config);
     ~Master(); // No virtual needed since no inheritance as of now.
 
     void run();
     MasterRegistry registry;
+    ReplicationFollower replica;
+    ShardMap shards;
+    ThreadPool batch_pool; // fans out large mlookup/mreg/mcache/munlock batches
+    CoreRouter router;     // forwards keyed requests between cores, with --per_core
+    LatencyRecorder latency; // from reading requests to sending their replies
+    // The event loop mode and request latencies, for the stats op.
+    std::string stats();
 
 protected:
     bool init();
     void cleanup();
-    int make_socket_non_blocking(int);
+    void maintenance();
+    static void *maintenance_helper(void *master);
+    void lease_timer();
+    static void *lease_timer_helper(void *master);
 
     vector<EpollMasterWorker*> epoll_master_workers;
+    vector<UringMasterWorker*> uring_master_workers; // instead, with --io=uring
+    std::string io;
+    MasterConfig config;
     std::uint16_t port;
     std::list<MasterWorker *> workers; // One worker per client
     int socket_fd;
+    vector<int> listen_fds; // one per event loop
     int num_core;
 };
 
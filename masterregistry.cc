@@ -1,54 +1,126 @@
 #include "masterregistry.h"
 #include "log.h"
-#include <queue>
-#include <set>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unordered_set>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// set while replaying or applying replicated records, which are journaled as is
+static thread_local bool applying = false;
+// set within a DeferDurable, whose owner waits for its last record instead of each
+static thread_local uint64_t* batch_lsn = NULL;
+
+// The log copies each record, so records are built in one buffer per thread.
+static string& record_buffer() {
+  static thread_local string rec;
+  rec.clear();
+  return rec;
+}
+
+DeferDurable::DeferDurable(uint64_t* lsn) : outer(batch_lsn) {
+  batch_lsn = lsn;
+}
+
+DeferDurable::~DeferDurable() {
+  batch_lsn = outer;
+}
 
 KeyEntry::KeyEntry(string key, bool consistency):
   key(key),
-  consistency(consistency)
+  consistency(consistency),
+  erased(false),
+  snapshot(new LocationSnapshot())
 {
 }
 
-bool KeyEntry::cache_key(string location) {
-  lock.lock();
-  LOG_DEBUG << "Key " << key << " cached at " << location;
-  locations.insert(location);
-  lock.unlock();
+KeyEntry::~KeyEntry() {
+  delete snapshot.load();
+}
+
+void KeyEntry::publish(LocationSnapshot* next) {
+  Epoch::retire(snapshot.exchange(next, memory_order_acq_rel));
+}
+
+bool KeyEntry::cache_key(NodeId location) {
+  write([this, location]() {cache_locked(location);});
   return true;
 }
 
-bool KeyEntry::uncache_key(string location) {
-  lock.lock();
-  LOG_DEBUG << "Key " << key << " removed from " << location;
-  locations.erase(location);
-  lock.unlock();
+bool KeyEntry::uncache_key(NodeId location) {
+  write([this, location]() {uncache_locked(location);});
   return true;
 }
 
 void KeyEntry::clear() {
-  lock.lock();
+  write([this]() {clear_locked();});
+}
+
+void KeyEntry::cache_locked(NodeId location) {
+  LOG_DEBUG << "Key " << key << " cached at " << location;
+  LocationSnapshot* curr = snapshot.load(memory_order_relaxed);
+  if (!curr->contains(location)) {
+    LocationSnapshot* next = new LocationSnapshot(*curr);
+    next->nodes.push_back(location);
+    publish(next);
+  }
+}
+
+void KeyEntry::uncache_locked(NodeId location) {
+  LOG_DEBUG << "Key " << key << " removed from " << location;
+  LocationSnapshot* curr = snapshot.load(memory_order_relaxed);
+  if (curr->contains(location)) {
+    LocationSnapshot* next = new LocationSnapshot();
+    for (NodeId n : curr->nodes)
+      if (n != location)
+        next->nodes.push_back(n);
+    publish(next);
+  }
+}
+
+void KeyEntry::clear_locked() {
   LOG_DEBUG << "Key " << key << " cleared";
-  locations.clear();
-  lock.unlock();
+  if (!snapshot.load(memory_order_relaxed)->nodes.empty())
+    publish(new LocationSnapshot());
 }
 
-string KeyEntry::get_location(string from) {
-  lock.lock_shared();
-  string ret("");
-  if(locations.find(from) != locations.end()) {
-    ret = "use_local";
-  } else {
-    int x = 0;
-    for (auto& i : locations) {
-      ret += i + ";";
-      x++;
-      if (x >=3)
-        break;
-    }
+void KeyEntry::get_location(NodeId from, NodeTopology& topology, const InternTable& nodes, string& out) {
+  const LocationSnapshot* curr = snapshot.load(memory_order_acquire);
+  if (curr->contains(from))
+    out.assign("use_local");
+  else
+    topology.rank(curr->nodes, from, nodes, out);
+  LOG_DEBUG << "Key " << key << " is cached at " << out;
+}
+
+void KeyEntry::save(BinaryWriter& out) {
+  const LocationSnapshot* curr = snapshot.load(memory_order_acquire);
+  out.put_u32(curr->nodes.size());
+  for (NodeId n : curr->nodes)
+    out.put_u32(n);
+  if (consistency)
+    consistent_lock.save(out);
+}
+
+bool KeyEntry::load(BinaryReader& in, const vector<NodeId>& node_map) {
+  //not published yet, so the snapshot is filled in place
+  LocationSnapshot* curr = snapshot.load(memory_order_relaxed);
+  uint n = in.get_u32();
+  for (uint i = 0; i < n && in.good(); i++) {
+    NodeId node = in.get_u32();
+    if (node < node_map.size())
+      curr->nodes.push_back(node_map[node]);
   }
-  lock.unlock_shared();
-  LOG_DEBUG << "Key " << key << " is cached at " << ret;
-  return ret;
+  if (consistency)
+    consistent_lock.load(in, node_map);
+  return in.good();
 }
 
 /*
@@ -61,245 +133,394 @@ bool KeyEntry::is_cached(string location) {
 }
 */
 
-LambdaEntry::LambdaEntry(uint lambda_id) : lambda_id(lambda_id) {
+LambdaEntry::LambdaEntry(uint lambda_id) :
+  lambda_id(lambda_id),
+  min_dependency(UINT_MAX),
+  connections(0),
+  finished(false),
+  idle_since(now())
+{
+}
+
+int64_t LambdaEntry::now() {
+  return chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void LambdaEntry::use_lock(string key, bool write) {
+  LockState ls = {key, write};
+  tbb::spin_mutex::scoped_lock guard(lock);
+  locks.push_back(ls);
+}
+
+void LambdaEntry::release_lock(const string& key) {
+  tbb::spin_mutex::scoped_lock guard(lock);
+  for (size_t i = 0; i < locks.size(); i++) {
+    if (locks[i].key == key) {
+      locks[i] = locks.back();
+      locks.pop_back();
+      return;
+    }
+  }
+}
+
+vector<LockState> LambdaEntry::held_locks() {
+  tbb::spin_mutex::scoped_lock guard(lock);
+  return locks;
 }
 
-void LambdaEntry::depends_on(string key, uint version) {
-  KeyVersion kv = {key, version};
-  dependency.push_back(kv);
+void LambdaEntry::connected() {
+  connections++;
 }
 
+void LambdaEntry::disconnected() {
+  if (--connections == 0)
+    idle_since = now();
+}
+
+void LambdaEntry::done() {
+  finished = true;
+  idle_since = now();
+}
+
+bool LambdaEntry::live(int64_t now) {
+  return !finished && (connections > 0 || now - idle_since < LAMBDA_RETAIN_SEC);
+}
 
-MasterRegistry::MasterRegistry() : lambda_seq(0) {
+bool LambdaEntry::reclaimable(int64_t now) {
+  if (connections > 0 || now - idle_since < LAMBDA_RETAIN_SEC)
+    return false;
+  tbb::spin_mutex::scoped_lock guard(lock);
+  return locks.empty();
+}
+
+void LambdaEntry::depends_on(uint version) {
+  uint curr = min_dependency.load();
+  while (version < curr && !min_dependency.compare_exchange_weak(curr, version));
+}
+
+
+MasterRegistry::MasterRegistry() : lambda_seq(0), hot_fetches(0), nodes_lost(0), leases(LEASE_TICK_MS), leases_expired(0), lambdas_reclaimed(0), wal(new WriteAheadLog("", false)) {
   LOG_INFO << "Init MasterRegistry";
+  wal->open(0);
 }
 
 MasterRegistry::~MasterRegistry() {
   LOG_INFO << "Deleting MasterRegistry";
-  for (auto it = keys.begin(); it != keys.end(); it++)
-    delete it->second;
+  keys.for_each([](KeyEntry* entry) { delete entry; });
+  //wal is left alone, its flusher thread runs until the process exits
 }
 
 uint MasterRegistry::get_lambda_seq() {
   uint seq = lambda_seq.fetch_add(1);
-  auto entry = new LambdaEntry(seq);
-#if USE_TBB
-  LambdaHashMap::accessor acc;
-  lineage.insert(acc, seq);
-  acc->second = entry;
-#else
-  lineage_lock.lock();
-  lineage[seq] = entry;
-  lineage_lock.unlock();
-#endif
+  lambdas.create(seq, seq);
+  journal_lambda(WAL_LAMBDA, seq);
   return seq;
 }
 
-uint MasterRegistry::get_key_version(string input_key, bool prev) {
-  auto key_entry = get_key_entry(input_key);
-  if (key_entry != NULL) {
-    if(prev)
-      return key_entry->consistent_lock.get_prev_seq_num();
-    else
-      return key_entry->consistent_lock.get_seq_num();
-  } else {
-    assert(false);
-  }
-}
-
-void MasterRegistry::register_lineage(uint lambda, string key, uint version) {
-  auto entry = get_lambda_entry(lambda);
-  if (entry == NULL) {
-    LOG_ERROR << "lambda" << lambda << " not exist in lineage";
-    assert(false);
-  } else {
-    entry->depends_on(key, version);
-    LOG_DEBUG << "Sucessfully registered lineage for " << lambda << ", key " << key << ", version " << version;
-  }
-}
-
-bool MasterRegistry::reg_key(string key, string location) {
+bool MasterRegistry::reg_key(const string& key, NodeId location) {
   assert(key.at(0) != '~');
-  bool ret = false;
   LOG_DEBUG << "reg_key " << key << " at location " << location;
-  auto key_entry = get_key_entry(key);
-  if (key_entry != NULL) {
-    if(key_entry->consistency) {
+  uint64_t lsn = 0;
+  bool erased = true;
+  //an entry deleted under us is out of the map, so the next try creates one
+  while (erased) {
+    auto key_entry = get_or_create_key_entry(key, false);
+    if (key_entry->consistency) {
       LOG_DEBUG << key << " is a consistent key";
-      ret = false;
-    } else {
-      LOG_DEBUG << key << " exist, clear key location cache";
-      key_entry->clear();
-      ret = true;
+      return false;
     }
-  } else {
-    LOG_DEBUG << key << " does not exist, creating new entry";
-#if USE_TBB == 1
-    KeyHashMap::accessor acc;
-    keys.insert(acc, key);
-    key_entry = new KeyEntry(key);
-    acc->second = key_entry;
-#else
-    lock.lock();
-    key_entry = new KeyEntry(key);
-    keys[key] = key_entry;
-    lock.unlock();
-#endif
-    LOG_DEBUG << key << " entry created";
-    ret = true;
-  }
-
-  if (ret) {
-    LOG_DEBUG << key << " location " << location << " to be cached";
-    key_entry->cache_key(location);
+    key_entry->write([&]() {
+      erased = key_entry->erased;
+      if (erased)
+        return;
+      LOG_DEBUG << key << " location " << location << " replaces the cached ones";
+      key_entry->clear_locked();
+      key_entry->cache_locked(location);
+      lsn = append_key(WAL_REG, key, location);
+    });
   }
-  return ret;
+  node_keys.add(location, key);
+  wait_journal(lsn);
+  return true;
 }
 
-bool MasterRegistry::cache_key(string key, string location) {
+bool MasterRegistry::cache_key(const string& key, NodeId location) {
   auto key_entry = get_key_entry(key);
+  if (key_entry == NULL)
+    return false;
   LOG_DEBUG << key << " location to be cached";
-  return key_entry->cache_key(location);
+  uint64_t lsn = 0;
+  key_entry->write([&]() {
+    key_entry->cache_locked(location);
+    if (!key_entry->erased)
+      lsn = append_key(WAL_CACHE, key_entry->key, location);
+  });
+  node_keys.add(location, key_entry->key);
+  wait_journal(lsn);
+  return true;
 }
 
-bool MasterRegistry::uncache_key(string key, string location) {
+bool MasterRegistry::uncache_key(const string& key, NodeId location) {
   auto key_entry = get_key_entry(key);
+  if (key_entry == NULL)
+    return false;
   LOG_DEBUG << key << " location to be uncached";
-  return key_entry->uncache_key(location);
+  uint64_t lsn = 0;
+  key_entry->write([&]() {
+    key_entry->uncache_locked(location);
+    if (!key_entry->erased)
+      lsn = append_key(WAL_UNCACHE, key_entry->key, location);
+  });
+  wait_journal(lsn);
+  return true;
 }
 
-void MasterRegistry::clear_key(string key) {
-#if USE_TBB == 1
-  keys.erase(key);
-#else
-  lock.lock();
+void MasterRegistry::clear_key(const string& key) {
   LOG_DEBUG << key << " entry to be erased";
-  keys.erase(key);
-  lock.unlock();
-#endif
+  KeyEntry* entry = keys.erase(key);
+  index_key(key);
+  if (entry != NULL)
+    journal_erase(entry);
+  Epoch::retire(entry);
+}
+
+string MasterRegistry::get_location(const string& input_key, NodeId from, bool spread) {
+  string ret;
+  get_location(input_key, from, spread, ret);
+  return ret;
 }
 
-string MasterRegistry::get_location(string input_key, string from) {
+void MasterRegistry::get_location(const string& input_key, NodeId from, bool spread, string& out) {
   auto key_entry = get_key_entry(input_key);
   if (key_entry == NULL) {
     LOG_DEBUG << "input_key " << input_key <<  ", key is not found";
-    return "";
+    out.clear();
   } else {
     //if (key_entry->second->is_cached(from)) {
     //  LOG_DEBUG << "input_key " << input_key << " key " << key << ", key exist on local machien, returning use_local";
     //  return "use_local";
     //} else {
       LOG_DEBUG << "input_key " << input_key << ", query key entry for location";
-      return key_entry->get_location(from);
+      key_entry->get_location(from, topology, nodes, out);
+      if (spread && out != "" && out != "use_local")
+        count_peer_read(key_entry, KeyHashMap::hash(key_entry->key));
     //}
   }
 }
 
-string MasterRegistry::get_location_version(string input_key, string from, uint version) {
+string MasterRegistry::get_location_version(const string& input_key, NodeId from, uint version) {
   auto key_entry = get_key_entry(input_key);
   if (key_entry == NULL) {
     LOG_DEBUG << "input_key " << input_key <<  ", key is not found";
     return "";
   } else {
       LOG_DEBUG << "input_key " << input_key << ", version " << version << ", query key entry for location, from " << from;
-      return key_entry->consistent_lock.get_locations_with_from(version, from);
+      return key_entry->consistent_lock.get_locations_with_from(version, from, topology, nodes);
   }
 }
 
 
-string MasterRegistry::consistent_read_lock(string input_key, string location, string lambda_id, int max_duration, bool snap_iso) {
+string MasterRegistry::consistent_lock(const string& input_key, LockRequest& req, string& loc, const LockWait* wait) {
   assert(input_key.at(0) == '~');
-  string uri = location + "@" + lambda_id;
-  uint lambda_seq = atoi(lambda_id.substr(6).c_str());
   string ret;
   auto key_entry = get_key_entry(input_key);
-  if (key_entry != NULL) {
-    if(key_entry->consistency) {
-      ret = key_entry->consistent_lock.reader_lock(uri, max_duration, lambda_seq, snap_iso);
-    } else {
-      ret = "exception: not_consistent_key";
+  loc.clear();
+  if (req.s3 && !req.write) {
+    if (key_entry != NULL)
+      key_entry->get_location(req.location, topology, nodes, loc);
+    if (loc == "") {
+      //nobody has it, the lambda fetches it from s3 and writes it back
+      req.write = true;
+      req.lineage = false;
     }
-  } else {
+  }
+  if (!req.write && !req.recent) {
+    //with s3 the newest version is as good, loc already has it
+    if (key_entry != NULL && !req.s3)
+      loc = key_entry->consistent_lock.get_locations_with_from(req.version, req.location, topology, nodes);
+    LOG_DEBUG << "Return version " << req.version << ": " << loc;
+    return "success";
+  }
+  if (key_entry == NULL && req.write)
+    key_entry = get_or_create_key_entry(input_key.substr(1), true);
+  if (key_entry == NULL) {
     ret = "exception: key_not_found";
+    loc.clear();
+  } else if (!key_entry->consistency) {
+    ret = "exception: not_consistent_key";
+    key_entry->get_location(req.location, topology, nodes, loc);
+  } else {
+    ret = lock_entry(key_entry, input_key, req, loc, wait);
+  }
+  if (req.write && ret != "success" && ret != "wait" && !req.recent && key_entry != NULL) {
+    //the writer settles for reading the version it asked for
+    ret = "success";
+    loc = key_entry->consistent_lock.get_locations_with_from(req.version, req.location, topology, nodes);
   }
   LOG_DEBUG << "Return: " << ret;
   return ret;
 }
 
-string MasterRegistry::consistent_read_unlock(string input_key, string location, string lambda_id, bool modified){
+string MasterRegistry::lock_entry(KeyEntry* entry, const string& key, const LockRequest& req, string& loc, const LockWait* wait) {
+  Holder holder = {req.location, req.lambda};
+  ReaderWriterLock& rw = entry->consistent_lock;
+  string ret;
+  uint64_t lease = 0;
+  uint version = 0;
+  if (wait == NULL) {
+    if (req.write)
+      ret = rw.writer_lock(holder, req.max_duration, req.lambda, req.snap_iso, &lease, &version);
+    else
+      ret = rw.reader_lock(holder, req.max_duration, req.lambda, req.snap_iso, &lease, &version);
+  } else {
+    //a waiter is answered from an unlock, expiry or delete of this entry,
+    //so the entry is still there when it is granted
+    function<void(string, bool, const string&)> on_grant = wait->on_grant;
+    Waiter w = {holder, req.write, req.max_duration, req.lambda, req.snap_iso, wait->alive,
+      [this, entry, key, req, on_grant](string ret, uint64_t lease, uint version) {
+        EpochGuard epoch;
+        string loc;
+        lock_granted(entry, key, req, ret, lease, version, loc);
+        on_grant(ret, req.write, loc);
+      }};
+    ret = rw.lock_or_wait(w, &lease, &version);
+  }
+  if (ret != "wait")
+    lock_granted(entry, key, req, ret, lease, version, loc);
+  return ret;
+}
+
+void MasterRegistry::lock_granted(KeyEntry* entry, const string& key, const LockRequest& req, const string& ret, uint64_t lease, uint version, string& loc) {
+  if (ret == "success") {
+    //registered before the lease starts, so an expiry finds it to forget
+    auto lambda = get_lambda_entry(req.lambda);
+    if (lambda == NULL) {
+      LOG_ERROR << "lambda" << req.lambda << " not exist in lineage";
+      assert(false);
+    } else {
+      if (req.lineage) {
+        lambda->depends_on(version);
+        if (graph.add(req.lambda, key, version) && !applying) {
+          string& rec = record_buffer();
+          BinaryWriter w(rec);
+          w.put_u32(req.lambda);
+          w.put_str(key);
+          w.put_u32(version);
+          journal(WAL_LINEAGE, rec);
+        }
+      }
+      lambda->use_lock(key, req.write);
+      LOG_DEBUG << "Sucessfully registered lock for " << req.lambda << ", key " << key << ", write " << req.write << ", version " << version;
+    }
+    schedule_lease(entry->key, {req.location, req.lambda}, lease, req.max_duration);
+  }
+  entry->get_location(req.location, topology, nodes, loc);
+}
+
+string MasterRegistry::consistent_read_unlock(const string& input_key, NodeId location, uint lambda_id, bool modified){
   assert(input_key.at(0) == '~');
-  string uri = location + "@" + lambda_id;
+  Holder uri = {location, lambda_id};
   string ret;
   auto key_entry = get_key_entry(input_key);
   if (key_entry == NULL) {
     LOG_ERROR << input_key << " does not exsit when unlock";
     ret ="exception: key_not_exist";
   } else {
-    if (modified){
-      LOG_DEBUG << "key modified, after lock, caching key location";
-      key_entry->cache_key(location);
-    }
-    ret = key_entry->consistent_lock.reader_unlock(uri);
+    Commit commit{};
+    uint64_t lsn = 0;
+    key_entry->write([&]() {
+      if (modified) {
+        LOG_DEBUG << "key modified, after lock, caching key location";
+        key_entry->cache_locked(location);
+      }
+      ret = key_entry->consistent_lock.reader_unlock(uri, &commit);
+      if (ret == "success")
+        lsn = append_commit(WAL_READ, key_entry->key, commit, modified);
+    });
+    if (modified || commit.recorded)
+      node_keys.add(location, key_entry->key);
+    if (ret == "success")
+      forget_lock(lambda_id, input_key);
+    wait_journal(lsn);
   }
   LOG_DEBUG << "Return: " << ret;
   return ret;
 } 
 
 
-string MasterRegistry::consistent_write_lock(string input_key, string location, string lambda_id, int max_duration, bool snap_iso) {
-  assert(input_key.at(0) == '~');
-  string key = input_key.substr(1);
-  string uri = location + "@" + lambda_id;
-  uint lambda_seq = atoi(lambda_id.substr(6).c_str());
-  string ret;
-  auto key_entry = get_key_entry(input_key);
-  if (key_entry != NULL) {
-    if(key_entry->consistency) {
-      ret = key_entry->consistent_lock.writer_lock(uri, max_duration, lambda_seq, snap_iso);
-    } else {
-      ret = "exception: not_consistent_key";
+template <typename F>
+void MasterRegistry::for_batch(const vector<string>& names, size_t begin, size_t end, F f) {
+  //hash order walks each map shard's table front to back
+  vector<pair<uint64_t, size_t>> order;
+  order.reserve(end - begin);
+  for (size_t i = begin; i < end; i++)
+    order.push_back(make_pair(KeyHashMap::hash(names[i]), i));
+  sort(order.begin(), order.end());
+  uint64_t last = 0;
+  {
+    DeferDurable scope(&last);
+    for (size_t j = 0; j < order.size(); j++) {
+      if (j + BATCH_PREFETCH < order.size())
+        keys.prefetch(order[j + BATCH_PREFETCH].first);
+      f(order[j].second, order[j].first);
     }
-  } else {
-    //TODO: possible that keys[key] is not empty now....
-    //solution, must hold lock when delete
-#if USE_TBB == 1
-    KeyHashMap::accessor acc;
-    keys.insert(acc, key);
-    auto value = new KeyEntry(key, true);
-    acc->second = value;
-#else
-    lock.lock();
-    auto value = new KeyEntry(key, true);
-    keys[key] = value;
-    lock.unlock();
-#endif
-    ret = value->consistent_lock.writer_lock(uri, max_duration, lambda_seq, snap_iso);
   }
-  LOG_DEBUG << "Return: " << ret;
-  return ret;
+  if (last != 0)
+    wait_journal(last);
+}
+
+void MasterRegistry::get_locations(const vector<string>& names, size_t begin, size_t end, NodeId from, vector<string>& out, bool spread) {
+  for_batch(names, begin, end, [this, &names, from, &out, spread](size_t i, uint64_t hash) {
+    KeyEntry* entry = keys.find(names[i].data(), names[i].size(), hash);
+    if (entry == NULL)
+      out[i].clear();
+    else
+      entry->get_location(from, topology, nodes, out[i]);
+    if (spread && out[i] != "" && out[i] != "use_local")
+      count_peer_read(entry, hash);
+  });
 }
 
-string MasterRegistry::consistent_delete(string input_key, string lambda_id) {
+void MasterRegistry::reg_keys(const vector<string>& names, size_t begin, size_t end, NodeId location, vector<char>& out) {
+  for_batch(names, begin, end, [this, &names, location, &out](size_t i, uint64_t) {
+    out[i] = !names[i].empty() && names[i][0] != '~' && reg_key(names[i], location) ? '1' : '0';
+  });
+}
+
+void MasterRegistry::cache_keys(const vector<string>& names, size_t begin, size_t end, NodeId location, vector<char>& out) {
+  for_batch(names, begin, end, [this, &names, location, &out](size_t i, uint64_t hash) {
+    KeyEntry* entry = keys.find(names[i].data(), names[i].size(), hash);
+    out[i] = entry != NULL && cache_key(names[i], location) ? '1' : '0';
+  });
+}
+
+void MasterRegistry::consistent_unlock_keys(const vector<string>& names, size_t begin, size_t end, NodeId location, uint lambda_id, bool write, const string& modified, vector<string>& out) {
+  for_batch(names, begin, end, [this, &names, location, lambda_id, write, &modified, &out](size_t i, uint64_t) {
+    if (names[i].empty() || names[i][0] != '~') {
+      out[i] = "exception: key_not_consistent";
+      return;
+    }
+    bool m = i < modified.size() && modified[i] == '1';
+    out[i] = write ? consistent_write_unlock(names[i], location, lambda_id, m) : consistent_read_unlock(names[i], location, lambda_id, m);
+  });
+}
+
+string MasterRegistry::consistent_delete(const string& input_key, uint lambda_seq) {
   assert(input_key.at(0) == '~');
   string key = input_key.substr(1);
-  uint lambda_seq = atoi(lambda_id.substr(6).c_str());
+  Holder deleter = {NO_NODE, lambda_seq};
   string ret;
   auto key_entry = get_key_entry(input_key);
   if (key_entry != NULL) {
     if(key_entry->consistency) {
-      ret = key_entry->consistent_lock.writer_lock("null", 65536, lambda_seq, false);
+      ret = key_entry->consistent_lock.writer_lock(deleter, 65536, lambda_seq, false);
       if (ret == "success") {
-#if USE_TBB == 1
-        KeyHashMap::accessor acc;
-        keys.find(acc, key);
-        delete acc->second;
-        keys.erase(key);
-#else
-        lock.lock();
-        delete keys[key];
-        keys.erase(key);
-        lock.unlock();
-#endif
+        keys.erase(key.data(), key.size(), KeyHashMap::hash(key), key_entry);
+        index_key(key);
+        journal_erase(key_entry);
+        //parked lockers retry against the key's next incarnation
+        key_entry->consistent_lock.close_waiters();
+        Epoch::retire(key_entry);
       }
     } else {
       ret = "exception: not_consistent_key";
@@ -311,7 +532,7 @@ string MasterRegistry::consistent_delete(string input_key, string lambda_id) {
   return ret;
 }
 
-string MasterRegistry::delete_key(string key) {
+string MasterRegistry::delete_key(const string& key) {
   assert(key.at(0) != '~');
   string ret;
   auto key_entry = get_key_entry(key);
@@ -319,17 +540,11 @@ string MasterRegistry::delete_key(string key) {
     if(key_entry->consistency) {
       ret = "exception: key_is_consistent";
     } else {
-#if USE_TBB == 1
-      KeyHashMap::accessor acc;
-      keys.find(acc, key);
-      delete acc->second;
-      keys.erase(key);
-#else
-      lock.lock();
-      delete keys[key];
-      keys.erase(key);
-      lock.unlock();
-#endif
+      KeyEntry* erased = keys.erase(key.data(), key.size(), KeyHashMap::hash(key), key_entry);
+      index_key(key);
+      if (erased != NULL)
+        journal_erase(erased);
+      Epoch::retire(erased);
       ret = "success";
     }
   } else {
@@ -341,123 +556,1045 @@ string MasterRegistry::delete_key(string key) {
 
 
 
-string MasterRegistry::consistent_write_unlock(string input_key, string location, string lambda_id, bool modified){
+string MasterRegistry::list_prefix(const string& prefix, string& cursor, size_t max_bytes, function<bool(const string&)> owned) {
+  EpochGuard epoch;
+  string ret, last;
+  bool more = false;
+  boost::shared_lock<boost::shared_mutex> guard(index_lock);
+  index.scan(prefix, cursor, [this, &owned, &ret, &last, &more, max_bytes](const string& key) {
+    if (!owned(key))
+      return true;
+    //the index can trail the map by one change
+    KeyEntry* entry = keys.find(key);
+    if (entry == NULL)
+      return true;
+    string name = entry->consistency ? "~" + key : key;
+    if (!ret.empty() && ret.size() + name.size() + 1 > max_bytes) {
+      more = true;
+      return false;
+    }
+    ret += name + ";";
+    last = key;
+    return true;
+  });
+  cursor = more ? last : "";
+  return ret;
+}
+
+size_t MasterRegistry::delete_prefix(const string& prefix, uint lambda, function<bool(const string&)> owned, size_t& skipped) {
+  EpochGuard epoch;
+  vector<string> names;
+  {
+    boost::shared_lock<boost::shared_mutex> guard(index_lock);
+    index.scan(prefix, "", [&names, &owned](const string& key) {
+      if (owned(key))
+        names.push_back(key);
+      return true;
+    });
+  }
+  Holder deleter = {NO_NODE, lambda};
+  map<NodeId, vector<string>> purges;
+  vector<uint> versions;
+  size_t deleted = 0;
+  skipped = 0;
+  for_batch(names, 0, names.size(), [&](size_t i, uint64_t hash) {
+    const string& key = names[i];
+    KeyEntry* entry = keys.find(key.data(), key.size(), hash);
+    if (entry == NULL)
+      return;
+    if (entry->consistency && entry->consistent_lock.writer_lock(deleter, 65536, lambda, false) != "success") {
+      skipped++;
+      return;
+    }
+    if (keys.erase(key.data(), key.size(), hash, entry) != entry)
+      return;
+    index_key(key);
+    journal_erase(entry);
+    //plain keys are cached under their name, consistent ones per version
+    versions.clear();
+    if (entry->consistency) {
+      entry->consistent_lock.close_waiters();
+      entry->consistent_lock.live_versions(versions);
+    }
+    for (NodeId n : entry->locations()->nodes) {
+      if (!entry->consistency)
+        purges[n].push_back("purge:" + key);
+      for (uint v : versions)
+        purges[n].push_back("purge:~~tmp~~" + key + "~" + to_string(v));
+    }
+    Epoch::retire(entry);
+    deleted++;
+  });
+  for (auto& p : purges)
+    post(p.first, p.second);
+  LOG_DEBUG << "delete_prefix " << prefix << " deleted " << deleted << " skipped " << skipped << " purges for " << purges.size() << " nodes";
+  return deleted;
+}
+
+string MasterRegistry::consistent_write_unlock(const string& input_key, NodeId location, uint lambda_id, bool modified){
   assert(input_key.at(0) == '~');
-  string uri = location + "@" + lambda_id;
+  Holder uri = {location, lambda_id};
   string ret;
   auto key_entry = get_key_entry(input_key);
   if (key_entry == NULL) {
     LOG_ERROR << input_key << " does not exsit when unlock";
     ret = "exception: key_not_exist";
   } else {
-    if(modified) {
-      LOG_DEBUG << "key modified, after lock, caching key location";
-      key_entry->clear();
-      key_entry->cache_key(location);
-    }
-    ret = key_entry->consistent_lock.writer_unlock(uri);
+    Commit commit{};
+    uint64_t lsn = 0;
+    key_entry->write([&]() {
+      if (modified) {
+        LOG_DEBUG << "key modified, after lock, caching key location";
+        key_entry->clear_locked();
+        key_entry->cache_locked(location);
+      }
+      ret = key_entry->consistent_lock.writer_unlock(uri, &commit);
+      if (ret == "success")
+        lsn = append_commit(WAL_WRITE, key_entry->key, commit, modified);
+    });
+    if (modified || commit.recorded)
+      node_keys.add(location, key_entry->key);
+    if (ret == "success")
+      forget_lock(lambda_id, input_key);
+    wait_journal(lsn);
   }
   LOG_DEBUG << "return: " << ret;
   return ret;
 } 
 
-KeyEntry* MasterRegistry::get_key_entry(string input_key) {
-  bool consistency = input_key[0] == '~';
-  string key = consistency?input_key.substr(1):input_key;
-#if USE_TBB == 1
-  KeyHashMap::accessor key_acc;
-  if (keys.find(key_acc, key)) {
-    return key_acc->second;
+KeyEntry* MasterRegistry::get_key_entry(const string& input_key) {
+  //consistent keys are stored without their leading '~'
+  size_t skip = input_key[0] == '~' ? 1 : 0;
+  const char* key = input_key.data() + skip;
+  size_t len = input_key.size() - skip;
+  return keys.find(key, len, KeyHashMap::hash(key, len));
+}
+
+KeyEntry* MasterRegistry::get_or_create_key_entry(const string& key, bool consistency) {
+  auto key_entry = keys.find(key);
+  if (key_entry != NULL)
+    return key_entry;
+  auto created = new KeyEntry(key, consistency);
+  key_entry = keys.insert(created);
+  if (key_entry != created) {
+    LOG_DEBUG << key << " created concurrently, using existing entry";
+    delete created; // never published
   } else {
-    return NULL;
+    index_key(key);
   }
-#else
-  lock.lock_shared();
-  auto key_entry = keys.find(key);
-  lock.unlock_shared();
-  return key_entry == keys.end()?NULL:key_entry->second;
-#endif
+  return key_entry;
 }
 
-LambdaEntry* MasterRegistry::get_lambda_entry(uint lambda_id) {
-#if USE_TBB == 1
-  LambdaHashMap::accessor acc;
-  if (lineage.find(acc, lambda_id)) {
-    return acc->second;
-  } else {
-    return NULL;
+void MasterRegistry::note_holders(KeyEntry* entry) {
+  for (NodeId n : entry->locations()->nodes)
+    node_keys.add(n, entry->key);
+  if (entry->consistency) {
+    vector<NodeId> holders;
+    entry->consistent_lock.holder_nodes(holders);
+    for (NodeId n : holders)
+      node_keys.add(n, entry->key);
   }
-#else
-  lineage_lock.lock_shared();
-  auto lambda_entry = lineage.find(lambda_id);
-  lineage_lock.unlock_shared();
-  return lambda_entry == lineage.end()?NULL:lambda_entry->second;
-#endif
+}
+
+void MasterRegistry::index_key(const string& key) {
+  EpochGuard epoch;
+  boost::unique_lock<boost::shared_mutex> guard(index_lock);
+  if (keys.find(key) != NULL)
+    index.insert(key);
+  else
+    index.erase(key);
+}
+
+LambdaEntry* MasterRegistry::get_lambda_entry(uint lambda_id) {
+  return lambdas.get(lambda_id);
 }
 
 string MasterRegistry::get_lineage(uint lambda_id) {
+  vector<uint> lambdas(1, lambda_id);
+  string cursor = "";
+  return get_lineage(lambdas, cursor, SIZE_MAX);
+}
+
+string MasterRegistry::get_lineage(const vector<uint>& lambdas, string& cursor, size_t max_bytes) {
+  //newest first: a lambda already in the union brings nothing new, its
+  //closure is part of the closure that reached it
+  vector<uint> roots(lambdas);
+  sort(roots.begin(), roots.end(), greater<uint>());
+  vector<bool> in_union;
+  vector<uint> all;
+  for (uint lambda_id : roots) {
+    if (lambda_id < in_union.size() && in_union[lambda_id])
+      continue;
+    auto closure = graph.closure(lambda_id);
+    if (!closure->empty() && closure->back() >= in_union.size())
+      in_union.resize(closure->back() + 1, false);
+    for (uint l : *closure) {
+      if (!in_union[l]) {
+        in_union[l] = true;
+        all.push_back(l);
+      }
+    }
+  }
+  sort(all.begin(), all.end());
+
+  //cursor is "lambda:edge", lambda ids only grow so it stays valid across calls
+  uint start_lambda = 0, start_edge = 0;
+  if (cursor != "")
+    sscanf(cursor.c_str(), "%u:%u", &start_lambda, &start_edge);
+  cursor = "";
   string res = "";
-  set<uint> visited;
-  queue<uint> pending;
-  pending.push(lambda_id);
-  visited.insert(lambda_id);
-  while(!pending.empty()) {
-    uint curr = pending.front();
-    pending.pop();
-    auto entry = get_lambda_entry(curr);
-    for (auto kv : entry->dependency) {
-      if (visited.find(kv.version) == visited.end()) {
-        visited.insert(kv.version);
-        pending.push(kv.version);
+  vector<LineageEdge> edges;
+  for (auto it = lower_bound(all.begin(), all.end(), start_lambda); it != all.end(); it++) {
+    uint curr = *it;
+    edges.clear();
+    graph.edges(curr, edges);
+    for (uint i = curr == start_lambda ? start_edge : 0; i < edges.size(); i++) {
+      const string& key = graph.key_name(edges[i].key);
+      auto key_entry = get_key_entry(key);
+      string locations = key_entry == NULL ? "" : key_entry->consistent_lock.get_locations(edges[i].version, nodes);
+      string item = to_string(curr) + "," + key + "," + to_string(edges[i].version) + "," + locations + "$";
+      if (res != "" && res.size() + item.size() > max_bytes) {
+        cursor = to_string(curr) + ":" + to_string(i);
+        return res;
       }
-      
-      auto key_entry = get_key_entry(kv.key);
-      LOG_DEBUG << "get_lineage from lambda " << lambda_id << " for key " << kv.key << " version " << kv.version;
-      string locations = key_entry->consistent_lock.get_locations(kv.version);
-      res += to_string(curr) + "," + kv.key + "," + to_string(kv.version) + "," + locations + "$";
+      res += item;
     }
   }
   return res;
 }
 
 
-string MasterRegistry::failover_write_update(string key, uint version, string addr, string lambda_id) {
+string MasterRegistry::failover_write_update(const string& key, uint version, NodeId addr, uint lambda_id) {
   auto key_entry = get_key_entry(key);
   if(key_entry == NULL)
     return "key_not_found";
   else {
-    key_entry->clear();
-    key_entry->cache_key(addr);
-    return key_entry->consistent_lock.update_version_location(version, addr + "@" + lambda_id);
+    Holder location = {addr, lambda_id};
+    uint64_t lease = 0;
+    Commit commit = {false, 0, location};
+    string ret;
+    uint64_t lsn = 0;
+    key_entry->write([&]() {
+      key_entry->clear_locked();
+      key_entry->cache_locked(addr);
+      ret = key_entry->consistent_lock.update_version_location(version, location, &lease, &commit);
+      lsn = append_commit(WAL_FAILOVER, key_entry->key, commit, true);
+    });
+    node_keys.add(addr, key_entry->key);
+    if (lease != 0)
+      schedule_lease(key_entry->key, location, lease, 1000);
+    wait_journal(lsn);
+    return ret;
   }
 }
 
-string MasterRegistry::force_release_lock(vector<uint> lambdas) {
+string MasterRegistry::force_release_lock(vector<uint> lambda_ids) {
   LOG_DEBUG << "force release lock";
-  for (uint lambda_id : lambdas) {
+  for (uint lambda_id : lambda_ids) {
     LOG_DEBUG << "force release lock for lambda " << lambda_id;
     auto entry = get_lambda_entry(lambda_id);
-    for (LockState ls : entry->locks ) {
+    if (entry == NULL)
+      continue;
+    for (LockState ls : entry->held_locks()) {
       LOG_DEBUG << "releaseing " << ls.key;
-      get_key_entry(ls.key)->consistent_lock.force_release_lock();
+      auto key_entry = get_key_entry(ls.key);
+      if (key_entry != NULL) {
+        Commit commit{};
+        uint64_t lsn = 0;
+        key_entry->write([&]() {
+          key_entry->consistent_lock.force_release_lock(&commit);
+          if (commit.recorded)
+            lsn = append_commit(WAL_WRITE, key_entry->key, commit, false);
+        });
+        if (commit.recorded)
+          node_keys.add(commit.holder.node, key_entry->key);
+        wait_journal(lsn);
+      }
+      entry->release_lock(ls.key);
     }    
   }
   return "success";
 }
 
 
-void MasterRegistry::register_lock(uint lambda, string key, bool write) {
+void MasterRegistry::forget_lock(uint lambda, const string& key) {
   auto entry = get_lambda_entry(lambda);
-  if (entry == NULL) {
-    LOG_ERROR << "can't file lambda in lineage";
-    assert(false);
+  if (entry != NULL)
+    entry->release_lock(key);
+}
+
+void MasterRegistry::lambda_connected(uint lambda, bool adopt) {
+  if (adopt)
+    adopt_lambda(lambda);
+  //ids come from get_lambda_seq, a replay may bring back a reclaimed one
+  if (lambda < lambda_seq)
+    lambdas.create(lambda, lambda)->connected();
+  else
+    LOG_ERROR << "lambda" << lambda << " was never assigned";
+}
+
+void MasterRegistry::adopt_lambda(uint lambda) {
+  if (get_lambda_entry(lambda) != NULL)
+    return;
+  uint seq = lambda_seq;
+  while (seq <= lambda && !lambda_seq.compare_exchange_weak(seq, lambda + 1));
+  lambdas.create(lambda, lambda);
+  journal_lambda(WAL_LAMBDA, lambda);
+}
+
+void MasterRegistry::lambda_disconnected(uint lambda) {
+  auto entry = get_lambda_entry(lambda);
+  if (entry != NULL)
+    entry->disconnected();
+}
+
+string MasterRegistry::lambda_done(uint lambda) {
+  auto entry = get_lambda_entry(lambda);
+  if (entry == NULL)
+    return "exception: lambda_not_found";
+  entry->done();
+  journal_lambda(WAL_LAMBDA_DONE, lambda);
+  return "success";
+}
+
+uint MasterRegistry::low_watermark() {
+  uint watermark = UINT_MAX;
+  int64_t now = LambdaEntry::now();
+  lambdas.for_each([&watermark, now](uint, LambdaEntry* entry) {
+    if (entry->live(now) && entry->min_dependency < watermark)
+      watermark = entry->min_dependency;
+  });
+  return watermark;
+}
+
+int MasterRegistry::reclaim_lambdas(const vector<uint>& live_versions) {
+  //a version is the id of the lambda that wrote it
+  unordered_set<uint> has_output(live_versions.begin(), live_versions.end());
+  int64_t now = LambdaEntry::now();
+  vector<uint> reclaim;
+  lambdas.for_each([&](uint id, LambdaEntry* entry) {
+    if (entry->reclaimable(now) && has_output.find(id) == has_output.end())
+      reclaim.push_back(id);
+  });
+  //with no connection left no request holds these, a replay connecting an
+  //id again may recreate it before the epoch ends
+  for (uint id : reclaim) {
+    graph.remove(id);
+    lambdas.retire(id);
+  }
+  lambdas_reclaimed += reclaim.size();
+  LOG_DEBUG << "reclaimed " << reclaim.size() << " lambdas, " << lambdas.size() << " left";
+  return reclaim.size();
+}
+
+int MasterRegistry::collect_garbage() {
+  EpochGuard epoch;
+  uint watermark = low_watermark();
+  vector<KeyEntry*> entries;
+  keys.for_each([&entries](KeyEntry* entry) {
+    if (entry->consistency)
+      entries.push_back(entry);
+  });
+  int count = 0;
+  vector<ReclaimedVersion> reclaimed;
+  for (auto entry : entries) {
+    reclaimed.clear();
+    count += entry->consistent_lock.collect(watermark, reclaimed);
+    for (auto& rv : reclaimed) {
+      //the writer's file is ~~tmp~<shm name>~<version>, readers fetch the same name
+      string file = "~~tmp~~" + entry->key + "~" + to_string(rv.version);
+      for (auto& h : rv.holders)
+        if (h.node != NO_NODE)
+          post(h.node, "purge:" + file);
+    }
+  }
+  LOG_DEBUG << "gc watermark " << watermark << " collected " << count << " versions from " << entries.size() << " keys";
+  vector<uint> live_versions;
+  for (auto entry : entries)
+    entry->consistent_lock.live_versions(live_versions);
+  reclaim_lambdas(live_versions);
+  return count;
+}
+
+void MasterRegistry::count_peer_read(KeyEntry* entry, uint64_t hash) {
+  //consistent keys are read per version, only plain ones are spread
+  if (!entry->consistency && hot_keys.hit(hash))
+    add_replica(entry);
+}
+
+void MasterRegistry::add_replica(KeyEntry* entry) {
+  //the idlest cache server without a copy pulls one from a holder and
+  //registers it with cache, so the key's replicas follow its readers
+  const LocationSnapshot* locs = entry->locations();
+  if (locs->nodes.empty() || locs->nodes.size() >= HOT_KEY_MAX_REPLICAS)
+    return;
+  lock_guard<mutex> guard(fetch_lock);
+  InlineVector<NodeId, 4>& pending = fetching[entry->key];
+  if (locs->nodes.size() + pending.size() >= HOT_KEY_MAX_REPLICAS)
+    return;
+  NodeId target = topology.idlest([locs, &pending](NodeId n) {
+    return locs->contains(n) || pending.find_if([n](NodeId x) { return x == n; }) != NULL;
+  }, nodes);
+  if (target == NO_NODE)
+    return;
+  pending.push_back(target);
+  string source;
+  topology.rank(locs->nodes, target, nodes, source);
+  source = source.substr(0, source.find(';'));
+  post(target, "fetch:" + source + "," + entry->key);
+  hot_fetches++;
+  LOG_DEBUG << "hot key " << entry->key << ": " << nodes.name(target) << " fetches it from " << source;
+}
+
+size_t MasterRegistry::purge_node(NodeId node) {
+  EpochGuard epoch;
+  vector<uint64_t> hashes;
+  node_keys.take(node, hashes);
+  size_t purged = 0;
+  //hash order walks each map shard's table front to back
+  sort(hashes.begin(), hashes.end());
+  for (size_t j = 0; j < hashes.size(); j++) {
+    if (j + BATCH_PREFETCH < hashes.size())
+      keys.prefetch(hashes[j + BATCH_PREFETCH]);
+    keys.for_hash(hashes[j], [node, &purged](KeyEntry* entry) {
+      bool held = entry->locations()->contains(node);
+      if (held)
+        entry->uncache_key(node);
+      if (entry->consistency && entry->consistent_lock.forget_node(node) > 0)
+        held = true;
+      if (held)
+        purged++;
+    });
+  }
+  //one record stands for the whole pass, replay repeats it from its own index
+  string& rec = record_buffer();
+  BinaryWriter w(rec);
+  w.put_str(journal_node(node));
+  journal(WAL_NODE_LOST, rec);
+  LOG_DEBUG << "purged " << nodes.name(node) << " from " << purged << " of " << hashes.size() << " keys";
+  return purged;
+}
+
+size_t MasterRegistry::decommission(NodeId node) {
+  topology.forget(node);
+  {
+    lock_guard<mutex> guard(inbox_lock);
+    inbox.erase(node);
+  }
+  size_t purged = purge_node(node);
+  LOG_INFO << "cache server " << nodes.name(node) << " decommissioned, purged from " << purged << " keys";
+  return purged;
+}
+
+int MasterRegistry::detect_failures() {
+  vector<NodeId> lost;
+  topology.expire(time(NULL), nodes, lost);
+  for (NodeId n : lost) {
+    //commands queued for it stay, in case it was only cut off
+    size_t purged = purge_node(n);
+    LOG_INFO << "cache server " << nodes.name(n) << " stopped polling, purged from " << purged << " keys";
+  }
+  nodes_lost += lost.size();
+  return lost.size();
+}
+
+size_t MasterRegistry::sweep_node_keys() {
+  EpochGuard epoch;
+  return node_keys.sweep([this](NodeId node, uint64_t hash) {
+    bool held = false;
+    keys.for_hash(hash, [node, &held](KeyEntry* entry) {
+      if (entry->locations()->contains(node) || (entry->consistency && entry->consistent_lock.held_by(node)))
+        held = true;
+    });
+    return held;
+  });
+}
+
+void MasterRegistry::rotate_hot_keys() {
+  hot_keys.rotate();
+  lock_guard<mutex> guard(fetch_lock);
+  fetching.clear();
+}
+
+void MasterRegistry::post(NodeId node, string cmd) {
+  lock_guard<mutex> guard(inbox_lock);
+  inbox[node].push_back(cmd);
+}
+
+void MasterRegistry::post(NodeId node, const vector<string>& cmds) {
+  lock_guard<mutex> guard(inbox_lock);
+  vector<string>& box = inbox[node];
+  box.insert(box.end(), cmds.begin(), cmds.end());
+}
+
+string MasterRegistry::poll(NodeId node, size_t max_bytes) {
+  string ret = "";
+  lock_guard<mutex> guard(inbox_lock);
+  auto it = inbox.find(node);
+  if (it == inbox.end())
+    return ret;
+  vector<string>& cmds = it->second;
+  size_t taken = 0;
+  while (taken < cmds.size() && (ret.empty() || ret.size() + cmds[taken].size() + 1 <= max_bytes)) {
+    ret += cmds[taken] + ";";
+    taken++;
+  }
+  cmds.erase(cmds.begin(), cmds.begin() + taken);
+  if (cmds.empty())
+    inbox.erase(it);
+  return ret;
+}
+
+void MasterRegistry::schedule_lease(const string& key, Holder holder, uint64_t lease, int max_duration) {
+  leases.schedule((uint64_t)max_duration * 1000, [this, key, holder, lease]() {
+    expire_lease(key, holder, lease);
+  });
+}
+
+void MasterRegistry::expire_lease(const string& key, Holder holder, uint64_t lease) {
+  EpochGuard epoch;
+  //the key may have been deleted or re-created since, the lease id tells
+  auto key_entry = get_key_entry(key);
+  if (key_entry == NULL)
+    return;
+  Commit commit{};
+  bool expired = false;
+  uint64_t lsn = 0;
+  key_entry->write([&]() {
+    expired = key_entry->consistent_lock.expire(holder, lease, &commit);
+    if (expired && commit.recorded)
+      lsn = append_commit(WAL_WRITE, key, commit, false);
+  });
+  if (expired) {
+    forget_lock(holder.lambda, "~" + key);
+    if (commit.recorded)
+      node_keys.add(commit.holder.node, key);
+    wait_journal(lsn);
+    leases_expired++;
+    LOG_INFO << "lease on " << key << " held by lambda" << holder.lambda << " expired";
+  }
+}
+
+string MasterRegistry::stats() {
+  return "keys=" + to_string(keys.size()) +
+    "|leases=" + to_string(leases.size()) +
+    "|lease_expired=" + to_string(leases_expired.load()) +
+    "|lambdas=" + to_string(lambdas.size()) +
+    "|lambdas_reclaimed=" + to_string(lambdas_reclaimed.load()) +
+    "|hot_fetches=" + to_string(hot_fetches.load()) +
+    "|node_keys=" + to_string(node_keys.size()) +
+    "|nodes_lost=" + to_string(nodes_lost.load());
+}
+
+const string& MasterRegistry::journal_node(NodeId node) {
+  static const string none;
+  return node == NO_NODE ? none : nodes.name(node);
+}
+
+NodeId MasterRegistry::replay_node(const string& name) {
+  return name == "" ? NO_NODE : nodes.intern(name);
+}
+
+uint64_t MasterRegistry::append(uint8_t type, const string& payload) {
+  return applying ? 0 : wal->append(type, payload);
+}
+
+void MasterRegistry::journal(uint8_t type, const string& payload) {
+  wait_journal(append(type, payload));
+}
+
+void MasterRegistry::wait_journal(uint64_t lsn) {
+  if (lsn == 0)
+    return;
+  if (batch_lsn != NULL)
+    *batch_lsn = max(*batch_lsn, lsn);
+  else
+    wal->wait_durable(lsn);
+}
+
+bool MasterRegistry::when_durable(uint64_t lsn, function<void()> f) {
+  return wal->when_durable(lsn, std::move(f));
+}
+
+void MasterRegistry::journal_lambda(uint8_t type, uint lambda) {
+  if (applying)
+    return;
+  string& rec = record_buffer();
+  BinaryWriter w(rec);
+  w.put_u32(lambda);
+  journal(type, rec);
+}
+
+uint64_t MasterRegistry::append_key(uint8_t type, const string& key, NodeId node) {
+  if (applying)
+    return 0;
+  string& rec = record_buffer();
+  BinaryWriter w(rec);
+  w.put_str(key);
+  w.put_str(journal_node(node));
+  return append(type, rec);
+}
+
+void MasterRegistry::journal_erase(KeyEntry* entry) {
+  uint64_t lsn = 0;
+  entry->write([this, entry, &lsn]() {
+    entry->erased = true;
+    lsn = append_key(WAL_DELETE, entry->key, NO_NODE);
+  });
+  wait_journal(lsn);
+}
+
+uint64_t MasterRegistry::append_commit(uint8_t type, const string& key, const Commit& c, bool modified) {
+  if (applying)
+    return 0;
+  string& rec = record_buffer();
+  BinaryWriter w(rec);
+  w.put_str(key);
+  w.put_str(journal_node(c.holder.node));
+  w.put_u32(c.holder.lambda);
+  w.put_u8(c.recorded);
+  w.put_u32(c.version);
+  w.put_u8(modified);
+  return append(type, rec);
+}
+
+void MasterRegistry::apply(uint8_t type, BinaryReader& in) {
+  if (type == WAL_LAMBDA || type == WAL_LAMBDA_DONE) {
+    uint lambda = in.get_u32();
+    if (!in.good())
+      return;
+    if (type == WAL_LAMBDA) {
+      if (lambda >= lambda_seq)
+        lambda_seq = lambda + 1;
+      lambdas.create(lambda, lambda);
+    } else {
+      auto entry = get_lambda_entry(lambda);
+      if (entry != NULL)
+        entry->done();
+    }
+  } else if (type == WAL_LINEAGE) {
+    uint lambda = in.get_u32();
+    string key = in.get_str();
+    uint version = in.get_u32();
+    if (!in.good())
+      return;
+    lambdas.create(lambda, lambda)->depends_on(version);
+    graph.add(lambda, key, version);
+  } else if (type == WAL_REG || type == WAL_CACHE || type == WAL_UNCACHE || type == WAL_DELETE) {
+    string key = in.get_str();
+    NodeId node = replay_node(in.get_str());
+    if (!in.good())
+      return;
+    if (type == WAL_REG) {
+      reg_key(key, node);
+      return;
+    }
+    auto key_entry = keys.find(key);
+    if (key_entry == NULL)
+      return;
+    if (type == WAL_CACHE) {
+      key_entry->cache_key(node);
+      node_keys.add(node, key);
+    } else if (type == WAL_UNCACHE)
+      key_entry->uncache_key(node);
+    else {
+      Epoch::retire(keys.erase(key.data(), key.size(), KeyHashMap::hash(key), key_entry));
+      index_key(key);
+    }
+  } else if (type == WAL_WRITE || type == WAL_READ || type == WAL_FAILOVER) {
+    string key = in.get_str();
+    Holder holder;
+    holder.node = replay_node(in.get_str());
+    holder.lambda = in.get_u32();
+    bool recorded = in.get_u8();
+    uint version = in.get_u32();
+    bool modified = in.get_u8();
+    if (!in.good())
+      return;
+    auto key_entry = type == WAL_WRITE ? get_or_create_key_entry(key, true) : keys.find(key);
+    if (key_entry == NULL)
+      return;
+    if (modified && type != WAL_READ)
+      key_entry->clear();
+    if (modified && holder.node != NO_NODE)
+      key_entry->cache_key(holder.node);
+    if (modified || recorded)
+      node_keys.add(holder.node, key);
+    if (!recorded)
+      return;
+    if (type == WAL_WRITE)
+      key_entry->consistent_lock.restore_write(version, holder);
+    else if (type == WAL_READ)
+      key_entry->consistent_lock.restore_read(version, holder);
+    else
+      key_entry->consistent_lock.restore_location(version, holder);
+  } else if (type == WAL_IMPORT) {
+    import_chunk(in);
+  } else if (type == WAL_NODE_LOST) {
+    NodeId node = replay_node(in.get_str());
+    if (in.good() && node != NO_NODE)
+      purge_node(node);
   } else {
-    entry->use_lock(key,write);
-    LOG_DEBUG << "Sucessfully registered lock for " << lambda << ", key " << key << ", write " << write;
+    LOG_ERROR << "unknown journal record type " << (int)type;
+  }
+}
+
+static bool write_all(int fd, const string& buf) {
+  size_t sent = 0;
+  while (sent < buf.size()) {
+    ssize_t n = write(fd, buf.data() + sent, buf.size() - sent);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    sent += n;
+  }
+  return true;
+}
+
+void MasterRegistry::save_nodes(BinaryWriter& out) {
+  uint num_nodes = nodes.size();
+  out.put_u32(num_nodes);
+  for (uint n = 0; n < num_nodes; n++)
+    out.put_str(nodes.name(n));
+}
+
+vector<NodeId> MasterRegistry::load_nodes(BinaryReader& in) {
+  //node ids in a dump are positions in its own name table
+  uint num_nodes = in.get_u32();
+  vector<NodeId> node_map;
+  for (uint n = 0; n < num_nodes && in.good(); n++)
+    node_map.push_back(nodes.intern(in.get_str()));
+  return node_map;
+}
+
+void MasterRegistry::save_key(BinaryWriter& out, KeyEntry* entry) {
+  out.put_str(entry->key);
+  out.put_u8(entry->consistency);
+  entry->save(out);
+}
+
+KeyEntry* MasterRegistry::load_key(BinaryReader& in, const vector<NodeId>& node_map) {
+  string key = in.get_str();
+  bool consistency = in.get_u8();
+  KeyEntry* entry = new KeyEntry(key, consistency);
+  entry->load(in, node_map);
+  return entry;
+}
+
+bool MasterRegistry::save_snapshot(function<bool(const string&)> sink, uint64_t& lsn) {
+  EpochGuard epoch;
+  //records are journaled after their change is made, so everything up to
+  //lsn is in the registry already
+  lsn = wal->last_lsn();
+  vector<KeyEntry*> entries;
+  keys.for_each([&entries](KeyEntry* entry) { entries.push_back(entry); });
+  vector<uint> ids;
+  lambdas.for_each([&ids](uint id, LambdaEntry*) { ids.push_back(id); });
+
+  //handed out in SNAPSHOT_FLUSH_BYTES blocks, the checksum chains the hashes
+  //of the blocks so load_snapshot can verify it the same way
+  bool ok = true;
+  uint64_t checksum = 0;
+  string buf;
+  BinaryWriter w(buf);
+  auto flush = [&](bool last) {
+    size_t n = last ? buf.size() : buf.size() / SNAPSHOT_FLUSH_BYTES * SNAPSHOT_FLUSH_BYTES;
+    for (size_t off = 0; off < n; off += SNAPSHOT_FLUSH_BYTES)
+      checksum = wyhash(buf.data() + off, min((size_t)SNAPSHOT_FLUSH_BYTES, n - off), checksum);
+    ok = ok && sink(buf.substr(0, n));
+    buf.erase(0, n);
+  };
+  buf.append(SNAPSHOT_MAGIC);
+  w.put_u64(lsn);
+  w.put_u32(lambda_seq);
+  save_nodes(w);
+
+  w.put_u64(entries.size());
+  for (auto entry : entries) {
+    save_key(w, entry);
+    if (buf.size() >= SNAPSHOT_FLUSH_BYTES)
+      flush(false);
+    if (!ok)
+      return false;
+  }
+
+  w.put_u32(ids.size());
+  for (uint id : ids) {
+    auto entry = get_lambda_entry(id);
+    w.put_u32(id);
+    w.put_u32(entry == NULL ? UINT_MAX : entry->min_dependency.load());
+    w.put_u8(entry == NULL || entry->is_done());
+  }
+  graph.save(w);
+  flush(true);
+  w.put_u64(checksum);
+  return ok && sink(buf);
+}
+
+bool MasterRegistry::load_snapshot(const char* base, size_t size, uint64_t& lsn) {
+  if (size < strlen(SNAPSHOT_MAGIC) + sizeof(uint64_t) || memcmp(base, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) != 0)
+    return false;
+  size_t body = size - sizeof(uint64_t);
+  uint64_t checksum = 0;
+  for (size_t off = 0; off < body; off += SNAPSHOT_FLUSH_BYTES)
+    checksum = wyhash(base + off, min((size_t)SNAPSHOT_FLUSH_BYTES, body - off), checksum);
+  BinaryReader trailer(base + body, sizeof(uint64_t));
+  if (trailer.get_u64() != checksum)
+    return false;
+
+  EpochGuard epoch;
+  BinaryReader in(base + strlen(SNAPSHOT_MAGIC), body - strlen(SNAPSHOT_MAGIC));
+  lsn = in.get_u64();
+  lambda_seq = in.get_u32();
+  vector<NodeId> node_map = load_nodes(in);
+
+  uint64_t num_keys = in.get_u64();
+  keys.reserve(num_keys);
+  {
+    boost::unique_lock<boost::shared_mutex> guard(index_lock);
+    for (uint64_t k = 0; k < num_keys && in.good(); k++) {
+      KeyEntry* entry = keys.insert(load_key(in, node_map));
+      index.insert(entry->key);
+      note_holders(entry);
+    }
+  }
+
+  uint num_lambdas = in.get_u32();
+  for (uint i = 0; i < num_lambdas && in.good(); i++) {
+    uint id = in.get_u32();
+    uint min_dependency = in.get_u32();
+    bool finished = in.get_u8();
+    LambdaEntry* entry = lambdas.create(id, id);
+    entry->depends_on(min_dependency);
+    if (finished)
+      entry->done();
+  }
+  graph.load(in);
+  LOG_INFO << "loaded snapshot at lsn " << lsn << ": " << num_keys << " keys, " << num_lambdas << " lambdas";
+  return in.good();
+}
+
+bool MasterRegistry::load_snapshot_file(const string& path, uint64_t& lsn) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  fstat(fd, &st);
+  size_t size = st.st_size;
+  const char* base = size == 0 ? (const char*)MAP_FAILED : (const char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    LOG_ERROR << "snapshot " << path << " is unreadable";
+    return false;
+  }
+  madvise((void*)base, size, MADV_SEQUENTIAL);
+  bool ok = load_snapshot(base, size, lsn);
+  if (!ok)
+    LOG_ERROR << "snapshot " << path << " is corrupt";
+  munmap((void*)base, size);
+  return ok;
+}
+
+bool MasterRegistry::open_store(const string& dir, bool sync) {
+  mkdir(dir.c_str(), 0755);
+  data_dir = dir;
+  auto start = chrono::steady_clock::now();
+  uint64_t lsn = 0;
+  string path = dir + "/" + SNAPSHOT_FILE;
+  if (access(path.c_str(), F_OK) == 0 && !load_snapshot_file(path, lsn))
+    return false;
+  uint64_t replayed = 0;
+  applying = true;
+  uint64_t last = WriteAheadLog::replay(dir, lsn, [this, &replayed](uint64_t, uint8_t type, const char* payload, size_t len) {
+    EpochGuard epoch;
+    BinaryReader in(payload, len);
+    apply(type, in);
+    replayed++;
+  });
+  applying = false;
+  if (last == WAL_GAP)
+    return false;
+  auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+  LOG_INFO << "recovered " << keys.size() << " keys, replayed " << replayed << " journal records up to lsn " << last << " in " << elapsed.count() << "ms";
+  //nobody has used the in-memory log yet
+  delete wal;
+  wal = new WriteAheadLog(dir, sync);
+  return wal->open(last);
+}
+
+bool MasterRegistry::checkpoint() {
+  if (data_dir == "")
+    return false;
+  auto start = chrono::steady_clock::now();
+  //move on to a new segment first: the snapshot then has at least what the
+  //older segments have, later records may or may not make it in and
+  //replaying them again is harmless
+  wal->rotate();
+  string path = data_dir + "/" + SNAPSHOT_FILE;
+  string tmp = path + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  uint64_t lsn = 0;
+  bool ok = fd >= 0 && save_snapshot([fd](const string& data) { return write_all(fd, data); }, lsn);
+  ok = ok && fsync(fd) == 0;
+  if (fd >= 0)
+    close(fd);
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    LOG_ERROR << "snapshot at lsn " << lsn << " failed, keeping the journal";
+    unlink(tmp.c_str());
+    return false;
+  }
+  int dfd = open(data_dir.c_str(), O_RDONLY);
+  if (dfd >= 0) {
+    fsync(dfd);
+    close(dfd);
+  }
+  wal->truncate(lsn);
+  auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+  LOG_INFO << "snapshot at lsn " << lsn << " written in " << elapsed.count() << "ms";
+  return true;
+}
+
+uint64_t MasterRegistry::journal_lsn() {
+  return wal->last_lsn();
+}
+
+uint64_t MasterRegistry::read_journal(uint64_t lsn, string& out, size_t max_bytes, int wait_ms, bool* complete) {
+  return wal->read(lsn, out, max_bytes, wait_ms, complete);
+}
+
+bool MasterRegistry::apply_journal(const char* frames, size_t len) {
+  size_t off = 0;
+  while (off < len) {
+    uint64_t lsn;
+    uint8_t type;
+    const char* payload;
+    uint32_t payload_len;
+    size_t n = WriteAheadLog::decode(frames + off, len - off, lsn, type, payload, payload_len);
+    if (n == 0)
+      return false;
+    uint64_t last = wal->last_lsn();
+    if (lsn > last + 1)
+      return false;
+    if (lsn == last + 1) {
+      EpochGuard epoch;
+      BinaryReader in(payload, payload_len);
+      applying = true;
+      apply(type, in);
+      applying = false;
+      wal->append_frame(frames + off, n);
+    }
+    off += n;
   }
-};
+  return true;
+}
 
+void MasterRegistry::reset() {
+  EpochGuard epoch;
+  vector<KeyEntry*> entries;
+  keys.for_each([&entries](KeyEntry* entry) { entries.push_back(entry); });
+  for (auto entry : entries) {
+    Epoch::retire(keys.erase(entry->key.data(), entry->key.size(), KeyHashMap::hash(entry->key), entry));
+    entry->consistent_lock.close_waiters();
+  }
+  vector<uint> ids;
+  lambdas.for_each([&ids](uint id, LambdaEntry*) { ids.push_back(id); });
+  for (uint id : ids)
+    lambdas.retire(id);
+  graph.clear();
+  {
+    boost::unique_lock<boost::shared_mutex> guard(index_lock);
+    index.clear();
+  }
+  node_keys.clear();
+  lock_guard<mutex> guard(inbox_lock);
+  inbox.clear();
+}
 
+bool MasterRegistry::install_snapshot(const string& data) {
+  reset();
+  uint64_t lsn = 0;
+  if (!load_snapshot(data.data(), data.size(), lsn))
+    return false;
+  wal->reset(lsn);
+  //the local journal restarts at lsn, so the local snapshot must too
+  if (data_dir != "")
+    checkpoint();
+  return true;
+}
 
+bool MasterRegistry::export_keys(function<bool(const string&)> pred, function<bool(const string&)> sink, size_t& count) {
+  EpochGuard epoch;
+  vector<KeyEntry*> entries;
+  keys.for_each([&entries, &pred](KeyEntry* entry) {
+    if (pred(entry->key))
+      entries.push_back(entry);
+  });
+  count = entries.size();
+  //chunk: node names, u32 number of keys, keys as in a snapshot
+  string body;
+  size_t i = 0;
+  while (i < entries.size()) {
+    body.clear();
+    BinaryWriter b(body);
+    uint n = 0;
+    for (; i < entries.size() && body.size() < SNAPSHOT_FLUSH_BYTES; i++, n++)
+      save_key(b, entries[i]);
+    string chunk;
+    BinaryWriter w(chunk);
+    save_nodes(w);
+    w.put_u32(n);
+    chunk.append(body);
+    if (!sink(chunk))
+      return false;
+  }
+  return true;
+}
 
+bool MasterRegistry::import_chunk(BinaryReader& in) {
+  vector<NodeId> node_map = load_nodes(in);
+  uint n = in.get_u32();
+  for (uint k = 0; k < n && in.good(); k++) {
+    KeyEntry* entry = load_key(in, node_map);
+    //a retried migration sends keys again, the latest copy wins
+    KeyEntry* old = keys.find(entry->key);
+    if (old != NULL && keys.erase(old->key.data(), old->key.size(), KeyHashMap::hash(old->key), old) == old) {
+      old->consistent_lock.close_waiters();
+      Epoch::retire(old);
+    }
+    string key = entry->key;
+    if (keys.insert(entry) != entry)
+      delete entry;
+    else
+      note_holders(entry);
+    index_key(key);
+  }
+  return in.good();
+}
 
+bool MasterRegistry::import_keys(const char* chunk, size_t len) {
+  EpochGuard epoch;
+  BinaryReader in(chunk, len);
+  if (!import_chunk(in))
+    return false;
+  journal(WAL_IMPORT, string(chunk, len));
+  return true;
+}
+
+size_t MasterRegistry::drop_keys(function<bool(const string&)> pred) {
+  EpochGuard epoch;
+  vector<KeyEntry*> entries;
+  keys.for_each([&entries, &pred](KeyEntry* entry) {
+    if (pred(entry->key))
+      entries.push_back(entry);
+  });
+  for (auto entry : entries) {
+    if (keys.erase(entry->key.data(), entry->key.size(), KeyHashMap::hash(entry->key), entry) != entry)
+      continue;
+    index_key(entry->key);
+    journal_erase(entry);
+    entry->consistent_lock.close_waiters();
+    Epoch::retire(entry);
+  }
+  return entries.size();
+}
@@ -1,40 +1,131 @@
 #ifndef MASTERREGISTRY_H
 #define MASTERREGISTRY_H
 
-#include "tbb/concurrent_hash_map.h"
 #include <mutex>
 #include <set>
 #include <map>
 #include <unordered_map>
 #include "readerwriterlock.h"
+#include "keyhashmap.h"
+#include "interntable.h"
+#include "inlinevector.h"
+#include "epoch.h"
+#include "timerwheel.h"
+#include "lineagegraph.h"
+#include "prefixindex.h"
+#include "hotkeys.h"
+#include "nodekeys.h"
+#include "slab.h"
+#include "wal.h"
+#include "binaryio.h"
+#include "tbb/spin_mutex.h"
 #include <boost/thread.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #include <atomic>
 
-#define USE_TBB 1
+#define LEASE_TICK_MS 100
+#define LAMBDA_SLAB_BITS 12
+// how long a lambda's record outlives its last connection or lambda_done;
+// a disconnected, unfinished lambda stays live this long so it can be replayed
+#define LAMBDA_RETAIN_SEC 600
+#define SNAPSHOT_MAGIC "UCSNAP01"
+#define SNAPSHOT_FILE "snapshot"
+#define SNAPSHOT_FLUSH_BYTES (1 << 20)
+#define BATCH_PREFETCH 8 // keys a batch looks ahead
+
+// Journal record types, see MasterRegistry::apply for their payloads.
+enum JournalRecord {
+  WAL_LAMBDA = 1,
+  WAL_LAMBDA_DONE,
+  WAL_REG,
+  WAL_CACHE,
+  WAL_UNCACHE,
+  WAL_DELETE,
+  WAL_WRITE,
+  WAL_READ,
+  WAL_FAILOVER,
+  WAL_LINEAGE,
+  WAL_IMPORT,
+  WAL_NODE_LOST
+};
 
 using namespace std;
 
+// Immutable view of where a key is cached. Replaced wholesale on every
+// change and retired through Epoch, so lookups read it without locking.
+struct LocationSnapshot {
+  InlineVector<NodeId, 4> nodes;
+  bool contains(NodeId n) const {
+    for (NodeId x : nodes)
+      if (x == n)
+        return true;
+    return false;
+  }
+};
+
+// How to park a contended consistent lock request instead of failing it.
+// on_grant gets what consistent_lock would have returned, the mode taken
+// and loc.
+struct LockWait {
+  function<bool()> alive;
+  function<void(string ret, bool write, const string& loc)> on_grant;
+};
+
+// A consistent lock request, see MasterRegistry::consistent_lock.
+struct LockRequest {
+  NodeId location;
+  uint lambda;
+  bool write;
+  int max_duration;
+  bool snap_iso;
+  bool lineage; // record the version the lock lets lambda read
+  bool s3;      // the lambda can read from s3 what no cache server holds
+  bool recent;  // else a read is for version, see consistent_lock
+  uint version;
+};
+
 class KeyEntry {
 public:
   KeyEntry(string key, bool consistency = false);
-  bool cache_key(string location);
-  bool uncache_key(string location);
+  ~KeyEntry();
+  bool cache_key(NodeId location);
+  bool uncache_key(NodeId location);
   void clear();
-  string get_location(string);
+  // Runs f under the writer lock. The changes f makes with the *_locked
+  // calls below, and the log records it appends for them, are then in the
+  // same order for every writer of the key, so replay and followers
+  // rebuild what this master had.
+  template <typename F>
+  void write(F f) {
+    lock_guard<mutex> guard(lock);
+    f();
+  }
+  // Caller is inside write().
+  void cache_locked(NodeId location);
+  void uncache_locked(NodeId location);
+  void clear_locked();
+  // Sets out to "use_local" when from has it, else the best replicas for
+  // from. Caller must hold an EpochGuard.
+  void get_location(NodeId from, NodeTopology& topology, const InternTable& nodes, string& out);
+  // Caller must hold an EpochGuard.
+  const LocationSnapshot* locations() {return snapshot.load(memory_order_acquire);}
+  // Locations by node id plus the versions of a consistent key. save()
+  // needs an EpochGuard; load() is only for an entry not yet in the map.
+  void save(BinaryWriter& out);
+  bool load(BinaryReader& in, const vector<NodeId>& node_map);
   //bool is_cached(string location);
   const bool consistency;
   const string key;
   ReaderWriterLock consistent_lock;
+  // Set inside write() once the entry is out of the map. Later changes to
+  // it are not logged, the key may be here again under a new entry.
+  bool erased;
  
 private:
-  boost::shared_mutex lock;
-  set<string> locations;
-};
+  void publish(LocationSnapshot* next);
 
-struct KeyVersion {
-  string key;
-  uint version;
+  mutex lock; // serializes writers, readers go through snapshot
+  atomic<LocationSnapshot*> snapshot;
 };
 
 struct LockState {
@@ -45,77 +136,240 @@ struct LockState {
 class LambdaEntry {
 public:
   LambdaEntry(uint);
-  void depends_on(string key, uint version);
-  void use_lock(string key, bool write) {LockState ls = {key,write}; locks.push_back(ls);};
+  void depends_on(uint version);
+  void use_lock(string key, bool write);
+  void release_lock(const string& key);
+  vector<LockState> held_locks();
+  void connected();
+  void disconnected();
+  void done();
+  bool is_done() {return finished;}
+  // Unfinished and connected, or disconnected for less than LAMBDA_RETAIN_SEC.
+  bool live(int64_t now);
+  bool reclaimable(int64_t now);
+  static int64_t now();
   uint lambda_id;
-  vector<KeyVersion> dependency;
-  vector<LockState> locks; 
-};
-
-struct KeyHashCompare {
-  static size_t hash( const string& x ) {
-    size_t h = 0;
-    for( const char* s = x.c_str(); *s; ++s )
-      h = (h*17)^*s;
-    return h;
-  }
-  static bool equal( const string& x, const string& y ) {
-    return x==y;
-  }
+  atomic<uint> min_dependency; // oldest version this lambda read
+private:
+  tbb::spin_mutex lock;
+  vector<LockState> locks; // locks currently held
+  atomic<int> connections;
+  atomic<bool> finished;
+  atomic<int64_t> idle_since; // when the last connection closed or it finished
 };
 
-typedef tbb::concurrent_hash_map<string, KeyEntry*, KeyHashCompare> KeyHashMap;
-
-struct LambdaHashCompare {
-  static size_t hash( const int& x ) {
-    return x;
-  }
-  static bool equal( const int& x, const int& y ) {
-    return x==y;
-  }
+// While one is in scope, the mutations its thread journals do not wait for
+// the disk: the last lsn they were given is kept in *lsn instead, and the
+// owner holds their replies until MasterRegistry::when_durable. Scopes nest,
+// an inner one's lsn is the outer one's to wait for.
+class DeferDurable {
+public:
+  DeferDurable(uint64_t* lsn);
+  ~DeferDurable();
+private:
+  uint64_t* outer;
 };
 
-typedef tbb::concurrent_hash_map<uint, LambdaEntry*, LambdaHashCompare> LambdaHashMap;
-
 class MasterRegistry {
 public: 
   MasterRegistry();
   ~MasterRegistry();
-  bool reg_key(string key, string location);
-  bool cache_key(string key, string location);
-  bool uncache_key(string key, string location);
-  void clear_key(string key);
-  uint get_key_version(string key, bool prev);
-  string get_location(string key, string from);
-  string get_location_version(string key, string from, uint version);
-
-  string consistent_write_lock(string key, string location, string lambda_id, int max_duration, bool snap_iso);
-  string consistent_write_unlock(string key, string location, string lambda_id, bool modified);
-
-  string consistent_read_lock(string key, string location, string lambda_id, int max_duration, bool snap_iso);
-  string consistent_read_unlock(string key, string location, string lambda_id, bool modified);
+  void reserve_keys(size_t n) {keys.reserve(n);}
+  NodeId intern_node(const string& addr) {return nodes.intern(addr);}
+  const string& node_name(NodeId node) {return nodes.name(node);}
+  // Labels and load a cache server reports, see NodeTopology.
+  void set_node_labels(NodeId node, const string& rack, const string& host) {topology.set_labels(node, rack, host);}
+  void report_node_load(NodeId node, uint32_t load) {topology.report_load(node, load);}
+  bool reg_key(const string& key, NodeId location);
+  bool cache_key(const string& key, NodeId location);
+  bool uncache_key(const string& key, NodeId location);
+  void clear_key(const string& key);
+  // With spread set, reads served by a peer count toward the key being hot,
+  // see add_replica.
+  string get_location(const string& key, NodeId from, bool spread = false);
+  // Into out, reusing its buffer.
+  void get_location(const string& key, NodeId from, bool spread, string& out);
+  string get_location_version(const string& key, NodeId from, uint version);
+
+  // A whole lock request on the key's entry, looked up once. With req.s3 a
+  // read of a key no cache server holds is taken as a write, req.write is
+  // left saying which. A read not of the recent version takes no lock and
+  // gets the holders of req.version (of the newest with req.s3), and so
+  // does a refused write of one. A write lock creates a missing key. On a
+  // grant, the version it covers, taken with the lock, goes into the
+  // lambda's lineage if req.lineage is set and the lock into the lambda's
+  // held locks, before its lease starts. loc is set to the key's locations
+  // for req.location whatever the result. With wait set, a contended
+  // request returns "wait" and the same is done once it is granted, the
+  // result going to wait->on_grant.
+  string consistent_lock(const string& key, LockRequest& req, string& loc, const LockWait* wait = NULL);
+  string consistent_write_unlock(const string& key, NodeId location, uint lambda_id, bool modified);
+  string consistent_read_unlock(const string& key, NodeId location, uint lambda_id, bool modified);
   
-  string consistent_delete(string key, string lambda);
-  string delete_key(string key);
+  // Batches over names[begin, end), the result for names[i] goes to out[i].
+  // Keys are visited in hash order with their slots prefetched ahead, and
+  // their journal records are waited for once at the end. Caller holds an
+  // EpochGuard.
+  void get_locations(const vector<string>& names, size_t begin, size_t end, NodeId from, vector<string>& out, bool spread = false);
+  void reg_keys(const vector<string>& names, size_t begin, size_t end, NodeId location, vector<char>& out);
+  void cache_keys(const vector<string>& names, size_t begin, size_t end, NodeId location, vector<char>& out);
+  // modified[i] is '1' if the holder changed names[i].
+  void consistent_unlock_keys(const vector<string>& names, size_t begin, size_t end, NodeId location, uint lambda_id, bool write, const string& modified, vector<string>& out);
+
+  string consistent_delete(const string& key, uint lambda);
+  string delete_key(const string& key);
+  // Prefix queries over the stored names (consistent keys without their
+  // '~'), skipping keys owned is false for. list_prefix returns "name;..."
+  // with consistent keys as "~name", stops before max_bytes (but always
+  // returns one name) and sets cursor to resume from, "" after the last page.
+  string list_prefix(const string& prefix, string& cursor, size_t max_bytes, function<bool(const string&)> owned);
+  // Deletes every key under prefix in one pass, consistent ones as lambda
+  // would, and queues purges of their cached files per node. Consistent keys
+  // someone else holds are left and counted in skipped.
+  size_t delete_prefix(const string& prefix, uint lambda, function<bool(const string&)> owned, size_t& skipped);
   string get_lineage(uint lambda_id);
+  // Lineage of the union of the closures of lambdas, in lambda id order, as
+  // "lambda,key,version,locations$" entries. Stops before max_bytes (but
+  // always returns one entry) and sets cursor to where to resume; cursor is
+  // "" on the first call and again once everything has been returned.
+  string get_lineage(const vector<uint>& lambdas, string& cursor, size_t max_bytes);
   uint get_lambda_seq();
-  void register_lineage(uint lambda, string key, uint version);
-  void register_lock(uint lambda, string key, bool write);
-  string failover_write_update(string key, uint version, string addr, string lambda);
+  string failover_write_update(const string& key, uint version, NodeId addr, uint lambda);
   string force_release_lock(vector<uint> lambdas);
+
+  // Live lambdas pin the versions they read. Connecting with the id of a
+  // reclaimed lambda, to replay it, brings its record back. With adopt set
+  // (sharded, ids come from another shard) unseen ids are taken as well.
+  void lambda_connected(uint lambda, bool adopt = false);
+  // Makes sure there is a record for a lambda whose id another shard gave
+  // out. Caller holds an EpochGuard.
+  void adopt_lambda(uint lambda);
+  void lambda_disconnected(uint lambda);
+  string lambda_done(uint lambda);
+  uint low_watermark();
+  // Compacts version history below the low watermark and queues purges of
+  // the matching ~~tmp~ files for the nodes that held them, then reclaims
+  // the records of lambdas that are done and whose outputs are all gone.
+  int collect_garbage();
+  void post(NodeId node, string cmd);
+  void post(NodeId node, const vector<string>& cmds);
+  string poll(NodeId node, size_t max_bytes);
+  // Drops node from the locations and version holders of every key it
+  // holds, in one pass over its keys in node_keys, journaled as one record.
+  // Returns how many keys still listed it.
+  size_t purge_node(NodeId node);
+  // A cache server leaving on purpose: purged as if lost, its queued
+  // commands dropped, and not chosen again until it polls.
+  size_t decommission(NodeId node);
+  // Purges the cache servers whose polls stopped, see NodeTopology::expire.
+  int detect_failures();
+  // Drops node_keys names whose key no longer lists the node.
+  size_t sweep_node_keys();
+  // Starts a new hot key window, every HOT_KEY_WINDOW_MS.
+  void rotate_hot_keys();
+  // Releases consistent locks whose holders outlived their duration.
+  int expire_leases() {return leases.advance();}
+  string stats();
+
+  // Loads the snapshot in dir, replays the journal after it, and from then
+  // on journals every mutation there before it is acknowledged. With sync
+  // off, records are written within one flush but not fsync'd.
+  bool open_store(const string& dir, bool sync);
+  // Writes a new snapshot while requests keep running and drops the journal
+  // segments it covers.
+  bool checkpoint();
+
+  // Replication. Every mutation is journaled, in memory when there is no
+  // data dir, and followers are fed the journal from their last lsn or, once
+  // that has left memory, a snapshot first.
+  uint64_t journal_lsn();
+  // Waits until lsn is durable, or leaves that to the DeferDurable in scope.
+  void wait_journal(uint64_t lsn);
+  // See WriteAheadLog::when_durable.
+  bool when_durable(uint64_t lsn, function<void()> f);
+  // See WriteAheadLog::read.
+  uint64_t read_journal(uint64_t lsn, string& out, size_t max_bytes, int wait_ms, bool* complete);
+  // Streams a snapshot to sink in pieces; lsn is the last record it covers.
+  bool save_snapshot(function<bool(const string&)> sink, uint64_t& lsn);
+  // Applies journal records from a leader, skipping ones already applied.
+  // Returns false on a gap or a corrupt record.
+  bool apply_journal(const char* frames, size_t len);
+  // Replaces the whole registry with a snapshot from a leader.
+  bool install_snapshot(const string& data);
+
+  // Sharding. Streams the keys pred selects to sink in chunks of about
+  // SNAPSHOT_FLUSH_BYTES, each with the node names it refers to.
+  bool export_keys(function<bool(const string&)> pred, function<bool(const string&)> sink, size_t& count);
+  // Adds an exported chunk, replacing keys already here.
+  bool import_keys(const char* chunk, size_t len);
+  // Forgets the keys pred selects without purging their cached copies,
+  // which stay valid for the shard the keys moved to.
+  size_t drop_keys(function<bool(const string&)> pred);
 private:
+  template <typename F>
+  void for_batch(const vector<string>& names, size_t begin, size_t end, F f);
+  // append_* log a record and return its lsn, 0 while applying one; the
+  // journal_* calls also wait for it, see wait_journal().
+  uint64_t append(uint8_t type, const string& payload);
+  void journal(uint8_t type, const string& payload);
+  void journal_lambda(uint8_t type, uint lambda);
+  uint64_t append_key(uint8_t type, const string& key, NodeId node);
+  uint64_t append_commit(uint8_t type, const string& key, const Commit& c, bool modified);
+  // Marks an entry just taken out of the map erased and logs its delete.
+  void journal_erase(KeyEntry* entry);
+  const string& journal_node(NodeId node);
+  NodeId replay_node(const string& name);
+  void apply(uint8_t type, BinaryReader& in);
+  void save_nodes(BinaryWriter& out);
+  vector<NodeId> load_nodes(BinaryReader& in);
+  void save_key(BinaryWriter& out, KeyEntry* entry);
+  KeyEntry* load_key(BinaryReader& in, const vector<NodeId>& node_map);
+  bool import_chunk(BinaryReader& in);
+  bool load_snapshot(const char* base, size_t size, uint64_t& lsn);
+  bool load_snapshot_file(const string& path, uint64_t& lsn);
+  void reset();
+  string lock_entry(KeyEntry* entry, const string& key, const LockRequest& req, string& loc, const LockWait* wait);
+  // The rest of consistent_lock once the lock has answered.
+  void lock_granted(KeyEntry* entry, const string& key, const LockRequest& req, const string& ret, uint64_t lease, uint version, string& loc);
+  void schedule_lease(const string& key, Holder holder, uint64_t lease, int max_duration);
+  void expire_lease(const string& key, Holder holder, uint64_t lease);
+  void forget_lock(uint lambda, const string& key);
+  int reclaim_lambdas(const vector<uint>& live_versions);
+  // Entries are reclaimed through Epoch, callers must hold an EpochGuard.
   LambdaEntry* get_lambda_entry(uint lambda_id);
-  KeyEntry* get_key_entry(string key);
+  // Entries are reclaimed through Epoch, callers must hold an EpochGuard.
+  KeyEntry* get_key_entry(const string& key);
+  KeyEntry* get_or_create_key_entry(const string& key, bool consistency);
+  // Brings key's place in the index in line with the map. Called after every
+  // insert or erase; whichever caller gets index_lock last sees the final
+  // state, so racing changes to one key cannot leave the index behind.
+  void index_key(const string& key);
+  // Records the nodes of an entry that did not go through cache_key, one
+  // loaded from a snapshot or an import.
+  void note_holders(KeyEntry* entry);
+  void count_peer_read(KeyEntry* entry, uint64_t hash);
+  void add_replica(KeyEntry* entry);
   atomic<uint> lambda_seq;
-#if USE_TBB == 1
+  InternTable nodes;
+  NodeTopology topology;
+  HotKeys hot_keys;
+  mutex fetch_lock;
+  map<string, InlineVector<NodeId, 4>> fetching; // fetches asked for this window
+  atomic<uint64_t> hot_fetches;
+  NodeKeys node_keys; // keys each cache server may hold
+  atomic<uint64_t> nodes_lost;
   KeyHashMap keys;
-  LambdaHashMap lineage;
-#else
-  map<string, KeyEntry*> keys;
-  boost::shared_mutex lock;
-  map<uint, LambdaEntry*> lineage;
-  boost::shared_mutex lineage_lock;
-#endif
+  PrefixIndex index; // names in keys, in order
+  boost::shared_mutex index_lock;
+  LineageGraph graph;
+  mutex inbox_lock;
+  map<NodeId, vector<string>> inbox;
+  TimerWheel leases;
+  atomic<uint64_t> leases_expired;
+  SlabArray<LambdaEntry, LAMBDA_SLAB_BITS> lambdas;
+  atomic<uint64_t> lambdas_reclaimed;
+  WriteAheadLog* wal; // in memory only without a data dir
+  string data_dir;
 };
 
 #endif
@@ -2,6 +2,7 @@
 #include "masterworker.h"
 #include "master.h"
 #include "log.h"
+#include "epoch.h"
 #include <ctime>
 #include <string>
 #include <iomanip>
@@ -13,16 +14,52 @@
 #include <boost/algorithm/string.hpp>
 #include <vector>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+#include <future>
+#include "replication.h"
+#include "frame.h"
 
 using namespace std;
 
-MasterWorker::MasterWorker(Master &master, int socket)
+MasterWorker::MasterWorker(Master &master, int socket, int core)
   : master(master)
   , socket(socket)
+  , lambda_registered(false)
+  , channel(new ReplyChannel(socket, master.registry))
+  , can_defer(false)
+  , in_begin(0)
+  , in_end(0)
+  , output_bytes(0)
+  , journaled(0)
+  , core(core)
+  , output_base(0)
+  , in_flight(0)
+  , request_begin(0)
+  , stalled(false)
+  , paused(false)
+  , fed(false)
+  , deferred(false)
+  , binary(false)
+  , upgrade(false)
 {
   init();
 }
 
+MasterWorker::~MasterWorker()
+{
+  channel->close();
+  if (lambda_registered) {
+    //nobody waits for a reply, nor has the loop to wait for the record
+    uint64_t lsn = 0;
+    DeferDurable deferred_sync(&lsn);
+    master.registry.lambda_disconnected(lambda_seq);
+  }
+}
+
 
 void MasterWorker::init()
 {
@@ -38,6 +75,7 @@ void MasterWorker::init()
   strcpy(ip_str, inet_ntoa(addr.sin_addr));
   ip = ip_str;
   this->addr = ip;
+  node_id = master.registry.intern_node(this->addr);
   LOG_DEBUG << "Connection from " << ip;
 }
 
@@ -46,59 +84,504 @@ void MasterWorker::exit()
   close(socket);
 }
 
-string MasterWorker::readline() {
-  string line("");
-  char buf[1024 * 1024];
-  int n = 0;
-  while(n = read(socket, buf, 1024 * 1024)) {
-    char* pos = std::find(buf, buf + n, '\n');
-    if(pos != buf + n) {
-      assert(pos == buf + n - 1);
-      *pos = '\0';
-      line += buf;
+void MasterWorker::reserve_input(size_t n) {
+  //the buffer is reused: consumed bytes are only moved out of the way when
+  //the free space at the end runs out, and it only grows for a request
+  //bigger than what is left
+  if (in_begin == in_end)
+    in_begin = in_end = 0;
+  if (input.size() - in_end >= n)
+    return;
+  if (in_begin > 0) {
+    memmove(input.data(), input.data() + in_begin, in_end - in_begin);
+    in_end -= in_begin;
+    in_begin = 0;
+  }
+  if (input.size() - in_end < n)
+    input.resize(max(max((size_t)READ_BYTES, input.size() * 2), in_end + n));
+}
+
+bool MasterWorker::fill() {
+  //a fed worker only has what the loop handed it
+  if (fed)
+    return false;
+  reserve_input(1);
+  while (true) {
+    int n = read(socket, input.data() + in_end, input.size() - in_end);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    in_end += n;
+    return true;
+  }
+}
+
+void MasterWorker::feed(const char* data, size_t len) {
+  fed = true;
+  reserve_input(len);
+  memcpy(input.data() + in_end, data, len);
+  in_end += len;
+  do_action();
+}
+
+Token MasterWorker::readline() {
+  //a read can carry several lines, the ones after the first wait in input
+  size_t seen = 0;
+  const char* eol;
+  while (true) {
+    eol = (const char*)memchr(input.data() + in_begin + seen, '\n', in_end - in_begin - seen);
+    if (eol == NULL) {
+      seen = in_end - in_begin;
+      if (!fill())
+        return Token{NULL, 0};
+    } else if (eol == input.data() + in_begin) {
+      //skip an empty line, size 0 tells the caller there is no line yet
+      in_begin++;
+    } else {
       break;
     }
-    line += buf;
   }
-  return line;
+  const char* line = input.data() + in_begin;
+  request_begin = in_begin;
+  in_begin += eol - line + 1;
+  return Token{line, (size_t)(eol - line)};
+}
+
+bool MasterWorker::readframe(uint8_t& opcode, uint64_t& id, vector<string>& fields) {
+  while (true) {
+    size_t n = decode_frame(input.data() + in_begin, in_end - in_begin, opcode, id, fields);
+    if (n == FRAME_CORRUPT) {
+      LOG_ERROR << "corrupt frame from " << addr << ", closing";
+      shutdown(socket, SHUT_RDWR);
+      in_begin = in_end = 0;
+      return false;
+    }
+    if (n > 0) {
+      request_begin = in_begin;
+      in_begin += n;
+      return true;
+    }
+    if (!fill())
+      return false;
+  }
 }
 
 void MasterWorker::do_action() {
+  //epoll is edge triggered, so take every request that has arrived, then
+  //send all their replies at once. A peer that does not read its replies
+  //is not read from either until they drain, see on_writable
+  uint64_t start = now_ns();
+  uint64_t requests = 0;
+  //the replies wait for the journal in flush, not the loop in journal()
+  DeferDurable deferred_sync(&journaled);
+  while (true) {
+    if (output.size() >= IOV_MAX || output_bytes >= READ_BYTES)
+      flush();
+    if (channel->backlogged()) {
+      paused = true;
+      break;
+    }
+    //replies held up behind a forwarded request, see replied
+    if (output.size() >= IOV_MAX) {
+      stalled = true;
+      break;
+    }
+    bool handled;
+    if (binary) {
+      uint8_t opcode;
+      uint64_t id;
+      if (!readframe(opcode, id, fields))
+        break;
+      handled = handle_frame(opcode, id);
+    } else {
+      Token line = readline();
+      if (line.size == 0)
+        break;
+      handled = handle_line(line);
+    }
+    if (!handled) {
+      //read again once the forwarded requests are answered
+      in_begin = request_begin;
+      stalled = true;
+      break;
+    }
+    requests++;
+  }
+  flush();
+  if (requests > 0)
+    master.latency.record(now_ns() - start, requests);
+}
+
+void MasterWorker::on_writable() {
+  if (!channel->drain())
+    return;
+  if (paused && !channel->backlogged()) {
+    paused = false;
+    do_action();
+  }
+}
+
+void MasterWorker::flush() {
+  if (output.empty())
+    return;
+  if (in_flight == 0) {
+    channel->send(output, false, journaled);
+    output_base += output.size();
+    recycle(output.size());
+    output_bytes = 0;
+    journaled = 0;
+    return;
+  }
+  //replies go out in order, up to the first one still at another core
+  size_t ready = 0;
+  while (ready < output.size() && output[ready] != "")
+    output_bytes -= output[ready++].size();
+  if (ready == 0)
+    return;
+  //journaled may cover later replies too, they are sent no earlier for it
+  channel->send(output.data(), ready, false, journaled);
+  recycle(ready);
+  output_base += ready;
+}
+
+string& MasterWorker::next_output() {
+  output.emplace_back();
+  if (!spare.empty()) {
+    output.back().swap(spare.back());
+    spare.pop_back();
+  }
+  return output.back();
+}
+
+void MasterWorker::recycle(size_t n) {
+  //small buffers are kept, a big reply's is not held on to
+  for (size_t i = 0; i < n && spare.size() < IOV_MAX; i++) {
+    if (output[i].capacity() > SPARE_REPLY_BYTES)
+      continue;
+    output[i].clear();
+    spare.push_back(move(output[i]));
+  }
+  output.erase(output.begin(), output.begin() + n);
+}
+
+Routed MasterWorker::route(uint8_t op, const string& key) {
+  if (core < 0 || !master.router.active())
+    return ROUTE_LOCAL;
+  int to = master.router.owner(key);
+  if (to == core)
+    return ROUTE_LOCAL;
+  //tasks are recycled, so these assignments reuse their buffers
+  CoreTask* t = master.router.task(core);
+  t->worker = this;
+  t->slot = output_base + output.size();
+  t->node = node_id;
+  t->op = op;
+  t->id = msg_id;
+  t->key = key;
+  if (!master.router.forward(core, to, t)) {
+    //running it here could pass a request for the same key still queued
+    master.router.recycle(core, t);
+    master.router.wait(core, this);
+    return ROUTE_FULL;
+  }
+  next_output();
+  in_flight++;
+  return ROUTE_FORWARDED;
+}
+
+void MasterWorker::run_forwarded(Master& master, CoreTask* task) {
+  EpochGuard epoch;
+  task->lsn = 0;
+  DeferDurable deferred_sync(&task->lsn);
+  handle_keyed(master, task->node, task->op, task->key, task->ret);
+}
+
+void MasterWorker::deliver(CoreTask* task) {
+  //text or frames alike, the connection cannot switch with replies due
+  string& slot = output[task->slot - output_base];
+  channel->encode(slot, task->id, task->op, task->ret);
+  output_bytes += slot.size();
+  journaled = max(journaled, task->lsn);
+  in_flight--;
+}
+
+void MasterWorker::replied() {
+  if (stalled && in_flight == 0) {
+    stalled = false;
+    do_action();
+  } else {
+    flush();
+  }
+}
+
+void MasterWorker::hang_up() {
+  channel->close();
+}
+
+bool MasterWorker::handle_line(const Token& line) {
+  LOG_DEBUG << "Received msg<-" << addr << ":lambda" << lambda_seq << " " << line;
+  //"id|op|key" for a keyed op, most of the traffic, is answered from the
+  //tokens over input into reused buffers, with nothing allocated. Only
+  //reg, cache, uncache and lookup: the rest, consistent locks included,
+  //are split into strings below
+  Token t[LINE_FIELDS];
+  size_t n = split_command(line.data, line.data + line.size, t, LINE_FIELDS);
+  uint8_t op = n > 1 ? frame_opcode(t[1].data, t[1].size) : (uint8_t)OP_NONE;
+  if (n == 3 && keyed(op)) {
+    msg_id.assign(t[0].data, t[0].size);
+    request_key.assign(t[2].data, t[2].size);
+    Routed routed = route(op, request_key);
+    if (routed != ROUTE_LOCAL)
+      return routed == ROUTE_FORWARDED;
+    {
+      EpochGuard epoch;
+      handle_keyed(master, node_id, op, request_key, reply_fields);
+    }
+    string& reply = next_output();
+    channel->encode(reply, msg_id, op, reply_fields);
+    output_bytes += reply.size();
+    return true;
+  }
+  //only keyed requests may pass the ones out at other cores, and only
+  //because those are for other keys
+  if (in_flight > 0)
+    return false;
   vector<string> cmds;
-  vector<string> rets;
-  string ret, msg;
-  msg = readline();
-  if (msg == "")
+  string response;
+  string msg = line.str();
+  boost::split(cmds, msg, boost::is_any_of("/"));
+  can_defer = cmds.size() == 1;
+  deferred = false;
+  for (size_t i = 0; i < cmds.size(); i++) {
+    vector<string> parts;
+    boost::split(parts, cmds[i], boost::is_any_of("|"));
+    msg_id = parts[0];
+    parts.erase(parts.begin());
+    if (cmds.size() == 1 && parts.size() > 1 && keyed(op)) {
+      Routed routed = route(op, parts[1]);
+      if (routed != ROUTE_LOCAL)
+        return routed == ROUTE_FORWARDED;
+    }
+    if (i > 0)
+      response += "/";
+    response += msg_id + "|" + boost::algorithm::join(handle_msg(parts), "|");
+  }
+  if (deferred) {
+    LOG_DEBUG << "Reply to " << addr << ":lambda" << lambda_seq << " deferred";
+    return true;
+  }
+  LOG_DEBUG << "Sending msg->" << addr << ":lambda" << lambda_seq << " " << response;
+  string& reply = next_output();
+  reply.append(response).push_back('\n');
+  output_bytes += reply.size();
+  if (upgrade) {
+    //the ack goes out as text, everything after it is framed
+    flush();
+    upgrade = false;
+    binary = true;
+    channel->binary = true;
+  }
+  return true;
+}
+
+bool MasterWorker::handle_frame(uint8_t opcode, uint64_t id) {
+  //replies carry the request id, so any request may be answered later
+  const string& op = frame_op_name(opcode);
+  if (in_flight > 0 && !keyed(opcode))
+    return false;
+  can_defer = true;
+  deferred = false;
+  msg_id = to_string(id);
+  vector<string> ret;
+  if (keyed(opcode) && fields.size() == 1) {
+    //the key is the only field, nothing is copied on the way
+    Routed routed = route(opcode, fields[0]);
+    if (routed != ROUTE_LOCAL)
+      return routed == ROUTE_FORWARDED;
+    {
+      EpochGuard epoch;
+      handle_keyed(master, node_id, opcode, fields[0], reply_fields);
+    }
+    string& reply = next_output();
+    channel->encode(reply, msg_id, opcode, reply_fields);
+    output_bytes += reply.size();
+    return true;
+  }
+  if (op == "") {
+    LOG_ERROR << "unknown opcode " << (int)opcode << " from " << addr;
+  } else {
+    fields.insert(fields.begin(), op);
+    ret = handle_msg(fields);
+  }
+  if (!deferred) {
+    string& reply = next_output();
+    channel->encode(reply, msg_id, opcode, ret);
+    output_bytes += reply.size();
+  }
+  return true;
+}
+
+void ReplyChannel::encode(string& out, const string& id, uint8_t opcode, const vector<string>& fields) {
+  if (binary) {
+    //the opcode stands for the "<op>_ack" name
+    encode_frame(out, opcode | FRAME_ACK, strtoull(id.c_str(), NULL, 10), fields, 1);
     return;
-  cmds.clear();
-  rets.clear();
-  LOG_DEBUG << "Received msg<-" << addr << ":lambda" << lambda_seq << " " << msg;
-  boost::split(cmds, msg, boost::is_any_of("/"));        
-  for (auto const& cmd : cmds) {
-    rets.push_back(handle_msg(cmd));
-  }
-  ret = boost::algorithm::join(rets, "/");
-  LOG_DEBUG << "Sending msg->" << addr << ":lambda" << lambda_seq << " " << ret;
-  string response = ret + "\n";
-  assert(response.size() < 1024 * 1024);
-  int total_written = 0, written = 0;
-  while(true) {
-    if ( (written = write(socket, response.c_str() + total_written, response.size() - total_written)) < 0) {
-      if (errno == EAGAIN)
-        continue;
-      else if (errno == ECONNRESET || errno == EPIPE)
-        return;
-      else {
-        std::cerr << "error: unable to write socket " << socket << std::endl;
-        break;
+  }
+  out.append(id).push_back('|');
+  for (size_t i = 0; i < fields.size(); i++) {
+    if (i > 0)
+      out.push_back('|');
+    out.append(fields[i]);
+  }
+  out.push_back('\n');
+}
+
+bool ReplyChannel::reply(const string& id, uint8_t opcode, const vector<string>& fields) {
+  string response;
+  encode(response, id, opcode, fields);
+  //granted from another request's thread, which journaled the grant
+  return send(&response, 1, false, registry.journal_lsn());
+}
+
+bool ReplyChannel::send(const vector<string>& batch, bool wait, uint64_t lsn) {
+  return send(batch.data(), batch.size(), wait, lsn);
+}
+
+bool ReplyChannel::send(const string& response, bool wait) {
+  return send(&response, 1, wait);
+}
+
+bool ReplyChannel::send(const string* parts, size_t count, bool wait, uint64_t lsn) {
+  lock_guard<mutex> guard(lock);
+  if (!open)
+    return false;
+  if (lsn > held_lsn) {
+    shared_ptr<ReplyChannel> self = shared_from_this();
+    if (registry.when_durable(lsn, [self, lsn]() { self->release(lsn); }))
+      held_lsn = lsn;
+  }
+  if (held_lsn > 0) {
+    for (size_t i = 0; i < count; i++)
+      held.append(parts[i]);
+    return true;
+  }
+  if (!write_parts(parts, count))
+    return false;
+  if (wait)
+    return settle(CHANNEL_BACKLOG_BYTES);
+  return true;
+}
+
+void ReplyChannel::release(uint64_t lsn) {
+  lock_guard<mutex> guard(lock);
+  //a later lsn came in meanwhile, its own call releases everything
+  if (!open || held_lsn > lsn)
+    return;
+  held_lsn = 0;
+  string out;
+  out.swap(held);
+  write_parts(&out, 1);
+}
+
+bool ReplyChannel::write_parts(const string* parts, size_t count) {
+  size_t next = 0, offset = 0;
+  //behind what is already parked, the bytes wait their turn
+  if (pending.size() == pending_sent) {
+    //one writev for as many parts as fit, resumed where a short write ended
+    struct iovec iov[IOV_MAX];
+    while (next < count) {
+      int n = 0;
+      for (size_t i = next; i < count && n < IOV_MAX; i++, n++) {
+        size_t skip = i == next ? offset : 0;
+        iov[n].iov_base = (void*)(parts[i].data() + skip);
+        iov[n].iov_len = parts[i].size() - skip;
+      }
+      ssize_t written = writev(socket, iov, n);
+      if (written < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN)
+          break;
+        return fail();
+      }
+      size_t left = written;
+      while (next < count && (left > 0 || parts[next].size() == offset)) {
+        size_t rest = parts[next].size() - offset;
+        if (left < rest) {
+          offset += left;
+          break;
+        }
+        left -= rest;
+        offset = 0;
+        next++;
       }
     }
-    total_written += written;
-    if (total_written >= response.size())
-      break;
   }
-  assert(total_written == response.size());
+  //the socket is full, the event loop sends the rest once it drains
+  for (size_t i = next; i < count; i++) {
+    size_t skip = i == next ? offset : 0;
+    pending.append(parts[i], skip, string::npos);
+  }
+  return true;
+}
+
+bool ReplyChannel::settle(size_t limit) {
+  while (pending.size() - pending_sent > limit) {
+    struct pollfd p = {socket, POLLOUT, 0};
+    poll(&p, 1, 100);
+    if (!open || !write_pending())
+      return false;
+  }
+  return true;
+}
+
+bool ReplyChannel::write_pending() {
+  while (pending_sent < pending.size()) {
+    ssize_t written = write(socket, pending.data() + pending_sent, pending.size() - pending_sent);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        return true;
+      return fail();
+    }
+    pending_sent += written;
+  }
+  pending.clear();
+  pending_sent = 0;
+  return true;
+}
 
+bool ReplyChannel::fail() {
+  if (errno != ECONNRESET && errno != EPIPE)
+    LOG_ERROR << "unable to write socket " << socket << " errno " << errno;
+  //nothing after a lost write may reach the peer
+  open = false;
+  pending.clear();
+  pending_sent = 0;
+  held.clear();
+  held_lsn = 0;
+  return false;
+}
+
+bool ReplyChannel::drain() {
+  lock_guard<mutex> guard(lock);
+  return open && write_pending();
+}
+
+bool ReplyChannel::backlogged() {
+  lock_guard<mutex> guard(lock);
+  return pending.size() - pending_sent > CHANNEL_BACKLOG_BYTES;
+}
+
+void ReplyChannel::close() {
+  lock_guard<mutex> guard(lock);
+  open = false;
+  pending.clear();
+  pending_sent = 0;
+  held.clear();
+  held_lsn = 0;
 }
 
 void MasterWorker::run() {
@@ -109,183 +592,484 @@ void MasterWorker::run() {
   exit();
 }
 
-string MasterWorker::handle_msg(string msg) {
-  string ret;
-  vector<string> parts;
-  boost::split(parts, msg, boost::is_any_of("|"));
-  string id = parts[0];
-  parts.erase(parts.begin());
-  if(parts[0] == "new_server")
-    ret = handle_new_server(parts);
-  else if(parts[0] == "reg")
-    ret = handle_reg(parts);
-  else if(parts[0] == "cache")
-    ret = handle_cache(parts);
-  else if(parts[0] == "uncache")
-    ret = handle_uncache(parts);
-  else if(parts[0] == "lookup")
-    ret = handle_lookup(parts);
-  else if(parts[0] == "delete")
-    ret = handle_delete(parts);
-  else if(parts[0] == "consistent_lock")
-    ret = handle_consistent_lock(parts);
-  else if(parts[0] == "consistent_unlock")
-    ret = handle_consistent_unlock(parts);
-  else if(parts[0] == "consistent_delete")
-    ret = handle_consistent_delete(parts);
-  else if(parts[0] == "lineage")
-    ret = handle_lineage(parts);
-  else if(parts[0] == "failover_write_update")
-    ret = handle_failover_write_update(parts);
-  else if(parts[0] == "force_release_lock")
-    ret = handle_force_release_lock(parts);
-  else {
-    LOG_ERROR << "error msg type";
-    ret = string("");
-  }
-  return id + "|" + ret;
-}
-
-string MasterWorker::handle_new_server(vector<string> parts) {
-  //new_server|port|lambda_id(optional)
+vector<string> MasterWorker::refuse(Master& master, const vector<string>& parts) {
+  //a follower's registry only changes through the replication stream
+  if (master.replica.following() && parts[0] != "new_server" && parts[0] != "lookup" && parts[0] != "mlookup" && parts[0] != "lineage" &&
+      parts[0] != "list_prefix" && parts[0] != "stats" && parts[0] != "replicate" && parts[0] != "promote" && parts[0] != "follow")
+    return {parts[0] + "_ack", "exception: read_only_follower"};
+  //keys of other shards are bounced, the sender refreshes its ring and retries
+  const string* key = routing_key(parts);
+  if (key != NULL && !master.replica.following()) {
+    string err = master.shards.check(*key);
+    if (err != "")
+      return {parts[0] + "_ack", err};
+  }
+  return {};
+}
+
+bool MasterWorker::keyed(uint8_t op) {
+  return op == OP_REG || op == OP_CACHE || op == OP_UNCACHE || op == OP_LOOKUP;
+}
+
+void MasterWorker::handle_keyed(Master& master, NodeId node_id, uint8_t op, const string& key, vector<string>& ret) {
+  ret.resize(2);
+  ret[0].assign(frame_op_name(op)).append("_ack");
+  //the checks of refuse, without building parts for it
+  if (master.replica.following() && op != OP_LOOKUP) {
+    ret[1].assign("exception: read_only_follower");
+    return;
+  }
+  if (!master.replica.following()) {
+    string err = master.shards.check(key);
+    if (err != "") {
+      ret[1].assign(err);
+      return;
+    }
+  }
+  switch (op) {
+  case OP_REG:
+    handle_reg(master, node_id, key, ret);
+    break;
+  case OP_CACHE:
+    handle_cache(master, node_id, key, ret);
+    break;
+  case OP_UNCACHE:
+    handle_uncache(master, node_id, key, ret);
+    break;
+  default:
+    handle_lookup(master, node_id, key, ret);
+  }
+}
+
+vector<string> MasterWorker::handle_msg(vector<string>& parts) {
+  //registry entries stay valid until the end of the request
+  EpochGuard epoch;
+  uint8_t op = frame_opcode(parts[0]);
+  vector<string> ret;
+  if (keyed(op)) {
+    if (parts.size() > 1)
+      handle_keyed(master, node_id, op, parts[1], ret);
+    return ret;
+  }
+  ret = refuse(master, parts);
+  if (!ret.empty())
+    return ret;
+  switch (op) {
+  case OP_NEW_SERVER: ret = handle_new_server(parts); break;
+  case OP_MLOOKUP: ret = handle_mlookup(parts); break;
+  case OP_MREG: ret = handle_mreg(parts); break;
+  case OP_MCACHE: ret = handle_mcache(parts); break;
+  case OP_MUNLOCK: ret = handle_munlock(parts); break;
+  case OP_DELETE: ret = handle_delete(parts); break;
+  case OP_LIST_PREFIX: ret = handle_list_prefix(parts); break;
+  case OP_DELETE_PREFIX: ret = handle_delete_prefix(parts); break;
+  case OP_CONSISTENT_LOCK: ret = handle_consistent_lock(parts); break;
+  case OP_CONSISTENT_UNLOCK: ret = handle_consistent_unlock(parts); break;
+  case OP_CONSISTENT_DELETE: ret = handle_consistent_delete(parts); break;
+  case OP_LINEAGE: ret = handle_lineage(parts); break;
+  case OP_FAILOVER_WRITE_UPDATE: ret = handle_failover_write_update(parts); break;
+  case OP_FORCE_RELEASE_LOCK: ret = handle_force_release_lock(parts); break;
+  case OP_POLL: ret = handle_poll(parts); break;
+  case OP_DECOMMISSION: ret = handle_decommission(parts); break;
+  case OP_STATS: ret = handle_stats(parts); break;
+  case OP_LAMBDA_DONE: ret = handle_lambda_done(parts); break;
+  case OP_PROMOTE: ret = handle_promote(parts); break;
+  case OP_FOLLOW: ret = handle_follow(parts); break;
+  case OP_SHARDS: ret = handle_shards(parts); break;
+  case OP_MIGRATE_DONE: ret = handle_migrate_done(parts); break;
+  default:
+    //the commands that take over their connection have no opcode
+    if (parts[0] == "replicate")
+      ret = handle_replicate(parts);
+    else if (parts[0] == "migrate")
+      ret = handle_migrate(parts);
+    else
+      LOG_ERROR << "error msg type";
+  }
+  return ret;
+}
+
+vector<string> MasterWorker::handle_new_server(const vector<string>& parts) {
+  //new_server|port|lambda_id(optional)|rack|host|load|protocol, cache servers
+  //send the rest, protocol FRAME_PROTOCOL switches the connection to frames
+  upgrade = !binary && parts.size() > 6 && parts[6] == FRAME_PROTOCOL;
+  bool framed = binary || upgrade;
+  auto ack = [&parts, framed](string lambda) -> vector<string> {
+    vector<string> ret = {"new_server_ack", parts[1], lambda};
+    if (framed)
+      ret.push_back(FRAME_PROTOCOL);
+    return ret;
+  };
   port = parts[1];
   addr = ip + ":" + port; //TODO addr should be cacheserver addr, not lambda addr
-  LOG_DEBUG << "handle new_server from " << addr;
-  if (parts.size() < 3 || parts[2] == "") {
+  node_id = master.registry.intern_node(addr);
+  if (parts.size() > 5) {
+    master.registry.set_node_labels(node_id, parts[3], parts[4]);
+    master.registry.report_node_load(node_id, atoi(parts[5].c_str()));
+  }
+  LOG_DEBUG << "handle new_server from " << addr << " node " << node_id;
+  if (master.replica.following()) {
+    //reads only: the node is known for use_local, lambdas belong to the leader
+    return ack(parts.size() < 3 || parts[2] == "" ? string("0") : to_string(parse_lambda(parts[2])));
+  }
+  bool new_lambda = parts.size() < 3 || parts[2] == "";
+  //lambda ids come from the first shard, other shards take them as given
+  if (new_lambda && !master.shards.assigns_lambdas())
+    return ack("0");
+  if (lambda_registered)
+    master.registry.lambda_disconnected(lambda_seq);
+  if (new_lambda) {
     lambda_seq = master.registry.get_lambda_seq();
   } else {
-    lambda_seq = atoi(parts[2].substr(6).c_str());
+    lambda_seq = parse_lambda(parts[2]);
   }
-  return "new_server_ack|" + parts[1] + "|" + to_string(lambda_seq);
+  master.registry.lambda_connected(lambda_seq, master.shards.sharded());
+  lambda_registered = true;
+  return ack(to_string(lambda_seq));
 }
 
-string MasterWorker::handle_reg(vector<string> parts){
-  bool ret = master.registry.reg_key(parts[1], addr);
-  return "reg_ack|" + parts[1] + "|" + (ret?"success":"fail");
+void MasterWorker::handle_reg(Master& master, NodeId node_id, const string& key, vector<string>& ret) {
+  bool ok = master.registry.reg_key(key, node_id);
+  ret.resize(3);
+  ret[1].assign(key);
+  ret[2].assign(ok?"success":"fail");
 }
 
-string MasterWorker::handle_cache(vector<string> parts){
-  bool ret = master.registry.cache_key(parts[1], addr);
-  return "cache_ack|" + parts[1] + "|" + (ret?"success":"fail");
+void MasterWorker::handle_cache(Master& master, NodeId node_id, const string& key, vector<string>& ret) {
+  bool ok = master.registry.cache_key(key, node_id);
+  ret.resize(3);
+  ret[1].assign(key);
+  ret[2].assign(ok?"success":"fail");
 }
 
-string MasterWorker::handle_uncache(vector<string> parts){ 
-  bool ret = master.registry.uncache_key(parts[1], addr);
-  return "uncache_ack|" + parts[1] + "|" + (ret?"success":"fail");
+void MasterWorker::handle_uncache(Master& master, NodeId node_id, const string& key, vector<string>& ret) {
+  bool ok = master.registry.uncache_key(key, node_id);
+  ret.resize(3);
+  ret[1].assign(key);
+  ret[2].assign(ok?"success":"fail");
 }
 
-string MasterWorker::handle_lookup(vector<string> parts) {
-  string ret = master.registry.get_location(parts[1], addr);
-  return "lookup_ack|" + ret;
-} 
+void MasterWorker::handle_lookup(Master& master, NodeId node_id, const string& key, vector<string>& ret) {
+  if (master.replica.following() && !master.replica.fresh()) {
+    ret[1].assign("exception: stale");
+    return;
+  }
+  //only the leader's inboxes are polled, so only it spreads hot keys
+  master.registry.get_location(key, node_id, !master.replica.following(), ret[1]);
+}
 
-string MasterWorker::handle_consistent_lock(vector<string> parts) {
-  //consistent_lock|read/write|key|lambda|duration_in_sec|use_s3|snap|check_loc|version
-  string pre_check_loc = "";
-  if (parts[5] == "s3" || parts[7] == "check_loc")
-    //TODO: state may change after get_location....
-    pre_check_loc = master.registry.get_location(parts[2], addr);
-  
-  LOG_DEBUG << "handle consistent_lock from " << addr << " pre_check_loc " << pre_check_loc;
+string MasterWorker::check_batch(const vector<string>& names) {
+  //a batch is for one shard, the sender regroups it after a ring change
+  if (master.replica.following())
+    return "";
+  for (auto& name : names) {
+    string err = master.shards.check(name);
+    if (err != "")
+      return err;
+  }
+  return "";
+}
 
-  if (parts[1] == "write" || (parts[5] == "s3" && pre_check_loc == "")) {
-    LOG_DEBUG << "write branch";
-    string ret, loc;
-    ret = master.registry.consistent_write_lock(parts[2], addr, parts[3], atoi(parts[4].c_str()), parts[6] == "snap");
-    loc = master.registry.get_location(parts[2], addr);
-    if(ret == "success") {
-      LOG_DEBUG << "ret = success";
-      uint lambda_id = atoi(parts[3].substr(6).c_str());
-      if( parts[7] == "check_loc" && parts[5] != "s3") { //check_loc iff open as rw
-        LOG_DEBUG << "check_loc and s3";
-        uint key_version = master.registry.get_key_version(parts[2], true);
-        master.registry.register_lineage(lambda_id, parts[2], key_version);
-      }
-      master.registry.register_lock(lambda_id, parts[2], true);
-    } else { 
-      if (parts[8] == "recent") {
-        LOG_DEBUG << "part[8] == recent, lock failed";
-      } else {
-        LOG_DEBUG << "part[8] != recent";
-        ret = "success";
-        loc = master.registry.get_location_version(parts[2], addr, atoi(parts[8].c_str()));
-      }
-    }
-    return "consistent_lock_ack|" + ret + "|write|" + loc;
-  } else if (parts[1] == "read") {
-    LOG_DEBUG << "read branch";
-    string ret, loc;
-    if (parts[8] == "recent") {
-      //LOG_DEBUG << "parts[8] == recent";
-      ret = master.registry.consistent_read_lock(parts[2], addr, parts[3], atoi(parts[4].c_str()), parts[6] == "snap");
-      loc = master.registry.get_location(parts[2], addr);
-      if(ret == "success") {
-        uint lambda_id = atoi(parts[3].substr(6).c_str());
-        uint key_version = master.registry.get_key_version(parts[2], false);
-        master.registry.register_lineage(lambda_id, parts[2], key_version);
-        master.registry.register_lock(lambda_id, parts[2], false);
-      }
-    } else {
-      //LOG_DEBUG << "parts[8] != recent";
-      ret = "success";
-      if (parts[5] != "s3") {
-        //LOG_DEBUG << "get_location_version";
-        loc = master.registry.get_location_version(parts[2], addr, atoi(parts[8].c_str()));
-      } else { //you just want the newest version
-        //LOG_DEBUG << "get_location";
-        loc = master.registry.get_location(parts[2], addr);
-      }
-    }
-    return "consistent_lock_ack|" + ret + "|read|" + loc;
-  } else {
-    return "consistent_lock_ack|wrong_cmd";
+void MasterWorker::run_batch(size_t n, function<void(size_t, size_t)> f) {
+  if (n < BATCH_PARALLEL_MIN) {
+    f(0, n);
+    return;
   }
+  size_t tasks = min(master.batch_pool.threadCount() + 1, n / BATCH_PARALLEL_MIN);
+  size_t step = (n + tasks - 1) / tasks;
+  vector<future<uint64_t>> done;
+  for (size_t begin = step; begin < n; begin += step) {
+    size_t end = min(n, begin + step);
+    done.push_back(master.batch_pool.add([&f, begin, end]() {
+      EpochGuard epoch;
+      //the reply waits for what the pool thread journaled
+      uint64_t lsn = 0;
+      DeferDurable deferred_sync(&lsn);
+      f(begin, end);
+      return lsn;
+    }));
+  }
+  f(0, step);
+  for (auto& d : done)
+    master.registry.wait_journal(d.get());
+}
+
+vector<string> MasterWorker::handle_mlookup(const vector<string>& parts) {
+  //mlookup|key|key|..., replies mlookup_ack|locations|locations|... in key order
+  if (master.replica.following() && !master.replica.fresh())
+    return {"mlookup_ack", "exception: stale"};
+  vector<string> names(parts.begin() + 1, parts.end());
+  string err = check_batch(names);
+  if (err != "")
+    return {"mlookup_ack", err};
+  vector<string> out(names.size());
+  bool spread = !master.replica.following();
+  run_batch(names.size(), [this, &names, &out, spread](size_t begin, size_t end) {
+    master.registry.get_locations(names, begin, end, node_id, out, spread);
+  });
+  out.insert(out.begin(), "mlookup_ack");
+  return out;
+}
+
+vector<string> MasterWorker::handle_mreg(const vector<string>& parts) {
+  //mreg|key|key|..., replies mreg_ack|<1 or 0 per key>
+  vector<string> names(parts.begin() + 1, parts.end());
+  string err = check_batch(names);
+  if (err != "")
+    return {"mreg_ack", err};
+  vector<char> out(names.size());
+  run_batch(names.size(), [this, &names, &out](size_t begin, size_t end) {
+    master.registry.reg_keys(names, begin, end, node_id, out);
+  });
+  return {"mreg_ack", string(out.begin(), out.end())};
+}
+
+vector<string> MasterWorker::handle_mcache(const vector<string>& parts) {
+  //mcache|key|key|..., replies mcache_ack|<1 or 0 per key>
+  vector<string> names(parts.begin() + 1, parts.end());
+  string err = check_batch(names);
+  if (err != "")
+    return {"mcache_ack", err};
+  vector<char> out(names.size());
+  run_batch(names.size(), [this, &names, &out](size_t begin, size_t end) {
+    master.registry.cache_keys(names, begin, end, node_id, out);
+  });
+  return {"mcache_ack", string(out.begin(), out.end())};
+}
+
+vector<string> MasterWorker::handle_munlock(const vector<string>& parts) {
+  //munlock|read/write|lambda|<1 or 0 per key: modified>|key|key|...
+  //replies munlock_ack|ret|ret|... in key order
+  if (parts.size() < 4 || (parts[1] != "write" && parts[1] != "read"))
+    return {"munlock_ack", "wrong_cmd"};
+  vector<string> names(parts.begin() + 4, parts.end());
+  string err = check_batch(names);
+  if (err != "")
+    return {"munlock_ack", err};
+  uint lambda_id = parse_lambda(parts[2]);
+  bool write = parts[1] == "write";
+  const string& modified = parts[3];
+  vector<string> out(names.size());
+  run_batch(names.size(), [this, &names, &out, lambda_id, write, &modified](size_t begin, size_t end) {
+    master.registry.consistent_unlock_keys(names, begin, end, node_id, lambda_id, write, modified, out);
+  });
+  out.insert(out.begin(), "munlock_ack");
+  return out;
+}
+
+vector<string> MasterWorker::handle_consistent_lock(const vector<string>& parts) {
+  //consistent_lock|read/write|key|lambda|duration_in_sec|use_s3|snap|check_loc|version|wait(optional)
+  uint lambda_id = parse_lambda(parts[3]);
+  //through its cache server a lambda reaches shards it never connected to
+  if (master.shards.sharded())
+    master.registry.adopt_lambda(lambda_id);
+  LOG_DEBUG << "handle consistent_lock from " << addr;
+
+  bool write = parts[1] == "write";
+  if (!write && parts[1] != "read")
+    return {"consistent_lock_ack", "wrong_cmd"};
+
+  //readers, and writers opening as rw (check_loc iff open as rw), depend on
+  //the version they read
+  bool s3 = parts[5] == "s3";
+  bool recent = parts[8] == "recent";
+  LockRequest req = {node_id, lambda_id, write, atoi(parts[4].c_str()), parts[6] == "snap",
+                     !write || (parts[7] == "check_loc" && !s3), s3, recent,
+                     recent ? 0 : (uint)atoi(parts[8].c_str())};
+
+  //a contended request can wait in the key's queue, its reply is sent
+  //through the channel when the lock is granted. The replies before it are
+  //sent first, as the grant may come from another thread right away, but
+  //those to requests read after it can go out ahead of the grant: clients
+  //match replies by id. Only for single-command lines, whose reply is the
+  //grant alone
+  LockWait wait;
+  bool can_wait = can_defer && parts.size() > 9 && parts[9] == "wait" && recent;
+  if (can_wait) {
+    flush();
+    shared_ptr<ReplyChannel> ch = channel;
+    string id = msg_id;
+    wait.alive = [ch]() { return ch->open.load(); };
+    wait.on_grant = [ch, id](string ret, bool write, const string& loc) {
+      ch->reply(id, OP_CONSISTENT_LOCK, {"consistent_lock_ack", ret, write ? "write" : "read", loc});
+    };
+  }
+
+  string loc;
+  string ret = master.registry.consistent_lock(parts[2], req, loc, can_wait ? &wait : NULL);
+  if (ret == "wait") {
+    deferred = true;
+    return {};
+  }
+  return {"consistent_lock_ack", ret, req.write ? "write" : "read", loc};
 }
 
-string MasterWorker::handle_consistent_unlock(vector<string> parts) {
+vector<string> MasterWorker::handle_consistent_unlock(const vector<string>& parts) {
   //consistent_unlock|read/write|key|lambda|modified
   if (parts[1] == "write") {
-    string ret = master.registry.consistent_write_unlock(parts[2], addr, parts[3], parts[4][0] == '1');
-    return "consistent_unlock_ack|" + ret;
+    string ret = master.registry.consistent_write_unlock(parts[2], node_id, parse_lambda(parts[3]), parts[4][0] == '1');
+    return {"consistent_unlock_ack", ret};
   } else if (parts[1] == "read") {
-    string ret = master.registry.consistent_read_unlock(parts[2], addr, parts[3], parts[4][0] == '1');
-    return "consistent_unlock_ack|" + ret;
+    string ret = master.registry.consistent_read_unlock(parts[2], node_id, parse_lambda(parts[3]), parts[4][0] == '1');
+    return {"consistent_unlock_ack", ret};
   } else {
-    return "consistent_unlock_ack|wrong_cmd";
+    return {"consistent_unlock_ack", "wrong_cmd"};
   }
 }
 
-string MasterWorker::handle_consistent_delete(vector<string> parts) {
+vector<string> MasterWorker::handle_consistent_delete(const vector<string>& parts) {
   //consistent_delete|key|lambda
-  string ret = master.registry.consistent_delete(parts[1], parts[2]);
-  return "consistent_delete_ack|" + ret;
+  string ret = master.registry.consistent_delete(parts[1], parse_lambda(parts[2]));
+  return {"consistent_delete_ack", ret};
 }
 
-string MasterWorker::handle_delete(vector<string> parts) {
+vector<string> MasterWorker::handle_delete(const vector<string>& parts) {
   //delete|key
   string ret = master.registry.delete_key(parts[1]);
-  return "delete_ack|" + ret;
+  return {"delete_ack", ret};
 }
 
-string MasterWorker::handle_lineage(vector<string> parts) {
-  //lineage|lambda_id
-  string ret = master.registry.get_lineage(atoi(parts[1].c_str()));
-  return "lineage_ack|" + ret;
+vector<string> MasterWorker::handle_list_prefix(const vector<string>& parts) {
+  //list_prefix|prefix|cursor|max_bytes -> list_prefix_ack|name;name;...|next_cursor
+  //next_cursor is empty after the last page, every shard lists its own keys
+  if (master.replica.following() && !master.replica.fresh())
+    return {"list_prefix_ack", "exception: stale"};
+  string cursor = parts.size() > 2 ? parts[2] : "";
+  size_t max_bytes = parts.size() > 3 ? atoi(parts[3].c_str()) : 65536;
+  string ret = master.registry.list_prefix(parts[1], cursor, max_bytes, [this](const string& key) {
+    return master.shards.check(key) == "";
+  });
+  return {"list_prefix_ack", ret, cursor};
 }
 
-string MasterWorker::handle_failover_write_update(vector<string> parts) {
+vector<string> MasterWorker::handle_delete_prefix(const vector<string>& parts) {
+  //delete_prefix|prefix|lambda_id -> delete_prefix_ack|deleted|skipped
+  //skipped counts consistent keys another lambda holds
+  size_t skipped = 0;
+  size_t deleted = master.registry.delete_prefix(parts[1], parse_lambda(parts.size() > 2 ? parts[2] : ""), [this](const string& key) {
+    return master.shards.check(key) == "";
+  }, skipped);
+  return {"delete_prefix_ack", to_string(deleted), to_string(skipped)};
+}
+
+vector<string> MasterWorker::handle_lineage(const vector<string>& parts) {
+  //lineage|lambda_id or lineage|lambda_id,lambda_id,...|cursor|max_bytes
+  if (master.replica.following() && !master.replica.fresh())
+    return {"lineage_ack", "exception: stale"};
+  if (parts.size() < 4) {
+    string ret = master.registry.get_lineage(atoi(parts[1].c_str()));
+    return {"lineage_ack", ret};
+  }
+  //lineage_ack|entries|next_cursor, next_cursor is empty after the last page
+  vector<string> lambda_strings;
+  vector<uint> lambdas;
+  boost::split(lambda_strings, parts[1], boost::is_any_of(","));
+  for (string ls : lambda_strings)
+    lambdas.push_back(atoi(ls.c_str()));
+  string cursor = parts[2];
+  string ret = master.registry.get_lineage(lambdas, cursor, atoi(parts[3].c_str()));
+  return {"lineage_ack", ret, cursor};
+}
+
+vector<string> MasterWorker::handle_failover_write_update(const vector<string>& parts) {
   //failover_write_update|key|version|lambda_id
-  return "failover_write_update_ack|" + master.registry.failover_write_update(parts[1], atoi(parts[2].c_str()), addr, parts[3]);
+  return {"failover_write_update_ack", master.registry.failover_write_update(parts[1], atoi(parts[2].c_str()), node_id, parse_lambda(parts[3]))};
 }
 
-string MasterWorker::handle_force_release_lock(vector<string> parts) {
+vector<string> MasterWorker::handle_force_release_lock(const vector<string>& parts) {
   //force_release_lock|lambdas
   vector<string> lambda_strings;
   vector<uint> lambdas;
   boost::split(lambda_strings, parts[1], boost::is_any_of(","));
   for (string ls : lambda_strings)
     lambdas.push_back(atoi(ls.c_str()));
-  return  "force_release_lock_ack|"+ master.registry.force_release_lock(lambdas);
+  return {"force_release_lock_ack", master.registry.force_release_lock(lambdas)};
+}
+
+vector<string> MasterWorker::handle_poll(const vector<string>& parts) {
+  //poll|max_bytes|load, the cache server's heartbeat
+  size_t max_bytes = parts.size() > 1 ? atoi(parts[1].c_str()) : 4096;
+  if (parts.size() > 2)
+    master.registry.report_node_load(node_id, atoi(parts[2].c_str()));
+  return {"poll_ack", master.registry.poll(node_id, max_bytes)};
+}
+
+vector<string> MasterWorker::handle_decommission(const vector<string>& parts) {
+  //decommission|host:port, the sender's own cache server when empty
+  NodeId node = parts.size() > 1 && parts[1] != "" ? master.registry.intern_node(parts[1]) : node_id;
+  return {"decommission_ack", to_string(master.registry.decommission(node))};
+}
+
+vector<string> MasterWorker::handle_stats(const vector<string>&) {
+  //stats
+  return {"stats_ack", master.registry.stats() + master.replica.stats() + master.shards.stats() + master.stats()};
+}
+
+vector<string> MasterWorker::handle_lambda_done(const vector<string>& parts) {
+  //lambda_done|lambda_id
+  return {"lambda_done_ack", master.registry.lambda_done(parse_lambda(parts[1]))};
+}
+
+vector<string> MasterWorker::handle_replicate(const vector<string>& parts) {
+  //replicate|lsn, the connection then carries the replication stream
+  if (!can_defer)
+    return {"replicate_ack", "exception: must be sent alone"};
+  //replies to requests before this one go out ahead of the stream
+  flush();
+  deferred = true;
+  ReplicationSender::start(master.registry, channel, strtoull(parts[1].c_str(), NULL, 10));
+  return {};
+}
+
+vector<string> MasterWorker::handle_promote(const vector<string>&) {
+  //promote
+  master.replica.promote();
+  return {"promote_ack", "success", to_string(master.registry.journal_lsn())};
+}
+
+vector<string> MasterWorker::handle_follow(const vector<string>& parts) {
+  //follow|host:port
+  master.replica.follow(parts[1]);
+  return {"follow_ack", "success"};
+}
+
+vector<string> MasterWorker::handle_shards(const vector<string>&) {
+  //shards, replies shards_ack|ring_version|host:port,host:port,...
+  string spec = master.shards.spec();
+  size_t bar = spec.find('|');
+  return {"shards_ack", spec.substr(0, bar), bar == string::npos ? string("") : spec.substr(bar + 1)};
+}
+
+vector<string> MasterWorker::handle_migrate(const vector<string>& parts) {
+  //migrate|new_shard|members, the connection then carries the moved keys
+  if (!can_defer)
+    return {"migrate_ack", "exception: must be sent alone"};
+  if (!master.shards.sharded())
+    return {"migrate_ack", "exception: not_sharded"};
+  flush();
+  deferred = true;
+  master.shards.start_export(parts[1], HashRing::parse(parts[2]), channel);
+  return {};
+}
+
+vector<string> MasterWorker::handle_migrate_done(const vector<string>& parts) {
+  //migrate_done|new_shard
+  return {"migrate_done_ack", to_string(master.shards.finish_export(parts[1]))};
+}
+
+const string* MasterWorker::routing_key(const vector<string>& parts) {
+  const string& op = parts[0];
+  if (op == "consistent_lock" || op == "consistent_unlock")
+    return parts.size() > 2 ? &parts[2] : NULL;
+  if (op == "reg" || op == "cache" || op == "uncache" || op == "lookup" || op == "delete" ||
+      op == "consistent_delete" || op == "failover_write_update")
+    return parts.size() > 1 ? &parts[1] : NULL;
+  return NULL;
+}
+
+uint MasterWorker::parse_lambda(const string& lambda_id) {
+  //lambda ids travel as "lambda<seq>"
+  return lambda_id.size() > 6 ? atoi(lambda_id.c_str() + 6) : 0;
 }
 
 void *MasterWorker::pthread_helper(void * worker) {
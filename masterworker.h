@@ -3,43 +3,215 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+#include "interntable.h"
+#include "corerouter.h"
+#include "masterregistry.h"
+#include "token.h"
+
+// batches of at least this many keys are split across the batch pool
+#define BATCH_PARALLEL_MIN 1024
+#define READ_BYTES (64 * 1024)
+// replies parked for a slow reader beyond which it is not read from
+#define CHANNEL_BACKLOG_BYTES (4 * 1024 * 1024)
+// fields of a single command line parsed without copying
+#define LINE_FIELDS 16
+// largest reply buffer a connection keeps for its next replies; it keeps
+// at most IOV_MAX, what one flush sends
+#define SPARE_REPLY_BYTES 512
 
 using namespace std;
 
 class Master;
 
+// Serializes replies on a client socket. Parked lock requests keep a
+// reference and answer from whichever thread grants them, possibly after
+// the worker is gone, so the worker closes the channel when it goes away.
+//
+// Writes never wait for a full socket: what it does not take is parked in
+// order and sent by drain() when the event loop sees EPOLLOUT.
+//
+// Nor do they wait for the disk: replies to requests journaled up to lsn
+// are held until the journal flusher reports lsn durable, and what is sent
+// after them is held behind them, so a client never sees an ack for a
+// mutation a crash could lose.
+struct ReplyChannel : enable_shared_from_this<ReplyChannel> {
+  ReplyChannel(int socket, MasterRegistry& registry) : socket(socket), pending_sent(0), held_lsn(0), open(true), binary(false), registry(registry) {}
+  // Returns false once the peer is gone or the channel is closed. With
+  // wait, blocks while more than CHANNEL_BACKLOG_BYTES are parked, for
+  // streams written from their own thread.
+  bool send(const string& response, bool wait = false);
+  // Sends the responses in order with as few writes as possible, once the
+  // journal is durable up to lsn.
+  bool send(const vector<string>& batch, bool wait = false, uint64_t lsn = 0);
+  bool send(const string* parts, size_t count, bool wait, uint64_t lsn = 0);
+  // Appends the reply to request id to out as it goes on the wire.
+  void encode(string& out, const string& id, uint8_t opcode, const vector<string>& fields);
+  // Sends fields ("<op>_ack", ...) as the reply to request id, as a line or
+  // a frame depending on the connection, once everything journaled so far
+  // is durable.
+  bool reply(const string& id, uint8_t opcode, const vector<string>& fields);
+  // Writes parked bytes until the socket is full again.
+  bool drain();
+  bool backlogged();
+  void close();
+  mutex lock;
+  int socket;
+  string pending; // parked bytes, pending_sent of them already written
+  size_t pending_sent;
+  string held;     // waiting for the journal, see send
+  uint64_t held_lsn; // 0 when nothing is held
+  atomic<bool> open;
+  atomic<bool> binary;
+
+private:
+  void release(uint64_t lsn);
+  bool write_parts(const string* parts, size_t count);
+  bool settle(size_t limit);
+  bool write_pending();
+  bool fail();
+  MasterRegistry& registry;
+};
+
+// What MasterWorker::route did with a keyed request.
+enum Routed {
+  ROUTE_LOCAL,     // this core owns the key, run it here
+  ROUTE_FORWARDED, // its reply comes back through the router
+  ROUTE_FULL,      // the owner's queue is full, read it again later
+};
+
 class MasterWorker
 {
 public:
-  MasterWorker(Master &master, int socket);
+  // core is the pinned event loop's, else -1.
+  MasterWorker(Master &master, int socket, int core = -1);
+  ~MasterWorker();
   void run();
   static void *pthread_helper(void * worker);
   void do_action();
+  // The socket has room again: sends parked replies and reads on if
+  // do_action paused for them.
+  void on_writable();
+  // Handles bytes a completion-based loop read for this connection; the
+  // worker then never reads the socket itself.
+  void feed(const char* data, size_t len);
+  // False while a slow reader's replies are parked, see CHANNEL_BACKLOG_BYTES.
+  bool reading() const { return !paused; }
+  // Places the reply to a request forwarded to another core; replied()
+  // sends what is in order once a batch of them is in.
+  void deliver(CoreTask* task);
+  void replied();
+  // Requests still out at other cores.
+  size_t forwarded() const { return in_flight; }
+  int get_socket() const { return socket; }
+  // The connection is gone but replies are still due: stop writing to it.
+  void hang_up();
+  // Runs a request forwarded by another core on the owner's core.
+  static void run_forwarded(Master& master, CoreTask* task);
 
 protected:
   void init();
   void exit();
-  string readline();
-  string handle_msg(string);
-  string handle_new_server(vector<string>);
-  string handle_cache(vector<string>);
-  string handle_uncache(vector<string>);
-  string handle_reg(vector<string>);
-  string handle_lookup(vector<string>);
-  string handle_consistent_lock(vector<string>);
-  string handle_consistent_unlock(vector<string>);
-  string handle_consistent_delete(vector<string>);
-  string handle_delete(vector<string>);
-  string handle_lineage(vector<string>);
-  string handle_failover_write_update(vector<string>);
-  string handle_force_release_lock(vector<string>);
+  // Reads what has arrived to the end of input, false when nothing has.
+  bool fill();
+  // At least n free bytes at the end of input.
+  void reserve_input(size_t n);
+  // The next whole line, in input, empty until one has arrived.
+  Token readline();
+  // The next whole frame, false until one has arrived.
+  bool readframe(uint8_t& opcode, uint64_t& id, vector<string>& fields);
+  // False when the request has to wait for the ones forwarded before it.
+  bool handle_line(const Token& line);
+  // The frame's fields are in fields.
+  bool handle_frame(uint8_t opcode, uint64_t id);
+  // Hands a keyed request to the core owning key. ROUTE_FULL when that
+  // core's queue has no room: the request then waits, like one behind a
+  // forwarded request, rather than running here ahead of the ones queued.
+  Routed route(uint8_t op, const string& key);
+  // An empty reply at the end of output, with a spare buffer if there is one.
+  string& next_output();
+  // Sends the replies queued in output.
+  void flush();
+  // Drops the first n replies of output, keeping their buffers as spares.
+  void recycle(size_t n);
+  // parts[0] is the command, returns the reply fields, "<op>_ack" first.
+  vector<string> handle_msg(vector<string>& parts);
+  // Whether the request is refused here, as a follower or for another shard.
+  static vector<string> refuse(Master& master, const vector<string>& parts);
+  // reg, cache, uncache and lookup, which only touch the key's own entry.
+  static bool keyed(uint8_t op);
+  // Sets ret to the reply fields, refusing the request as refuse() would.
+  // ret's strings are assigned into, so their buffers are reused.
+  static void handle_keyed(Master& master, NodeId node_id, uint8_t op, const string& key, vector<string>& ret);
+  static void handle_reg(Master& master, NodeId node_id, const string& key, vector<string>& ret);
+  static void handle_cache(Master& master, NodeId node_id, const string& key, vector<string>& ret);
+  static void handle_uncache(Master& master, NodeId node_id, const string& key, vector<string>& ret);
+  static void handle_lookup(Master& master, NodeId node_id, const string& key, vector<string>& ret);
+  vector<string> handle_new_server(const vector<string>& parts);
+  vector<string> handle_consistent_lock(const vector<string>& parts);
+  vector<string> handle_consistent_unlock(const vector<string>& parts);
+  vector<string> handle_consistent_delete(const vector<string>& parts);
+  vector<string> handle_delete(const vector<string>& parts);
+  vector<string> handle_list_prefix(const vector<string>& parts);
+  vector<string> handle_delete_prefix(const vector<string>& parts);
+  vector<string> handle_lineage(const vector<string>& parts);
+  vector<string> handle_failover_write_update(const vector<string>& parts);
+  vector<string> handle_force_release_lock(const vector<string>& parts);
+  vector<string> handle_poll(const vector<string>& parts);
+  vector<string> handle_decommission(const vector<string>& parts);
+  vector<string> handle_stats(const vector<string>& parts);
+  vector<string> handle_lambda_done(const vector<string>& parts);
+  vector<string> handle_replicate(const vector<string>& parts);
+  vector<string> handle_promote(const vector<string>& parts);
+  vector<string> handle_follow(const vector<string>& parts);
+  vector<string> handle_shards(const vector<string>& parts);
+  vector<string> handle_mlookup(const vector<string>& parts);
+  vector<string> handle_mreg(const vector<string>& parts);
+  vector<string> handle_mcache(const vector<string>& parts);
+  vector<string> handle_munlock(const vector<string>& parts);
+  string check_batch(const vector<string>& names);
+  void run_batch(size_t n, function<void(size_t, size_t)> f);
+  vector<string> handle_migrate(const vector<string>& parts);
+  vector<string> handle_migrate_done(const vector<string>& parts);
+  static const string* routing_key(const vector<string>& parts);
+  static uint parse_lambda(const string& lambda_id);
 
   Master &master;
   int socket;
   uint lambda_seq;
+  bool lambda_registered;
   string ip;
   string port;
   string addr;
+  NodeId node_id;
+  shared_ptr<ReplyChannel> channel;
+  string msg_id;    // id of the request being handled
+  bool can_defer;   // the request line holds a single command
+  vector<char> input; // reused read buffer
+  size_t in_begin;  // input[in_begin, in_end) is read but not yet handled
+  size_t in_end;
+  vector<string> output; // replies of this wakeup, not sent yet
+  vector<string> spare; // cleared replies, their buffers reused by output
+  vector<string> fields; // of the frame being handled
+  vector<string> reply_fields; // of the keyed request being handled
+  string request_key; // of the keyed request being handled
+  size_t output_bytes;
+  uint64_t journaled; // last journal record behind the replies in output
+  int core;         // pinned event loop, -1 when not pinned
+  uint64_t output_base; // replies sent so far, the slot of output[0]
+  size_t in_flight; // forwarded requests, "" in output until they return
+  size_t request_begin; // where in input the last request read starts
+  bool stalled;     // stopped reading until the forwarded replies are in,
+                    // or the owner's queue has room again
+  bool paused;      // stopped reading until the parked replies drain
+  bool fed;         // input comes from feed, not from fill
+  bool deferred;    // its reply will be sent later through channel
+  bool binary;      // requests and replies are frames, see frame.h
+  bool upgrade;     // switch to frames once this reply is sent
 private:
   MasterWorker(const MasterWorker &); // No copies!
 };
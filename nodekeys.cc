@@ -0,0 +1,65 @@
+#include "nodekeys.h"
+#include "keyhashmap.h"
+
+void NodeKeys::add(NodeId node, const string& key) {
+  if (node == NO_NODE)
+    return;
+  uint64_t hash = KeyHashMap::hash(key);
+  Stripe& s = stripe(node);
+  lock_guard<mutex> guard(s.lock);
+  s.keys[node].insert(hash);
+}
+
+void NodeKeys::take(NodeId node, vector<uint64_t>& out) {
+  Stripe& s = stripe(node);
+  unordered_set<uint64_t> hashes;
+  {
+    lock_guard<mutex> guard(s.lock);
+    auto it = s.keys.find(node);
+    if (it == s.keys.end())
+      return;
+    hashes.swap(it->second);
+    s.keys.erase(it);
+  }
+  out.insert(out.end(), hashes.begin(), hashes.end());
+}
+
+size_t NodeKeys::sweep(function<bool(NodeId, uint64_t)> held) {
+  size_t dropped = 0;
+  for (Stripe& s : stripes) {
+    lock_guard<mutex> guard(s.lock);
+    for (auto it = s.keys.begin(); it != s.keys.end(); ) {
+      unordered_set<uint64_t>& hashes = it->second;
+      for (auto k = hashes.begin(); k != hashes.end(); ) {
+        if (held(it->first, *k)) {
+          k++;
+        } else {
+          k = hashes.erase(k);
+          dropped++;
+        }
+      }
+      if (hashes.empty())
+        it = s.keys.erase(it);
+      else
+        it++;
+    }
+  }
+  return dropped;
+}
+
+size_t NodeKeys::size() {
+  size_t n = 0;
+  for (Stripe& s : stripes) {
+    lock_guard<mutex> guard(s.lock);
+    for (auto& p : s.keys)
+      n += p.second.size();
+  }
+  return n;
+}
+
+void NodeKeys::clear() {
+  for (Stripe& s : stripes) {
+    lock_guard<mutex> guard(s.lock);
+    s.keys.clear();
+  }
+}
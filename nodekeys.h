@@ -0,0 +1,50 @@
+#ifndef NODEKEYS_H
+#define NODEKEYS_H
+
+#include <stdint.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "interntable.h"
+
+#define NODE_KEYS_STRIPES 64
+
+using namespace std;
+
+// Reverse index from a cache server to the keys it may hold, in their
+// locations or as a version holder, so a lost or departing node is purged
+// by visiting its own keys instead of every key. A key is recorded by its
+// KeyHashMap hash, not a copy of its name; readers find the entries with
+// KeyHashMap::for_hash.
+//
+// Keys are added after the location they stand for is published and are
+// never removed one by one: a record can outlive the copy it stands for,
+// and whoever reads the index checks the entry. take() hands over a node's
+// keys at once, sweep() drops the stale ones every gc round.
+//
+// Striped by node, each stripe under its own mutex.
+class NodeKeys {
+public:
+  void add(NodeId node, const string& key);
+  // Moves the key hashes recorded for node into out and forgets them.
+  void take(NodeId node, vector<uint64_t>& out);
+  // Drops the keys held(node, hash) is false for, checked with the node's
+  // stripe locked so an add() cannot slip between check and drop.
+  size_t sweep(function<bool(NodeId, uint64_t)> held);
+  size_t size();
+  void clear();
+
+private:
+  struct Stripe {
+    mutex lock;
+    unordered_map<NodeId, unordered_set<uint64_t>> keys;
+  };
+  Stripe& stripe(NodeId node) {return stripes[node % NODE_KEYS_STRIPES];}
+
+  Stripe stripes[NODE_KEYS_STRIPES];
+};
+
+#endif
@@ -0,0 +1,167 @@
+#include "nodetopology.h"
+#include <pthread.h>
+#include <ctime>
+
+static thread_local uint64_t random_state = 0;
+
+// xorshift64, seeded per thread
+static uint32_t next_random() {
+  if (random_state == 0)
+    random_state = ((uint64_t)pthread_self() * 0x9E3779B97F4A7C15ULL) | 1;
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state >> 32;
+}
+
+NodeTopology::NodeTopology() {
+  for (int i = 0; i < INTERN_MAX_CHUNKS; i++)
+    chunks[i].store(NULL, memory_order_relaxed);
+}
+
+NodeTopology::~NodeTopology() {
+  for (int i = 0; i < INTERN_MAX_CHUNKS; i++)
+    delete[] chunks[i].load(memory_order_relaxed);
+}
+
+NodeTopology::Info* NodeTopology::info(NodeId node, bool create) {
+  if (node == NO_NODE || (node >> INTERN_CHUNK_BITS) >= INTERN_MAX_CHUNKS)
+    return NULL;
+  atomic<Info*>& slot = chunks[node >> INTERN_CHUNK_BITS];
+  Info* chunk = slot.load(memory_order_acquire);
+  if (chunk == NULL) {
+    if (!create)
+      return NULL;
+    lock_guard<mutex> guard(lock);
+    chunk = slot.load(memory_order_relaxed);
+    if (chunk == NULL) {
+      chunk = new Info[INTERN_CHUNK_SIZE];
+      for (int i = 0; i < INTERN_CHUNK_SIZE; i++) {
+        chunk[i].rack.store(0, memory_order_relaxed);
+        chunk[i].host.store(0, memory_order_relaxed);
+        chunk[i].load.store(0, memory_order_relaxed);
+        chunk[i].seen.store(0, memory_order_relaxed);
+      }
+      slot.store(chunk, memory_order_release);
+    }
+  }
+  return &chunk[node & (INTERN_CHUNK_SIZE - 1)];
+}
+
+void NodeTopology::set_labels(NodeId node, const string& rack, const string& host) {
+  Info* i = info(node, true);
+  if (i == NULL)
+    return;
+  if (rack != "")
+    i->rack.store(labels.intern(rack) + 1, memory_order_relaxed);
+  if (host != "")
+    i->host.store(labels.intern(host) + 1, memory_order_relaxed);
+  i->seen.store(time(NULL), memory_order_relaxed);
+}
+
+void NodeTopology::report_load(NodeId node, uint32_t load) {
+  Info* i = info(node, true);
+  if (i == NULL)
+    return;
+  i->load.store(load, memory_order_relaxed);
+  i->seen.store(time(NULL), memory_order_relaxed);
+}
+
+uint32_t NodeTopology::load(NodeId node) {
+  Info* i = info(node, false);
+  return i == NULL ? 0 : i->load.load(memory_order_relaxed);
+}
+
+int NodeTopology::tier(Info* from, NodeId node) {
+  Info* i = info(node, false);
+  if (from == NULL || i == NULL)
+    return 2;
+  uint32_t host = from->host.load(memory_order_relaxed);
+  if (host != 0 && host == i->host.load(memory_order_relaxed))
+    return 0;
+  uint32_t rack = from->rack.load(memory_order_relaxed);
+  if (rack != 0 && rack == i->rack.load(memory_order_relaxed))
+    return 1;
+  return 2;
+}
+
+void NodeTopology::rank(const InlineVector<NodeId, 4>& nodes, NodeId from, const InternTable& names, string& out) {
+  out.clear();
+  if (nodes.empty())
+    return;
+  if (nodes.size() == 1) {
+    out.append(names.name(nodes[0])).push_back(';');
+    return;
+  }
+  Info* me = info(from, false);
+  InlineVector<NodeId, 8> left;
+  InlineVector<int, 8> tiers;
+  for (NodeId n : nodes) {
+    left.push_back(n);
+    tiers.push_back(tier(me, n));
+  }
+  InlineVector<uint32_t, 8> pool;
+  for (int k = 0; k < LOCATION_CHOICES && !left.empty(); k++) {
+    int best = 3;
+    for (int t : tiers)
+      best = t < best ? t : best;
+    pool.clear();
+    for (uint32_t i = 0; i < left.size(); i++)
+      if (tiers[i] == best)
+        pool.push_back(i);
+    uint32_t pick = pool[0];
+    if (pool.size() > 1) {
+      //two distinct draws from the pool, the less loaded one wins
+      uint32_t a = next_random() % pool.size();
+      uint32_t b = (a + 1 + next_random() % (pool.size() - 1)) % pool.size();
+      pick = load(left[pool[a]]) <= load(left[pool[b]]) ? pool[a] : pool[b];
+    }
+    if (k == 0 && (next_random() & (LOAD_SAMPLE - 1)) == 0) {
+      Info* i = info(left[pick], true);
+      if (i != NULL)
+        i->load.fetch_add(LOAD_SAMPLE, memory_order_relaxed);
+    }
+    out.append(names.name(left[pick])).push_back(';');
+    left.erase_at(pick);
+    tiers.erase_at(pick);
+  }
+}
+
+NodeId NodeTopology::idlest(function<bool(NodeId)> skip, const InternTable& names) {
+  int64_t live_since = time(NULL) - NODE_LIVE_SEC;
+  NodeId best = NO_NODE;
+  uint32_t best_load = UINT32_MAX;
+  for (NodeId n = 0; n < names.size(); n++) {
+    Info* i = info(n, false);
+    if (i == NULL || i->seen.load(memory_order_relaxed) < live_since || skip(n))
+      continue;
+    uint32_t l = i->load.load(memory_order_relaxed);
+    if (l < best_load) {
+      best = n;
+      best_load = l;
+    }
+  }
+  if (best != NO_NODE)
+    info(best, false)->load.fetch_add(1, memory_order_relaxed);
+  return best;
+}
+
+void NodeTopology::expire(int64_t now, const InternTable& names, vector<NodeId>& lost) {
+  for (NodeId n = 0; n < names.size(); n++) {
+    Info* i = info(n, false);
+    if (i == NULL)
+      continue;
+    int64_t seen = i->seen.load(memory_order_relaxed);
+    //0 is never polled or already reported
+    if (seen != 0 && seen < now - NODE_LIVE_SEC && i->seen.compare_exchange_strong(seen, 0))
+      lost.push_back(n);
+  }
+}
+
+void NodeTopology::forget(NodeId node) {
+  Info* i = info(node, false);
+  if (i == NULL)
+    return;
+  i->seen.store(0, memory_order_relaxed);
+  i->load.store(0, memory_order_relaxed);
+}
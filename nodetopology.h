@@ -0,0 +1,69 @@
+#ifndef NODETOPOLOGY_H
+#define NODETOPOLOGY_H
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "interntable.h"
+#include "inlinevector.h"
+
+#define LOCATION_CHOICES 3 // replicas a lookup returns at most
+#define NODE_LIVE_SEC 15 // a cache server that has not polled this long is gone
+#define LOAD_SAMPLE 8 // lookups per count of handed out transfers, a power of two
+
+using namespace std;
+
+// Where cache servers sit and how busy they are, by NodeId. Servers report
+// rack and host labels at new_server and their outstanding transfers with
+// every poll; a node without labels only matches itself.
+//
+// rank() orders a key's replicas for a reader: same host, then same rack,
+// then the rest, and within a tier it draws two at random and takes the less
+// loaded one. Loads are only reported every few seconds, so the nodes
+// handed out first count as more transfers until the next report, which
+// keeps a burst of lookups from piling onto the node that was idle. One
+// lookup in LOAD_SAMPLE, drawn at random, adds LOAD_SAMPLE, so the shared
+// counter is not written by every lookup.
+//
+// Lock-free reads; labels and loads are plain atomics, chunks are added
+// under a mutex and never freed.
+class NodeTopology {
+public:
+  NodeTopology();
+  ~NodeTopology();
+  // Empty labels leave the ones already known.
+  void set_labels(NodeId node, const string& rack, const string& host);
+  void report_load(NodeId node, uint32_t load);
+  uint32_t load(NodeId node);
+  // Sets out to "a;b;c;" for at most LOCATION_CHOICES of nodes, best first
+  // for from.
+  void rank(const InlineVector<NodeId, 4>& nodes, NodeId from, const InternTable& names, string& out);
+  // The least loaded live cache server not skipped, or NO_NODE. It counts
+  // one more transfer for the node it returns.
+  NodeId idlest(function<bool(NodeId)> skip, const InternTable& names);
+  // Failure detector over the poll heartbeats: appends the cache servers
+  // that have polled before but not within NODE_LIVE_SEC of now, once each;
+  // a node that polls again is watched again.
+  void expire(int64_t now, const InternTable& names, vector<NodeId>& lost);
+  // Stops watching node and choosing it, until it polls again.
+  void forget(NodeId node);
+
+private:
+  struct Info {
+    atomic<uint32_t> rack; // label id + 1, 0 when unknown
+    atomic<uint32_t> host;
+    atomic<uint32_t> load;
+    atomic<int64_t> seen; // last report, seconds
+  };
+  Info* info(NodeId node, bool create);
+  int tier(Info* from, NodeId node);
+
+  mutex lock;
+  InternTable labels;
+  atomic<Info*> chunks[INTERN_MAX_CHUNKS];
+};
+
+#endif
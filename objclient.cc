@@ -22,7 +22,7 @@ ObjClient::ObjClient() {
     LOG_ERROR << "pipe failed";
 }
 
-bool ObjClient::fetch(string node, string key) {
+bool ObjClient::fetch(string node, string key, string dir) {
   int conn = get_or_create_sock(node);
   string request = "get|" + key + ";";
   LOG_DEBUG << "Sending msg: " << request;
@@ -65,7 +65,7 @@ bool ObjClient::fetch(string node, string key) {
   char * end;
   uint64_t fsize = strtoull(parts[2].c_str(), &end, 10);
   LOG_DEBUG << "file size is " << fsize; 
-  string fn("/dev/shm/" + parts[1]);
+  string fn(dir + parts[1]);
   int remaining_bytes = read_end - hdr_len;
   LOG_DEBUG << "file " << fn << " remaining_bytes " << remaining_bytes; 
 #if USESENDFILE
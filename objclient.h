@@ -8,7 +8,8 @@ using namespace std;
 class ObjClient {
 public:
   ObjClient();
-  bool fetch(string node, string key);
+  // Copies key from the object server at node into dir.
+  bool fetch(string node, string key, string dir = "/dev/shm/");
   ~ObjClient();
 private:
   map<string, int> obj_client_socks;
@@ -20,15 +20,30 @@
 #include <iosfwd>
 #include <netinet/tcp.h>
 #include <exception>
+#include <atomic>
+#include <poll.h>
 
 #define BUFSIZE 1024 * 1500
 #define STORAGE "/dev/shm/cache/"
 #define min(a,b) (a<b?a:b)
+
+static atomic<int> in_flight(0);
+
+int ObjWorker::transfers() {
+  return in_flight.load(memory_order_relaxed);
+}
 using namespace std;
 
 
 
-ObjWorker::ObjWorker(int socket) : socket(socket) {
+ObjWorker::ObjWorker(int socket)
+  : defer_bodies(false)
+  , socket(socket)
+  , output_sent(0)
+  , sending(NULL)
+  , sending_left(0)
+  , sending_size(0)
+{
   fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
   int yes = 1;
   if (setsockopt(socket, SOL_TCP/*IPPROTO_TCP*/, TCP_NODELAY, &yes, sizeof(int)))
@@ -39,6 +54,11 @@ ObjWorker::ObjWorker(int socket) : socket(socket) {
   remote_ip = get_remote_ip(socket);
 }
 
+ObjWorker::~ObjWorker() {
+  if (sending != NULL)
+    finish_file();
+}
+
 void ObjWorker::exit()
 {
   close(socket);
@@ -69,38 +89,84 @@ string ObjWorker::get_remote_ip(int socket) {
 }
 
 
-int ObjWorker::reply(int socket, const char* msg, int size, int retry, bool silent) {
-  if (!silent)
-    LOG_DEBUG << "Replying(" << remote_ip << "): " << msg;
-  int ret, i;
-  int sent = 0;
-  //int cork = 0;
-  //setsockopt(socket, SOL_TCP, TCP_CORK, &cork, sizeof(cork));
-  int remaining = size;
-  bool keep_retry = retry < 0;
-  for(i = 0; keep_retry || i < retry; i++) {
-    ret = write(socket, msg + sent, remaining);
-    if(ret > 0) {
-      //LOG_DEBUG << "write " << ret << " bytes";
-      sent += ret;
-      remaining -= ret;
-      if (remaining == 0)
-        break;
-    } else {
-      if (errno == EAGAIN)
-        continue;
-      else if (errno == ECONNRESET || errno == EPIPE) {
+void ObjWorker::reply(const string& msg) {
+  LOG_DEBUG << "Replying(" << remote_ip << "): " << msg;
+  output.append(msg);
+  flush();
+}
+
+bool ObjWorker::flush() {
+  while (true) {
+    while (output_sent < output.size()) {
+      int ret = write(socket, output.data() + output_sent, output.size() - output_sent);
+      if (ret > 0) {
+        output_sent += ret;
+      } else if (errno == EAGAIN) {
+        //the loop calls on_writable once the peer has read some
+        return false;
+      } else if (errno == ECONNRESET || errno == EPIPE) {
         LOG_ERROR << "Can't write socket," << std::strerror(errno);
         throw exception();
-      } else
+      } else if (errno != EINTR) {
         LOG_DEBUG << "Can't write socket, ret = " << ret << " error = " << std::strerror(errno);
+      }
+    }
+    output.clear();
+    output_sent = 0;
+    if (sending == NULL)
+      return true;
+    if (sending_left == 0) {
+      finish_file();
+      continue;
     }
+    if (defer_bodies)
+      return true;
+#if USESENDFILE
+    ssize_t sent = sendfile(socket, fileno(sending), NULL, sending_left);
+    if (sent > 0) {
+      sending_left -= sent;
+      LOG_TRACE << "sent " << sent << " left " << sending_left;
+    } else if (sent < 0 && errno == EAGAIN) {
+      return false;
+    } else if (sent == 0 || errno != EINTR) {
+      LOG_ERROR << "sendfile fail, left = " << sending_left << " errno = " << strerror(errno);
+      DIE("send fail");
+    }
+#else
+    //the next chunk goes out through output, whose buffer is reused
+    output.resize(min(BUFSIZE, sending_left));
+    size_t actual_read = fread(&output[0], 1, output.size(), sending);
+    output.resize(actual_read);
+    if (actual_read == 0) {
+      if (ferror(sending) != 0)
+        LOG_DEBUG << "we have an error";
+      LOG_ERROR << "file " << sending_name << " ended " << sending_left << " bytes early";
+      sending_left = 0;
+    }
+    sending_left -= actual_read;
+    LOG_TRACE << "Read " << actual_read << " left " << sending_left;
+#endif
   }
-  if (retry > 0 && i >= retry)
-    LOG_ERROR << "Retried sending for " << i << " times";
-  //cork = 1;
-  //setsockopt(socket, SOL_TCP, TCP_CORK, &cork, sizeof(cork));
-  return sent;
+}
+
+void ObjWorker::body_sent(uint64_t n) {
+  sending_left -= n;
+  if (sending_left == 0)
+    finish_file();
+}
+
+void ObjWorker::finish_file() {
+  struct flock fl;
+  fl.l_type   = F_UNLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start  = 0;
+  fl.l_len    = 0;
+  fl.l_pid    = getpid();
+  fcntl(fileno(sending), F_SETLK, &fl);
+  fclose(sending);
+  sending = NULL;
+  in_flight--;
+  LOG_DEBUG << "Finished sending " << sending_name;
 }
 
 void ObjWorker::handle_get(vector<string> parts){
@@ -112,99 +178,32 @@ void ObjWorker::handle_get(vector<string> parts){
   struct stat fileStat;
   if(stat(fn.c_str() ,&fileStat) != 0) {
     LOG_ERROR << "Failed to open file " << fn << ", err " << strerror(errno);
-    string response = "get_fail|" + parts[1] + ";";
-    reply(socket, response.c_str(), response.size());
-  } else {
-    LOG_DEBUG << "Found file " << fn;
-    string response("get_success|" + fn.substr(strlen(STORAGE)) + "|" + to_string(fileStat.st_size) + ";");
-    reply(socket, response.c_str(), response.size());
-#if USESENDFILE
-    int shm_file = open(fn.c_str(), O_RDONLY);
-    if (shm_file < 0)
-      LOG_ERROR << "failed to open file, errno " << strerror(errno);
-    int sent;
-    uint64_t total_sent = 0;
-    while (total_sent < fileStat.st_size) {
-      sent = sendfile(socket, shm_file, NULL, fileStat.st_size - total_sent);
-      if(sent >= 0) {
-        total_sent += sent;
-        LOG_TRACE << "sent " << sent << " total_sent " << total_sent;
-      }
-      else if (errno == EINTR || errno == EAGAIN) {
-        //LOG_ERROR << "send error, sent = " << sent << " errno " << strerror(errno);
-        continue;
-      } else {
-        LOG_ERROR << "Sent = " << sent << " errno = " << strerror(errno);
-        break;
-      }
-    }
-    if (total_sent != fileStat.st_size) {
-      LOG_ERROR << "sendfile fail, total_sent = " << total_sent << " fsize " << fileStat.st_size;
-      DIE("send fail");
-    }
-    LOG_DEBUG << "Sent " << total_sent << " bytes to client";
-    close(shm_file);
-#else
-    //char* shm = mmap(0, fileStat.st_size, PROT_READ, MAP_SHARED, shm_fd, 0);
-    //int fd = open(fn.c_str(), O_RDONLY | O_DIRECT);
-    //LOG_DEBUG << "file opened" << fd << strerror(errno);
-    FILE* shm_file = fopen(fn.c_str(), "rb");
-    int shm_fd = fileno(shm_file);
-    //assert(shm_fd == fd);
-    //int shm_file = open(fn.c_str(), O_RDONLY);
-    LOG_DEBUG << "Locking file " << fn;
-    //flock(shm_fd, LOCK_SH);
-    struct flock fl;
-    fl.l_type   = F_RDLCK;  /* F_RDLCK, F_WRLCK, F_UNLCK    */
-    fl.l_whence = SEEK_SET; /* SEEK_SET, SEEK_CUR, SEEK_END */
-    fl.l_start  = 0;        /* Offset from l_whence         */
-    fl.l_len    = 0;        /* length, 0 = to EOF           */
-    fl.l_pid    = getpid(); /* our PID                      */
-    fcntl(shm_fd, F_SETLKW, &fl);
-
-    char readBuf[BUFSIZE];
-    uint64_t total_read = 0;
-    size_t actual_read;
-
-    /*
-    fseek(shm_file, 0L, SEEK_END);
-    int ftell_size = ftell(shm_file);
-    rewind(shm_file);
-    LOG_DEBUG << "statsize: " << fileStat.st_size << " ftell size: " << ftell_size;
+    reply("get_fail|" + parts[1] + ";");
+    return;
+  }
+  LOG_DEBUG << "Found file " << fn;
+  FILE* shm_file = fopen(fn.c_str(), "rb");
+  if (shm_file == NULL) {
+    LOG_ERROR << "Failed to open file " << fn << ", err " << strerror(errno);
+    reply("get_fail|" + parts[1] + ";");
+    return;
+  }
+  LOG_DEBUG << "Locking file " << fn;
+  struct flock fl;
+  fl.l_type   = F_RDLCK;  /* F_RDLCK, F_WRLCK, F_UNLCK    */
+  fl.l_whence = SEEK_SET; /* SEEK_SET, SEEK_CUR, SEEK_END */
+  fl.l_start  = 0;        /* Offset from l_whence         */
+  fl.l_len    = 0;        /* length, 0 = to EOF           */
+  fl.l_pid    = getpid(); /* our PID                      */
+  fcntl(fileno(shm_file), F_SETLKW, &fl);
 
-    struct stat fileStat2;
-    if(stat(fn.c_str() ,&fileStat2) != 0) {
-      LOG_DEBUG << "failed to stat";
-    }
-    LOG_DEBUG << "statsize after lock: " << fileStat2.st_size;
-    */
-    while(true) {
-    //while(total_read < fileStat.st_size) {
-      //actual_read = shm_file.read(readBuf, BUFSIZE).gcount();
-      //actual_read = fread(shm_file, readBuf, BUFSIZE);
-      actual_read = fread(readBuf, 1, BUFSIZE, shm_file);
-      if(actual_read == 0) {
-        if (ferror(shm_file) != 0)
-          LOG_DEBUG << "we have an error";
-        break;
-      }
-      total_read += actual_read;
-      //LOG_DEBUG << fn << " sending " << actual_read << " bytes";
-      int actual_sent = reply(socket, readBuf, actual_read, -1, true);
-      if (actual_sent != actual_read)
-        LOG_ERROR << "Error: Actual sent = " << actual_sent << " Actual read = " << actual_read;
-      LOG_TRACE << "Read " << actual_read << " Sent " << actual_sent << " Total Read " << total_read;
-      if(total_read == fileStat.st_size)
-        break;//needed with st_size is a multiple of BUFSIZE
-    }
-    if(total_read != fileStat.st_size)
-      LOG_ERROR << "total_read != fileStat.st_size " << total_read << " " << fileStat.st_size;
-    fl.l_type   = F_UNLCK;
-    fcntl(shm_fd, F_SETLK, &fl);
-    fclose(shm_file);
-    LOG_DEBUG << "Finished sending " << fn << " totalbytes: " << total_read; 
-#endif
-  } 
+  //the body is sent by flush, as fast as the peer reads it
+  in_flight++;
+  sending = shm_file;
+  sending_name = fn;
+  sending_left = fileStat.st_size;
+  sending_size = fileStat.st_size;
+  reply("get_success|" + fn.substr(strlen(STORAGE)) + "|" + to_string(fileStat.st_size) + ";");
 }
 
 
@@ -245,15 +244,20 @@ void ObjWorker::handle_put(vector<string> parts, char* remaining_start, int rema
     shm_file.close();
     LOG_DEBUG << "Done receiving key " << fn << " size " << rsize;    
   }
-  string response("put_success|" + parts[1] + ";");
-  reply(socket, response.c_str(), response.size());
+  reply("put_success|" + parts[1] + ";");
 
 }
 
+void ObjWorker::on_writable() {
+  if (flush())
+    handle_msg();
+}
+
 void ObjWorker::handle_msg() {
   char buffer[1024];
   int read_size;
-  while ((read_size = read(socket, buffer, sizeof(buffer))) > 0) {
+  //requests wait in the socket while a reply is still going out
+  while (sending == NULL && output.empty() && (read_size = read(socket, buffer, sizeof(buffer))) > 0) {
     for (int i = 0; i < read_size; ++i) {
       if (buffer[i] == ';') {
         buffer[i] = '\0';
@@ -277,6 +281,11 @@ void ObjWorker::run() {
   try{
     while (true) {
       handle_msg();
+      //this thread serves no one else, so it waits out a slow reader
+      while (!flush()) {
+        struct pollfd p = {socket, POLLOUT, 0};
+        poll(&p, 1, 100);
+      }
     }
   } catch (exception& e) {
     LOG_ERROR << "Caught exception";
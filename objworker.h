@@ -3,6 +3,8 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <stdio.h>
+#include <stdint.h>
 
 using namespace std;
 
@@ -11,9 +13,28 @@ class ObjWorker
 {
 public:
   ObjWorker(int socket);
+  ~ObjWorker();
   void run();
   static void *pthread_helper(void * worker);
   void handle_msg();
+  // The socket has room again: goes on with the reply it could not finish
+  // and then with the requests that came in meanwhile.
+  void on_writable();
+  // Sends queued bytes and the rest of the file being sent until done,
+  // true, or until the socket is full, false.
+  bool flush();
+
+  // Set by a completion-based loop (UringWorker) that sends file bodies
+  // itself: flush() then stops after the reply header, and the loop sends
+  // body_left() bytes of body_fd() from body_offset(), reporting them with
+  // body_sent(), which closes the file after the last one.
+  bool defer_bodies;
+  int body_fd() { return sending == NULL ? -1 : fileno(sending); }
+  uint64_t body_left() { return sending_left; }
+  uint64_t body_offset() { return sending_size - sending_left; }
+  void body_sent(uint64_t n);
+  // Files being sent to peers right now, the load reported to the masters.
+  static int transfers();
 
 protected:
   void exit();
@@ -21,7 +42,15 @@ protected:
   string remote_ip;
 private:
   ObjWorker(const ObjWorker &); // No copies!
-  int reply(int socket, const char* msg, int size, int retry = 1, bool silent = false);
+  // Queues msg behind what is being sent and sends as much as fits.
+  void reply(const string& msg);
+  void finish_file();
+  string output;       // queued bytes, output_sent of them written
+  size_t output_sent;
+  FILE* sending;       // the file of a get in progress, NULL when none
+  string sending_name;
+  uint64_t sending_left;
+  uint64_t sending_size;
   void handle_get(vector<string> parts);
   void handle_put(vector<string> parts, char* remaining_start, int remaining_size);
   string get_remote_ip(int socket);
@@ -0,0 +1,144 @@
+#include "prefixindex.h"
+
+PrefixIndex::PrefixIndex() : root(new Node(true)), count(0) {
+}
+
+PrefixIndex::~PrefixIndex() {
+  destroy(root);
+}
+
+void PrefixIndex::destroy(Node* node) {
+  for (Node* child : node->children)
+    destroy(child);
+  delete node;
+}
+
+void PrefixIndex::clear() {
+  destroy(root);
+  root = new Node(true);
+  count = 0;
+}
+
+PrefixIndex::Node* PrefixIndex::leaf_for(const string& key) {
+  Node* node = root;
+  while (!node->leaf)
+    node = node->children[upper_bound(node->keys.begin(), node->keys.end(), key) - node->keys.begin()];
+  return node;
+}
+
+bool PrefixIndex::insert(const string& key) {
+  string separator;
+  bool added = false;
+  Node* right = insert(root, key, separator, added);
+  if (right != NULL) {
+    Node* top = new Node(false);
+    top->keys.push_back(separator);
+    top->children.push_back(root);
+    top->children.push_back(right);
+    root = top;
+  }
+  if (added)
+    count++;
+  return added;
+}
+
+// Returns the new right sibling when node split, with its smallest key in
+// separator.
+PrefixIndex::Node* PrefixIndex::insert(Node* node, const string& key, string& separator, bool& added) {
+  if (node->leaf) {
+    auto pos = lower_bound(node->keys.begin(), node->keys.end(), key);
+    if (pos != node->keys.end() && *pos == key)
+      return NULL;
+    node->keys.insert(pos, key);
+    added = true;
+    if (node->keys.size() <= PREFIX_INDEX_FANOUT)
+      return NULL;
+    Node* right = new Node(true);
+    size_t half = node->keys.size() / 2;
+    right->keys.assign(node->keys.begin() + half, node->keys.end());
+    node->keys.resize(half);
+    right->prev = node;
+    right->next = node->next;
+    if (node->next != NULL)
+      node->next->prev = right;
+    node->next = right;
+    separator = right->keys[0];
+    return right;
+  }
+  size_t i = upper_bound(node->keys.begin(), node->keys.end(), key) - node->keys.begin();
+  string child_separator;
+  Node* split = insert(node->children[i], key, child_separator, added);
+  if (split == NULL)
+    return NULL;
+  node->keys.insert(node->keys.begin() + i, child_separator);
+  node->children.insert(node->children.begin() + i + 1, split);
+  if (node->children.size() <= PREFIX_INDEX_FANOUT)
+    return NULL;
+  //the middle separator moves up, the halves keep the ones around it
+  Node* right = new Node(false);
+  size_t mid = node->keys.size() / 2;
+  separator = node->keys[mid];
+  right->keys.assign(node->keys.begin() + mid + 1, node->keys.end());
+  right->children.assign(node->children.begin() + mid + 1, node->children.end());
+  node->keys.resize(mid);
+  node->children.resize(mid + 1);
+  return right;
+}
+
+bool PrefixIndex::erase(const string& key) {
+  bool empty = false;
+  if (!erase(root, key, empty))
+    return false;
+  count--;
+  if (empty) {
+    //only an inner root can run out of children
+    if (!root->leaf) {
+      delete root;
+      root = new Node(true);
+    }
+  } else {
+    while (!root->leaf && root->children.size() == 1) {
+      Node* only = root->children[0];
+      delete root;
+      root = only;
+    }
+  }
+  return true;
+}
+
+// Sets empty when node has nothing left and the caller should free it.
+bool PrefixIndex::erase(Node* node, const string& key, bool& empty) {
+  if (node->leaf) {
+    auto pos = lower_bound(node->keys.begin(), node->keys.end(), key);
+    if (pos == node->keys.end() || *pos != key)
+      return false;
+    node->keys.erase(pos);
+    empty = node->keys.empty();
+    return true;
+  }
+  size_t i = upper_bound(node->keys.begin(), node->keys.end(), key) - node->keys.begin();
+  bool child_empty = false;
+  if (!erase(node->children[i], key, child_empty))
+    return false;
+  if (child_empty) {
+    Node* child = node->children[i];
+    if (child->leaf)
+      unlink(child);
+    delete child;
+    node->children.erase(node->children.begin() + i);
+    //drop the separator on the side of the gone child
+    if (i > 0)
+      node->keys.erase(node->keys.begin() + i - 1);
+    else if (!node->keys.empty())
+      node->keys.erase(node->keys.begin());
+  }
+  empty = node->children.empty();
+  return true;
+}
+
+void PrefixIndex::unlink(Node* leaf) {
+  if (leaf->prev != NULL)
+    leaf->prev->next = leaf->next;
+  if (leaf->next != NULL)
+    leaf->next->prev = leaf->prev;
+}
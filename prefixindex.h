@@ -0,0 +1,75 @@
+#ifndef PREFIXINDEX_H
+#define PREFIXINDEX_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define PREFIX_INDEX_FANOUT 64
+
+using namespace std;
+
+// Ordered set of key names, a B+-tree with up to PREFIX_INDEX_FANOUT keys a
+// leaf and children an inner node. Leaves are chained both ways so a prefix
+// scan descends once and then walks the leaves.
+//
+// Erase frees leaves that run empty, and inner nodes with them, but does not
+// merge underfull siblings: key sets here shrink by whole prefixes, which
+// empties leaves rather than thinning them.
+//
+// Not thread safe, MasterRegistry guards it with index_lock.
+class PrefixIndex {
+public:
+  PrefixIndex();
+  ~PrefixIndex();
+  // False if key was already there.
+  bool insert(const string& key);
+  // False if key was not there.
+  bool erase(const string& key);
+  void clear();
+  size_t size() {return count;}
+
+  // Calls f(key) in order on the keys that start with prefix and sort after
+  // after ("" for the first one), until f returns false.
+  template <typename F>
+  void scan(const string& prefix, const string& after, F f);
+
+private:
+  struct Node {
+    Node(bool leaf) : leaf(leaf), prev(NULL), next(NULL) {}
+    bool leaf;
+    // leaf: the keys; inner: keys[i] is the smallest key under children[i + 1]
+    vector<string> keys;
+    vector<Node*> children;
+    Node* prev; // leaves only
+    Node* next;
+  };
+  Node* insert(Node* node, const string& key, string& separator, bool& added);
+  bool erase(Node* node, const string& key, bool& empty);
+  void unlink(Node* leaf);
+  void destroy(Node* node);
+  Node* leaf_for(const string& key);
+
+  Node* root;
+  size_t count;
+};
+
+template <typename F>
+void PrefixIndex::scan(const string& prefix, const string& after, F f) {
+  const string& start = after > prefix ? after : prefix;
+  Node* leaf = leaf_for(start);
+  size_t i = lower_bound(leaf->keys.begin(), leaf->keys.end(), start) - leaf->keys.begin();
+  for (; leaf != NULL; leaf = leaf->next, i = 0) {
+    for (; i < leaf->keys.size(); i++) {
+      const string& key = leaf->keys[i];
+      if (key.compare(0, prefix.size(), prefix) != 0)
+        return;
+      if (!after.empty() && key == after)
+        continue;
+      if (!f(key))
+        return;
+    }
+  }
+}
+
+#endif
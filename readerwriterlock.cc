@@ -1,27 +1,74 @@
 #include "readerwriterlock.h"
 #include "log.h"
-#include <boost/algorithm/string.hpp>
 #include <vector>
+#include <algorithm>
+#include <atomic>
 
-ReaderWriterLock::ReaderWriterLock() : seq_num(0) {
+static atomic<uint64_t> next_lease(1);
+
+ReaderWriterLock::ReaderWriterLock() : closed(false), seq_num(0) {
+}
+
+Owner* ReaderWriterLock::find_owner(Holder h) {
+  return owners.find_if([h](const Owner& o) { return o.holder == h; });
+}
+
+uint64_t ReaderWriterLock::add_owner(Holder h, int max_duration) {
+  Owner o = {h, chrono::system_clock::now() + chrono::seconds(max_duration), next_lease++};
+  owners.push_back(o);
+  return o.lease;
 }
 
-string ReaderWriterLock::reader_lock(string reader, int max_duration, uint lambda_seq, bool snap_iso) {
+static void set_commit(Commit* commit, uint version, Holder holder) {
+  if (commit != NULL) {
+    commit->recorded = true;
+    commit->version = version;
+    commit->holder = holder;
+  }
+}
+
+void ReaderWriterLock::release_reader(Owner* o, bool record_location, Commit* commit) {
+  Holder reader = o->holder;
+  owners.erase_at(o - owners.begin());
+  if (record_location) {
+    version_locations[seq_num].push_back(reader);
+    set_commit(commit, seq_num, reader);
+  }
+}
+
+void ReaderWriterLock::release_writer(Owner* o, Commit* commit) {
+  Holder writer = o->holder;
+  owners.erase_at(o - owners.begin());
+  version_history.push_back(seq_num);
+  HolderList v;
+  v.push_back(writer);
+  version_locations[seq_num] = v;
+  set_commit(commit, seq_num, writer);
+}
+
+string ReaderWriterLock::try_reader(Holder reader, int max_duration, uint lambda_seq, bool snap_iso, uint64_t* lease, uint* version) {
   string ret = "fail";
-  lock.lock();
-  LOG_DEBUG << "reader " << reader << " num owner = " << owners.size() << " write = " << write_mode;
+  LOG_DEBUG << "reader " << reader.node << "@lambda" << reader.lambda << " num owner = " << owners.size() << " write = " << write_mode;
   if (owners.size() == 0) {
     if (!snap_iso || lambda_seq >= seq_num) {
-      owners[reader] = chrono::system_clock::now() + chrono::seconds(max_duration);
+      uint64_t id = add_owner(reader, max_duration);
+      if (lease != NULL)
+        *lease = id;
+      if (version != NULL)
+        *version = seq_num;
       write_mode = false;
       ret = "success";
     } else {
       ret = "exception: key_seq_num_err";
     }
   } else if (!write_mode) {
-    if (owners.find(reader) == owners.end()) {
+    if (find_owner(reader) == NULL) {
       if (!snap_iso || lambda_seq >= seq_num) {
-        owners[reader] = chrono::system_clock::now() + chrono::seconds(max_duration);
+        uint64_t id = add_owner(reader, max_duration);
+        if (lease != NULL)
+          *lease = id;
+        if (version != NULL)
+          *version = seq_num;
         ret = "success";
       } else {
         ret = "exception: key_seq_num_err";
@@ -30,141 +77,385 @@ string ReaderWriterLock::reader_lock(string reader, int max_duration, uint lambd
       ret = "exception: you already have the lock";
     }
   }
-  lock.unlock();
   return ret;
 }
 
-string ReaderWriterLock::reader_unlock(string reader) {
+string ReaderWriterLock::try_writer(Holder writer, int max_duration, uint lambda_seq, bool snap_iso, uint64_t* lease, uint* version) {
   string ret = "fail";
-  lock.lock();
-  LOG_DEBUG << "reader " << reader << " num owner = " << owners.size() << " write = " << write_mode;
+  LOG_DEBUG << "writer " << writer.node << "@lambda" << writer.lambda << " num owner = " << owners.size() << " write = " << write_mode << " seq_num = " << seq_num << " lambda_seq = " << lambda_seq;
   if (owners.size() == 0) {
-    LOG_DEBUG << reader << " attempts to unlock, but owner.size() == 0";
-    ret = "exception: empty owner list";
-  } else if (write_mode) {
-    LOG_DEBUG << reader << " attempts to unlock, but the lock is in write mode";
-    ret = "exception: lock in write mode";
-  } else if (owners.find(reader) == owners.end()) {
-    LOG_DEBUG << reader << " attempts to unlock, but could not find reader";
-    ret = "exception: can't find reader";
-  } else {
-    owners.erase(reader);
-    version_locations[seq_num].push_back(reader);
-    ret = "success";
+    if (!snap_iso || lambda_seq >= seq_num) {
+      uint64_t id = add_owner(writer, max_duration);
+      if (lease != NULL)
+        *lease = id;
+      if (version != NULL)
+        *version = version_history.empty() ? 0 : version_history.back();
+      write_mode = true;
+      seq_num = lambda_seq;
+      ret = "success";
+    } else {
+      ret = "exception: key_seq_num_err";
+    }
+  }
+  return ret;
+}
+
+string ReaderWriterLock::reader_lock(Holder reader, int max_duration, uint lambda_seq, bool snap_iso, uint64_t* lease, uint* version) {
+  lock.lock();
+  //queued waiters go first
+  string ret = waiters.empty() ? try_reader(reader, max_duration, lambda_seq, snap_iso, lease, version) : "fail";
+  lock.unlock();
+  return ret;
+}
+
+string ReaderWriterLock::writer_lock(Holder writer, int max_duration, uint lambda_seq, bool snap_iso, uint64_t* lease, uint* version) {
+  lock.lock();
+  string ret = waiters.empty() ? try_writer(writer, max_duration, lambda_seq, snap_iso, lease, version) : "fail";
+  lock.unlock();
+  return ret;
+}
+
+string ReaderWriterLock::lock_or_wait(const Waiter& w, uint64_t* lease, uint* version) {
+  lock.lock();
+  string ret = "fail";
+  if (closed) {
+    lock.unlock();
+    return ret;
+  }
+  if (waiters.empty()) {
+    if (w.write)
+      ret = try_writer(w.holder, w.max_duration, w.lambda_seq, w.snap_iso, lease, version);
+    else
+      ret = try_reader(w.holder, w.max_duration, w.lambda_seq, w.snap_iso, lease, version);
+  }
+  if (ret == "fail") {
+    LOG_DEBUG << "lambda" << w.holder.lambda << " queued behind " << waiters.size() << " waiters";
+    waiters.push_back(w);
+    ret = "wait";
   }
   lock.unlock();
   return ret;
 }
 
-string ReaderWriterLock::writer_lock(string writer, int max_duration, uint lambda_seq, bool snap_iso) {
+void ReaderWriterLock::wake(vector<Grant>& granted) {
+  while (!waiters.empty()) {
+    Waiter& w = waiters.front();
+    if (!w.alive()) {
+      waiters.pop_front();
+      continue;
+    }
+    Grant g = {w, "", 0, 0};
+    if (w.write)
+      g.ret = try_writer(w.holder, w.max_duration, w.lambda_seq, w.snap_iso, &g.lease, &g.version);
+    else
+      g.ret = try_reader(w.holder, w.max_duration, w.lambda_seq, w.snap_iso, &g.lease, &g.version);
+    if (g.ret == "fail")
+      break;
+    granted.push_back(g);
+    waiters.pop_front();
+  }
+}
+
+void ReaderWriterLock::notify(vector<Grant>& granted) {
+  for (auto& g : granted)
+    g.waiter.on_grant(g.ret, g.lease, g.version);
+}
+
+void ReaderWriterLock::close_waiters() {
+  lock.lock();
+  closed = true;
+  vector<Grant> cancelled;
+  for (auto& w : waiters) {
+    Grant g = {w, "fail", 0, 0};
+    cancelled.push_back(g);
+  }
+  waiters.clear();
+  lock.unlock();
+  notify(cancelled);
+}
+
+string ReaderWriterLock::reader_unlock(Holder reader, Commit* commit) {
   string ret = "fail";
+  vector<Grant> granted;
   lock.lock();
-  LOG_DEBUG << "writer " << writer << " num owner = " << owners.size() << " write = " << write_mode << " seq_num = " << seq_num << " lambda_seq = " << lambda_seq;
+  LOG_DEBUG << "reader " << reader.node << "@lambda" << reader.lambda << " num owner = " << owners.size() << " write = " << write_mode;
   if (owners.size() == 0) {
-    if (!snap_iso || lambda_seq >= seq_num) {
-      owners[writer] = chrono::system_clock::now() + chrono::seconds(max_duration);
-      write_mode = true;
-      seq_num = lambda_seq;
-      ret = "success";
-    } else {
-      ret = "exception: key_seq_num_err";
-    }
+    LOG_DEBUG << "lambda" << reader.lambda << " attempts to unlock, but owner.size() == 0";
+    ret = "exception: empty owner list";
+  } else if (write_mode) {
+    LOG_DEBUG << "lambda" << reader.lambda << " attempts to unlock, but the lock is in write mode";
+    ret = "exception: lock in write mode";
+  } else if (find_owner(reader) == NULL) {
+    LOG_DEBUG << "lambda" << reader.lambda << " attempts to unlock, but could not find reader";
+    ret = "exception: can't find reader";
+  } else {
+    release_reader(find_owner(reader), true, commit);
+    wake(granted);
+    ret = "success";
   }
   lock.unlock();
+  notify(granted);
   return ret;
 }
 
-string ReaderWriterLock::writer_unlock(string writer) {
+string ReaderWriterLock::writer_unlock(Holder writer, Commit* commit) {
   string ret = "fail";
+  vector<Grant> granted;
   lock.lock();
-  LOG_DEBUG << "writer " << writer << " num owner = " << owners.size() << " write = " << write_mode;
+  LOG_DEBUG << "writer " << writer.node << "@lambda" << writer.lambda << " num owner = " << owners.size() << " write = " << write_mode;
   if (owners.size() == 0) {
-    LOG_DEBUG << writer << " attempts to unlock, but owner.size() == 0";
+    LOG_DEBUG << "lambda" << writer.lambda << " attempts to unlock, but owner.size() == 0";
     ret = "exception: empty owner list";
   } else if (!write_mode) {
-    LOG_DEBUG << writer << " attempts to unlock, but the lock is in read mode";
+    LOG_DEBUG << "lambda" << writer.lambda << " attempts to unlock, but the lock is in read mode";
     ret = "exception: lock in read mode";
-  } else if (owners.find(writer) == owners.end()) {
-    LOG_DEBUG << writer << " attempts to unlock, but could not find writer";
+  } else if (find_owner(writer) == NULL) {
+    LOG_DEBUG << "lambda" << writer.lambda << " attempts to unlock, but could not find writer";
     ret = "exception: can't find writer";
   } else {
-    owners.erase(writer);
-    version_history.push_back(seq_num);
-    vector<string> v;
-    v.push_back(writer);
-    version_locations[seq_num] = v;
+    release_writer(find_owner(writer), commit);
+    wake(granted);
     ret = "success";
   }
   lock.unlock();
+  notify(granted);
   return ret;
 }
 
+bool ReaderWriterLock::expire(Holder h, uint64_t lease, Commit* commit) {
+  bool expired = false;
+  vector<Grant> granted;
+  lock.lock();
+  Owner* o = find_owner(h);
+  if (o != NULL && o->lease == lease) {
+    LOG_DEBUG << (write_mode ? "writer " : "reader ") << h.node << "@lambda" << h.lambda << " lease " << lease << " expired";
+    if (write_mode)
+      release_writer(o, commit);
+    else
+      release_reader(o, false, commit);
+    wake(granted);
+    expired = true;
+  }
+  lock.unlock();
+  notify(granted);
+  return expired;
+}
 
-
-string ReaderWriterLock::get_locations(uint version) {
+string ReaderWriterLock::get_locations(uint version, const InternTable& nodes) {
   string ret = "";
   int count = 0;
-  for (auto l : version_locations[version]){
-    ret += l + ";";
-    count += 1;
-    if(count > 3)
-      break;
+  lock.lock_shared();
+  auto it = version_locations.find(version);
+  if (it != version_locations.end()) {
+    for (auto& h : it->second) {
+      ret += nodes.name(h.node) + "@lambda" + to_string(h.lambda) + ";";
+      count += 1;
+      if(count > 3)
+        break;
+    }
   }
+  lock.unlock_shared();
   LOG_DEBUG << "returning " << ret;
   return ret;
 }
 
-string ReaderWriterLock::get_locations_with_from(uint version, string from) {
-  string ret = "";
-  vector<string> parts;
-  int count = 0;
-  for (auto l : version_locations[version]) {
-    LOG_DEBUG << "location " << l;
-    boost::split(parts, l, boost::is_any_of("@"));
-    if (parts[0] == from)
-      return "use_local";
-    ret += parts[0] + ";";
-    count += 1;
-    if (count > 3)
-      break;
+string ReaderWriterLock::get_locations_with_from(uint version, NodeId from, NodeTopology& topology, const InternTable& nodes) {
+  InlineVector<NodeId, 4> holders;
+  lock.lock_shared();
+  auto it = version_locations.find(version);
+  if (it != version_locations.end()) {
+    for (auto& h : it->second) {
+      NodeId n = h.node;
+      if (n != NO_NODE && holders.find_if([n](NodeId x) { return x == n; }) == NULL)
+        holders.push_back(n);
+    }
   }
+  lock.unlock_shared();
+  string ret;
+  if (holders.find_if([from](NodeId x) { return x == from; }) != NULL)
+    ret = "use_local";
+  else
+    topology.rank(holders, from, nodes, ret);
   LOG_DEBUG << "returning " << ret;
   return ret;
 }
 
-string ReaderWriterLock::update_version_location(uint version, string location) {
+string ReaderWriterLock::update_version_location(uint version, Holder location, uint64_t* lease, Commit* commit) {
   string ret = "success";
   lock.lock();
   if (version == seq_num) {
     //assert(write_mode);
     owners.clear();
-    owners[location] = chrono::system_clock::now() + chrono::seconds(1000);
+    uint64_t id = add_owner(location, 1000);
+    if (lease != NULL)
+      *lease = id;
   } else if (version < seq_num) {
     version_locations[seq_num].clear();
     version_locations[seq_num].push_back(location);
+    set_commit(commit, seq_num, location);
   } else {
-    LOG_DEBUG << "version " << version << " seq_num " << seq_num << " location " << location;
+    LOG_DEBUG << "version " << version << " seq_num " << seq_num << " location " << location.node << "@lambda" << location.lambda;
     //assert(false);
   }
   lock.unlock();
   return ret;
 }
 
-string ReaderWriterLock::force_release_lock() {
+int ReaderWriterLock::collect(uint watermark, vector<ReclaimedVersion>& reclaimed) {
+  int count = 0;
+  lock.lock();
+  uint latest = version_history.empty() ? seq_num : version_history.back();
+  for (auto it = version_locations.begin(); it != version_locations.end() && it->first < watermark; ) {
+    if (it->first == latest || it->first == seq_num) {
+      it++;
+      continue;
+    }
+    ReclaimedVersion rv = {it->first, it->second};
+    reclaimed.push_back(rv);
+    it = version_locations.erase(it);
+    count++;
+  }
+  if (count > 0) {
+    size_t kept = 0;
+    for (uint v : version_history)
+      if (v >= watermark || v == latest || v == seq_num)
+        version_history[kept++] = v;
+    version_history.resize(kept);
+    LOG_DEBUG << "collected " << count << " versions below " << watermark;
+  }
+  lock.unlock();
+  return count;
+}
+
+void ReaderWriterLock::live_versions(vector<uint>& out) {
+  lock.lock_shared();
+  for (auto& v : version_locations)
+    out.push_back(v.first);
+  out.push_back(seq_num);
+  lock.unlock_shared();
+}
+
+bool ReaderWriterLock::held_by(NodeId node) {
+  bool held = false;
+  lock.lock_shared();
+  for (auto& v : version_locations)
+    for (auto& h : v.second)
+      held = held || h.node == node;
+  lock.unlock_shared();
+  return held;
+}
+
+void ReaderWriterLock::holder_nodes(vector<NodeId>& out) {
+  lock.lock_shared();
+  for (auto& v : version_locations)
+    for (auto& h : v.second)
+      if (h.node != NO_NODE && find(out.begin(), out.end(), h.node) == out.end())
+        out.push_back(h.node);
+  lock.unlock_shared();
+}
+
+int ReaderWriterLock::forget_node(NodeId node) {
+  int count = 0;
+  lock.lock();
+  for (auto& v : version_locations) {
+    //versions left without holders stay, as a version nobody caches
+    for (uint32_t i = v.second.size(); i-- > 0; ) {
+      if (v.second[i].node == node) {
+        v.second.erase_at(i);
+        count++;
+      }
+    }
+  }
+  lock.unlock();
+  return count;
+}
+
+string ReaderWriterLock::force_release_lock(Commit* commit) {
   LOG_DEBUG << "force release lock";
   lock.lock();
   if (write_mode) {
     if( owners.size() > 0) {
       version_history.push_back(seq_num);
-      vector<string> v;
-      v.push_back(owners.begin()->first);
+      HolderList v;
+      v.push_back(owners.front().holder);
       version_locations[seq_num] = v;
-      LOG_DEBUG << "owner " << owners.begin()->first << " pushed to history";
+      set_commit(commit, seq_num, owners.front().holder);
+      LOG_DEBUG << "owner lambda" << owners.front().holder.lambda << " pushed to history";
     } else {
       LOG_DEBUG << "owner empty";
     }
   }
   owners.clear();
-  lock.unlock(); 
+  vector<Grant> granted;
+  wake(granted);
+  lock.unlock();
+  notify(granted);
   return "success";
 }
+
+void ReaderWriterLock::restore_write(uint version, Holder writer) {
+  lock.lock();
+  seq_num = version;
+  if (find(version_history.begin(), version_history.end(), version) == version_history.end())
+    version_history.push_back(version);
+  HolderList v;
+  v.push_back(writer);
+  version_locations[version] = v;
+  lock.unlock();
+}
+
+void ReaderWriterLock::restore_read(uint version, Holder reader) {
+  lock.lock();
+  HolderList& v = version_locations[version];
+  if (v.find_if([reader](const Holder& h) { return h == reader; }) == NULL)
+    v.push_back(reader);
+  lock.unlock();
+}
+
+void ReaderWriterLock::restore_location(uint version, Holder location) {
+  lock.lock();
+  HolderList v;
+  v.push_back(location);
+  version_locations[version] = v;
+  lock.unlock();
+}
+
+void ReaderWriterLock::save(BinaryWriter& out) {
+  lock.lock_shared();
+  out.put_u32(seq_num);
+  out.put_u32(version_history.size());
+  for (uint v : version_history)
+    out.put_u32(v);
+  out.put_u32(version_locations.size());
+  for (auto& vl : version_locations) {
+    out.put_u32(vl.first);
+    out.put_u32(vl.second.size());
+    for (auto& h : vl.second) {
+      out.put_u32(h.node);
+      out.put_u32(h.lambda);
+    }
+  }
+  lock.unlock_shared();
+}
+
+bool ReaderWriterLock::load(BinaryReader& in, const vector<NodeId>& node_map) {
+  lock.lock();
+  seq_num = in.get_u32();
+  uint n = in.get_u32();
+  for (uint i = 0; i < n && in.good(); i++)
+    version_history.push_back(in.get_u32());
+  n = in.get_u32();
+  for (uint i = 0; i < n && in.good(); i++) {
+    HolderList& v = version_locations[in.get_u32()];
+    uint m = in.get_u32();
+    for (uint j = 0; j < m && in.good(); j++) {
+      Holder h;
+      h.node = in.get_u32();
+      h.node = h.node < node_map.size() ? node_map[h.node] : NO_NODE;
+      h.lambda = in.get_u32();
+      v.push_back(h);
+    }
+  }
+  lock.unlock();
+  return in.good();
+}
@@ -5,31 +5,131 @@
 #include <ctime>
 #include <string>
 #include <map>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <stdint.h>
 #include <mutex>
 #include <boost/thread.hpp>
 #include <boost/thread/shared_mutex.hpp>
+#include "inlinevector.h"
+#include "interntable.h"
+#include "nodetopology.h"
+#include "binaryio.h"
 
 using namespace std;
 
+// A lock holder or version holder: the cache server node plus the lambda.
+struct Holder {
+  NodeId node;
+  uint lambda;
+  bool operator==(const Holder& o) const { return node == o.node && lambda == o.lambda; }
+};
+
+struct Owner {
+  Holder holder;
+  chrono::time_point<std::chrono::system_clock> expire;
+  uint64_t lease; // unique per grant, lets a timer tell if it still applies
+};
+
+typedef InlineVector<Holder, 2> HolderList;
+
+struct ReclaimedVersion {
+  uint version;
+  HolderList holders;
+};
+
+// The version location an unlock recorded, reported so it can be journaled.
+struct Commit {
+  bool recorded;
+  uint version;
+  Holder holder;
+};
+
+// A lock request parked until the lock can be granted. on_grant runs once
+// without the lock held, with the lock result and the lease and version of
+// the grant; "fail" means the request was dropped and should be retried.
+// Waiters whose alive() turns false are skipped.
+struct Waiter {
+  Holder holder;
+  bool write;
+  int max_duration;
+  uint lambda_seq;
+  bool snap_iso;
+  function<bool()> alive;
+  function<void(string ret, uint64_t lease, uint version)> on_grant;
+};
+
 class ReaderWriterLock {
 
 public:
   ReaderWriterLock();
-  string reader_lock(string, int duration, uint lambda_seq, bool snap_iso);
-  string reader_unlock(string);
-  string writer_lock(string, int duration, uint lambda_seq, bool snap_iso);
-  string writer_unlock(string);
-  //TODO: implement stale object collection
-  uint get_prev_seq_num() {return version_history.back();}
-  uint get_seq_num() {return seq_num;}
-  string get_locations(uint version);
-  string get_locations_with_from(uint version, string from);
-  string update_version_location(uint version, string location);
-  string force_release_lock();
+  // On success *lease is set to the id of the grant, see expire(), and
+  // *version to the version it lets the holder read, taken with the grant:
+  // the current one for a reader, the last written one for a writer.
+  string reader_lock(Holder, int duration, uint lambda_seq, bool snap_iso, uint64_t* lease = NULL, uint* version = NULL);
+  // When commit is given it is filled in with the location recorded, if any.
+  string reader_unlock(Holder, Commit* commit = NULL);
+  string writer_lock(Holder, int duration, uint lambda_seq, bool snap_iso, uint64_t* lease = NULL, uint* version = NULL);
+  string writer_unlock(Holder, Commit* commit = NULL);
+  // Like reader_lock/writer_lock, but a contended request is queued in FIFO
+  // order and "wait" is returned; unlocks and expiries then grant queued
+  // requests in order. Plain lock calls do not overtake queued ones.
+  string lock_or_wait(const Waiter& w, uint64_t* lease, uint* version = NULL);
+  // Hands every queued and later lock_or_wait request "fail", used when
+  // the key is deleted.
+  void close_waiters();
+  // Releases the grant if it is still held, as if its holder unlocked it.
+  // A reader that expires is not recorded as holding the version.
+  bool expire(Holder, uint64_t lease, Commit* commit = NULL);
+  // Drops versions older than watermark except the latest and the current one.
+  int collect(uint watermark, vector<ReclaimedVersion>& reclaimed);
+  // Versions that still have data: the ones with locations plus the current one.
+  void live_versions(vector<uint>& out);
+  // Whether node holds some version, and dropping it from every version it
+  // holds, for a cache server that is gone. Returns the holders dropped.
+  bool held_by(NodeId node);
+  void holder_nodes(vector<NodeId>& out);
+  int forget_node(NodeId node);
+  string get_locations(uint version, const InternTable& nodes);
+  string get_locations_with_from(uint version, NodeId from, NodeTopology& topology, const InternTable& nodes);
+  string update_version_location(uint version, Holder location, uint64_t* lease = NULL, Commit* commit = NULL);
+  string force_release_lock(Commit* commit = NULL);
+
+  // Replay of journaled commits. Each one assigns state rather than adding
+  // to it, so replaying a suffix of the journal over a snapshot that already
+  // reflects part of that suffix ends in the same state.
+  void restore_write(uint version, Holder writer);
+  void restore_read(uint version, Holder reader);
+  void restore_location(uint version, Holder location);
+  // Versions and their locations; owners and waiters are not persisted.
+  // Saved node ids index node_map on load.
+  void save(BinaryWriter& out);
+  bool load(BinaryReader& in, const vector<NodeId>& node_map);
 private:
+  Owner* find_owner(Holder h);
+  struct Grant {
+    Waiter waiter;
+    string ret;
+    uint64_t lease;
+    uint version;
+  };
+
+  string try_reader(Holder h, int max_duration, uint lambda_seq, bool snap_iso, uint64_t* lease, uint* version);
+  string try_writer(Holder h, int max_duration, uint lambda_seq, bool snap_iso, uint64_t* lease, uint* version);
+  // Grants queued requests from the front while possible, lock held.
+  void wake(vector<Grant>& granted);
+  // Runs the callbacks of wake(), lock released.
+  static void notify(vector<Grant>& granted);
+  uint64_t add_owner(Holder h, int max_duration);
+  void release_reader(Owner* o, bool record_location, Commit* commit);
+  void release_writer(Owner* o, Commit* commit);
+
   boost::shared_mutex lock;
-  map<string, chrono::time_point<std::chrono::system_clock>> owners;
-  map<uint, vector<string>> version_locations;
+  InlineVector<Owner, 1> owners;
+  deque<Waiter> waiters;
+  bool closed;
+  map<uint, HolderList> version_locations;
   vector<uint> version_history;
   bool write_mode;
   uint seq_num;
@@ -0,0 +1,267 @@
+#include "replication.h"
+#include "masterworker.h"
+#include "binaryio.h"
+#include "epoch.h"
+#include "log.h"
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstring>
+
+ReplicationSender::ReplicationSender(MasterRegistry& registry, shared_ptr<ReplyChannel> channel, uint64_t lsn) :
+  registry(registry),
+  channel(channel),
+  lsn(lsn)
+{
+}
+
+void ReplicationSender::start(MasterRegistry& registry, shared_ptr<ReplyChannel> channel, uint64_t lsn) {
+  ReplicationSender* sender = new ReplicationSender(registry, channel, lsn);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, run_helper, sender)) {
+    LOG_ERROR << "error: unable to create replication thread";
+    delete sender;
+    return;
+  }
+  pthread_detach(thread);
+}
+
+void* ReplicationSender::run_helper(void* sender) {
+  static_cast<ReplicationSender*>(sender)->run();
+  delete static_cast<ReplicationSender*>(sender);
+  return NULL;
+}
+
+bool send_frame(ReplyChannel& channel, char kind, const string& payload) {
+  string frame;
+  frame.reserve(REPL_FRAME_HEADER + payload.size());
+  BinaryWriter w(frame);
+  w.put_u8(kind);
+  w.put_u32(payload.size());
+  frame.append(payload);
+  //the stream thread keeps pace with the follower
+  return channel.send(frame, true);
+}
+
+bool ReplicationSender::send_frame(char kind, const string& payload) {
+  return ::send_frame(*channel, kind, payload);
+}
+
+bool ReplicationSender::send_snapshot() {
+  uint64_t snapshot_lsn = 0;
+  bool ok = registry.save_snapshot([this](const string& piece) {
+    return piece.empty() || send_frame(REPL_SNAPSHOT, piece);
+  }, snapshot_lsn);
+  if (!ok || !send_frame(REPL_SNAPSHOT_END, ""))
+    return false;
+  LOG_INFO << "sent a follower the snapshot at lsn " << snapshot_lsn;
+  lsn = snapshot_lsn;
+  return true;
+}
+
+void ReplicationSender::run() {
+  LOG_INFO << "follower attached at lsn " << lsn;
+  string records;
+  while (channel->open) {
+    records.clear();
+    bool complete = false;
+    uint64_t last = registry.read_journal(lsn, records, REPL_BATCH_BYTES, REPL_HEARTBEAT_MS, &complete);
+    if (last == WAL_GAP) {
+      if (!send_snapshot())
+        break;
+      continue;
+    }
+    if (!records.empty() && !send_frame(REPL_RECORDS, records))
+      break;
+    lsn = last;
+    if (complete) {
+      string hb;
+      BinaryWriter w(hb);
+      w.put_u64(lsn);
+      if (!send_frame(REPL_HEARTBEAT, hb))
+        break;
+    }
+  }
+  LOG_INFO << "follower at lsn " << lsn << " detached";
+}
+
+ReplicationFollower::ReplicationFollower(MasterRegistry& registry, int max_staleness_ms) :
+  registry(registry),
+  max_staleness_ms(max_staleness_ms),
+  is_following(false),
+  sock(-1),
+  fresh_at(0),
+  snapshots(0)
+{
+}
+
+int64_t ReplicationFollower::now_ms() {
+  return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ReplicationFollower::start() {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, run_helper, this))
+    LOG_ERROR << "error: unable to create replication thread";
+}
+
+void* ReplicationFollower::run_helper(void* follower) {
+  static_cast<ReplicationFollower*>(follower)->run();
+  return NULL;
+}
+
+void ReplicationFollower::follow(const string& addr) {
+  lock_guard<mutex> guard(lock);
+  leader = addr;
+  is_following = true;
+  //drop the current stream, the thread reconnects to the new leader
+  int s = sock;
+  if (s >= 0)
+    shutdown(s, SHUT_RDWR);
+}
+
+void ReplicationFollower::promote() {
+  lock_guard<mutex> guard(lock);
+  is_following = false;
+  int s = sock;
+  if (s >= 0)
+    shutdown(s, SHUT_RDWR);
+  LOG_INFO << "promoted at lsn " << registry.journal_lsn();
+}
+
+bool ReplicationFollower::fresh() {
+  return now_ms() - fresh_at <= max_staleness_ms;
+}
+
+string ReplicationFollower::stats() {
+  if (!is_following)
+    return "|role=leader";
+  return "|role=follower|fresh=" + to_string(fresh()) +
+    "|lag_ms=" + to_string(now_ms() - fresh_at) +
+    "|snapshots=" + to_string(snapshots.load());
+}
+
+bool recv_all(int sock, char* buf, size_t len) {
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = recv(sock, buf + got, len - got, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    got += n;
+  }
+  return true;
+}
+
+int connect_to(const string& addr) {
+  size_t colon = addr.rfind(':');
+  if (colon == string::npos)
+    return -1;
+  string host = addr.substr(0, colon);
+  string port = addr.substr(colon + 1);
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+    return -1;
+  int s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (s >= 0 && connect(s, res->ai_addr, res->ai_addrlen) != 0) {
+    close(s);
+    s = -1;
+  }
+  freeaddrinfo(res);
+  if (s >= 0) {
+    int yes = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
+  }
+  return s;
+}
+
+void ReplicationFollower::run() {
+  while (true) {
+    string addr;
+    {
+      lock_guard<mutex> guard(lock);
+      addr = leader;
+    }
+    if (!is_following || addr == "") {
+      sleep(REPL_RETRY_SEC);
+      continue;
+    }
+    int s = connect_to(addr);
+    if (s < 0) {
+      LOG_ERROR << "cannot reach leader " << addr;
+      sleep(REPL_RETRY_SEC);
+      continue;
+    }
+    {
+      //promote() or follow() may have come in while connecting
+      lock_guard<mutex> guard(lock);
+      if (!is_following || addr != leader) {
+        close(s);
+        continue;
+      }
+      sock = s;
+    }
+    stream(s);
+    {
+      lock_guard<mutex> guard(lock);
+      sock = -1;
+    }
+    close(s);
+    if (is_following)
+      sleep(REPL_RETRY_SEC);
+  }
+}
+
+void ReplicationFollower::stream(int s) {
+  string request = "0|replicate|" + to_string(registry.journal_lsn()) + "\n";
+  if (send(s, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size())
+    return;
+  LOG_INFO << "following from lsn " << registry.journal_lsn();
+  string snapshot;
+  string payload;
+  char header[REPL_FRAME_HEADER];
+  while (recv_all(s, header, REPL_FRAME_HEADER)) {
+    BinaryReader h(header, REPL_FRAME_HEADER);
+    char kind = h.get_u8();
+    uint32_t len = h.get_u32();
+    payload.resize(len);
+    if (len > 0 && !recv_all(s, &payload[0], len))
+      break;
+    if (kind == REPL_SNAPSHOT) {
+      //reads would see a half empty registry from the first piece on
+      fresh_at = 0;
+      snapshot.append(payload);
+    } else if (kind == REPL_SNAPSHOT_END) {
+      bool ok = registry.install_snapshot(snapshot);
+      snapshot.clear();
+      snapshot.shrink_to_fit();
+      snapshots++;
+      if (!ok) {
+        LOG_ERROR << "leader sent a corrupt snapshot";
+        break;
+      }
+    } else if (kind == REPL_RECORDS) {
+      if (!registry.apply_journal(payload.data(), payload.size())) {
+        LOG_ERROR << "gap or corrupt record in the journal stream at lsn " << registry.journal_lsn();
+        break;
+      }
+    } else if (kind == REPL_HEARTBEAT) {
+      BinaryReader in(payload.data(), payload.size());
+      if (registry.journal_lsn() >= in.get_u64())
+        fresh_at = now_ms();
+    } else {
+      LOG_ERROR << "unknown replication frame " << kind;
+      break;
+    }
+  }
+  LOG_INFO << "replication stream from leader closed at lsn " << registry.journal_lsn();
+}
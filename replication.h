@@ -0,0 +1,81 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "masterregistry.h"
+
+#define REPL_HEARTBEAT_MS 50
+#define REPL_BATCH_BYTES (1 << 20)
+#define REPL_RETRY_SEC 1
+#define REPL_MAX_STALENESS_MS 1000
+// stream frames: u8 kind, u32 length, payload
+#define REPL_FRAME_HEADER 5
+#define REPL_SNAPSHOT 'S'      // a piece of a snapshot
+#define REPL_SNAPSHOT_END 'E'  // the snapshot is complete, install it
+#define REPL_RECORDS 'R'       // journal records, encoded as in the journal
+#define REPL_HEARTBEAT 'H'     // u64 lsn: the follower has everything the leader had
+
+using namespace std;
+
+struct ReplyChannel;
+
+// Stream helpers, shared with shard migration which uses the same framing.
+// addr is "host:port"; returns a connected socket or -1.
+int connect_to(const string& addr);
+bool recv_all(int sock, char* buf, size_t len);
+bool send_frame(ReplyChannel& channel, char kind, const string& payload);
+
+// Leader side: after a follower sends "replicate|lsn" on a connection, a
+// thread streams it the journal from lsn on, or a snapshot first when those
+// records are no longer in memory. A heartbeat follows whenever the stream
+// has caught up with the journal. The thread stops when the connection goes.
+class ReplicationSender {
+public:
+  static void start(MasterRegistry& registry, shared_ptr<ReplyChannel> channel, uint64_t lsn);
+private:
+  ReplicationSender(MasterRegistry& registry, shared_ptr<ReplyChannel> channel, uint64_t lsn);
+  static void* run_helper(void* sender);
+  void run();
+  bool send_frame(char kind, const string& payload);
+  bool send_snapshot();
+
+  MasterRegistry& registry;
+  shared_ptr<ReplyChannel> channel;
+  uint64_t lsn;
+};
+
+// Follower side: keeps the registry a copy of the leader's by applying the
+// stream, reconnecting as needed. Reads are served while the last heartbeat
+// that found the follower caught up is at most max_staleness_ms old.
+// promote() stops following so the registry takes writes.
+class ReplicationFollower {
+public:
+  ReplicationFollower(MasterRegistry& registry, int max_staleness_ms);
+  void start();
+  // leader is "host:port"
+  void follow(const string& leader);
+  void promote();
+  bool following() {return is_following;}
+  bool fresh();
+  string stats();
+private:
+  static void* run_helper(void* follower);
+  void run();
+  void stream(int sock);
+  static int64_t now_ms();
+
+  MasterRegistry& registry;
+  const int max_staleness_ms;
+  mutex lock;
+  string leader;
+  atomic<bool> is_following;
+  atomic<int> sock;
+  atomic<int64_t> fresh_at;  // when a heartbeat last found us caught up
+  atomic<uint64_t> snapshots;
+};
+
+#endif
@@ -0,0 +1,233 @@
+#include "sharding.h"
+#include "replication.h"
+#include "masterworker.h"
+#include "binaryio.h"
+#include "epoch.h"
+#include "log.h"
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+ShardMap::ShardMap(MasterRegistry& registry) :
+  registry(registry),
+  pending(0),
+  keys_in(0),
+  keys_out(0)
+{
+}
+
+void ShardMap::configure(const string& self, const vector<string>& members, const string& data_dir) {
+  lock_guard<mutex> guard(lock);
+  this->self = self;
+  this->data_dir = data_dir;
+  vector<string> current = members;
+  if (data_dir != "") {
+    ifstream in(data_dir + "/" + SHARD_FILE);
+    string spec;
+    if (in && getline(in, spec) && spec != "") {
+      current = HashRing::parse(spec);
+      LOG_INFO << "using the shard list kept in " << data_dir << ": " << spec;
+    }
+  }
+  if (current.empty())
+    return;
+  if (find(current.begin(), current.end(), self) == current.end())
+    DIE("error: this master (%s) is not one of the shards %s", self.c_str(), HashRing::join(current).c_str());
+  update(current);
+  LOG_INFO << "shard " << self << " of " << HashRing::join(current);
+}
+
+bool ShardMap::assigns_lambdas() {
+  EpochGuard epoch;
+  vector<string> members = ring.members();
+  return members.empty() || members[0] == self;
+}
+
+string ShardMap::check(const string& key) {
+  const string& owner = ring.owner(key);
+  if (owner.empty())
+    return "";
+  if (owner != self)
+    return "exception: wrong_shard";
+  if (pending > 0) {
+    lock_guard<mutex> guard(lock);
+    if (importing.count(previous.owner(key)))
+      return "exception: migrating";
+  }
+  return "";
+}
+
+string ShardMap::spec() {
+  return to_string(ring.version()) + "|" + HashRing::join(ring.members());
+}
+
+void ShardMap::update(const vector<string>& members) {
+  if (members == ring.members())
+    return;
+  ring.set(members);
+  LOG_INFO << "shards are now " << HashRing::join(members);
+  if (data_dir == "")
+    return;
+  string path = data_dir + "/" + SHARD_FILE;
+  string tmp = path + ".tmp";
+  {
+    ofstream out(tmp);
+    out << HashRing::join(members) << endl;
+  }
+  if (rename(tmp.c_str(), path.c_str()) != 0)
+    LOG_ERROR << "cannot keep the shard list in " << path;
+}
+
+void ShardMap::join() {
+  vector<string> members = ring.members();
+  vector<string> others;
+  for (auto& m : members)
+    if (m != self)
+      others.push_back(m);
+  {
+    lock_guard<mutex> guard(lock);
+    previous.set(others);
+    importing.insert(others.begin(), others.end());
+    pending = importing.size();
+  }
+  for (auto& source : others) {
+    Import* job = new Import{this, source};
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, import_helper, job)) {
+      LOG_ERROR << "error: unable to create migration thread";
+      delete job;
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+void* ShardMap::import_helper(void* job) {
+  Import* j = static_cast<Import*>(job);
+  j->shards->import_keys(j->source);
+  delete j;
+  return NULL;
+}
+
+void ShardMap::import_keys(const string& source) {
+  while (!pull(source))
+    sleep(REPL_RETRY_SEC);
+}
+
+bool ShardMap::pull(const string& source) {
+  int s = connect_to(source);
+  if (s < 0) {
+    LOG_ERROR << "cannot reach shard " << source << " to take over its keys";
+    return false;
+  }
+  string request = "0|migrate|" + self + "|" + HashRing::join(ring.members()) + "\n";
+  bool done = send(s, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size();
+  uint64_t received = 0;
+  string payload;
+  char header[REPL_FRAME_HEADER];
+  while (done && recv_all(s, header, REPL_FRAME_HEADER)) {
+    BinaryReader h(header, REPL_FRAME_HEADER);
+    char kind = h.get_u8();
+    uint32_t len = h.get_u32();
+    payload.resize(len);
+    if (len > 0 && !recv_all(s, &payload[0], len))
+      break;
+    if (kind == MIGRATE_KEYS) {
+      if (!registry.import_keys(payload.data(), payload.size())) {
+        LOG_ERROR << "corrupt migration chunk from " << source;
+        break;
+      }
+      received++;
+    } else if (kind == MIGRATE_END) {
+      BinaryReader in(payload.data(), payload.size());
+      uint64_t n = in.get_u64();
+      keys_in += n;
+      {
+        lock_guard<mutex> guard(lock);
+        if (importing.erase(source))
+          pending--;
+      }
+      LOG_INFO << "took over " << n << " keys from " << source << " in " << received << " chunks";
+      //the old owner drops them once told, a lost reply only leaves strays there
+      string ack = "0|migrate_done|" + self + "\n";
+      if (send(s, ack.data(), ack.size(), MSG_NOSIGNAL) == (ssize_t)ack.size()) {
+        char c;
+        while (recv(s, &c, 1, 0) == 1 && c != '\n');
+      }
+      close(s);
+      return true;
+    } else {
+      LOG_ERROR << "unknown migration frame " << kind;
+      break;
+    }
+  }
+  LOG_ERROR << "migration from " << source << " broke off, retrying";
+  close(s);
+  return false;
+}
+
+void ShardMap::start_export(const string& dest, const vector<string>& members, shared_ptr<ReplyChannel> channel) {
+  {
+    lock_guard<mutex> guard(lock);
+    update(members);
+  }
+  Export* job = new Export{this, dest, channel};
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, export_helper, job)) {
+    LOG_ERROR << "error: unable to create migration thread";
+    delete job;
+    return;
+  }
+  pthread_detach(thread);
+}
+
+void* ShardMap::export_helper(void* job) {
+  Export* j = static_cast<Export*>(job);
+  j->shards->export_keys(j->dest, j->channel);
+  delete j;
+  return NULL;
+}
+
+void ShardMap::export_keys(const string& dest, shared_ptr<ReplyChannel> channel) {
+  //requests that passed the ownership check under the old ring may still
+  //change the keys, let them finish first
+  Epoch::synchronize();
+  size_t count = 0;
+  bool ok = registry.export_keys([this, &dest](const string& key) {
+    return ring.owner(key) == dest;
+  }, [&channel](const string& chunk) {
+    return send_frame(*channel, MIGRATE_KEYS, chunk);
+  }, count);
+  string end;
+  BinaryWriter w(end);
+  w.put_u64(count);
+  if (ok && send_frame(*channel, MIGRATE_END, end))
+    LOG_INFO << "sent " << count << " keys to shard " << dest;
+  else
+    LOG_ERROR << "migration to " << dest << " broke off";
+}
+
+size_t ShardMap::finish_export(const string& dest) {
+  if (dest == self)
+    return 0;
+  //only what dest confirmed, keys another join is still sending stay
+  size_t n = registry.drop_keys([this, &dest](const string& key) {
+    return ring.owner(key) == dest;
+  });
+  keys_out += n;
+  LOG_INFO << "dropped " << n << " keys now served by shard " << dest;
+  return n;
+}
+
+string ShardMap::stats() {
+  if (!sharded())
+    return "";
+  return "|shards=" + to_string(ring.members().size()) +
+    "|ring_version=" + to_string(ring.version()) +
+    "|importing=" + to_string(pending.load()) +
+    "|keys_in=" + to_string(keys_in.load()) +
+    "|keys_out=" + to_string(keys_out.load());
+}
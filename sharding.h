@@ -0,0 +1,84 @@
+#ifndef SHARDING_H
+#define SHARDING_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include "hashring.h"
+#include "masterregistry.h"
+
+#define SHARD_FILE "shards"
+// migration frames, framed like the replication stream
+#define MIGRATE_KEYS 'K'  // a chunk from MasterRegistry::export_keys
+#define MIGRATE_END 'E'   // u64 number of keys sent
+
+using namespace std;
+
+struct ReplyChannel;
+
+// This master's place among the shards of the keyspace. A keyed request
+// for a key another shard owns is answered "exception: wrong_shard"; the
+// sender then fetches the ring with the "shards" op and goes to the owner.
+//
+// Adding a shard: start it with the new member list and --join. It sends
+// "migrate|self|members" to every other member, which switches to the new
+// ring, waits out requests already past the ownership check and streams
+// over the keys that moved. Once they are in, the new shard sends
+// "migrate_done" and the old owner drops them. Meanwhile the new shard
+// answers requests for keys still on their way "exception: migrating".
+// Lineage stays with the shard that recorded it.
+class ShardMap {
+public:
+  ShardMap(MasterRegistry& registry);
+  // No members: not sharded, every key is ours. The member list is kept in
+  // data_dir and wins over the configured one on restart.
+  void configure(const string& self, const vector<string>& members, const string& data_dir);
+  bool sharded() {return !ring.empty();}
+  // The first member hands out lambda ids.
+  bool assigns_lambdas();
+  // "" when key is ours to serve, else the exception to reply with.
+  // Caller holds an EpochGuard.
+  string check(const string& key);
+  // "version|a:1,b:2"
+  string spec();
+  // New shard: pulls the keys it takes over from every other member.
+  void join();
+  // Old owner: switches to members and streams dest its keys on channel.
+  void start_export(const string& dest, const vector<string>& members, shared_ptr<ReplyChannel> channel);
+  // Old owner: dest has the keys, forget them here.
+  size_t finish_export(const string& dest);
+  string stats();
+private:
+  struct Export {
+    ShardMap* shards;
+    string dest;
+    shared_ptr<ReplyChannel> channel;
+  };
+  struct Import {
+    ShardMap* shards;
+    string source;
+  };
+  void update(const vector<string>& members);
+  static void* export_helper(void* job);
+  void export_keys(const string& dest, shared_ptr<ReplyChannel> channel);
+  static void* import_helper(void* job);
+  void import_keys(const string& source);
+  bool pull(const string& source);
+
+  MasterRegistry& registry;
+  HashRing ring;
+  HashRing previous; // the ring before we joined, while importing
+  string self;
+  string data_dir;
+  mutex lock;
+  set<string> importing; // members whose keys have not all arrived
+  atomic<int> pending;
+  atomic<uint64_t> keys_in;
+  atomic<uint64_t> keys_out;
+};
+
+#endif
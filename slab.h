@@ -0,0 +1,198 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include "epoch.h"
+
+#define SLAB_ID_BITS 32
+
+using namespace std;
+
+// Objects keyed by dense, mostly increasing ids (lambda ids), stored in
+// place in fixed-size slabs of 2^BITS slots. Looking up an id is two array
+// indexings with no lock and no hashing. A slab is freed once every id it
+// covers has been handed out and destroyed, so memory follows the set of
+// live ids rather than the highest id ever used.
+//
+// create() and destroy() serialize on a mutex. get() is lock-free; when
+// objects are read without another lock, remove them with retire(), which
+// defers destruction through Epoch, and hold an EpochGuard across get().
+// A retired id is gone for get() at once. create() may bring it back
+// within the epoch, and the old object is then destroyed in place at once,
+// so that create() must not race a reader still holding the old object.
+template <typename T, unsigned BITS>
+class SlabArray {
+public:
+  //the directory is calloc'd so the pages of unused ids are never touched
+  SlabArray() : chunks((atomic<Chunk*>*)calloc(NUM_CHUNKS, sizeof(atomic<Chunk*>))), high(0), count(0) {}
+  ~SlabArray() {
+    for (size_t c = 0; c < NUM_CHUNKS; c++) {
+      Chunk* chunk = chunks[c].load(memory_order_relaxed);
+      if (chunk == NULL)
+        continue;
+      for (uint i = 0; i < SLAB_SIZE; i++)
+        if (chunk->state[i].load(memory_order_relaxed) & (LIVE | RETIRED))
+          chunk->item(i)->~T();
+      delete chunk;
+    }
+    free(chunks);
+  }
+
+  T* get(uint id) {
+    Chunk* chunk = chunks[id >> BITS].load(memory_order_acquire);
+    if (chunk == NULL || !(chunk->state[id & MASK].load(memory_order_acquire) & LIVE))
+      return NULL;
+    return chunk->item(id & MASK);
+  }
+
+  // Constructs T(args...) at id, or returns the object already there.
+  template <typename... Args>
+  T* create(uint id, Args... args) {
+    lock_guard<mutex> guard(lock);
+    Chunk* chunk = chunks[id >> BITS].load(memory_order_relaxed);
+    if (chunk == NULL) {
+      chunk = new Chunk();
+      chunks[id >> BITS].store(chunk, memory_order_release);
+    }
+    uint i = id & MASK;
+    uint state = chunk->state[i].load(memory_order_relaxed);
+    if (!(state & LIVE)) {
+      //a retired object still waiting for its epoch is replaced now, the
+      //new generation makes its pending destruction a no-op
+      if (state & RETIRED)
+        chunk->item(i)->~T();
+      else
+        chunk->count++;
+      new (chunk->item(i)) T(args...);
+      chunk->state[i].store(next_generation(state) | LIVE, memory_order_release);
+      count++;
+      if ((uint64_t)id + 1 > high)
+        high = (uint64_t)id + 1;
+    }
+    return chunk->item(i);
+  }
+
+  // Destroys the object at id now. Only safe when nobody can be reading it.
+  void destroy(uint id) {
+    Chunk* empty;
+    {
+      lock_guard<mutex> guard(lock);
+      empty = destroy_locked(id, 0, false);
+    }
+    Epoch::retire(empty);
+  }
+
+  // Removes the object at id now and destroys it once current readers are
+  // done with it, unless create() reuses the id first.
+  void retire(uint id) {
+    Pending* p;
+    {
+      lock_guard<mutex> guard(lock);
+      Chunk* chunk = chunks[id >> BITS].load(memory_order_relaxed);
+      if (chunk == NULL)
+        return;
+      uint i = id & MASK;
+      uint state = chunk->state[i].load(memory_order_relaxed);
+      if (!(state & LIVE))
+        return;
+      state = next_generation(state) | RETIRED;
+      chunk->state[i].store(state, memory_order_release);
+      count--;
+      p = new Pending;
+      p->slab = this;
+      p->id = id;
+      p->state = state;
+    }
+    Epoch::retire(p);
+  }
+
+  size_t size() {
+    lock_guard<mutex> guard(lock);
+    return count;
+  }
+
+  // Calls f(id, T*) for every object. Holds the slab lock, so f must not
+  // create or destroy.
+  template <typename F>
+  void for_each(F f) {
+    lock_guard<mutex> guard(lock);
+    for (size_t c = 0; c <= (high >> BITS) && c < NUM_CHUNKS; c++) {
+      Chunk* chunk = chunks[c].load(memory_order_relaxed);
+      if (chunk == NULL)
+        continue;
+      for (uint i = 0; i < SLAB_SIZE; i++)
+        if (chunk->state[i].load(memory_order_relaxed) & LIVE)
+          f((uint)((c << BITS) | i), chunk->item(i));
+    }
+  }
+
+private:
+  static const uint SLAB_SIZE = 1u << BITS;
+  static const uint MASK = SLAB_SIZE - 1;
+  static const size_t NUM_CHUNKS = (size_t)1 << (SLAB_ID_BITS - BITS);
+  static const uint LIVE = 1;    // get() returns it
+  static const uint RETIRED = 2; // not live, destroyed at the end of its epoch
+
+  static uint next_generation(uint state) { return (state | 3) + 1; }
+
+  struct Chunk {
+    Chunk() : count(0) {
+      for (uint i = 0; i < SLAB_SIZE; i++)
+        state[i].store(0, memory_order_relaxed);
+    }
+    T* item(uint i) { return reinterpret_cast<T*>(&items[i]); }
+    typename aligned_storage<sizeof(T), alignof(T)>::type items[SLAB_SIZE];
+    atomic<uint> state[SLAB_SIZE]; // generation << 2 | RETIRED | LIVE
+    uint count; // slots holding an object, live or retired
+  };
+
+  struct Pending {
+    ~Pending() {
+      Chunk* empty;
+      {
+        lock_guard<mutex> guard(slab->lock);
+        empty = slab->destroy_locked(id, state, true);
+      }
+      Epoch::retire(empty);
+    }
+    SlabArray* slab;
+    uint id;
+    uint state;
+  };
+
+  // Returns the slab if it became empty; the caller retires it after
+  // dropping the lock, since retiring may run other deleters.
+  Chunk* destroy_locked(uint id, uint expected, bool check) {
+    size_t c = id >> BITS;
+    Chunk* chunk = chunks[c].load(memory_order_relaxed);
+    if (chunk == NULL)
+      return NULL;
+    uint i = id & MASK;
+    uint state = chunk->state[i].load(memory_order_relaxed);
+    if (!(state & (LIVE | RETIRED)) || (check && state != expected))
+      return NULL;
+    chunk->item(i)->~T();
+    chunk->state[i].store(next_generation(state), memory_order_release);
+    chunk->count--;
+    if (state & LIVE)
+      count--;
+    //keep the slab ids are still being handed out from
+    if (chunk->count == 0 && ((uint64_t)(c + 1) << BITS) <= high) {
+      chunks[c].store(NULL, memory_order_release);
+      return chunk;
+    }
+    return NULL;
+  }
+
+  mutex lock;
+  atomic<Chunk*>* chunks;
+  uint64_t high;  // one past the highest id ever created
+  size_t count;
+};
+
+#endif
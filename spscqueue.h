@@ -0,0 +1,42 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+
+using namespace std;
+
+// Bounded queue between exactly one producer thread and one consumer
+// thread. Each side only writes its own index, and the two indices sit on
+// separate cache lines, so a push and a pop never contend. N is a power
+// of two.
+template <typename T, size_t N>
+class SpscQueue {
+public:
+  SpscQueue() : head(0), tail(0) {}
+  // False when full.
+  bool push(const T& item) {
+    size_t t = tail.load(memory_order_relaxed);
+    if (t - head.load(memory_order_acquire) == N)
+      return false;
+    slots[t & (N - 1)] = item;
+    tail.store(t + 1, memory_order_release);
+    return true;
+  }
+  // False when empty.
+  bool pop(T& item) {
+    size_t h = head.load(memory_order_relaxed);
+    if (h == tail.load(memory_order_acquire))
+      return false;
+    item = slots[h & (N - 1)];
+    head.store(h + 1, memory_order_release);
+    return true;
+  }
+private:
+  static_assert((N & (N - 1)) == 0, "N must be a power of two");
+  T slots[N];
+  alignas(64) atomic<size_t> head;
+  alignas(64) atomic<size_t> tail;
+};
+
+#endif
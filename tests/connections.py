@@ -0,0 +1,53 @@
+import socket
+import subprocess
+import sys
+import threading
+from harness import *
+
+# Many connections opened at once are all accepted and served across the
+# per-loop SO_REUSEPORT listeners, and a second master cannot take the port.
+
+m = start()
+THREADS = 16
+PER_THREAD = 50
+acks = []
+failed = []
+
+def client(c):
+  conns = []
+  try:
+    for i in range(PER_THREAD):
+      conns.append(socket.create_connection(("127.0.0.1", m.port)))
+    for i, s in enumerate(conns):
+      s.settimeout(30)
+      s.sendall(("0|new_server|%d|\n" % (10000 + c * PER_THREAD + i)).encode())
+    for s in conns:
+      acks.append(recv_lines(s, 1)[0])
+  except socket.error as e:
+    failed.append("thread %d: %s" % (c, e))
+  for s in conns:
+    s.close()
+
+threads = [threading.Thread(target = client, args = (c,)) for c in range(THREADS)]
+for t in threads:
+  t.start()
+for t in threads:
+  t.join()
+check(not failed, "; ".join(failed))
+check(len(acks) == THREADS * PER_THREAD, "%d of %d acks" % (len(acks), THREADS * PER_THREAD))
+check(all(a.startswith("0|new_server_ack|") for a in acks), "bad ack")
+# each node got an id of its own
+check(len(set(a.split("|")[3] for a in acks)) == len(acks), "node ids handed out twice")
+
+second = subprocess.Popen([sys.argv[1], "--port=%d" % m.port],
+  stdout = subprocess.DEVNULL, stderr = subprocess.DEVNULL)
+try:
+  check(second.wait(10) != 0, "second master on the port exited cleanly")
+except subprocess.TimeoutExpired:
+  second.kill()
+  fail("second master started on a port in use")
+s = m.connect(9999)
+check(rpc(s, "1|lookup|bk~x") == "1|lookup_ack|", "first master after the second one failed")
+
+m.stop()
+print("ok")
@@ -0,0 +1,127 @@
+import socket
+import time
+from harness import *
+
+# Binary frames (frame.h): the upgrade in new_server, fields holding '|' and
+# '/', replies matched by id, a deferred lock grant, and frames cut into
+# single bytes.
+
+OPS = ["", "new_server", "reg", "cache", "uncache", "lookup", "mlookup", "mreg", "mcache", "munlock",
+  "delete", "list_prefix", "delete_prefix", "consistent_lock", "consistent_unlock",
+  "consistent_delete", "lineage", "failover_write_update", "force_release_lock", "poll",
+  "decommission", "stats", "lambda_done", "promote", "follow", "shards", "migrate_done"]
+FRAME_ACK = 0x80
+
+def varint(v):
+  out = b""
+  while v >= 0x80:
+    out += bytes([(v & 0x7f) | 0x80])
+    v >>= 7
+  return out + bytes([v])
+
+def get_varint(buf, i):
+  v = shift = 0
+  while True:
+    b = buf[i]
+    i += 1
+    v |= (b & 0x7f) << shift
+    shift += 7
+    if b < 0x80:
+      return v, i
+
+def frame(op, rid, fields):
+  body = bytes([OPS.index(op)]) + varint(rid) + varint(len(fields))
+  body += b"".join(varint(len(f)) + f.encode() for f in fields)
+  return varint(len(body)) + body
+
+class FrameConn():
+  def __init__(self, m, node_port):
+    self.s = socket.create_connection(("127.0.0.1", m.port))
+    self.s.settimeout(30)
+    self.buf = b""
+    self.s.sendall(("0|new_server|%d||r|h|0|bin1\n" % node_port).encode())
+    while b"\n" not in self.buf:
+      self.buf += self.s.recv(65536)
+    line, self.buf = self.buf.split(b"\n", 1)
+    self.ack = line.decode().split("|")
+    check(self.ack[-1] == "bin1", "frames not granted: " + line.decode())
+    self.lambda_id = "lambda" + self.ack[3]
+
+  def send(self, op, fields, rid = 1):
+    self.s.sendall(frame(op, rid, fields))
+
+  def recv(self):
+    # (op, id, fields) of the next reply frame
+    while True:
+      try:
+        n, i = get_varint(self.buf, 0)
+        if len(self.buf) - i >= n:
+          body = self.buf[i:i + n]
+          self.buf = self.buf[i + n:]
+          check(body[0] & FRAME_ACK, "reply opcode without FRAME_ACK")
+          rid, j = get_varint(body, 1)
+          count, j = get_varint(body, j)
+          fields = []
+          for _ in range(count):
+            size, j = get_varint(body, j)
+            fields.append(body[j:j + size].decode())
+            j += size
+          check(j == len(body), "trailing bytes in a reply frame")
+          return OPS[body[0] & 0x7f], rid, fields
+      except IndexError:
+        pass
+      chunk = self.s.recv(1 << 20)
+      check(chunk, "connection closed waiting for a frame")
+      self.buf += chunk
+
+  def rpc(self, op, fields, rid = 1):
+    self.send(op, fields, rid)
+    return self.recv()
+
+m = start()
+a = FrameConn(m, 2001)
+b = FrameConn(m, 2002)
+
+key = "bk~we|ird/key"
+check(a.rpc("reg", [key]) == ("reg", 1, [key, "success"]), "reg of a key with '|' and '/'")
+check(b.rpc("lookup", [key]) == ("lookup", 1, ["127.0.0.1:2001;"]), "lookup from another node")
+check(a.rpc("lookup", [key]) == ("lookup", 1, ["use_local"]), "lookup from the holder")
+
+# b waits on a's lock; the grant is sent later and must be a frame too
+lock = ["write", "~bk~c", None, "10", "nos3", "no_snap", "no_check_loc", "recent"]
+check(a.rpc("consistent_lock", [a.lambda_id if f is None else f for f in lock])[2][0] == "success",
+  "first lock")
+b.send("consistent_lock", [b.lambda_id if f is None else f for f in lock] + ["wait"], 77)
+time.sleep(0.2)
+check(a.rpc("consistent_unlock", ["write", "~bk~c", a.lambda_id, "1"]) == ("consistent_unlock", 1, ["success"]),
+  "unlock")
+check(b.recv() == ("consistent_lock", 77, ["success", "write", "127.0.0.1:2001;"]), "deferred grant")
+
+# pipelined frames, each reply carrying its request's id
+for i in range(5):
+  a.send("lookup", [key], 100 + i)
+check(sorted(a.recv()[1] for i in range(5)) == [100, 101, 102, 103, 104], "pipelined ids")
+
+# a frame arriving one byte at a time
+for c in frame("lookup", 9, [key]):
+  a.s.sendall(bytes([c]))
+  time.sleep(0.001)
+check(a.recv() == ("lookup", 9, ["use_local"]), "frame cut into bytes")
+
+# one batch frame against the same keys over text
+names = ["bk~k%05d" % i for i in range(20000)]
+check(len(a.rpc("mreg", names)[2][0]) == len(names), "mreg of %d keys" % len(names))
+op, rid, fields = b.rpc("mlookup", names)
+check(len(fields) == len(names) and all(f == "127.0.0.1:2001;" for f in fields), "framed mlookup")
+t = m.connect(2003)
+reply = rpc(t, "1|mlookup|" + "|".join(names)).split("|")
+check(reply[2:] == fields, "framed and text mlookup differ")
+
+# a corrupt frame closes only its own connection
+b.s.sendall(b"\xff" * 11)
+b.s.settimeout(5)
+check(b.s.recv(100) == b"", "corrupt frame did not close the connection")
+check(a.rpc("lookup", [key]) == ("lookup", 1, ["use_local"]), "other connection after a corrupt frame")
+
+m.stop()
+print("ok")
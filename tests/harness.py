@@ -0,0 +1,71 @@
+import os
+import socket
+import subprocess
+import sys
+import time
+
+# Shared by the master tests: each one is run as
+#   python3 <test>.py <path to master> [master flags...]
+# and exits non-zero on the first failed check.
+
+def free_port():
+  probe = socket.socket()
+  probe.bind(("127.0.0.1", 0))
+  port = probe.getsockname()[1]
+  probe.close()
+  return port
+
+class Master():
+  # a master on a free port of its own unless given one, with no data_dir
+  def __init__(self, binary, flags = [], port = None):
+    self.port = free_port() if port is None else port
+    self.proc = subprocess.Popen([binary, "--port=%d" % self.port] + flags,
+      stdout = subprocess.DEVNULL, stderr = subprocess.DEVNULL)
+    deadline = time.time() + 10
+    while True:
+      try:
+        socket.create_connection(("127.0.0.1", self.port)).close()
+        return
+      except socket.error:
+        if self.proc.poll() is not None or time.time() > deadline:
+          fail("master did not start on port %d" % self.port)
+        time.sleep(0.05)
+
+  def connect(self, node_port = None):
+    s = socket.create_connection(("127.0.0.1", self.port))
+    s.settimeout(30)
+    if node_port is not None:
+      reply = rpc(s, "0|new_server|%d|" % node_port)
+      check(reply.startswith("0|new_server_ack|"), "new_server: " + reply)
+    return s
+
+  def stop(self):
+    self.proc.kill()
+    self.proc.wait()
+
+def start():
+  if len(sys.argv) < 2:
+    sys.stderr.write("usage: %s <master> [flags...]\n" % sys.argv[0])
+    sys.exit(2)
+  return Master(sys.argv[1], sys.argv[2:])
+
+def fail(msg):
+  sys.stderr.write("FAIL: %s\n" % msg)
+  os._exit(1)
+
+def check(cond, msg):
+  if not cond:
+    fail(msg)
+
+def recv_lines(s, n):
+  # the first n reply lines; fails if the master hangs up early
+  buf = b""
+  while buf.count(b"\n") < n:
+    chunk = s.recv(1 << 20)
+    check(chunk, "connection closed after %d of %d replies" % (buf.count(b"\n"), n))
+    buf += chunk
+  return buf.decode().split("\n")[:n]
+
+def rpc(s, line):
+  s.sendall((line + "\n").encode())
+  return recv_lines(s, 1)[0]
@@ -0,0 +1,62 @@
+import socket
+import time
+from harness import *
+
+# Consistent lock leases and wait queues: an expired lease frees the lock,
+# a waiting request is answered when the lock is granted, in queue order,
+# and the wait of a closed connection is dropped.
+
+m = start()
+LOCK = "consistent_lock|write|~k%s|lambda%d|%d|nos3|no_snap|no_check_loc|recent"
+
+def stat(s, name):
+  for field in rpc(s, "0|stats").split("|"):
+    if field.startswith(name + "="):
+      return field.split("=")[1]
+  fail("no %s in stats" % name)
+
+def no_reply(s, wait):
+  s.settimeout(wait)
+  try:
+    got = s.recv(512)
+    fail("early reply " + got.decode())
+  except socket.timeout:
+    pass
+  s.settimeout(30)
+
+# a one second lease runs out and another lambda can take the lock
+a = m.connect(1222)
+b = m.connect(1333)
+check(rpc(a, "2|" + LOCK % ("", 0, 1)) == "2|consistent_lock_ack|success|write|", "first lock")
+check(rpc(b, "3|" + LOCK % ("", 1, 1)) == "3|consistent_lock_ack|fail|write|", "held lock")
+time.sleep(1.5)
+check(stat(b, "lease_expired") == "1", "lease did not expire")
+check(rpc(b, "5|" + LOCK % ("", 1, 100)) == "5|consistent_lock_ack|success|write|", "lock after expiry")
+check(rpc(b, "6|consistent_unlock|write|~k|lambda1|1") == "6|consistent_unlock_ack|success", "unlock")
+
+# waiting requests on ~kw: c goes away while queued, b holds a one second
+# lease once granted, and d is granted when that lease runs out
+c = m.connect(1444)
+d = m.connect(1555)
+check(rpc(a, "2|" + LOCK % ("w", 0, 100)) == "2|consistent_lock_ack|success|write|", "lock to wait on")
+c.sendall(("3|" + LOCK % ("w", 2, 100) + "|wait\n").encode())
+time.sleep(0.1)
+c.close()
+b.sendall(("3|" + LOCK % ("w", 1, 1) + "|wait\n").encode())
+time.sleep(0.1)
+d.sendall(("4|" + LOCK % ("w", 3, 100) + "|wait\n").encode())
+no_reply(b, 0.3)
+check(rpc(a, "5|consistent_unlock|write|~kw|lambda0|1") == "5|consistent_unlock_ack|success", "unlock")
+check(recv_lines(b, 1)[0] == "3|consistent_lock_ack|success|write|127.0.0.1:1222;", "grant to b")
+start_wait = time.time()
+check(recv_lines(d, 1)[0] == "4|consistent_lock_ack|success|write|127.0.0.1:1222;", "grant to d")
+check(time.time() - start_wait > 0.5, "d granted before b's lease ran out")
+
+# a parked request's reply follows the replies to the requests before it
+a.sendall(("6|reg|bk~r\n7|" + LOCK % ("w", 0, 100) + "|wait\n8|lookup|bk~r\n").encode())
+check(recv_lines(a, 2) == ["6|reg_ack|bk~r|success", "8|lookup_ack|use_local"], "replies around a wait")
+check(rpc(d, "9|consistent_unlock|write|~kw|lambda3|1") == "9|consistent_unlock_ack|success", "unlock by d")
+check(recv_lines(a, 1)[0].startswith("7|consistent_lock_ack|success|write|"), "grant after the later reply")
+
+m.stop()
+print("ok")
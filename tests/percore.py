@@ -0,0 +1,44 @@
+import threading
+from harness import *
+
+# Key-affine routing under --per_core: requests that land on another core's
+# keys are forwarded, and each connection must still see its replies in
+# request order, with a lookup seeing the reg sent before it. On a machine
+# with one core nothing is forwarded and this only checks ordering.
+
+m = start()
+N = 5000
+CLIENTS = 4
+failed = []
+
+def client(c):
+  s = m.connect(1444 + c)
+  reqs = []
+  for i in range(N):
+    key = "o%d~%d" % (c, i)
+    reqs += ["reg|" + key, "lookup|" + key, "lookup|" + key]
+    if i % 50 == 0:
+      # one line whose commands fall on different cores
+      reqs.append("lookup|%s/lookup|o%d~%d" % (key, c, i // 2))
+  s.sendall("".join("%d|%s\n" % (n, r.replace("/", "/%d|" % n, 1)) for n, r in enumerate(reqs)).encode())
+  lines = recv_lines(s, len(reqs))
+  for n, line in enumerate(lines):
+    if reqs[n].startswith("reg|"):
+      expected = "%d|reg_ack|%s|success" % (n, reqs[n][4:])
+    elif "/" in reqs[n]:
+      expected = "%d|lookup_ack|use_local/%d|lookup_ack|use_local" % (n, n)
+    else:
+      expected = "%d|lookup_ack|use_local" % n
+    if line != expected:
+      failed.append("client %d reply %d: %s, expected %s" % (c, n, line, expected))
+      return
+
+threads = [threading.Thread(target = client, args = (c,)) for c in range(CLIENTS)]
+for t in threads:
+  t.start()
+for t in threads:
+  t.join()
+check(not failed, "; ".join(failed))
+
+m.stop()
+print("ok")
@@ -0,0 +1,52 @@
+import random
+import socket
+from harness import *
+
+# Pipelined text requests: every reply comes back once, in request order,
+# however the input is cut into reads.
+
+m = start()
+N = 20000
+
+# one write of N regs then N lookups of the same keys
+s = m.connect(1444)
+reqs = "".join("%d|reg|pk~%d\n" % (i, i) for i in range(N))
+reqs += "".join("%d|lookup|pk~%d\n" % (N + i, i) for i in range(N))
+s.sendall(reqs.encode())
+lines = recv_lines(s, 2 * N)
+for i, line in enumerate(lines):
+  fields = line.split("|")
+  check(fields[0] == str(i), "reply %d out of order: %s" % (i, line))
+  expected = ["reg_ack", "pk~%d" % i, "success"] if i < N else ["lookup_ack", "use_local"]
+  check(fields[1:] == expected, "reply %d: %s" % (i, line))
+
+# empty lines are skipped without holding up the requests behind them, and
+# a line of several commands gets one reply line
+s.sendall(b"1|reg|pk~e\n\n\n2|lookup|pk~e/3|lookup|pk~none\n\n4|lookup|pk~e\n")
+check(recv_lines(s, 3) == ["1|reg_ack|pk~e|success", "2|lookup_ack|use_local/3|lookup_ack|",
+  "4|lookup_ack|use_local"], "empty lines or multi-command line")
+
+# the same kind of stream cut at random byte offsets, with ops mixed
+rng = random.Random(1)
+reqs = ["mreg|" + "|".join("pk~mix%d" % i for i in range(700))]
+for i in range(3000):
+  key = "pk~mix%d" % (i % 700)
+  reqs += ["reg|" + key, "cache|" + key, "lookup|" + key]
+  if i % 7 == 0:
+    reqs += ["delete|" + key, "lookup|" + key, "reg|" + key]
+  if i % 13 == 0:
+    reqs.append("mlookup|%s|pk~mix%d" % (key, i % 5))
+  reqs.append("uncache|pk~mix%d" % ((i * 3) % 700))
+data = "".join("%d|%s\n" % (n, r) for n, r in enumerate(reqs)).encode()
+pos = 0
+while pos < len(data):
+  cut = pos + rng.randint(1, 200)
+  s.sendall(data[pos:cut])
+  pos = cut
+lines = recv_lines(s, len(reqs))
+for n, line in enumerate(lines):
+  op = reqs[n].split("|")[0]
+  check(line.startswith("%d|%s_ack|" % (n, op)), "reply %d to %s: %s" % (n, reqs[n], line))
+
+m.stop()
+print("ok")
@@ -0,0 +1,122 @@
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+from harness import *
+
+# Restarts from --data_dir after kill -9: locations, deletes, consistent
+# versions, lineage and lambda ids come back from the log alone and from a
+# snapshot plus the log after it. A torn last record is dropped; a missing
+# segment stops recovery.
+
+data = tempfile.mkdtemp(prefix = "master-recovery-")
+LOCK = "consistent_lock|%s|~bk~c|lambda%d|100|nos3|no_snap|no_check_loc|%s"
+
+def restart(m, flags = []):
+  if m is not None:
+    m.stop()
+  return Master(sys.argv[1], sys.argv[2:] + ["--data_dir=" + data] + flags)
+
+def nodes(m):
+  # the two cache servers again, each with a new lambda id
+  a = m.connect(1222)
+  b = m.connect(1333)
+  return a, b
+
+def expect(s, request, reply):
+  got = rpc(s, request)
+  check(got == reply, "%s: got %s, expected %s" % (request, got, reply))
+
+def check_state(m, first_version = False):
+  a, b = nodes(m)
+  expect(a, "1|lookup|bk~x", "1|lookup_ack|use_local")
+  expect(b, "1|lookup|bk~x", "1|lookup_ack|use_local")
+  expect(a, "2|lookup|bk~y", "2|lookup_ack|127.0.0.1:1333;")
+  expect(b, "2|lookup|bk~y", "2|lookup_ack|use_local")
+  expect(a, "3|lookup|bk~gone", "3|lookup_ack|")
+  expect(a, "4|lineage|0,1", "4|" + lineage)
+  lambda_a = int(rpc(a, "5|new_server|1222|").split("|")[3])
+  check(lambda_a > 1, "lambda id %d handed out again" % lambda_a)
+  # each version's holders, asked by a node that holds neither; the first
+  # version goes once the maintenance pass has collected it
+  c = m.connect(1444)
+  if first_version:
+    expect(c, "6|" + LOCK % ("read", lambda_a, "0"), "6|consistent_lock_ack|success|read|127.0.0.1:1222;")
+  reply = rpc(c, "7|" + LOCK % ("read", lambda_a, "1")).split("|")
+  check(reply[:4] == ["7", "consistent_lock_ack", "success", "read"] and
+    sorted(reply[4].split(";")) == ["", "127.0.0.1:1222", "127.0.0.1:1333"], "version 1: " + "|".join(reply))
+  return a, b
+
+def segments():
+  return sorted(f for f in os.listdir(data) if f.startswith("wal."))
+
+# the state, made by lambdas 0 and 1
+m = restart(None)
+a, b = nodes(m)
+expect(a, "1|reg|bk~x", "1|reg_ack|bk~x|success")
+expect(b, "2|reg|bk~y", "2|reg_ack|bk~y|success")
+expect(b, "3|cache|bk~x", "3|cache_ack|bk~x|success")
+expect(a, "4|cache|bk~y", "4|cache_ack|bk~y|success")
+expect(a, "5|uncache|bk~y", "5|uncache_ack|bk~y|success")
+expect(a, "6|reg|bk~gone", "6|reg_ack|bk~gone|success")
+expect(a, "7|delete|bk~gone", "7|delete_ack|success")
+expect(a, "8|" + LOCK % ("write", 0, "recent"), "8|consistent_lock_ack|success|write|")
+expect(a, "9|consistent_unlock|write|~bk~c|lambda0|1", "9|consistent_unlock_ack|success")
+expect(b, "10|" + LOCK % ("write", 1, "recent"), "10|consistent_lock_ack|success|write|127.0.0.1:1222;")
+expect(b, "11|consistent_unlock|write|~bk~c|lambda1|1", "11|consistent_unlock_ack|success")
+expect(a, "12|" + LOCK % ("read", 0, "recent"), "12|consistent_lock_ack|success|read|127.0.0.1:1333;")
+expect(a, "13|consistent_unlock|read|~bk~c|lambda0|0", "13|consistent_unlock_ack|success")
+lineage = rpc(a, "14|lineage|0,1").split("|", 1)[1]
+check("~bk~c" in lineage, "no lineage recorded: " + lineage)
+
+# from the log alone
+m = restart(m)
+check_state(m, True)
+
+# from a snapshot, taken on the maintenance pass, plus the log after it
+m = restart(m, ["--snapshot_interval=1"])
+deadline = time.time() + 30
+while not os.path.exists(os.path.join(data, "snapshot")):
+  check(time.time() < deadline, "no snapshot written")
+  time.sleep(0.2)
+a, b = check_state(m)
+expect(a, "20|reg|bk~z", "20|reg_ack|bk~z|success")
+m = restart(m)
+a, b = check_state(m)
+expect(b, "21|lookup|bk~z", "21|lookup_ack|127.0.0.1:1222;")
+
+# a record cut short by the crash is dropped, and the log goes on after it
+expect(a, "22|reg|bk~torn", "22|reg_ack|bk~torn|success")
+m.stop()
+last = os.path.join(data, segments()[-1])
+os.truncate(last, os.path.getsize(last) - 3)
+m = restart(None)
+a, b = check_state(m)
+expect(b, "23|lookup|bk~z", "23|lookup_ack|127.0.0.1:1222;")
+expect(b, "24|lookup|bk~torn", "24|lookup_ack|")
+expect(a, "25|reg|bk~after", "25|reg_ack|bk~after|success")
+m = restart(m)
+a, b = check_state(m)
+expect(b, "26|lookup|bk~after", "26|lookup_ack|127.0.0.1:1222;")
+
+# every restart opens a new segment; losing one that holds records is a
+# gap, and the master must refuse to start rather than skip it
+expect(a, "27|reg|bk~more", "27|reg_ack|bk~more|success")
+m = restart(m)
+a, b = nodes(m)
+m.stop()
+written = [f for f in segments() if os.path.getsize(os.path.join(data, f)) > 0]
+check(len(written) >= 3, "expected three segments with records, have %s" % written)
+os.remove(os.path.join(data, written[-2]))
+gap = subprocess.Popen([sys.argv[1], "--port=0", "--data_dir=" + data] + sys.argv[2:],
+  stdout = subprocess.DEVNULL, stderr = subprocess.DEVNULL)
+try:
+  check(gap.wait(10) != 0, "recovered across a missing segment")
+except subprocess.TimeoutExpired:
+  gap.kill()
+  fail("master started with a segment missing")
+
+shutil.rmtree(data)
+print("ok")
@@ -0,0 +1,79 @@
+import os
+import shutil
+import sys
+import tempfile
+import time
+from harness import *
+
+# A follower (--follow) catching up from a snapshot when the leader no
+# longer holds the records it needs, then from the record stream; its
+# lookups while the leader's heartbeats come and once they stop; and
+# promote, after which it takes writes.
+
+data = tempfile.mkdtemp(prefix = "master-replication-")
+LOCK = "consistent_lock|%s|~bk~c|lambda%d|100|nos3|no_snap|no_check_loc|%s"
+
+def stat(s, name):
+  for field in rpc(s, "0|stats").split("|"):
+    if field.startswith(name + "="):
+      return field.split("=")[1]
+  fail("no %s in stats" % name)
+
+def wait_for(s, request, reply, what):
+  deadline = time.time() + 10
+  while True:
+    got = rpc(s, request)
+    if got == reply:
+      return
+    check(time.time() < deadline, "%s: got %s, expected %s" % (what, got, reply))
+    time.sleep(0.05)
+
+# a leader restarted from its log only keeps what it logged since in
+# memory, so a new follower needs a snapshot first
+leader = Master(sys.argv[1], sys.argv[2:] + ["--data_dir=" + data])
+a = leader.connect(1222)
+check(rpc(a, "1|reg|bk~x") == "1|reg_ack|bk~x|success", "reg on the leader")
+check(rpc(a, "2|" + LOCK % ("write", 0, "recent")) == "2|consistent_lock_ack|success|write|", "lock on the leader")
+check(rpc(a, "3|consistent_unlock|write|~bk~c|lambda0|1") == "3|consistent_unlock_ack|success", "unlock")
+leader.stop()
+leader = Master(sys.argv[1], sys.argv[2:] + ["--data_dir=" + data])
+a = leader.connect(1222)
+check(rpc(a, "4|reg|bk~y") == "4|reg_ack|bk~y|success", "reg after the restart")
+
+follower = Master(sys.argv[1], sys.argv[2:] + ["--follow=127.0.0.1:%d" % leader.port, "--max_staleness_ms=500"])
+b = follower.connect(1333)
+wait_for(b, "5|lookup|bk~x", "5|lookup_ack|127.0.0.1:1222;", "key from the snapshot")
+check(rpc(b, "6|lookup|bk~y") == "6|lookup_ack|127.0.0.1:1222;", "key logged after the restart")
+check(stat(b, "role") == "follower" and stat(b, "snapshots") == "1", "one snapshot installed")
+check(rpc(b, "7|" + LOCK % ("read", 0, "0")) == "7|consistent_lock_ack|exception: read_only_follower",
+  "lock on a follower")
+
+# later changes arrive as records, deletes included
+check(rpc(a, "8|reg|bk~z") == "8|reg_ack|bk~z|success", "reg while followed")
+check(rpc(a, "9|delete|bk~y") == "9|delete_ack|success", "delete while followed")
+wait_for(b, "10|lookup|bk~z", "10|lookup_ack|127.0.0.1:1222;", "streamed reg")
+wait_for(b, "11|lookup|bk~y", "11|lookup_ack|", "streamed delete")
+check(stat(b, "snapshots") == "1", "caught up without another snapshot")
+check(rpc(b, "12|reg|bk~w") == "12|reg_ack|exception: read_only_follower", "reg on a follower")
+
+# heartbeats keep an idle follower fresh past max_staleness_ms
+time.sleep(1)
+check(stat(b, "fresh") == "1", "idle follower went stale")
+check(rpc(b, "13|lookup|bk~z") == "13|lookup_ack|127.0.0.1:1222;", "lookup on an idle follower")
+
+# without the leader it goes stale and refuses lookups
+leader.stop()
+wait_for(b, "14|lookup|bk~z", "14|lookup_ack|exception: stale", "lookup after the leader died")
+check(stat(b, "fresh") == "0", "fresh without a leader")
+
+# promoted, it serves and takes writes on what it has
+check(rpc(b, "15|promote").startswith("15|promote_ack|success|"), "promote")
+check(stat(b, "role") == "leader", "role after promote")
+check(rpc(b, "16|lookup|bk~z") == "16|lookup_ack|127.0.0.1:1222;", "lookup after promote")
+check(rpc(b, "17|reg|bk~w") == "17|reg_ack|bk~w|success", "reg after promote")
+check(rpc(b, "18|" + LOCK % ("write", 1, "recent")) == "18|consistent_lock_ack|success|write|127.0.0.1:1222;",
+  "lock after promote")
+
+follower.stop()
+shutil.rmtree(data)
+print("ok")
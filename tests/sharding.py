@@ -0,0 +1,105 @@
+import signal
+import sys
+import time
+from harness import *
+
+# Two shards refuse each other's keys with wrong_shard, and a client that
+# refetches the ring with "shards" finds the owner. A third one joins
+# (--join) and takes its keys over: from a shard that is stopped mid-way
+# they are "exception: migrating" until they arrive, and once each old
+# owner is told migrate_done it drops them.
+
+A, B, C = free_port(), free_port(), free_port()
+addr = lambda port: "127.0.0.1:%d" % port
+two = ",".join(addr(p) for p in (A, B))
+three = ",".join(addr(p) for p in (A, B, C))
+
+def shard(port, members, flags = []):
+  return Master(sys.argv[1], sys.argv[2:] + ["--shards=" + members, "--shard_addr=" + addr(port)] + flags, port)
+
+def stat(s, name):
+  for field in rpc(s, "0|stats").split("|"):
+    if field.startswith(name + "="):
+      return int(field.split("=")[1])
+  fail("no %s in stats" % name)
+
+def members(s):
+  return rpc(s, "0|shards").split("|")[3]
+
+masters = {A: shard(A, two), B: shard(B, two)}
+conns = {p: masters[p].connect(1222) for p in (A, B)}
+
+# each key is taken by exactly one shard; the other one refuses it and
+# the ring it hands out names both
+keys = ["bk~key%d" % i for i in range(400)]
+owner = {}
+for i, key in enumerate(keys):
+  first, second = (A, B) if i % 2 == 0 else (B, A)
+  reply = rpc(conns[first], "%d|reg|%s" % (i, key))
+  if reply == "%d|reg_ack|exception: wrong_shard" % i:
+    check(members(conns[first]) == two, "ring after wrong_shard")
+    reply = rpc(conns[second], "%d|reg|%s" % (i, key))
+    owner[key] = second
+  else:
+    owner[key] = first
+  check(reply == "%d|reg_ack|%s|success" % (i, key), "reg at the owner: " + reply)
+  other = B if owner[key] == A else A
+  check(rpc(conns[other], "1|lookup|" + key) == "1|lookup_ack|exception: wrong_shard", "lookup at the other shard")
+check(0 < sum(1 for k in keys if owner[k] == A) < len(keys), "one shard owns every key")
+check(stat(conns[A], "keys") + stat(conns[B], "keys") == len(keys), "keys counted twice")
+
+# B stopped: C gets A's keys at once and waits on B's
+masters[B].proc.send_signal(signal.SIGSTOP)
+masters[C] = shard(C, three, ["--join"])
+conns[C] = masters[C].connect(1333)
+deadline = time.time() + 10
+while members(conns[A]) != three:
+  check(time.time() < deadline, "A never took the new ring")
+  time.sleep(0.05)
+moved = {}
+for key in keys:
+  reply = rpc(conns[C], "1|lookup|" + key)
+  if reply != "1|lookup_ack|exception: wrong_shard":
+    moved[key] = reply
+check(any(owner[k] == A for k in moved) and any(owner[k] == B for k in moved), "C took keys from only one shard")
+for key, reply in moved.items():
+  if owner[key] == B:
+    check(reply == "1|lookup_ack|exception: migrating", "key from a stopped shard: " + reply)
+  else:
+    deadline = time.time() + 10
+    while reply == "1|lookup_ack|exception: migrating":
+      check(time.time() < deadline, "keys from A never arrived")
+      time.sleep(0.05)
+      reply = rpc(conns[C], "1|lookup|" + key)
+    check(reply == "1|lookup_ack|127.0.0.1:1222;", "key from A: " + reply)
+
+# a client retries a migrating key until it is in, as call_master does
+masters[B].proc.send_signal(signal.SIGCONT)
+for key in moved:
+  deadline = time.time() + 10
+  while True:
+    reply = rpc(conns[C], "1|lookup|" + key)
+    if reply != "1|lookup_ack|exception: migrating":
+      break
+    check(time.time() < deadline, "keys from B never arrived")
+    time.sleep(0.05)
+  check(reply == "1|lookup_ack|127.0.0.1:1222;", "moved key at C: " + reply)
+check(members(conns[B]) == three, "B kept the old ring")
+
+# migrate_done: the old owners drop what moved, every key is in one place
+deadline = time.time() + 10
+while stat(conns[A], "keys_out") + stat(conns[B], "keys_out") < len(moved):
+  check(time.time() < deadline, "old owners kept the moved keys")
+  time.sleep(0.05)
+check(stat(conns[C], "keys_in") == len(moved), "keys_in")
+check(sum(stat(conns[p], "keys") for p in (A, B, C)) == len(keys), "keys lost or left behind")
+for key in keys:
+  for p in (A, B):
+    if key in moved or owner[key] != p:
+      check(rpc(conns[p], "1|lookup|" + key) == "1|lookup_ack|exception: wrong_shard", "moved key at its old owner")
+    else:
+      check(rpc(conns[p], "1|lookup|" + key) == "1|lookup_ack|use_local", "kept key at its owner")
+
+for m in masters.values():
+  m.stop()
+print("ok")
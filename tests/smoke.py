@@ -0,0 +1,41 @@
+from harness import *
+
+# Replies of the common commands from two nodes, one request at a time.
+
+m = start()
+a = m.connect()
+b = m.connect()
+
+def expect(s, request, reply):
+  got = rpc(s, request)
+  check(got == reply, "%s: got %s, expected %s" % (request, got, reply))
+
+expect(a, "0|new_server|1222|", "0|new_server_ack|1222|0")
+expect(b, "0|new_server|1333|", "0|new_server_ack|1333|1")
+expect(a, "1|reg|bk~x", "1|reg_ack|bk~x|success")
+expect(b, "2|lookup|bk~x", "2|lookup_ack|127.0.0.1:1222;")
+expect(a, "2|lookup|bk~x", "2|lookup_ack|use_local")
+expect(b, "3|cache|bk~x", "3|cache_ack|bk~x|success")
+expect(b, "3|lookup|bk~x", "3|lookup_ack|use_local")
+expect(b, "4|mlookup|bk~x|bk~none", "4|mlookup_ack|use_local|")
+expect(b, "5|uncache|bk~x", "5|uncache_ack|bk~x|success")
+expect(b, "5|lookup|bk~x", "5|lookup_ack|127.0.0.1:1222;")
+
+lock = "consistent_lock|%s|~bk~c|lambda%d|100|nos3|no_snap|no_check_loc|recent"
+expect(a, "4|" + lock % ("write", 0), "4|consistent_lock_ack|success|write|")
+expect(b, "4|" + lock % ("write", 1), "4|consistent_lock_ack|fail|write|")
+expect(a, "5|consistent_unlock|write|~bk~c|lambda0|1", "5|consistent_unlock_ack|success")
+expect(b, "4|" + lock % ("read", 1), "4|consistent_lock_ack|success|read|127.0.0.1:1222;")
+expect(b, "5|consistent_unlock|read|~bk~c|lambda1|1", "5|consistent_unlock_ack|success")
+expect(b, "6|lineage|1", "6|lineage_ack|1,~bk~c,0,127.0.0.1:1222@lambda0;127.0.0.1:1333@lambda1;$")
+expect(b, "7|delete|bk~x/8|lookup|bk~x", "7|delete_ack|success/8|lookup_ack|")
+
+# malformed requests get an empty reply under their id, and the
+# connection keeps working
+for request in ["9|bogus|bk~x", "10|reg", "11|lookup"]:
+  got = rpc(a, request)
+  check(got.startswith(request.split("|")[0] + "|"), "%s: got %s" % (request, got))
+expect(a, "12|reg|bk~y", "12|reg_ack|bk~y|success")
+
+m.stop()
+print("ok")
@@ -0,0 +1,75 @@
+#include "timerwheel.h"
+#include "log.h"
+
+TimerWheel::TimerWheel(uint tick_ms) :
+  tick_ms(tick_ms),
+  start(chrono::steady_clock::now()),
+  now(0),
+  count(0)
+{
+}
+
+uint64_t TimerWheel::current_tick() {
+  auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+  return elapsed.count() / tick_ms;
+}
+
+void TimerWheel::place(Timer& t) {
+  uint64_t diff = t.deadline > now ? t.deadline - now : 0;
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 && diff >= (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+    level++;
+  uint64_t max = 1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+  if (diff >= max) {
+    //beyond the top level, park it as far out as the wheel reaches
+    t.deadline = now + max - 1;
+  }
+  uint slot = (t.deadline >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+  slots[level][slot].push_back(std::move(t));
+}
+
+void TimerWheel::cascade(int level) {
+  uint slot = (now >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+  vector<Timer> moving;
+  moving.swap(slots[level][slot]);
+  for (auto& t : moving)
+    place(t);
+}
+
+void TimerWheel::schedule(uint64_t delay_ms, function<void()> fire) {
+  lock_guard<mutex> guard(lock);
+  //round up so a timer never fires early
+  uint64_t ticks = (delay_ms + tick_ms - 1) / tick_ms;
+  Timer t = {current_tick() + (ticks == 0 ? 1 : ticks), fire};
+  if (t.deadline <= now)
+    t.deadline = now + 1;
+  place(t);
+  count++;
+}
+
+int TimerWheel::advance() {
+  vector<Timer> due;
+  {
+    lock_guard<mutex> guard(lock);
+    uint64_t target = current_tick();
+    while (now < target) {
+      now++;
+      for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--)
+        if ((now & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) == 0)
+          cascade(level);
+      vector<Timer>& slot = slots[0][now & (TIMER_WHEEL_SLOTS - 1)];
+      for (auto& t : slot)
+        due.push_back(std::move(t));
+      slot.clear();
+    }
+    count -= due.size();
+  }
+  for (auto& t : due)
+    t.fire();
+  return due.size();
+}
+
+size_t TimerWheel::size() {
+  lock_guard<mutex> guard(lock);
+  return count;
+}
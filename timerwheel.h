@@ -0,0 +1,52 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+using namespace std;
+
+// Hierarchical timer wheel.
+//
+// Level 0 has one slot per tick, each level above covers TIMER_WHEEL_SLOTS
+// slots of the level below. A timer goes into the lowest level whose span
+// reaches its deadline, so scheduling is O(1). Whenever the low levels wrap,
+// the next slot of the level above is cascaded down; every timer moves at
+// most TIMER_WHEEL_LEVELS times before it fires. Timers cannot be cancelled,
+// callbacks are expected to check whether they still apply.
+class TimerWheel {
+public:
+  TimerWheel(uint tick_ms);
+  // Runs fire from advance() no sooner than delay_ms from now.
+  void schedule(uint64_t delay_ms, function<void()> fire);
+  // Moves the wheel up to the current time and runs every due callback.
+  // Callbacks run without the wheel lock held and may schedule new timers.
+  int advance();
+  size_t size();
+
+private:
+  struct Timer {
+    uint64_t deadline;
+    function<void()> fire;
+  };
+
+  void place(Timer& t);
+  void cascade(int level);
+  uint64_t current_tick();
+
+  mutex lock;
+  const uint tick_ms;
+  const chrono::steady_clock::time_point start;
+  uint64_t now;   // last tick processed
+  size_t count;
+  vector<Timer> slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef TOKEN_H
+#define TOKEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <ostream>
+#include <string>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+// A field of a request line, pointing into the connection's input buffer
+// so that parsing copies nothing. Valid until the buffer is read into.
+struct Token {
+  const char* data;
+  size_t size;
+  string str() const {return string(data, size);}
+};
+
+inline ostream& operator<<(ostream& out, const Token& t) {
+  return out.write(t.data, t.size);
+}
+
+// The first a or b in [p, end), or end. With SSE2, compares 16 bytes at a
+// time against both.
+static inline const char* find_either(const char* p, const char* end, char a, char b) {
+#ifdef __SSE2__
+  const __m128i va = _mm_set1_epi8(a);
+  const __m128i vb = _mm_set1_epi8(b);
+  for (; end - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+    int hits = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)));
+    if (hits != 0)
+      return p + __builtin_ctz(hits);
+  }
+#endif
+  for (; p < end; p++)
+    if (*p == a || *p == b)
+      return p;
+  return end;
+}
+
+// Splits a single command "id|op|field|..." at '|' into up to max tokens.
+// Returns how many, or 0 when [p, end) holds more than max fields or
+// several '/' separated commands.
+static inline size_t split_command(const char* p, const char* end, Token* out, size_t max) {
+  size_t n = 0;
+  while (true) {
+    const char* d = find_either(p, end, '|', '/');
+    if (n == max || (d < end && *d == '/'))
+      return 0;
+    out[n].data = p;
+    out[n].size = d - p;
+    n++;
+    if (d == end)
+      return n;
+    p = d + 1;
+  }
+}
+
+// FNV-1a of a command name. constexpr, so a switch over the hashes of the
+// names is built at compile time and fails to compile on a collision.
+constexpr uint32_t op_hash(const char* s, size_t n, uint32_t h = 2166136261u) {
+  return n == 0 ? h : op_hash(s + 1, n - 1, (h ^ (uint8_t)*s) * 16777619u);
+}
+
+#endif
@@ -0,0 +1,199 @@
+#include "uring.h"
+#include "log.h"
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+static int uring_setup(unsigned entries, struct io_uring_params* p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned op, const void* arg, unsigned n) {
+  return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+Uring::Uring()
+  : fd(-1)
+  , sqes((struct io_uring_sqe*)MAP_FAILED)
+  , sq_local(0)
+  , sq_ring(MAP_FAILED)
+  , cq_ring(MAP_FAILED)
+  , buf_ring(NULL)
+  , buf_ring_size(0)
+  , buf_count(0)
+  , buf_size(0)
+  , buf_base(NULL)
+{
+}
+
+Uring::~Uring() {
+  if (buf_ring != NULL) {
+    munmap(buf_ring, buf_ring_size);
+    munmap(buf_base, (size_t)buf_count * buf_size);
+  }
+  if (sqes != MAP_FAILED)
+    munmap(sqes, sqes_size);
+  if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+    munmap(cq_ring, cq_ring_size);
+  if (sq_ring != MAP_FAILED)
+    munmap(sq_ring, sq_ring_size);
+  if (fd >= 0)
+    close(fd);
+}
+
+bool Uring::init() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  //completions only run when the loop enters the kernel anyway
+  p.flags = IORING_SETUP_COOP_TASKRUN;
+  fd = uring_setup(URING_ENTRIES, &p);
+  if (fd < 0 && errno == EINVAL) {
+    p.flags = 0;
+    fd = uring_setup(URING_ENTRIES, &p);
+  }
+  if (fd < 0)
+    return false;
+  sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+  sq_ring = mmap(0, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED)
+    return false;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    cq_ring = sq_ring;
+  else
+    cq_ring = mmap(0, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  if (cq_ring == MAP_FAILED)
+    return false;
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = (struct io_uring_sqe*)mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    return false;
+
+  char* sq = (char*)sq_ring;
+  sq_head = (unsigned*)(sq + p.sq_off.head);
+  sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+  sq_array = (unsigned*)(sq + p.sq_off.array);
+  sq_local = *sq_tail;
+  char* cq = (char*)cq_ring;
+  cq_head = (unsigned*)(cq + p.cq_off.head);
+  cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  return true;
+}
+
+string Uring::backend(const string& requested) {
+  if (requested != "uring")
+    return "epoll";
+  //multishot recv came with 6.0, the provided buffer ring with 5.19
+  struct utsname u;
+  int major = 0, minor = 0;
+  if (uname(&u) == 0)
+    sscanf(u.release, "%d.%d", &major, &minor);
+  if (major < 6) {
+    LOG_ERROR << "io_uring needs linux 6.0 for multishot recv, using epoll";
+    return "epoll";
+  }
+  Uring probe;
+  if (!probe.init() || !probe.provide_buffers(0, 1, 64)) {
+    LOG_ERROR << "io_uring is not available (" << strerror(errno) << "), using epoll";
+    return "epoll";
+  }
+  return "uring";
+}
+
+struct io_uring_sqe* Uring::sqe() {
+  if (sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > sq_mask)
+    submit(0);
+  unsigned index = sq_local & sq_mask;
+  struct io_uring_sqe* s = &sqes[index];
+  memset(s, 0, sizeof(*s));
+  sq_array[index] = index;
+  sq_local++;
+  return s;
+}
+
+int Uring::submit(unsigned wait) {
+  unsigned queued = sq_local - *sq_tail;
+  __atomic_store_n(sq_tail, sq_local, __ATOMIC_RELEASE);
+  while (true) {
+    int ret = uring_enter(fd, queued, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (ret >= 0 || errno != EINTR)
+      return ret;
+    //the SQEs were taken before the signal, only wait again
+    queued = 0;
+  }
+}
+
+struct io_uring_cqe* Uring::peek() {
+  unsigned head = *cq_head;
+  if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &cqes[head & cq_mask];
+}
+
+void Uring::seen() {
+  __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+bool Uring::provide_buffers(uint16_t group, uint16_t count, uint32_t size) {
+  //the kernel takes a power of two entries
+  buf_ring_size = count * sizeof(struct io_uring_buf);
+  void* ring = mmap(0, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED)
+    return false;
+  void* base = mmap(0, (size_t)count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    munmap(ring, buf_ring_size);
+    return false;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)ring;
+  reg.ring_entries = count;
+  reg.bgid = group;
+  if (uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    int err = errno;
+    munmap(ring, buf_ring_size);
+    munmap(base, (size_t)count * size);
+    errno = err;
+    return false;
+  }
+  buf_ring = (struct io_uring_buf_ring*)ring;
+  buf_base = (char*)base;
+  buf_count = count;
+  buf_size = size;
+  for (uint16_t id = 0; id < count; id++)
+    recycle(id);
+  return true;
+}
+
+char* Uring::provided(uint16_t id) {
+  return buf_base + (size_t)id * buf_size;
+}
+
+void Uring::recycle(uint16_t id) {
+  uint16_t tail = buf_ring->tail;
+  //not buf_ring->bufs: in C++ the uapi flex array lands at offset 8
+  struct io_uring_buf* b = (struct io_uring_buf*)buf_ring + (tail & (buf_count - 1));
+  b->addr = (uint64_t)provided(id);
+  b->len = buf_size;
+  b->bid = id;
+  __atomic_store_n(&buf_ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+bool Uring::register_buffers(const struct iovec* iov, unsigned count) {
+  return uring_register(fd, IORING_REGISTER_BUFFERS, iov, count) == 0;
+}
@@ -0,0 +1,70 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <string>
+
+#define URING_ENTRIES 1024
+
+using namespace std;
+
+// A thin io_uring over the raw syscalls: the three mmap'd rings, SQE
+// allocation, submit-and-wait and CQE reaping, a provided buffer ring for
+// multishot recv and a table of registered buffers.
+//
+// Single issuer: only the thread that runs the loop touches the ring.
+class Uring {
+public:
+  Uring();
+  ~Uring();
+  // Maps a ring of URING_ENTRIES, false when the kernel lacks io_uring or
+  // any of the ops the event loops use.
+  bool init();
+  // "epoll" or "uring" from a --io= value, "uring" only when it works here.
+  static string backend(const string& requested);
+
+  // A cleared SQE, submitting the queued ones first when the ring is full.
+  struct io_uring_sqe* sqe();
+  // Submits what is queued and waits for at least wait completions.
+  int submit(unsigned wait);
+  // The next completion or NULL; seen() hands it back to the kernel.
+  struct io_uring_cqe* peek();
+  void seen();
+
+  // count buffers of size bytes for IOSQE_BUFFER_SELECT recv in group.
+  bool provide_buffers(uint16_t group, uint16_t count, uint32_t size);
+  char* provided(uint16_t id);
+  // Gives buffer id back to the kernel once its bytes are used.
+  void recycle(uint16_t id);
+
+  // Fixed buffers for READ_FIXED/WRITE_FIXED, index is their position.
+  bool register_buffers(const struct iovec* iov, unsigned count);
+
+private:
+  int fd;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned sq_local; // tail of the SQEs handed out but not yet published
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  struct io_uring_buf_ring* buf_ring;
+  size_t buf_ring_size;
+  uint16_t buf_count;
+  uint32_t buf_size;
+  char* buf_base;
+};
+
+#endif
@@ -0,0 +1,198 @@
+#include "uringmasterworker.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "log.h"
+
+// what a completion is for, the low byte of its user_data
+#define URING_ACCEPT 1
+#define URING_RECV 2
+#define URING_POLL 3
+#define URING_CANCEL 4
+
+#define RECV_IDLE 0
+#define RECV_ARMED 1
+#define RECV_CANCELLING 2
+
+static inline uint64_t tag(uint32_t id, uint8_t kind) {
+  return ((uint64_t)id << 8) | kind;
+}
+
+UringMasterWorker::UringMasterWorker() : listen_fd(-1), master(NULL), next_id(1), count(0) {
+}
+
+UringMasterWorker::~UringMasterWorker() {
+}
+
+void UringMasterWorker::listen(int fd, Master& master) {
+  this->master = &master;
+  listen_fd = fd;
+  //the ring is only touched by the loop's thread, which starts here
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, &UringMasterWorker::pthread_helper, this))
+    DIE("Can't create thread");
+}
+
+void UringMasterWorker::run() {
+  if (!ring.init())
+    DIE("Can't create io_uring: %s", strerror(errno));
+  if (!ring.provide_buffers(0, URING_RECV_BUFFERS, URING_RECV_BYTES))
+    DIE("Can't register recv buffers: %s", strerror(errno));
+  arm_accept();
+  while (true) {
+    if (ring.submit(1) < 0 && errno != EBUSY && errno != EAGAIN)
+      LOG_ERROR << "io_uring_enter failed " << strerror(errno);
+    struct io_uring_cqe* cqe;
+    while ((cqe = ring.peek()) != NULL) {
+      completed(cqe);
+      ring.seen();
+    }
+  }
+}
+
+void UringMasterWorker::arm_accept() {
+  struct io_uring_sqe* s = ring.sqe();
+  s->opcode = IORING_OP_ACCEPT;
+  s->fd = listen_fd;
+  s->ioprio = IORING_ACCEPT_MULTISHOT;
+  s->accept_flags = SOCK_NONBLOCK;
+  s->user_data = tag(0, URING_ACCEPT);
+}
+
+void UringMasterWorker::arm_recv(uint32_t id, Conn& c) {
+  struct io_uring_sqe* s = ring.sqe();
+  s->opcode = IORING_OP_RECV;
+  s->fd = c.fd;
+  s->ioprio = IORING_RECV_MULTISHOT;
+  s->flags = IOSQE_BUFFER_SELECT;
+  s->buf_group = 0;
+  s->user_data = tag(id, URING_RECV);
+  c.receiving = RECV_ARMED;
+}
+
+void UringMasterWorker::arm_poll(uint32_t id, Conn& c) {
+  //like EPOLLOUT|EPOLLET, it fires again only once a full socket drains
+  struct io_uring_sqe* s = ring.sqe();
+  s->opcode = IORING_OP_POLL_ADD;
+  s->fd = c.fd;
+  s->poll32_events = POLLOUT;
+  s->len = IORING_POLL_ADD_MULTI;
+  s->user_data = tag(id, URING_POLL);
+}
+
+void UringMasterWorker::cancel(uint32_t id, uint8_t kind) {
+  struct io_uring_sqe* s = ring.sqe();
+  s->opcode = IORING_OP_ASYNC_CANCEL;
+  s->addr = tag(id, kind);
+  s->user_data = tag(id, URING_CANCEL);
+}
+
+void UringMasterWorker::remove(uint32_t id) {
+  auto it = conns.find(id);
+  if (it == conns.end())
+    return;
+  if (it->second.receiving == RECV_ARMED)
+    cancel(id, URING_RECV);
+  cancel(id, URING_POLL);
+  delete it->second.worker;
+  //the pending operations hold their own reference to the socket
+  close(it->second.fd);
+  conns.erase(it);
+  count--;
+  LOG_DEBUG << "connection " << id << " is removed from uringworker";
+}
+
+void UringMasterWorker::completed(struct io_uring_cqe* cqe) {
+  uint8_t kind = cqe->user_data & 0xff;
+  uint32_t id = cqe->user_data >> 8;
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+  int res = cqe->res;
+  if (kind == URING_ACCEPT) {
+    if (res >= 0) {
+      uint32_t conn = next_id++;
+      Conn& c = conns[conn];
+      c.fd = res;
+      c.worker = new MasterWorker(*master, res);
+      c.receiving = RECV_IDLE;
+      count++;
+      arm_recv(conn, c);
+      arm_poll(conn, c);
+    } else if (res != -EAGAIN && res != -ECONNABORTED) {
+      LOG_ERROR << "error: unable to accept client " << strerror(-res);
+    }
+    if (!more)
+      arm_accept();
+    return;
+  }
+  if (kind == URING_CANCEL)
+    return;
+
+  auto it = conns.find(id);
+  //a completion of a connection already removed only returns its buffer
+  if (kind == URING_RECV) {
+    bool buffer = cqe->flags & IORING_CQE_F_BUFFER;
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (it == conns.end()) {
+      if (buffer)
+        ring.recycle(bid);
+      return;
+    }
+    Conn& c = it->second;
+    if (!more)
+      c.receiving = RECV_IDLE;
+    if (res > 0 && buffer) {
+      try {
+        c.worker->feed(ring.provided(bid), res);
+      } catch (exception& e) {
+        LOG_ERROR << "Caught exception, removing";
+        ring.recycle(bid);
+        remove(id);
+        return;
+      }
+    }
+    if (buffer)
+      ring.recycle(bid);
+    //-ENOBUFS: all buffers were taken, the recv is armed again below
+    if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+      remove(id);
+      return;
+    }
+    if (!c.worker->reading() && c.receiving == RECV_ARMED) {
+      //leave the requests in the socket until the replies drain
+      cancel(id, URING_RECV);
+      c.receiving = RECV_CANCELLING;
+    } else if (c.worker->reading() && c.receiving == RECV_IDLE) {
+      arm_recv(id, c);
+    }
+    return;
+  }
+
+  if (kind == URING_POLL) {
+    if (it == conns.end())
+      return;
+    Conn& c = it->second;
+    if (res < 0 || (res & (POLLERR | POLLHUP))) {
+      if (res != -ECANCELED)
+        remove(id);
+      return;
+    }
+    try {
+      c.worker->on_writable();
+    } catch (exception& e) {
+      LOG_ERROR << "Caught exception, removing";
+      remove(id);
+      return;
+    }
+    if (c.worker->reading() && c.receiving == RECV_IDLE)
+      arm_recv(id, c);
+    if (!more)
+      arm_poll(id, c);
+  }
+}
+
+void *UringMasterWorker::pthread_helper(void * worker) {
+  static_cast<UringMasterWorker *>(worker)->run();
+  return nullptr;
+}
@@ -0,0 +1,48 @@
+#ifndef URINGMASTERWORKER_H
+#define URINGMASTERWORKER_H
+
+#include <unordered_map>
+#include "masterworker.h"
+#include "uring.h"
+
+#define URING_RECV_BUFFERS 64 // provided recv buffers per loop, a power of two
+#define URING_RECV_BYTES (16 * 1024)
+
+// The io_uring counterpart of EpollMasterWorker, picked with --io=uring.
+// Its thread starts with listen(): a multishot accept on the loop's own
+// listener, and for every connection a multishot recv into the provided
+// buffers and a multishot POLLOUT poll that drains parked replies. Read
+// bytes go to MasterWorker::feed, so one io_uring_enter serves everything
+// that completed meanwhile. Replies are still written directly, they go
+// out in one writev per wakeup and rarely find the socket full.
+class UringMasterWorker {
+public:
+  UringMasterWorker();
+  ~UringMasterWorker();
+  void listen(int fd, Master& master);
+  int get_count() {return count;}
+  static void *pthread_helper(void * worker);
+  void run();
+
+private:
+  struct Conn {
+    MasterWorker* worker;
+    int fd;
+    uint8_t receiving; // RECV_IDLE, RECV_ARMED or RECV_CANCELLING
+  };
+  void arm_accept();
+  void arm_recv(uint32_t id, Conn& c);
+  void arm_poll(uint32_t id, Conn& c);
+  void cancel(uint32_t id, uint8_t kind);
+  void completed(struct io_uring_cqe* cqe);
+  void remove(uint32_t id);
+
+  Uring ring;
+  int listen_fd;
+  Master* master;
+  unordered_map<uint32_t, Conn> conns; // by connection id, never reused
+  uint32_t next_id;
+  int count;
+};
+
+#endif
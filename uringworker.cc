@@ -0,0 +1,258 @@
+#include "uringworker.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "log.h"
+
+// what a completion is for, the low byte of its user_data
+#define URING_ACCEPT 1
+#define URING_POLL_IN 2
+#define URING_POLL_OUT 3
+#define URING_READ 4
+#define URING_SEND 5
+#define URING_CANCEL 6
+
+static inline uint64_t tag(uint32_t id, uint8_t kind) {
+  return ((uint64_t)id << 8) | kind;
+}
+
+UringWorker::UringWorker() : listen_fd(-1), next_id(1), buffers(NULL), registered(false), count(0) {
+}
+
+UringWorker::~UringWorker() {
+  delete[] buffers;
+}
+
+void UringWorker::listen(int fd) {
+  listen_fd = fd;
+  //the ring is only touched by the loop's thread, which starts here
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, &UringWorker::pthread_helper, this))
+    DIE("Can't create thread");
+}
+
+void UringWorker::run() {
+  if (!ring.init())
+    DIE("Can't create io_uring: %s", strerror(errno));
+  buffers = new char[(size_t)URING_BODY_BUFFERS * URING_BODY_CHUNK];
+  struct iovec iov[URING_BODY_BUFFERS];
+  for (int i = 0; i < URING_BODY_BUFFERS; i++) {
+    iov[i].iov_base = buffers + (size_t)i * URING_BODY_CHUNK;
+    iov[i].iov_len = URING_BODY_CHUNK;
+    free_buffers.push_back(i);
+  }
+  //pinned pages count against RLIMIT_MEMLOCK, plain reads do without
+  registered = ring.register_buffers(iov, URING_BODY_BUFFERS);
+  if (!registered)
+    LOG_ERROR << "Can't register body buffers (" << strerror(errno) << "), using plain reads";
+  arm_accept();
+  while (true) {
+    if (ring.submit(1) < 0 && errno != EBUSY && errno != EAGAIN)
+      LOG_ERROR << "io_uring_enter failed " << strerror(errno);
+    struct io_uring_cqe* cqe;
+    while ((cqe = ring.peek()) != NULL) {
+      completed(cqe);
+      ring.seen();
+    }
+  }
+}
+
+void UringWorker::arm_accept() {
+  struct io_uring_sqe* s = ring.sqe();
+  s->opcode = IORING_OP_ACCEPT;
+  s->fd = listen_fd;
+  s->ioprio = IORING_ACCEPT_MULTISHOT;
+  s->accept_flags = SOCK_NONBLOCK;
+  s->user_data = tag(0, URING_ACCEPT);
+}
+
+void UringWorker::arm_poll(uint32_t id, Conn& c, uint32_t events, uint8_t kind) {
+  struct io_uring_sqe* s = ring.sqe();
+  s->opcode = IORING_OP_POLL_ADD;
+  s->fd = c.fd;
+  s->poll32_events = events;
+  //requests are watched for good, room to write only while a reply waits
+  if (kind == URING_POLL_IN)
+    s->len = IORING_POLL_ADD_MULTI;
+  else
+    c.polling_out = true;
+  s->user_data = tag(id, kind);
+}
+
+void UringWorker::cancel(uint32_t id, uint8_t kind) {
+  struct io_uring_sqe* s = ring.sqe();
+  s->opcode = IORING_OP_ASYNC_CANCEL;
+  s->addr = tag(id, kind);
+  s->user_data = tag(id, URING_CANCEL);
+}
+
+void UringWorker::serve(uint32_t id, Conn& c) {
+  bool read = false;
+  while (!c.closing && c.chunk == 0) {
+    if (!c.worker->flush()) {
+      if (!c.polling_out)
+        arm_poll(id, c, POLLOUT, URING_POLL_OUT);
+      return;
+    }
+    if (c.worker->body_fd() >= 0) {
+      send_chunk(id, c);
+      return;
+    }
+    release_buffer(c);
+    //handle_msg reads until the socket is empty or a reply is pending
+    if (read)
+      return;
+    c.worker->handle_msg();
+    read = true;
+  }
+}
+
+void UringWorker::send_chunk(uint32_t id, Conn& c) {
+  if (c.buffer < 0 && c.own == NULL) {
+    if (!free_buffers.empty()) {
+      c.buffer = free_buffers.back();
+      free_buffers.pop_back();
+    } else {
+      c.own = new char[URING_BODY_CHUNK];
+    }
+  }
+  char* buf = c.buffer >= 0 ? buffers + (size_t)c.buffer * URING_BODY_CHUNK : c.own;
+  uint32_t len = c.worker->body_left() < URING_BODY_CHUNK ? c.worker->body_left() : URING_BODY_CHUNK;
+
+  //a short read breaks the link, and the send then completes as cancelled
+  struct io_uring_sqe* r = ring.sqe();
+  r->opcode = c.buffer >= 0 && registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  if (r->opcode == IORING_OP_READ_FIXED)
+    r->buf_index = c.buffer;
+  r->fd = c.worker->body_fd();
+  r->off = c.worker->body_offset();
+  r->addr = (uint64_t)buf;
+  r->len = len;
+  r->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+  r->user_data = tag(id, URING_READ);
+
+  //MSG_WAITALL: the ring waits for room itself and completes once for all
+  struct io_uring_sqe* s = ring.sqe();
+  s->opcode = IORING_OP_SEND;
+  s->fd = c.fd;
+  s->addr = (uint64_t)buf;
+  s->len = len;
+  s->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+  s->user_data = tag(id, URING_SEND);
+  c.chunk = len;
+}
+
+void UringWorker::release_buffer(Conn& c) {
+  if (c.buffer >= 0)
+    free_buffers.push_back(c.buffer);
+  c.buffer = -1;
+  delete[] c.own;
+  c.own = NULL;
+}
+
+void UringWorker::remove(uint32_t id) {
+  auto it = conns.find(id);
+  if (it == conns.end() || it->second.closing)
+    return;
+  Conn& c = it->second;
+  c.closing = true;
+  cancel(id, URING_POLL_IN);
+  if (c.polling_out)
+    cancel(id, URING_POLL_OUT);
+  if (c.chunk == 0) {
+    reap(id);
+    return;
+  }
+  //the send may not have started, so the socket stays open until it ends
+  cancel(id, URING_READ);
+  cancel(id, URING_SEND);
+}
+
+void UringWorker::reap(uint32_t id) {
+  auto it = conns.find(id);
+  Conn& c = it->second;
+  delete c.worker;
+  close(c.fd);
+  release_buffer(c);
+  conns.erase(it);
+  count--;
+  LOG_DEBUG << "connection " << id << " is removed from uringworker";
+}
+
+void UringWorker::completed(struct io_uring_cqe* cqe) {
+  uint8_t kind = cqe->user_data & 0xff;
+  uint32_t id = cqe->user_data >> 8;
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+  int res = cqe->res;
+  if (kind == URING_ACCEPT) {
+    if (res >= 0) {
+      uint32_t conn = next_id++;
+      Conn& c = conns[conn];
+      c.fd = res;
+      c.worker = new ObjWorker(res);
+      c.worker->defer_bodies = true;
+      c.buffer = -1;
+      c.own = NULL;
+      c.chunk = 0;
+      c.polling_out = false;
+      c.closing = false;
+      count++;
+      arm_poll(conn, c, POLLIN | POLLRDHUP, URING_POLL_IN);
+    } else if (res != -EAGAIN && res != -ECONNABORTED) {
+      LOG_ERROR << "error: unable to accept client " << strerror(-res);
+    }
+    if (!more)
+      arm_accept();
+    return;
+  }
+  if (kind == URING_CANCEL)
+    return;
+  if (kind == URING_READ) {
+    //only failures complete, a successful read goes on to its send
+    LOG_ERROR << "reading a body failed: " << strerror(-res);
+    return;
+  }
+
+  auto it = conns.find(id);
+  if (it == conns.end())
+    return;
+  Conn& c = it->second;
+  try {
+    if (kind == URING_SEND) {
+      uint32_t len = c.chunk;
+      c.chunk = 0;
+      if (c.closing) {
+        reap(id);
+      } else if (res != (int)len) {
+        if (res != -EPIPE && res != -ECONNRESET)
+          LOG_ERROR << "sending a body failed, sent " << res << " of " << len;
+        remove(id);
+      } else {
+        c.worker->body_sent(len);
+        serve(id, c);
+      }
+    } else if (kind == URING_POLL_OUT) {
+      c.polling_out = false;
+      if (!c.closing && res >= 0)
+        serve(id, c);
+    } else if (kind == URING_POLL_IN && !c.closing) {
+      if (res < 0 || (res & (POLLERR | POLLHUP | POLLRDHUP))) {
+        remove(id);
+        return;
+      }
+      serve(id, c);
+      if (!more && !c.closing)
+        arm_poll(id, c, POLLIN | POLLRDHUP, URING_POLL_IN);
+    }
+  } catch (exception& e) {
+    LOG_ERROR << "Caught exception, removing";
+    remove(id);
+  }
+}
+
+void *UringWorker::pthread_helper(void * worker) {
+  static_cast<UringWorker *>(worker)->run();
+  return nullptr;
+}
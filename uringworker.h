@@ -0,0 +1,62 @@
+#ifndef URINGWORKER_H
+#define URINGWORKER_H
+
+#include <unordered_map>
+#include <vector>
+#include "objworker.h"
+#include "uring.h"
+
+#define URING_BODY_BUFFERS 2 // registered body buffers per loop
+#define URING_BODY_CHUNK (128 * 1024)
+
+// The io_uring counterpart of EpollWorker, picked with UCACHE_IO=uring.
+// Its thread starts with listen(): a multishot accept on the loop's own
+// listener and a multishot poll per connection for requests, which
+// ObjWorker still reads and parses. The body of a get goes out as linked
+// pairs, a READ_FIXED of the next chunk of the file into a registered
+// buffer and a SEND of that buffer, so a chunk costs no copy through the
+// worker and no wakeup between the two. A connection that finds every
+// registered buffer taken gets one of its own, so a slow reader never
+// holds up the others.
+class UringWorker {
+public:
+  UringWorker();
+  ~UringWorker();
+  void listen(int fd);
+  int get_count() {return count;}
+  static void *pthread_helper(void * worker);
+  void run();
+
+private:
+  struct Conn {
+    ObjWorker* worker;
+    int fd;
+    int buffer;      // registered buffer of the body in flight, or -1
+    char* own;       // its own buffer when none was free
+    uint32_t chunk;  // bytes of the chunk in flight, 0 when none
+    bool polling_out;
+    bool closing;    // torn down once the chunk in flight completes
+  };
+  void arm_accept();
+  void arm_poll(uint32_t id, Conn& c, uint32_t events, uint8_t kind);
+  void cancel(uint32_t id, uint8_t kind);
+  void completed(struct io_uring_cqe* cqe);
+  // Moves a connection on: flushes its reply, sends the next body chunk
+  // or reads the next requests.
+  void serve(uint32_t id, Conn& c);
+  void send_chunk(uint32_t id, Conn& c);
+  void release_buffer(Conn& c);
+  void remove(uint32_t id);
+  void reap(uint32_t id);
+
+  Uring ring;
+  int listen_fd;
+  unordered_map<uint32_t, Conn> conns; // by connection id, never reused
+  uint32_t next_id;
+  char* buffers;                  // URING_BODY_BUFFERS chunks
+  bool registered;                // buffers are registered with the ring
+  vector<int> free_buffers;
+  int count;
+};
+
+#endif
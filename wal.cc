@@ -0,0 +1,345 @@
+#include "wal.h"
+#include "hash.h"
+#include "log.h"
+#include "binaryio.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static uint32_t record_checksum(const char* p, size_t len) {
+  return (uint32_t)wyhash(p, len);
+}
+
+static string segment_path(const string& dir, uint64_t first_lsn) {
+  char name[64];
+  snprintf(name, sizeof(name), WAL_PREFIX "%020llu", (unsigned long long)first_lsn);
+  return dir + "/" + name;
+}
+
+// Segments in dir ordered by their first lsn.
+static vector<pair<uint64_t, string> > list_segments(const string& dir) {
+  vector<pair<uint64_t, string> > segments;
+  DIR* d = opendir(dir.c_str());
+  if (d == NULL)
+    return segments;
+  struct dirent* e;
+  while ((e = readdir(d)) != NULL) {
+    string name = e->d_name;
+    if (name.compare(0, strlen(WAL_PREFIX), WAL_PREFIX) != 0)
+      continue;
+    segments.push_back(make_pair(strtoull(name.c_str() + strlen(WAL_PREFIX), NULL, 10), dir + "/" + name));
+  }
+  closedir(d);
+  sort(segments.begin(), segments.end());
+  return segments;
+}
+
+WriteAheadLog::WriteAheadLog(const string& dir, bool sync) :
+  next_lsn(1),
+  durable_lsn(0),
+  flusher_idle(false),
+  recent_bytes(0),
+  fd(-1),
+  dir(dir),
+  sync(sync)
+{
+}
+
+WriteAheadLog::~WriteAheadLog() {
+  if (fd >= 0)
+    close(fd);
+}
+
+bool WriteAheadLog::open_segment(uint64_t first_lsn) {
+  string path = segment_path(dir, first_lsn);
+  int nfd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (nfd < 0) {
+    LOG_ERROR << "cannot open wal segment " << path;
+    return false;
+  }
+  if (fd >= 0)
+    close(fd);
+  fd = nfd;
+  //make the new file itself durable
+  int dfd = ::open(dir.c_str(), O_RDONLY);
+  if (dfd >= 0) {
+    fsync(dfd);
+    close(dfd);
+  }
+  return true;
+}
+
+bool WriteAheadLog::open(uint64_t last_lsn) {
+  {
+    lock_guard<mutex> guard(lock);
+    next_lsn = last_lsn + 1;
+    durable_lsn = last_lsn;
+    if (dir == "")
+      return true;
+    if (!open_segment(next_lsn))
+      return false;
+  }
+  pthread_t thread;
+  pthread_create(&thread, NULL, flusher_helper, this);
+  return true;
+}
+
+void WriteAheadLog::retain(uint64_t lsn, string frame) {
+  if (dir != "") {
+    buffer.append(frame);
+    //a busy flusher picks the record up with its next batch without a wakeup
+    if (flusher_idle)
+      appended.notify_one();
+  } else {
+    durable_lsn = lsn;
+  }
+  recent_bytes += frame.size();
+  recent.push_back(std::move(frame));
+  while (recent_bytes > WAL_RETAIN_BYTES && recent.size() > 1) {
+    recent_bytes -= recent.front().size();
+    recent.pop_front();
+  }
+  published.notify_all();
+}
+
+uint64_t WriteAheadLog::append(uint8_t type, const string& payload) {
+  string frame;
+  frame.reserve(WAL_HEADER_SIZE + payload.size() + WAL_TRAILER_SIZE);
+  BinaryWriter w(frame);
+  w.put_u32(payload.size());
+  w.put_u64(0); // lsn, filled in under the lock
+  w.put_u8(type);
+  frame.append(payload);
+  lock_guard<mutex> guard(lock);
+  uint64_t lsn = next_lsn++;
+  memcpy(&frame[4], &lsn, sizeof(lsn));
+  w.put_u32(record_checksum(frame.data(), frame.size()));
+  retain(lsn, std::move(frame));
+  return lsn;
+}
+
+bool WriteAheadLog::append_frame(const char* frame, size_t len) {
+  uint64_t lsn;
+  uint8_t type;
+  const char* payload;
+  uint32_t payload_len;
+  if (decode(frame, len, lsn, type, payload, payload_len) != len)
+    return false;
+  lock_guard<mutex> guard(lock);
+  if (lsn != next_lsn)
+    return false;
+  next_lsn++;
+  retain(lsn, string(frame, len));
+  return true;
+}
+
+void WriteAheadLog::wait_durable(uint64_t lsn) {
+  if (!sync || dir == "")
+    return;
+  unique_lock<mutex> guard(lock);
+  while (durable_lsn < lsn)
+    flushed.wait(guard);
+}
+
+bool WriteAheadLog::when_durable(uint64_t lsn, function<void()> f) {
+  if (!sync || dir == "")
+    return false;
+  lock_guard<mutex> guard(lock);
+  if (durable_lsn >= lsn)
+    return false;
+  waiters.insert(make_pair(lsn, std::move(f)));
+  return true;
+}
+
+uint64_t WriteAheadLog::last_lsn() {
+  lock_guard<mutex> guard(lock);
+  return next_lsn - 1;
+}
+
+void* WriteAheadLog::flusher_helper(void* wal) {
+  ((WriteAheadLog*)wal)->flusher();
+  return NULL;
+}
+
+void WriteAheadLog::flusher() {
+  string batch;
+  vector<function<void()>> ready; // waiters the batch made durable
+  while (true) {
+    uint64_t target;
+    int out;
+    {
+      unique_lock<mutex> guard(lock);
+      while (buffer.empty()) {
+        flusher_idle = true;
+        appended.wait(guard);
+      }
+      flusher_idle = false;
+      if (!sync) {
+        //nobody waits on an unsynced flush, let a bigger batch build up
+        guard.unlock();
+        usleep(WAL_ASYNC_DELAY_US);
+        guard.lock();
+      }
+      batch.swap(buffer);
+      target = next_lsn - 1;
+      out = fd;
+    }
+    //appends that arrive while this batch is written go out with the next one
+    size_t sent = 0;
+    while (sent < batch.size()) {
+      ssize_t n = write(out, batch.data() + sent, batch.size() - sent);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        DIE("error: wal write failed, errno %d", errno);
+      }
+      sent += n;
+    }
+    if (sync)
+      fdatasync(out);
+    batch.clear();
+    {
+      lock_guard<mutex> guard(lock);
+      durable_lsn = target;
+      auto end = waiters.upper_bound(target);
+      for (auto it = waiters.begin(); it != end; it++)
+        ready.push_back(std::move(it->second));
+      waiters.erase(waiters.begin(), end);
+    }
+    flushed.notify_all();
+    for (auto& f : ready)
+      f();
+    ready.clear();
+  }
+}
+
+uint64_t WriteAheadLog::rotate() {
+  unique_lock<mutex> guard(lock);
+  uint64_t last = next_lsn - 1;
+  if (dir == "")
+    return last;
+  //let the flusher drain into the current segment first
+  while (durable_lsn < last)
+    flushed.wait(guard);
+  if (sync)
+    fdatasync(fd);
+  open_segment(next_lsn);
+  return last;
+}
+
+void WriteAheadLog::truncate(uint64_t lsn) {
+  vector<pair<uint64_t, string> > segments = list_segments(dir);
+  //a segment only holds records below the next segment's first lsn
+  for (size_t i = 0; i + 1 < segments.size(); i++) {
+    if (segments[i + 1].first - 1 > lsn)
+      break;
+    unlink(segments[i].second.c_str());
+  }
+}
+
+void WriteAheadLog::reset(uint64_t last_lsn) {
+  unique_lock<mutex> guard(lock);
+  while (durable_lsn < next_lsn - 1)
+    flushed.wait(guard);
+  recent.clear();
+  recent_bytes = 0;
+  next_lsn = last_lsn + 1;
+  durable_lsn = last_lsn;
+  if (dir == "")
+    return;
+  vector<pair<uint64_t, string> > segments = list_segments(dir);
+  for (auto& s : segments)
+    unlink(s.second.c_str());
+  open_segment(next_lsn);
+}
+
+uint64_t WriteAheadLog::read(uint64_t lsn, string& out, size_t max_bytes, int wait_ms, bool* complete) {
+  unique_lock<mutex> guard(lock);
+  if (lsn + 1 >= next_lsn)
+    published.wait_for(guard, chrono::milliseconds(wait_ms), [this, lsn]() { return lsn + 1 < next_lsn; });
+  uint64_t first = next_lsn - recent.size();
+  if (lsn + 1 < first || lsn >= next_lsn)
+    return WAL_GAP;
+  uint64_t last = lsn;
+  for (size_t i = lsn + 1 - first; i < recent.size(); i++) {
+    if (last != lsn && out.size() + recent[i].size() > max_bytes)
+      break;
+    out.append(recent[i]);
+    last++;
+  }
+  if (complete != NULL)
+    *complete = last == next_lsn - 1;
+  return last;
+}
+
+size_t WriteAheadLog::decode(const char* p, size_t len, uint64_t& lsn, uint8_t& type, const char*& payload, uint32_t& payload_len) {
+  if (len < WAL_HEADER_SIZE + WAL_TRAILER_SIZE)
+    return 0;
+  BinaryReader r(p, len);
+  payload_len = r.get_u32();
+  lsn = r.get_u64();
+  type = r.get_u8();
+  if (r.remaining() < (size_t)payload_len + WAL_TRAILER_SIZE)
+    return 0;
+  payload = r.pos();
+  BinaryReader tail(payload + payload_len, WAL_TRAILER_SIZE);
+  if (tail.get_u32() != record_checksum(p, WAL_HEADER_SIZE + payload_len))
+    return 0;
+  return WAL_HEADER_SIZE + payload_len + WAL_TRAILER_SIZE;
+}
+
+uint64_t WriteAheadLog::replay(const string& dir, uint64_t from_lsn, Visitor f) {
+  uint64_t last = from_lsn;
+  vector<pair<uint64_t, string> > segments = list_segments(dir);
+  for (size_t s = 0; s < segments.size(); s++) {
+    if (s + 1 < segments.size() && segments[s + 1].first - 1 <= from_lsn)
+      continue;
+    int sfd = ::open(segments[s].second.c_str(), O_RDONLY);
+    if (sfd < 0)
+      continue;
+    struct stat st;
+    fstat(sfd, &st);
+    if (st.st_size == 0) {
+      close(sfd);
+      continue;
+    }
+    const char* base = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, sfd, 0);
+    close(sfd);
+    if (base == MAP_FAILED)
+      continue;
+    madvise((void*)base, st.st_size, MADV_SEQUENTIAL);
+    size_t off = 0;
+    while (off < (size_t)st.st_size) {
+      uint64_t lsn;
+      uint8_t type;
+      const char* payload;
+      uint32_t len;
+      size_t n = decode(base + off, st.st_size - off, lsn, type, payload, len);
+      if (n == 0) {
+        LOG_ERROR << "bad wal record in " << segments[s].second << " at offset " << off;
+        break;
+      }
+      off += n;
+      if (lsn <= last)
+        continue;
+      if (lsn != last + 1) {
+        LOG_ERROR << "wal records " << last + 1 << " to " << lsn - 1 << " are missing, " << segments[s].second << " goes on at " << lsn;
+        munmap((void*)base, st.st_size);
+        return WAL_GAP;
+      }
+      f(lsn, type, payload, len);
+      last = lsn;
+    }
+    munmap((void*)base, st.st_size);
+  }
+  return last;
+}
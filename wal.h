@@ -0,0 +1,95 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+#define WAL_PREFIX "wal."
+#define WAL_HEADER_SIZE 13 // u32 payload length, u64 lsn, u8 type
+#define WAL_TRAILER_SIZE 4 // u32 checksum
+#define WAL_ASYNC_DELAY_US 1000 // how long unsynced records may sit in memory
+#define WAL_RETAIN_BYTES (64 << 20) // recent records kept in memory for followers
+#define WAL_GAP UINT64_MAX
+
+using namespace std;
+
+// Append-only log of registry mutations, split into segment files named
+// after the first lsn they hold. With an empty dir nothing is written to
+// disk and only the in-memory tail is kept.
+//
+// append() only copies the record into a buffer. A flusher thread writes
+// whatever accumulated while the previous write was in flight with one
+// write() and one fdatasync(), so concurrent writers share a sync (group
+// commit). wait_durable() blocks until a record is on disk, when_durable()
+// has the flusher call back instead; with sync off both return at once and
+// records reach the file within about WAL_ASYNC_DELAY_US.
+//
+// The last WAL_RETAIN_BYTES of records also stay in memory, encoded as on
+// disk, so followers can be streamed the tail with read().
+class WriteAheadLog {
+public:
+  WriteAheadLog(const string& dir, bool sync);
+  ~WriteAheadLog();
+  // Starts a new segment after last_lsn, the last lsn already recovered.
+  bool open(uint64_t last_lsn);
+  uint64_t append(uint8_t type, const string& payload);
+  // Appends a record received from a leader as is. Returns false unless it
+  // is the next lsn.
+  bool append_frame(const char* frame, size_t len);
+  void wait_durable(uint64_t lsn);
+  // Has the flusher run f once lsn is durable. Returns false and drops f
+  // if it already is.
+  bool when_durable(uint64_t lsn, function<void()> f);
+  // Moves on to a new segment once everything appended so far is written.
+  // Returns the last lsn that went to the older segments.
+  uint64_t rotate();
+  // Deletes the segments holding only records up to lsn.
+  void truncate(uint64_t lsn);
+  // Forgets every record and continues after last_lsn, for a follower that
+  // installed a snapshot.
+  void reset(uint64_t last_lsn);
+  uint64_t last_lsn();
+  // Copies the records after lsn into out, whole records up to max_bytes,
+  // waiting up to wait_ms for one to arrive. Returns the last lsn copied (lsn
+  // itself if none), or WAL_GAP if the records after lsn are no longer in
+  // memory. *complete tells if out reaches the end of the log.
+  uint64_t read(uint64_t lsn, string& out, size_t max_bytes, int wait_ms, bool* complete);
+
+  // Checks the record at p. Returns its encoded size, or 0 if it is torn or
+  // corrupt.
+  static size_t decode(const char* p, size_t len, uint64_t& lsn, uint8_t& type, const char*& payload, uint32_t& payload_len);
+  typedef function<void(uint64_t lsn, uint8_t type, const char* payload, size_t len)> Visitor;
+  // Feeds every intact record after from_lsn to f, in order. A torn or
+  // corrupt record ends its segment. Returns the last lsn seen, or WAL_GAP
+  // if a record is missing before the end: replay stops at the gap, as what
+  // follows it cannot be applied.
+  static uint64_t replay(const string& dir, uint64_t from_lsn, Visitor f);
+
+private:
+  static void* flusher_helper(void* wal);
+  void flusher();
+  bool open_segment(uint64_t first_lsn);
+  void retain(uint64_t lsn, string frame);
+
+  mutex lock;
+  condition_variable appended;
+  condition_variable flushed;
+  condition_variable published; // wakes read()
+  string buffer;            // appended, not yet written
+  uint64_t next_lsn;
+  uint64_t durable_lsn;     // written (and synced if sync is on)
+  multimap<uint64_t, function<void()>> waiters; // see when_durable
+  bool flusher_idle;
+  deque<string> recent;     // encoded records, the last one has lsn next_lsn - 1
+  size_t recent_bytes;
+  int fd;
+  const string dir;
+  const bool sync;
+};
+
+#endif